@@ -0,0 +1,402 @@
+use std::{
+    cmp::Ordering,
+    fs, io,
+    path::{Path, PathBuf},
+    process,
+};
+
+use clap::Parser;
+use common::results::{Latency, Record, Run};
+
+#[derive(clap::Parser)]
+struct Args {
+    /// Stored run to compare against, or a results directory to take its latest run.
+    baseline: PathBuf,
+
+    /// Stored run to check for regressions, or a results directory to take its latest run.
+    candidate: PathBuf,
+
+    /// Smallest change in percent that is reported as a regression or an improvement.
+    #[clap(short, long, default_value_t = 5.0)]
+    threshold: f64,
+
+    /// Significance level of Welch's t-test. Changes with a higher p-value are attributed to noise.
+    /// Metrics with a single trial on either side are judged on the threshold alone.
+    #[clap(short, long, default_value_t = 0.05)]
+    alpha: f64,
+
+    /// Configuration keys that may differ between matched records, e.g. `numa` to compare a
+    /// node-local run with a cross-node one.
+    #[clap(long, value_delimiter = ',')]
+    ignore: Vec<String>,
+}
+
+// Whether two records measured the same configuration, apart from the ignored keys.
+fn same_config(a: &Record, b: &Record, ignore: &[String]) -> bool {
+    let relevant = |record: &Record| {
+        record
+            .config
+            .iter()
+            .filter(|(key, _)| !ignore.contains(key))
+            .map(|(key, value)| (key.clone(), value.clone()))
+            .collect::<Vec<_>>()
+    };
+    a.backend == b.backend && relevant(a) == relevant(b)
+}
+
+// Returns `path`, or the latest run in it if it is a directory. Stored runs are named after the
+// time they were made, so the latest one sorts last.
+fn resolve(path: &Path) -> io::Result<PathBuf> {
+    if !path.is_dir() {
+        return Ok(path.to_path_buf());
+    }
+    let mut runs = Vec::new();
+    for entry in fs::read_dir(path)? {
+        let path = entry?.path();
+        if path.extension().is_some_and(|ext| ext == "json") {
+            runs.push(path);
+        }
+    }
+    runs.sort();
+    runs.pop().ok_or_else(|| {
+        io::Error::new(
+            io::ErrorKind::NotFound,
+            format!("{} contains no runs", path.display()),
+        )
+    })
+}
+
+fn load(path: &Path) -> Run {
+    let path = resolve(path).unwrap_or_else(|err| panic!("{}: {err}", path.display()));
+    Run::load(&path).unwrap_or_else(|err| panic!("failed to load {}: {err}", path.display()))
+}
+
+fn mean(values: &[f64]) -> f64 {
+    values.iter().sum::<f64>() / values.len() as f64
+}
+
+fn variance(values: &[f64]) -> f64 {
+    let mean = mean(values);
+    values.iter().map(|v| (v - mean).powi(2)).sum::<f64>() / (values.len() - 1) as f64
+}
+
+// Lanczos approximation of the logarithm of the gamma function for `x > 0`.
+fn ln_gamma(x: f64) -> f64 {
+    const G: [f64; 6] = [
+        76.18009172947146,
+        -86.50532032941677,
+        24.01409824083091,
+        -1.231739572450155,
+        0.1208650973866179e-2,
+        -0.5395239384953e-5,
+    ];
+    let tmp = x + 5.5 - (x + 0.5) * (x + 5.5).ln();
+    let series = G.iter().enumerate().fold(1.000000000190015, |sum, (i, g)| {
+        sum + g / (x + 1.0 + i as f64)
+    });
+    -tmp + (2.5066282746310005 * series / x).ln()
+}
+
+// Continued fraction of the incomplete beta function, evaluated with the modified Lentz method.
+fn beta_fraction(a: f64, b: f64, x: f64) -> f64 {
+    const TINY: f64 = 1e-300;
+    let mut c = 1.0;
+    let mut d = 1.0 - (a + b) * x / (a + 1.0);
+    if d.abs() < TINY {
+        d = TINY;
+    }
+    d = 1.0 / d;
+    let mut h = d;
+    for m in 1..300 {
+        let m = m as f64;
+        for numerator in [
+            m * (b - m) * x / ((a + 2.0 * m - 1.0) * (a + 2.0 * m)),
+            -(a + m) * (a + b + m) * x / ((a + 2.0 * m) * (a + 2.0 * m + 1.0)),
+        ] {
+            d = 1.0 + numerator * d;
+            if d.abs() < TINY {
+                d = TINY;
+            }
+            c = 1.0 + numerator / c;
+            if c.abs() < TINY {
+                c = TINY;
+            }
+            d = 1.0 / d;
+            h *= d * c;
+        }
+        if (d * c - 1.0).abs() < 1e-12 {
+            break;
+        }
+    }
+    h
+}
+
+// Regularized incomplete beta function I_x(a, b).
+fn incomplete_beta(a: f64, b: f64, x: f64) -> f64 {
+    if x <= 0.0 {
+        return 0.0;
+    }
+    if x >= 1.0 {
+        return 1.0;
+    }
+    let front =
+        (ln_gamma(a + b) - ln_gamma(a) - ln_gamma(b) + a * x.ln() + b * (1.0 - x).ln()).exp();
+    if x < (a + 1.0) / (a + b + 2.0) {
+        front * beta_fraction(a, b, x) / a
+    } else {
+        1.0 - front * beta_fraction(b, a, 1.0 - x) / b
+    }
+}
+
+// Two-sided p-value of Welch's t-test for a difference between the means of `a` and `b`, which
+// does not assume that both have the same variance. Returns `None` with fewer than two samples on
+// either side.
+fn welch_p_value(a: &[f64], b: &[f64]) -> Option<f64> {
+    if a.len() < 2 || b.len() < 2 {
+        return None;
+    }
+    let (va, vb) = (variance(a) / a.len() as f64, variance(b) / b.len() as f64);
+    let diff = mean(b) - mean(a);
+    if va + vb == 0.0 {
+        return Some(if diff == 0.0 { 1.0 } else { 0.0 });
+    }
+    let t = diff / (va + vb).sqrt();
+    let df =
+        (va + vb).powi(2) / (va.powi(2) / (a.len() - 1) as f64 + vb.powi(2) / (b.len() - 1) as f64);
+    Some(t_p_value(t, df))
+}
+
+// Two-sided p-value of `t` under Student's t-distribution with `df` degrees of freedom.
+fn t_p_value(t: f64, df: f64) -> f64 {
+    incomplete_beta(df / 2.0, 0.5, df / (df + t * t))
+}
+
+#[derive(Clone, Copy, PartialEq)]
+enum Verdict {
+    Unchanged,
+    Improvement,
+    Regression,
+}
+
+struct Comparison {
+    baseline: f64,
+    candidate: f64,
+    // Relative change of the mean in percent.
+    change: f64,
+    p_value: Option<f64>,
+    verdict: Verdict,
+}
+
+fn compare(a: &[f64], b: &[f64], higher_is_better: bool, args: &Args) -> Comparison {
+    let (baseline, candidate) = (mean(a), mean(b));
+    // A metric that was zero in the baseline changes infinitely if it changes at all.
+    let change = if baseline == 0.0 {
+        match candidate.partial_cmp(&0.0) {
+            Some(Ordering::Greater) => f64::INFINITY,
+            Some(Ordering::Less) => f64::NEG_INFINITY,
+            _ => 0.0,
+        }
+    } else {
+        (candidate - baseline) / baseline.abs() * 100.0
+    };
+    let p_value = welch_p_value(a, b);
+    let significant = p_value.map_or(true, |p| p < args.alpha);
+    let better = if higher_is_better {
+        candidate > baseline
+    } else {
+        candidate < baseline
+    };
+    let verdict = if change.abs() < args.threshold || !significant {
+        Verdict::Unchanged
+    } else if better {
+        Verdict::Improvement
+    } else {
+        Verdict::Regression
+    };
+    Comparison {
+        baseline,
+        candidate,
+        change,
+        p_value,
+        verdict,
+    }
+}
+
+fn print_comparison(name: &str, unit: &str, c: &Comparison) {
+    let p_value = match c.p_value {
+        Some(p) => format!("p={p:.3}"),
+        None => "p=n/a".to_string(),
+    };
+    let verdict = match c.verdict {
+        Verdict::Unchanged => "",
+        Verdict::Improvement => "improvement",
+        Verdict::Regression => "REGRESSION",
+    };
+    let line = format!(
+        "  {name:<14} {:>12.3} -> {:>12.3} {unit:<8} {:>+7.1}% {p_value:<8} {verdict}",
+        c.baseline, c.candidate, c.change,
+    );
+    println!("{}", line.trim_end());
+}
+
+fn describe(record: &Record) -> String {
+    let mut description = record.backend.clone();
+    for (key, value) in &record.config {
+        description += &format!(" {key}={value}");
+    }
+    description
+}
+
+// Compares every metric the two records both have and returns the verdicts.
+fn compare_records(baseline: &Record, candidate: &Record, args: &Args) -> Vec<Verdict> {
+    println!("{}", describe(candidate));
+    let mut verdicts = Vec::new();
+    let mut metric = |name: &str, unit: &str, a: &[f64], b: &[f64], higher_is_better| {
+        if a.is_empty() || b.is_empty() {
+            return;
+        }
+        let comparison = compare(a, b, higher_is_better, args);
+        print_comparison(name, unit, &comparison);
+        verdicts.push(comparison.verdict);
+    };
+
+    metric(
+        "throughput",
+        &candidate.throughput_unit,
+        &baseline.throughput,
+        &candidate.throughput,
+        true,
+    );
+    metric("cpu", "CPUs", &baseline.cpu, &candidate.cpu, false);
+    let percentiles: [(&str, fn(&Latency) -> u64); 3] = [
+        ("latency p50", |l| l.p50),
+        ("latency p99", |l| l.p99),
+        ("latency p99.9", |l| l.p999),
+    ];
+    for (name, percentile) in percentiles {
+        let micros = |latency: &[Latency]| -> Vec<f64> {
+            latency.iter().map(|l| percentile(l) as f64 / 1e3).collect()
+        };
+        metric(
+            name,
+            "us",
+            &micros(&baseline.latency),
+            &micros(&candidate.latency),
+            false,
+        );
+    }
+    verdicts
+}
+
+fn main() {
+    let args = Args::parse();
+    let baseline = load(&args.baseline);
+    let candidate = load(&args.candidate);
+
+    for (name, run) in [("baseline", &baseline), ("candidate", &candidate)] {
+        let env = &run.environment;
+        println!(
+            "{name:<9} {} commit {} kernel {} on {}",
+            env.tool,
+            env.commit.as_deref().unwrap_or("unknown"),
+            env.kernel,
+            env.cpu_model,
+        );
+    }
+    let (a, b) = (&baseline.environment, &candidate.environment);
+    if a.kernel != b.kernel || a.cpu_model != b.cpu_model {
+        println!("warning: the runs were made on different kernels or CPUs");
+    }
+    println!();
+
+    let mut regressions = 0;
+    let mut unmatched = 0;
+    for record in &candidate.records {
+        let matching = baseline
+            .records
+            .iter()
+            .find(|r| same_config(r, record, &args.ignore));
+        let Some(matching) = matching else {
+            unmatched += 1;
+            continue;
+        };
+        regressions += compare_records(matching, record, &args)
+            .into_iter()
+            .filter(|&verdict| verdict == Verdict::Regression)
+            .count();
+    }
+
+    if unmatched > 0 {
+        println!("{unmatched} configurations of the candidate are missing from the baseline");
+    }
+    if regressions > 0 {
+        println!("{regressions} regressions beyond {}%", args.threshold);
+        process::exit(1);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn assert_close(actual: f64, expected: f64, tolerance: f64) {
+        assert!(
+            (actual - expected).abs() <= tolerance,
+            "{actual} is not within {tolerance} of {expected}"
+        );
+    }
+
+    #[test]
+    fn ln_gamma_matches_factorials() {
+        assert_close(ln_gamma(1.0), 0.0, 1e-10);
+        assert_close(ln_gamma(5.0), 24f64.ln(), 1e-10);
+        assert_close(ln_gamma(0.5), std::f64::consts::PI.sqrt().ln(), 1e-10);
+    }
+
+    #[test]
+    fn incomplete_beta_bounds_and_symmetry() {
+        assert_eq!(incomplete_beta(2.0, 3.0, 0.0), 0.0);
+        assert_eq!(incomplete_beta(2.0, 3.0, 1.0), 1.0);
+        // I_x(1, 1) is the uniform distribution.
+        assert_close(incomplete_beta(1.0, 1.0, 0.3), 0.3, 1e-10);
+        assert_close(
+            incomplete_beta(2.0, 3.0, 0.4),
+            1.0 - incomplete_beta(3.0, 2.0, 0.6),
+            1e-10,
+        );
+    }
+
+    // Critical values of the two-sided t-test from published tables.
+    #[test]
+    fn t_p_values_match_tables() {
+        assert_close(t_p_value(0.0, 10.0), 1.0, 1e-10);
+        assert_close(t_p_value(12.706, 1.0), 0.05, 1e-4);
+        assert_close(t_p_value(2.228, 10.0), 0.05, 1e-4);
+        assert_close(t_p_value(3.169, 10.0), 0.01, 1e-4);
+        assert_close(t_p_value(2.042, 30.0), 0.05, 1e-4);
+        assert_close(t_p_value(1.960, 1e6), 0.05, 1e-4);
+        assert_close(t_p_value(-2.228, 10.0), 0.05, 1e-4);
+    }
+
+    #[test]
+    fn welch_p_value_of_identical_and_separated_samples() {
+        assert_eq!(welch_p_value(&[1.0], &[2.0, 3.0]), None);
+        assert_eq!(welch_p_value(&[1.0, 1.0], &[1.0, 1.0]), Some(1.0));
+        assert_eq!(welch_p_value(&[1.0, 1.0], &[2.0, 2.0]), Some(0.0));
+        let p = welch_p_value(&[10.0, 10.1, 9.9, 10.0], &[12.0, 12.1, 11.9, 12.0]).unwrap();
+        assert!(p < 1e-4, "{p}");
+    }
+
+    #[test]
+    fn zero_baseline_is_not_misclassified() {
+        let args = Args::parse_from(["bench-compare", "a", "b"]);
+        let unchanged = compare(&[0.0, 0.0], &[0.0, 0.0], true, &args);
+        assert_eq!(unchanged.change, 0.0);
+        assert!(unchanged.verdict == Verdict::Unchanged);
+        let improvement = compare(&[0.0], &[1.0], true, &args);
+        assert_eq!(improvement.change, f64::INFINITY);
+        assert!(improvement.verdict == Verdict::Improvement);
+        let regression = compare(&[0.0], &[1.0], false, &args);
+        assert!(regression.verdict == Verdict::Regression);
+    }
+}
@@ -0,0 +1,566 @@
+use std::{
+    collections::BTreeMap,
+    fs::{self, File},
+    io::{self, BufRead, BufReader, BufWriter, Write},
+    mem,
+    os::unix::process::CommandExt,
+    path::PathBuf,
+    process::{Child, Command, Stdio},
+    thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::results::{Record, Run};
+use serde::Serialize;
+
+const SENDER_NETNS: &str = "cr18-sender";
+const RECEIVER_NETNS: &str = "cr18-receiver";
+const SENDER_VETH: &str = "veth-sender";
+const RECEIVER_VETH: &str = "veth-receiver";
+const SENDER_ADDR: &str = "10.0.0.2";
+const RECEIVER_ADDR: &str = "10.0.0.3";
+
+#[derive(Clone, Copy, Debug, clap::ValueEnum, Serialize)]
+#[serde(rename_all = "kebab-case")]
+enum Backend {
+    Epoll,
+    IoUring,
+}
+
+impl Backend {
+    fn name(self) -> &'static str {
+        match self {
+            Backend::Epoll => "epoll",
+            Backend::IoUring => "io-uring",
+        }
+    }
+
+    // The value of `--backend` of the `server` binary.
+    fn server_backend(self) -> &'static str {
+        match self {
+            Backend::Epoll => "epoll",
+            Backend::IoUring => "uring",
+        }
+    }
+}
+
+#[derive(clap::Parser)]
+struct Args {
+    /// Directory containing the `server` and `tcp-sender` binaries.
+    #[clap(long, default_value = "target/release")]
+    bin_dir: PathBuf,
+
+    #[clap(
+        long,
+        value_enum,
+        value_delimiter = ',',
+        default_value = "epoll,io-uring"
+    )]
+    backends: Vec<Backend>,
+
+    /// Server threads to sweep. The sender uses as many threads as the server.
+    #[clap(long, value_delimiter = ',', default_value = "1")]
+    threads: Vec<usize>,
+
+    /// Sender write sizes to sweep, in bytes.
+    #[clap(long, value_delimiter = ',', default_value = "65536")]
+    sizes: Vec<usize>,
+
+    #[clap(long, default_value_t = 1)]
+    connections_per_thread: usize,
+
+    #[clap(long, default_value_t = 3)]
+    trials: usize,
+
+    /// Measured seconds per trial.
+    #[clap(long, default_value_t = 10)]
+    duration: u64,
+
+    /// Seconds sent at the start of every trial and excluded from the results.
+    #[clap(long, default_value_t = 2)]
+    warmup: u64,
+
+    #[clap(long, default_value_t = 9000)]
+    port: u16,
+
+    /// Run both ends over loopback in the current namespace instead of across a veth pair.
+    #[clap(long)]
+    loopback: bool,
+
+    #[clap(long, default_value_t = 1500)]
+    mtu: u32,
+
+    #[clap(long, default_value_t = true, action = clap::ArgAction::Set)]
+    gro: bool,
+
+    /// Number of TX and RX queues of each veth device.
+    #[clap(long, default_value_t = 1)]
+    queues: u32,
+
+    /// CPUs the server is pinned to, e.g. `2-3` or `2,3`.
+    #[clap(long, value_parser = parse_cpu_list)]
+    server_cpus: Option<CpuList>,
+
+    /// NUMA placement of the server threads and their memory, passed to its `--numa`: `off`,
+    /// `auto` or a node number. Runs with the node of the NIC and with another node measure the
+    /// cost of crossing nodes.
+    #[clap(long, default_value = "off")]
+    server_numa: String,
+
+    /// Pipeline workers per server event loop, passed to its `--workers` (epoll only). With 0 the
+    /// handler runs inline in the event loop.
+    #[clap(long, default_value_t = 0)]
+    server_workers: usize,
+
+    /// Passes of the server handler over every received byte, passed to its `--work`.
+    #[clap(long, default_value_t = 0)]
+    server_work: u32,
+
+    /// CPUs the sender is pinned to.
+    #[clap(long, value_parser = parse_cpu_list)]
+    sender_cpus: Option<CpuList>,
+
+    /// Output path prefix. Writes `<prefix>.csv` with one row per trial, `<prefix>-summary.csv`
+    /// with statistics over the trials and `<prefix>.json` with both.
+    #[clap(short, long, default_value = "results")]
+    output: String,
+
+    /// Also store the run in this directory in the format read by `bench-compare`.
+    #[clap(long)]
+    store: Option<PathBuf>,
+}
+
+#[derive(Clone)]
+struct CpuList(Vec<usize>);
+
+fn parse_cpu_list(s: &str) -> Result<CpuList, String> {
+    let mut cpus = Vec::new();
+    for part in s.split(',') {
+        let parse = |s: &str| s.parse::<usize>().map_err(|err| format!("{s}: {err}"));
+        match part.split_once('-') {
+            Some((first, last)) => cpus.extend(parse(first)?..=parse(last)?),
+            None => cpus.push(parse(part)?),
+        }
+    }
+    Ok(CpuList(cpus))
+}
+
+#[derive(Serialize)]
+struct Trial {
+    backend: Backend,
+    threads: usize,
+    size: usize,
+    trial: usize,
+    gbps: f64,
+    // CPUs used by the server over the measured seconds.
+    cpu: f64,
+}
+
+#[derive(Serialize)]
+struct Summary {
+    backend: Backend,
+    threads: usize,
+    size: usize,
+    trials: usize,
+    mean_gbps: f64,
+    stddev_gbps: f64,
+    min_gbps: f64,
+    max_gbps: f64,
+    // Half-width of the 95% confidence interval of the mean.
+    ci95_gbps: f64,
+    mean_cpu: f64,
+}
+
+#[derive(Serialize)]
+struct Results<'a> {
+    trials: &'a [Trial],
+    summary: &'a [Summary],
+}
+
+fn run_command(program: &str, args: &[&str]) -> io::Result<()> {
+    let status = Command::new(program).args(args).status()?;
+    if !status.success() {
+        return Err(io::Error::other(format!(
+            "`{program} {}` failed: {status}",
+            args.join(" ")
+        )));
+    }
+    Ok(())
+}
+
+// Returns the user and system time consumed by a process so far.
+fn cpu_time(pid: u32) -> io::Result<Duration> {
+    let stat = fs::read_to_string(format!("/proc/{pid}/stat"))?;
+    // The command name in the second field may contain spaces, but not a closing parenthesis.
+    let fields: Vec<&str> = stat[stat.rfind(')').unwrap() + 2..]
+        .split_whitespace()
+        .collect();
+    let ticks = |i: usize| fields[i].parse::<u64>().map_err(io::Error::other);
+    // `utime` and `stime` are the 14th and 15th fields.
+    let ticks = ticks(11)? + ticks(12)?;
+    let ticks_per_sec = unsafe { libc::sysconf(libc::_SC_CLK_TCK) } as u64;
+    Ok(Duration::from_secs_f64(ticks as f64 / ticks_per_sec as f64))
+}
+
+// Deletes the namespaces, and with them the veth pair, when dropped.
+struct Topology;
+
+impl Topology {
+    fn delete() {
+        for netns in [SENDER_NETNS, RECEIVER_NETNS] {
+            let _ = Command::new("ip")
+                .args(["netns", "del", netns])
+                .stderr(Stdio::null())
+                .status();
+        }
+    }
+
+    fn create(args: &Args) -> io::Result<Self> {
+        // Clean up after a previous run that was interrupted.
+        Self::delete();
+
+        let queues = args.queues.to_string();
+        let mtu = args.mtu.to_string();
+
+        run_command("ip", &["netns", "add", SENDER_NETNS])?;
+        run_command("ip", &["netns", "add", RECEIVER_NETNS])?;
+        let topology = Topology;
+
+        #[rustfmt::skip]
+        run_command("ip", &[
+            "link", "add", SENDER_VETH, "numtxqueues", &queues, "numrxqueues", &queues,
+            "type", "veth",
+            "peer", "name", RECEIVER_VETH, "numtxqueues", &queues, "numrxqueues", &queues,
+        ])?;
+
+        for (netns, veth, addr) in [
+            (SENDER_NETNS, SENDER_VETH, SENDER_ADDR),
+            (RECEIVER_NETNS, RECEIVER_VETH, RECEIVER_ADDR),
+        ] {
+            let cidr = format!("{addr}/24");
+            run_command("ip", &["link", "set", veth, "netns", netns])?;
+            run_command("ip", &["-n", netns, "addr", "add", &cidr, "dev", veth])?;
+            run_command("ip", &["-n", netns, "link", "set", veth, "mtu", &mtu, "up"])?;
+            run_command("ip", &["-n", netns, "link", "set", "lo", "up"])?;
+        }
+
+        let gro = if args.gro { "on" } else { "off" };
+        #[rustfmt::skip]
+        run_command("ip", &[
+            "netns", "exec", RECEIVER_NETNS, "ethtool", "-K", RECEIVER_VETH, "gro", gro,
+        ])?;
+
+        Ok(topology)
+    }
+}
+
+impl Drop for Topology {
+    fn drop(&mut self) {
+        Self::delete();
+    }
+}
+
+// Builds a command that runs in `netns` (if any) with its CPU affinity restricted to `cpus`.
+fn command(netns: Option<&str>, cpus: Option<&[usize]>, program: PathBuf) -> Command {
+    let mut command = match netns {
+        Some(netns) => {
+            let mut command = Command::new("ip");
+            command.args(["netns", "exec", netns]).arg(program);
+            command
+        }
+        None => Command::new(program),
+    };
+
+    if let Some(cpus) = cpus {
+        let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+        for &cpu in cpus {
+            unsafe { libc::CPU_SET(cpu, &mut set) };
+        }
+        // The affinity is inherited across `ip netns exec`.
+        unsafe {
+            command.pre_exec(move || {
+                if libc::sched_setaffinity(0, mem::size_of_val(&set), &set) == -1 {
+                    return Err(io::Error::last_os_error());
+                }
+                Ok(())
+            });
+        }
+    }
+
+    command
+}
+
+struct Runner<'a> {
+    args: &'a Args,
+    server_addr: String,
+    sender_netns: Option<&'static str>,
+    receiver_netns: Option<&'static str>,
+}
+
+impl Runner<'_> {
+    fn start_server(&self, backend: Backend, threads: usize) -> io::Result<Child> {
+        let args = self.args;
+        let mut command = command(
+            self.receiver_netns,
+            args.server_cpus.as_ref().map(|cpus| &cpus.0[..]),
+            args.bin_dir.join("server"),
+        );
+        command
+            .args(["--backend", backend.server_backend()])
+            .args(["--bind", &self.server_addr])
+            .args(["--threads", &threads.to_string()])
+            .args(["--numa", &args.server_numa])
+            .args(["--work", &args.server_work.to_string()]);
+        if args.server_workers > 0 {
+            command.args(["--workers", &args.server_workers.to_string()]);
+        }
+        let server = command.spawn()?;
+
+        // There is no readiness notification, so give the server time to bind its listeners.
+        thread::sleep(Duration::from_millis(500));
+        Ok(server)
+    }
+
+    // Returns the mean throughput over the seconds that follow the warm-up, and the CPUs used by
+    // the server meanwhile.
+    fn run_sender(&self, server: &Child, threads: usize, size: usize) -> io::Result<(f64, f64)> {
+        let args = self.args;
+        let mut sender = command(
+            self.sender_netns,
+            args.sender_cpus.as_ref().map(|cpus| &cpus.0[..]),
+            args.bin_dir.join("tcp-sender"),
+        )
+        .args(["--connect", &self.server_addr])
+        .args(["--threads", &threads.to_string()])
+        .args([
+            "--connections",
+            &(threads * args.connections_per_thread).to_string(),
+        ])
+        .args(["--write-size", &size.to_string()])
+        .args(["--duration", &(args.warmup + args.duration).to_string()])
+        .stdout(Stdio::piped())
+        .spawn()?;
+
+        // The sender prints one `<second>s <throughput> Gbit/s` line per second.
+        let mut samples = Vec::new();
+        let mut cpu_start = None;
+        for line in BufReader::new(sender.stdout.take().unwrap()).lines() {
+            let line = line?;
+            let mut fields = line.split_whitespace();
+            let (Some(second), Some(gbps), Some("Gbit/s")) =
+                (fields.next(), fields.next(), fields.next())
+            else {
+                continue;
+            };
+            let (Some(second), Ok(gbps)) = (
+                second.strip_suffix('s').and_then(|s| s.parse::<u64>().ok()),
+                gbps.parse::<f64>(),
+            ) else {
+                continue;
+            };
+            if second == args.warmup {
+                cpu_start = Some((Instant::now(), cpu_time(server.id())?));
+            }
+            if second > args.warmup {
+                samples.push(gbps);
+            }
+        }
+        let cpu = match cpu_start {
+            Some((start, cpu_start)) => {
+                let elapsed = start.elapsed();
+                (cpu_time(server.id())? - cpu_start).as_secs_f64() / elapsed.as_secs_f64()
+            }
+            None => 0.0,
+        };
+
+        let status = sender.wait()?;
+        if !status.success() {
+            return Err(io::Error::other(format!("tcp-sender failed: {status}")));
+        }
+        if samples.is_empty() {
+            return Err(io::Error::other("tcp-sender reported no samples"));
+        }
+        let gbps = samples.iter().sum::<f64>() / samples.len() as f64;
+        Ok((gbps, cpu))
+    }
+
+    fn run_trial(&self, backend: Backend, threads: usize, size: usize) -> io::Result<(f64, f64)> {
+        let mut server = self.start_server(backend, threads)?;
+        let result = self.run_sender(&server, threads, size);
+        server.kill()?;
+        server.wait()?;
+        result
+    }
+}
+
+// Two-sided 95% Student's t quantiles for 1 to 30 degrees of freedom.
+const T95: [f64; 30] = [
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160,
+    2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+    2.052, 2.048, 2.045, 2.042,
+];
+
+fn summarize(trials: &[Trial]) -> Summary {
+    let values: Vec<f64> = trials.iter().map(|t| t.gbps).collect();
+    let n = values.len();
+    let mean = values.iter().sum::<f64>() / n as f64;
+    let stddev = if n > 1 {
+        (values.iter().map(|v| (v - mean).powi(2)).sum::<f64>() / (n - 1) as f64).sqrt()
+    } else {
+        0.0
+    };
+    let t = if n > 1 {
+        T95.get(n - 2).copied().unwrap_or(1.96)
+    } else {
+        0.0
+    };
+
+    Summary {
+        backend: trials[0].backend,
+        threads: trials[0].threads,
+        size: trials[0].size,
+        trials: n,
+        mean_gbps: mean,
+        stddev_gbps: stddev,
+        min_gbps: values.iter().copied().fold(f64::INFINITY, f64::min),
+        max_gbps: values.iter().copied().fold(f64::NEG_INFINITY, f64::max),
+        ci95_gbps: t * stddev / (n as f64).sqrt(),
+        mean_cpu: trials.iter().map(|t| t.cpu).sum::<f64>() / n as f64,
+    }
+}
+
+fn write_results(prefix: &str, trials: &[Trial], summary: &[Summary]) -> io::Result<()> {
+    let mut csv = BufWriter::new(File::create(format!("{prefix}.csv"))?);
+    writeln!(csv, "backend,threads,size,trial,gbps,cpu")?;
+    for t in trials {
+        writeln!(
+            csv,
+            "{},{},{},{},{:.4},{:.3}",
+            t.backend.name(),
+            t.threads,
+            t.size,
+            t.trial,
+            t.gbps,
+            t.cpu
+        )?;
+    }
+    csv.flush()?;
+
+    let mut csv = BufWriter::new(File::create(format!("{prefix}-summary.csv"))?);
+    writeln!(
+        csv,
+        "backend,threads,size,trials,mean_gbps,stddev_gbps,min_gbps,max_gbps,ci95_gbps,mean_cpu"
+    )?;
+    for s in summary {
+        writeln!(
+            csv,
+            "{},{},{},{},{:.4},{:.4},{:.4},{:.4},{:.4},{:.3}",
+            s.backend.name(),
+            s.threads,
+            s.size,
+            s.trials,
+            s.mean_gbps,
+            s.stddev_gbps,
+            s.min_gbps,
+            s.max_gbps,
+            s.ci95_gbps,
+            s.mean_cpu
+        )?;
+    }
+    csv.flush()?;
+
+    let json = BufWriter::new(File::create(format!("{prefix}.json"))?);
+    serde_json::to_writer_pretty(json, &Results { trials, summary })?;
+    Ok(())
+}
+
+// Groups the trials by configuration into the records of a stored run.
+fn run_record(args: &Args, trials: &[Trial]) -> Record {
+    let t = &trials[0];
+    let config = BTreeMap::from([
+        ("threads".to_string(), t.threads.to_string()),
+        ("size".to_string(), t.size.to_string()),
+        (
+            "connections_per_thread".to_string(),
+            args.connections_per_thread.to_string(),
+        ),
+        ("loopback".to_string(), args.loopback.to_string()),
+        ("mtu".to_string(), args.mtu.to_string()),
+        ("gro".to_string(), args.gro.to_string()),
+        ("queues".to_string(), args.queues.to_string()),
+        ("numa".to_string(), args.server_numa.clone()),
+        ("workers".to_string(), args.server_workers.to_string()),
+        ("work".to_string(), args.server_work.to_string()),
+    ]);
+    Record {
+        backend: t.backend.name().to_string(),
+        config,
+        throughput_unit: "Gbit/s".to_string(),
+        throughput: trials.iter().map(|t| t.gbps).collect(),
+        latency: Vec::new(),
+        cpu: trials.iter().map(|t| t.cpu).collect(),
+    }
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.trials > 0);
+
+    let (_topology, runner) = if args.loopback {
+        let runner = Runner {
+            args: &args,
+            server_addr: format!("127.0.0.1:{}", args.port),
+            sender_netns: None,
+            receiver_netns: None,
+        };
+        (None, runner)
+    } else {
+        let topology = Topology::create(&args).expect("failed to set up the veth pair");
+        let runner = Runner {
+            args: &args,
+            server_addr: format!("{RECEIVER_ADDR}:{}", args.port),
+            sender_netns: Some(SENDER_NETNS),
+            receiver_netns: Some(RECEIVER_NETNS),
+        };
+        (Some(topology), runner)
+    };
+
+    let mut trials = Vec::new();
+    let mut summary = Vec::new();
+    let mut run = Run::new("bench-runner");
+    for &backend in &args.backends {
+        for &threads in &args.threads {
+            for &size in &args.sizes {
+                let first = trials.len();
+                for trial in 0..args.trials {
+                    let (gbps, cpu) = runner
+                        .run_trial(backend, threads, size)
+                        .unwrap_or_else(|err| panic!("{backend:?} trial failed: {err}"));
+                    eprintln!(
+                        "{} threads={threads} size={size} trial={trial}: {gbps:.3} Gbit/s \
+                         {cpu:.2} CPUs",
+                        backend.name()
+                    );
+                    trials.push(Trial {
+                        backend,
+                        threads,
+                        size,
+                        trial,
+                        gbps,
+                        cpu,
+                    });
+                }
+                summary.push(summarize(&trials[first..]));
+                run.records.push(run_record(&args, &trials[first..]));
+                // Write after every configuration so that an interrupted sweep keeps its results.
+                write_results(&args.output, &trials, &summary).unwrap();
+            }
+        }
+    }
+
+    if let Some(dir) = &args.store {
+        let path = run.store(dir).expect("failed to store the run");
+        eprintln!("stored the run in {}", path.display());
+    }
+}
@@ -0,0 +1,187 @@
+use std::{
+    io::{self, Read, Write},
+    net::TcpStream,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+    thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::{histogram::Histogram, net::setsockopt};
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: String,
+
+    /// Number of threads, each of which opens one connection at a time.
+    #[clap(short, long, default_value_t = 4)]
+    threads: usize,
+
+    /// Size of the request sent on every connection. The server must be started with `--reply`,
+    /// which echoes it back.
+    #[clap(short, long, default_value_t = 64)]
+    size: usize,
+
+    #[clap(short, long, default_value_t = 10.0)]
+    duration: f64,
+
+    /// Seconds at the start of the run whose connections are not recorded.
+    #[clap(long, default_value_t = 1.0)]
+    warmup: f64,
+
+    /// Close connections with a RST instead of a FIN, so that no `TIME_WAIT` sockets exhaust the
+    /// ephemeral ports.
+    #[clap(long)]
+    reset: bool,
+}
+
+// Each thread publishes its connection count on its own cache line so that the reporting thread
+// does not cause false sharing between clients.
+#[derive(Default)]
+#[repr(align(64))]
+struct Counter(AtomicU64);
+
+#[derive(Default)]
+struct Results {
+    // From the start of `connect` until it returned, which the kernel completes before the server
+    // accepts the connection.
+    connect: Histogram,
+    // From the start of `connect` until the first byte of the reply, which includes accepting the
+    // connection and arming its first receive.
+    first_byte: Histogram,
+    errors: u64,
+}
+
+fn churn(
+    addr: &str,
+    request: &[u8],
+    reset: bool,
+    count: &Counter,
+    record_from: Instant,
+) -> io::Result<(Duration, Duration)> {
+    let start = Instant::now();
+    let mut stream = TcpStream::connect(addr)?;
+    let connected = start.elapsed();
+    stream.set_nodelay(true)?;
+    if reset {
+        let linger = libc::linger {
+            l_onoff: 1,
+            l_linger: 0,
+        };
+        setsockopt(&stream, libc::SOL_SOCKET, libc::SO_LINGER, &linger)?;
+    }
+
+    stream.write_all(request)?;
+    let mut buf = vec![0; request.len()];
+    let mut received = stream.read(&mut buf)?;
+    let first_byte = start.elapsed();
+    while received < buf.len() {
+        match stream.read(&mut buf[received..])? {
+            0 => return Err(io::ErrorKind::UnexpectedEof.into()),
+            n => received += n,
+        }
+    }
+
+    if start >= record_from {
+        count.0.fetch_add(1, Ordering::Relaxed);
+    }
+    Ok((connected, first_byte))
+}
+
+fn run(args: &Args, count: &Counter, record_from: Instant, stop: &AtomicBool) -> Results {
+    let request = vec![0xa5; args.size];
+    let mut results = Results::default();
+    while !stop.load(Ordering::Relaxed) {
+        let start = Instant::now();
+        match churn(&args.connect, &request, args.reset, count, record_from) {
+            Ok((connect, first_byte)) => {
+                if start >= record_from {
+                    results.connect.record(connect.as_nanos() as u64);
+                    results.first_byte.record(first_byte.as_nanos() as u64);
+                }
+            }
+            Err(err) => {
+                if results.errors == 0 {
+                    eprintln!("connection failed: {err}");
+                }
+                results.errors += 1;
+                // Typically the ephemeral ports or the accept queue ran out.
+                thread::sleep(Duration::from_millis(1));
+            }
+        }
+    }
+    results
+}
+
+fn micros(nanos: u64) -> f64 {
+    nanos as f64 / 1e3
+}
+
+fn print_latency(name: &str, histogram: &Histogram) {
+    println!(
+        "{name:>10} p50 {:>9.1} p99 {:>9.1} p99.9 {:>9.1} max {:>9.1} us",
+        micros(histogram.percentile(50.0)),
+        micros(histogram.percentile(99.0)),
+        micros(histogram.percentile(99.9)),
+        micros(histogram.max()),
+    );
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.threads > 0 && args.size > 0);
+
+    let counters: Vec<Counter> = (0..args.threads).map(|_| Counter::default()).collect();
+    let stop = AtomicBool::new(false);
+    let start = Instant::now();
+    let record_from = start + Duration::from_secs_f64(args.warmup);
+    let end = record_from + Duration::from_secs_f64(args.duration);
+
+    let mut results = Results::default();
+    thread::scope(|s| {
+        let workers: Vec<_> = counters
+            .iter()
+            .map(|count| {
+                let (args, stop) = (&args, &stop);
+                s.spawn(move || run(args, count, record_from, stop))
+            })
+            .collect();
+
+        let total = || {
+            counters
+                .iter()
+                .map(|c| c.0.load(Ordering::Relaxed))
+                .sum::<u64>()
+        };
+        let mut last = 0;
+        let mut next = record_from + Duration::from_secs(1);
+        while next <= end {
+            thread::sleep(next.saturating_duration_since(Instant::now()));
+            let count = total();
+            let tick = (next - record_from).as_secs();
+            println!("{tick:>4}s {:>9} conn/s", count - last);
+            last = count;
+            next += Duration::from_secs(1);
+        }
+        thread::sleep(end.saturating_duration_since(Instant::now()));
+        stop.store(true, Ordering::Relaxed);
+
+        for worker in workers {
+            let worker = worker.join().unwrap();
+            results.connect.merge(&worker.connect);
+            results.first_byte.merge(&worker.first_byte);
+            results.errors += worker.errors;
+        }
+    });
+
+    println!(
+        "{} connections in {:.3}s, {:.0} conn/s, {} errors",
+        results.first_byte.count(),
+        args.duration,
+        results.first_byte.count() as f64 / args.duration,
+        results.errors,
+    );
+    print_latency("connect", &results.connect);
+    print_latency("first byte", &results.first_byte);
+}
@@ -0,0 +1,32 @@
+use common::checksum::{crc32c_kernel, crc32c_scalar};
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+// Receive sizes: a small request, a buffer of the io_uring ring and of the pipeline blocks, and a
+// large read of the epoll backend.
+const SIZES: [usize; 3] = [64, 4096, 65536];
+
+// Reports the throughput of each kernel in bytes per second, the bound on the rate at which a
+// thread can verify the streams it receives.
+fn crc32c(c: &mut Criterion) {
+    let (kernel, name) = crc32c_kernel();
+    let data: Vec<u8> = (0..SIZES[SIZES.len() - 1]).map(|i| i as u8).collect();
+    // The check value of CRC32C.
+    assert_eq!(!kernel(!0, b"123456789"), 0xe3069283);
+    assert_eq!(kernel(!0, &data), crc32c_scalar(!0, &data));
+
+    let mut group = c.benchmark_group("crc32c");
+    for size in SIZES {
+        let data = &data[..size];
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::new("scalar", size), data, |b, data| {
+            b.iter(|| crc32c_scalar(!0, black_box(data)))
+        });
+        group.bench_with_input(BenchmarkId::new(name, size), data, |b, data| {
+            b.iter(|| kernel(!0, black_box(data)))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, crc32c);
+criterion_main!(benches);
@@ -0,0 +1,90 @@
+use std::{
+    mem::{self, MaybeUninit},
+    sync::Arc,
+};
+
+use common::{
+    engine::Handler,
+    http::Http,
+    kv::{Kv, Store},
+    ring::RingBuffer,
+};
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+// Size of the reads of the epoll backend into its shared buffer.
+const READ: usize = 4096;
+
+// Pipelined requests of uneven lengths, so that most reads end in the middle of one.
+fn http_stream() -> Vec<u8> {
+    let mut stream = Vec::new();
+    for i in 0..2048 {
+        let padding = "x".repeat(i * 37 % 300);
+        stream.extend_from_slice(
+            format!("GET /{i} HTTP/1.1\r\nHost: localhost\r\nX-Padding: {padding}\r\n\r\n")
+                .as_bytes(),
+        );
+    }
+    stream
+}
+
+fn kv_stream() -> Vec<u8> {
+    let mut stream = Vec::new();
+    for i in 0..2048 {
+        let value = "v".repeat(i * 97 % 1000);
+        stream.extend_from_slice(
+            format!("set key{} 0 0 {}\r\n{value}\r\n", i % 64, value.len()).as_bytes(),
+        );
+    }
+    stream
+}
+
+// Copies `READ` bytes at a time into a buffer shared by all connections, like `read` does, and
+// lets the handler copy the tail of a split message.
+fn split<H: Handler>(handler: &mut H, stream: &[u8], out: &mut Vec<u8>) {
+    let mut buf = [0; READ];
+    for chunk in stream.chunks(READ) {
+        buf[..chunk.len()].copy_from_slice(chunk);
+        handler.on_recv(0, &buf[..chunk.len()], out);
+        out.clear();
+    }
+}
+
+// Copies `READ` bytes at a time into the free space of a ring, which keeps a split message until
+// it is complete.
+fn ring<H: Handler>(handler: &mut H, ring: &mut RingBuffer, stream: &[u8], out: &mut Vec<u8>) {
+    for chunk in stream.chunks(READ) {
+        let free = ring.free();
+        let src: &[MaybeUninit<u8>] = unsafe { mem::transmute(chunk) };
+        free[..chunk.len()].copy_from_slice(src);
+        ring.commit(chunk.len());
+        let consumed = handler.on_recv_buffered(0, ring.data(), out);
+        ring.consume(consumed);
+        out.clear();
+    }
+    assert!(ring.is_empty());
+}
+
+fn bench<H: Handler>(c: &mut Criterion, name: &str, mut handler: H, stream: &[u8]) {
+    let mut out = Vec::new();
+    let mut buffer = RingBuffer::new(2 * READ).unwrap();
+    let mut group = c.benchmark_group("parse");
+    group.throughput(Throughput::Bytes(stream.len() as u64));
+    group.bench_function(BenchmarkId::new("split", name), |b| {
+        b.iter(|| split(&mut handler, stream, &mut out))
+    });
+    group.bench_function(BenchmarkId::new("ring", name), |b| {
+        b.iter(|| ring(&mut handler, &mut buffer, stream, &mut out))
+    });
+    group.finish();
+}
+
+// Compares parsing messages that are split across reads from a shared buffer with parsing them in
+// place in a ring of twice the read size, which never holds more than a split message and a read.
+fn parse(c: &mut Criterion) {
+    bench(c, "http", Http::default(), &http_stream());
+    let store = Arc::new(Store::new(1, 64));
+    bench(c, "kv", Kv::new(store), &kv_stream());
+}
+
+criterion_group!(benches, parse);
+criterion_main!(benches);
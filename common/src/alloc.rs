@@ -0,0 +1,160 @@
+use std::{
+    alloc::{GlobalAlloc, Layout, System},
+    cell::Cell,
+    ptr,
+};
+
+use crate::metrics::Counter;
+
+// The allocation counter of the calling thread, if it counts them.
+thread_local! {
+    static COUNTER: Cell<*const Counter> = const { Cell::new(ptr::null()) };
+}
+
+// The system allocator, counting the allocations and reallocations of the threads that asked for
+// it. It is only installed with the `count-allocations` feature, since it costs a thread-local
+// read on every allocation.
+pub struct CountingAllocator;
+
+#[inline]
+fn count() {
+    // The thread-local is gone while the thread exits.
+    let _ = COUNTER.try_with(|counter| {
+        let counter = counter.get();
+        if !counter.is_null() {
+            unsafe { (*counter).add(1) };
+        }
+    });
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        count();
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        count();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        count();
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+#[cfg(feature = "count-allocations")]
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+// Counts the allocations of the calling thread into `counter` from now on, which must outlive the
+// thread.
+pub(crate) fn count_into(counter: &Counter) {
+    COUNTER.with(|cell| cell.set(counter));
+}
+
+// Loopback traffic for the allocation tests of the backends, which need the counting allocator.
+#[cfg(feature = "count-allocations")]
+pub mod check {
+    use std::{
+        io::{Read, Write},
+        net::{SocketAddr, TcpStream},
+        thread,
+    };
+
+    use crate::{
+        engine::{Engine, Handler},
+        http::RESPONSE,
+        metrics::Metrics,
+    };
+
+    // Requests and the replies they must get.
+    pub type Exchanges = Vec<(Vec<u8>, Vec<u8>)>;
+
+    const CONNECTIONS: usize = 8;
+    const WARM_UP: usize = 200;
+    const ROUNDS: usize = 300;
+
+    pub fn http_exchanges() -> Exchanges {
+        let request = b"GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        vec![
+            (request.to_vec(), RESPONSE.to_vec()),
+            (
+                [&request[..], request].concat(),
+                [RESPONSE, RESPONSE].concat(),
+            ),
+        ]
+    }
+
+    // Sets and gets of a fixed set of keys, so that the table stops growing once warm.
+    pub fn kv_exchanges() -> Exchanges {
+        (0..16)
+            .flat_map(|i| {
+                let set = format!("set key{i} 0 0 5\r\nvalue\r\n").into_bytes();
+                let get = format!("get key{i}\r\n").into_bytes();
+                let value = format!("VALUE key{i} 0 5\r\nvalue\r\nEND\r\n").into_bytes();
+                [(set, b"STORED\r\n".to_vec()), (get, value)]
+            })
+            .collect()
+    }
+
+    // Sends every request on every connection, split in two writes so that the engine also sees
+    // partial requests, and checks the replies.
+    fn round(streams: &mut [TcpStream], exchanges: &Exchanges, reply: &mut Vec<u8>) {
+        for stream in streams.iter_mut() {
+            for (request, expected) in exchanges {
+                let (head, tail) = request.split_at(request.len() / 2);
+                stream.write_all(head).unwrap();
+                stream.write_all(tail).unwrap();
+                reply.resize(expected.len(), 0);
+                stream.read_exact(reply).unwrap();
+                assert_eq!(reply, expected);
+            }
+        }
+    }
+
+    // Runs `engine`, which listens on `addr`, on a thread of its own and panics if its event loop
+    // allocates once the connections are established and the pools are filled. The engine never
+    // returns, so it and its metrics live until the test process exits.
+    pub fn assert_no_allocations<E, H>(
+        engine: E,
+        addr: SocketAddr,
+        handler: H,
+        exchanges: Exchanges,
+    ) where
+        E: Engine + Send + 'static,
+        H: Handler + Clone + Send + 'static,
+    {
+        let metrics: &'static Metrics = Box::leak(Box::default());
+        thread::spawn(move || engine.run(handler, metrics));
+
+        let mut streams: Vec<_> = (0..CONNECTIONS)
+            .map(|_| {
+                let stream = TcpStream::connect(addr).unwrap();
+                stream.set_nodelay(true).unwrap();
+                stream
+            })
+            .collect();
+        let mut reply = Vec::new();
+        for _ in 0..WARM_UP {
+            round(&mut streams, &exchanges, &mut reply);
+        }
+        let allocations = metrics.allocations.get();
+        let events = metrics.events.get();
+        for _ in 0..ROUNDS {
+            round(&mut streams, &exchanges, &mut reply);
+        }
+        let events = metrics.events.get() - events;
+        assert!(events > 0, "the event loop handled no events");
+        assert_eq!(
+            metrics.allocations.get() - allocations,
+            0,
+            "the event loop allocated while handling {events} events"
+        );
+    }
+}
@@ -0,0 +1,142 @@
+use std::{
+    collections::HashMap,
+    mem,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+use crate::metrics::Metrics;
+
+#[derive(clap::Args)]
+pub struct BalanceArgs {
+    /// Milliseconds between two load checks of every event loop, or 0 to never move connections.
+    /// An event loop that received more than `--imbalance` percent above the average moves one of
+    /// its connections to the least loaded loop.
+    #[clap(long, default_value_t = 0)]
+    pub balance_interval: u64,
+
+    /// Percentage above the average receive rate that makes an event loop give a connection away.
+    #[clap(long, default_value_t = 25.0)]
+    pub imbalance: f64,
+}
+
+// Decides which connections an event loop gives to the others, from the byte counters of all the
+// event loops and the bytes it received on each of its connections since the last check.
+pub struct Balancer {
+    thread: usize,
+    metrics: Arc<[Metrics]>,
+    interval: Duration,
+    imbalance: f64,
+    next: Instant,
+    prev: Vec<u64>,
+    conns: HashMap<u32, u64>,
+}
+
+impl Balancer {
+    // Returns a balancer for each of the event loops that own the first `threads` blocks of
+    // `metrics`, or none if balancing is disabled.
+    pub fn for_threads(
+        threads: usize,
+        metrics: &Arc<[Metrics]>,
+        args: &BalanceArgs,
+    ) -> Vec<Option<Balancer>> {
+        (0..threads)
+            .map(|thread| {
+                (args.balance_interval > 0 && threads > 1).then(|| Balancer {
+                    thread,
+                    metrics: metrics.clone(),
+                    interval: Duration::from_millis(args.balance_interval),
+                    imbalance: args.imbalance / 100.0,
+                    next: Instant::now(),
+                    prev: vec![0; threads],
+                    conns: HashMap::new(),
+                })
+            })
+            .collect()
+    }
+
+    pub fn thread(&self) -> usize {
+        self.thread
+    }
+
+    #[inline]
+    pub fn record(&mut self, conn: u32, bytes: usize) {
+        *self.conns.entry(conn).or_default() += bytes as u64;
+    }
+
+    pub fn forget(&mut self, conn: u32) {
+        self.conns.remove(&conn);
+    }
+
+    // Returns a connection to move and the event loop to move it to, at most once per interval.
+    // The connection is the busiest one whose move narrows the gap to the least loaded loop
+    // instead of reversing it, so that a single elephant flow does not bounce between loops.
+    pub fn poll(&mut self) -> Option<(u32, usize)> {
+        let now = Instant::now();
+        if now < self.next {
+            return None;
+        }
+        self.next = now + self.interval;
+
+        let loads: Vec<u64> = self
+            .prev
+            .iter_mut()
+            .zip(self.metrics.iter())
+            .map(|(prev, metrics)| {
+                let bytes = metrics.bytes.get();
+                let load = bytes - *prev;
+                *prev = bytes;
+                load
+            })
+            .collect();
+        let conns = mem::take(&mut self.conns);
+
+        let mean = loads.iter().sum::<u64>() as f64 / loads.len() as f64;
+        let own = loads[self.thread];
+        if (own as f64) <= mean * (1.0 + self.imbalance) || conns.len() < 2 {
+            return None;
+        }
+        let (target, &least) = loads.iter().enumerate().min_by_key(|(_, &load)| load)?;
+        let gap = own - least;
+        conns
+            .into_iter()
+            .filter(|&(_, bytes)| bytes > 0 && bytes < gap)
+            .max_by_key(|&(_, bytes)| bytes)
+            .map(|(conn, _)| (conn, target))
+    }
+}
+
+// A queue per event loop of the connections moved to it by the others.
+pub struct Mailboxes<T> {
+    boxes: Box<[(AtomicBool, Mutex<Vec<T>>)]>,
+}
+
+impl<T> Mailboxes<T> {
+    pub fn new(threads: usize) -> Self {
+        Mailboxes {
+            boxes: (0..threads)
+                .map(|_| (AtomicBool::new(false), Mutex::new(Vec::new())))
+                .collect(),
+        }
+    }
+
+    pub fn send(&self, thread: usize, item: T) {
+        let (pending, items) = &self.boxes[thread];
+        items.lock().unwrap().push(item);
+        pending.store(true, Ordering::Release);
+    }
+
+    // Moves the items sent to `thread` into `out`. Checking for them is a load of a flag, cheap
+    // enough to be done on every iteration of an event loop.
+    pub fn receive(&self, thread: usize, out: &mut Vec<T>) {
+        let (pending, items) = &self.boxes[thread];
+        if !pending.load(Ordering::Acquire) {
+            return;
+        }
+        pending.store(false, Ordering::Relaxed);
+        out.append(&mut items.lock().unwrap());
+    }
+}
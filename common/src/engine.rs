@@ -0,0 +1,226 @@
+use std::{hint, sync::Arc, thread};
+
+use crate::{
+    checksum::{crc32c_kernel, Crc32c},
+    http::Http,
+    kv::{Kv, KvArgs, Store},
+    metrics::Metrics,
+    numa::Placement,
+};
+
+// The application stage of a server, called by every backend with the bytes it received. Backends
+// are generic over it so that each combination of backend and handler is compiled on its own and
+// the calls are inlined.
+pub trait Handler {
+    // Processes bytes received on connection `conn` and appends the reply, if any, to `out`.
+    // Connection numbers are reused after `on_close`.
+    fn on_recv(&mut self, conn: u32, data: &[u8], out: &mut Vec<u8>);
+
+    // Like `on_recv` for the bytes held by a receive buffer that keeps what is not consumed, and
+    // returns the number of bytes consumed. Handlers that frame messages parse the complete ones in
+    // place and leave a split one in the buffer instead of copying it.
+    #[inline]
+    fn on_recv_buffered(&mut self, conn: u32, data: &[u8], out: &mut Vec<u8>) -> usize {
+        self.on_recv(conn, data, out);
+        data.len()
+    }
+
+    fn on_close(&mut self, _conn: u32) {}
+
+    // Called instead of `on_close` when connection `conn` moves to another thread. Appends what
+    // the handler keeps for the connection, such as a split message, to `state`, which the
+    // handler of the other thread takes back with `on_attach` before the next bytes arrive.
+    fn on_detach(&mut self, conn: u32, _state: &mut Vec<u8>) {
+        self.on_close(conn);
+    }
+
+    fn on_attach(&mut self, _conn: u32, _state: &[u8]) {}
+}
+
+// Receives and drops everything.
+#[derive(Clone, Copy, Default)]
+pub struct Discard;
+
+impl Handler for Discard {
+    #[inline]
+    fn on_recv(&mut self, _conn: u32, _data: &[u8], _out: &mut Vec<u8>) {}
+}
+
+// Echoes every received byte back to the client.
+#[derive(Clone, Copy, Default)]
+pub struct Echo;
+
+impl Handler for Echo {
+    #[inline]
+    fn on_recv(&mut self, _conn: u32, data: &[u8], out: &mut Vec<u8>) {
+        out.extend_from_slice(data);
+    }
+}
+
+// Reads every received byte `passes` times, a stand-in for an expensive parser.
+#[derive(Clone, Copy)]
+pub struct Work {
+    pub passes: u32,
+}
+
+impl Handler for Work {
+    #[inline]
+    fn on_recv(&mut self, _conn: u32, data: &[u8], _out: &mut Vec<u8>) {
+        let mut hash = 0xcbf29ce484222325u64;
+        for _ in 0..self.passes {
+            for &byte in data {
+                hash = (hash ^ u64::from(byte)).wrapping_mul(0x100000001b3);
+            }
+        }
+        hint::black_box(hash);
+    }
+}
+
+// The receive loop of one backend thread, set up with everything it needs except the handler.
+pub trait Engine {
+    // Runs the loop on the calling thread, which owns `metrics`. Engines that process on more than
+    // one thread run a clone of `handler` on each.
+    fn run<H: Handler + Clone + Send + 'static>(self, handler: H, metrics: &Metrics);
+}
+
+// Runs every engine on its own thread with a handler made by `handler`, until they all return.
+// Each thread is placed before it runs its engine, so that the rings and buffers the engine sets
+// up are allocated on the node of its placement.
+pub fn serve<E, H, F>(
+    engines: Vec<E>,
+    placements: &[Placement],
+    handler: F,
+    metrics: Arc<[Metrics]>,
+) where
+    E: Engine + Send + 'static,
+    H: Handler + Clone + Send + 'static,
+    F: Fn() -> H,
+{
+    let threads: Vec<_> = engines
+        .into_iter()
+        .enumerate()
+        .map(|(i, engine)| {
+            let metrics = metrics.clone();
+            let handler = handler();
+            let placement = placements[i];
+            thread::spawn(move || {
+                if let Err(err) = placement.apply() {
+                    eprintln!("warning: failed to place thread {i}: {err}");
+                }
+                engine.run(handler, &metrics[i])
+            })
+        })
+        .collect();
+    for thread in threads {
+        thread.join().unwrap();
+    }
+}
+
+#[derive(clap::Args)]
+pub struct HandlerArgs {
+    /// Echo every received byte back to the client.
+    #[clap(long)]
+    pub reply: bool,
+
+    /// Compute the CRC32C of the byte stream of every connection as it is received, with the
+    /// fastest kernel the CPU supports.
+    #[clap(long)]
+    pub checksum: bool,
+
+    /// Answer pipelined HTTP/1.1 requests with a fixed response.
+    #[clap(long)]
+    pub http: bool,
+
+    #[clap(flatten)]
+    pub kv: KvArgs,
+
+    /// Read every received byte this many times in the handler, to model an expensive parser.
+    #[clap(long, default_value_t = 0)]
+    pub work: u32,
+}
+
+impl HandlerArgs {
+    // Whether the handler writes replies to the connections.
+    pub fn replies(&self) -> bool {
+        self.reply || self.http || self.kv.kv
+    }
+}
+
+// The options of a server that restrict the others, for `check_options`.
+#[derive(Default)]
+pub struct ServerOptions {
+    // The backend receives from sockets that replies can be written to.
+    pub sockets: bool,
+    pub workers: usize,
+    pub balance: bool,
+    pub recv_ring: bool,
+    pub write_dir: bool,
+}
+
+// Rejects the combinations of options that no backend supports, so that every binary rejects the
+// same ones.
+pub fn check_options(handler: &HandlerArgs, options: &ServerOptions) {
+    let handlers = [
+        handler.reply,
+        handler.checksum,
+        handler.http,
+        handler.kv.kv,
+        handler.work > 0,
+    ];
+    assert!(
+        handlers.iter().filter(|&&handler| handler).count() <= 1,
+        "--reply, --checksum, --http, --kv and --work are exclusive"
+    );
+    // AF_XDP bypasses the TCP stack, so there is nobody to reply to.
+    assert!(
+        !handler.replies() || options.sockets,
+        "--reply, --http and --kv are not supported by this backend"
+    );
+    // Workers have no access to the sockets.
+    assert!(
+        !(handler.replies() && options.workers > 0),
+        "--reply, --http and --kv are not supported with --workers"
+    );
+    // Segments of a moved connection could still be queued to a worker of its old event loop.
+    assert!(
+        !(options.balance && options.workers > 0),
+        "--balance-interval is not supported with --workers"
+    );
+    // Workers receive blocks of their own.
+    assert!(
+        !(options.recv_ring && options.workers > 0),
+        "--recv-ring is not supported with --workers"
+    );
+    // A moved connection would leave its writes and file behind.
+    assert!(
+        !(options.write_dir && options.balance),
+        "--balance-interval is not supported with --write-dir"
+    );
+}
+
+// Serves with the handler selected by `args`. The handler is picked at startup, so that each
+// backend is compiled once per handler.
+pub fn serve_with_handler<E: Engine + Send + 'static>(
+    engines: Vec<E>,
+    placements: &[Placement],
+    args: &HandlerArgs,
+    metrics: Arc<[Metrics]>,
+) {
+    if args.reply {
+        serve(engines, placements, || Echo, metrics);
+    } else if args.kv.kv {
+        let store = Arc::new(Store::new(engines.len(), args.kv.kv_memory));
+        serve(engines, placements, || Kv::new(store.clone()), metrics);
+    } else if args.http {
+        serve(engines, placements, || Http::default(), metrics);
+    } else if args.checksum {
+        let (kernel, name) = crc32c_kernel();
+        eprintln!("checksum: CRC32C with the {name} kernel");
+        serve(engines, placements, || Crc32c::new(kernel), metrics);
+    } else if args.work > 0 {
+        let passes = args.work;
+        serve(engines, placements, || Work { passes }, metrics);
+    } else {
+        serve(engines, placements, || Discard, metrics);
+    }
+}
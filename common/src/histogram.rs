@@ -0,0 +1,123 @@
+// A high dynamic range histogram in the style of HdrHistogram: values below `2^SUB_BUCKET_BITS`
+// are counted exactly, and every power of two above that is split into `2^(SUB_BUCKET_BITS - 1)`
+// linear sub-buckets. With 11 bits the relative error of any recorded value is below 0.1%, over the
+// whole `u64` range, in a fixed-size array.
+const SUB_BUCKET_BITS: u32 = 11;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+const HALF: usize = SUB_BUCKETS / 2;
+const BUCKETS: usize = SUB_BUCKETS + (64 - SUB_BUCKET_BITS as usize) * HALF;
+
+#[derive(Clone)]
+pub struct Histogram {
+    counts: Box<[u64]>,
+    count: u64,
+    min: u64,
+    max: u64,
+    sum: u128,
+}
+
+fn index(value: u64) -> usize {
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let msb = 63 - value.leading_zeros();
+    let shift = msb - (SUB_BUCKET_BITS - 1);
+    let top = (value >> shift) as usize;
+    SUB_BUCKETS + (shift as usize - 1) * HALF + (top - HALF)
+}
+
+// Returns the highest value that maps to `index`.
+fn highest_equivalent(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    let shift = (index - SUB_BUCKETS) / HALF + 1;
+    let top = ((index - SUB_BUCKETS) % HALF + HALF) as u64;
+    ((top + 1) << shift).wrapping_sub(1)
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Histogram {
+            counts: vec![0; BUCKETS].into_boxed_slice(),
+            count: 0,
+            min: u64::MAX,
+            max: 0,
+            sum: 0,
+        }
+    }
+}
+
+impl Histogram {
+    #[inline]
+    pub fn record(&mut self, value: u64) {
+        self.record_n(value, 1);
+    }
+
+    pub fn record_n(&mut self, value: u64, n: u64) {
+        self.counts[index(value)] += n;
+        self.count += n;
+        self.min = self.min.min(value);
+        self.max = self.max.max(value);
+        self.sum += u128::from(value) * u128::from(n);
+    }
+
+    pub fn merge(&mut self, other: &Histogram) {
+        for (a, b) in self.counts.iter_mut().zip(other.counts.iter()) {
+            *a += b;
+        }
+        self.count += other.count;
+        self.min = self.min.min(other.min);
+        self.max = self.max.max(other.max);
+        self.sum += other.sum;
+    }
+
+    pub fn reset(&mut self) {
+        self.counts.fill(0);
+        self.count = 0;
+        self.min = u64::MAX;
+        self.max = 0;
+        self.sum = 0;
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn min(&self) -> u64 {
+        if self.count == 0 {
+            0
+        } else {
+            self.min
+        }
+    }
+
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    pub fn mean(&self) -> f64 {
+        if self.count == 0 {
+            0.0
+        } else {
+            self.sum as f64 / self.count as f64
+        }
+    }
+
+    // Returns the value at `percentile` (between 0 and 100), rounded up to the highest value of its
+    // sub-bucket like HdrHistogram does, and clamped to the recorded maximum.
+    pub fn percentile(&self, percentile: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        let rank = ((percentile / 100.0 * self.count as f64).ceil() as u64).clamp(1, self.count);
+        let mut seen = 0;
+        for (i, &n) in self.counts.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                return highest_equivalent(i).min(self.max);
+            }
+        }
+        self.max
+    }
+}
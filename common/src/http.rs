@@ -0,0 +1,367 @@
+use std::collections::HashMap;
+
+pub(crate) use self::simd::find_byte;
+use self::simd::find_head_end;
+use crate::{engine::Handler, pool::BufferPool};
+
+// The reply to every request, serialized once.
+pub const RESPONSE: &[u8] = b"HTTP/1.1 200 OK\r\n\
+    Content-Type: text/plain\r\n\
+    Content-Length: 13\r\n\
+    \r\n\
+    Hello, World!";
+
+const BAD_REQUEST: &[u8] = b"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+
+// Longest request head that is buffered while waiting for its end.
+const MAX_HEAD: usize = 16384;
+// Largest request body that is buffered while waiting for its end, so that a client cannot make a
+// connection hold an unbounded amount of memory.
+const MAX_BODY: usize = 1 << 20;
+
+#[derive(Debug, PartialEq)]
+pub enum Parse {
+    // A whole message of this many bytes is at the start of the buffer.
+    Complete(usize),
+    // The buffer ends before the message does.
+    Partial,
+    Invalid,
+}
+
+#[cfg(target_arch = "x86_64")]
+mod simd {
+    use std::arch::x86_64::{
+        __m128i, _mm_and_si128, _mm_cmpeq_epi8, _mm_loadu_si128, _mm_movemask_epi8, _mm_set1_epi8,
+    };
+
+    // SSE2 is part of x86_64, so these need no runtime detection.
+
+    #[inline(always)]
+    unsafe fn load(data: &[u8], i: usize) -> __m128i {
+        _mm_loadu_si128(data.as_ptr().add(i).cast())
+    }
+
+    // Returns the offset of the first `byte` in `data`, comparing 16 bytes at a time.
+    #[inline]
+    pub fn find_byte(data: &[u8], byte: u8) -> Option<usize> {
+        let needle = unsafe { _mm_set1_epi8(byte as i8) };
+        let mut i = 0;
+        while i + 16 <= data.len() {
+            let mask = unsafe { _mm_movemask_epi8(_mm_cmpeq_epi8(load(data, i), needle)) };
+            if mask != 0 {
+                return Some(i + mask.trailing_zeros() as usize);
+            }
+            i += 16;
+        }
+        data[i..].iter().position(|&b| b == byte).map(|j| i + j)
+    }
+
+    // Returns the offset of the first "\r\n\r\n" in `data`. Four shifted loads are compared with
+    // the four bytes of the pattern, so that each 16-byte step checks 16 candidate offsets.
+    #[inline]
+    pub fn find_head_end(data: &[u8]) -> Option<usize> {
+        let (cr, lf) = unsafe { (_mm_set1_epi8(b'\r' as i8), _mm_set1_epi8(b'\n' as i8)) };
+        let mut i = 0;
+        while i + 19 <= data.len() {
+            let mask = unsafe {
+                let a = _mm_and_si128(
+                    _mm_cmpeq_epi8(load(data, i), cr),
+                    _mm_cmpeq_epi8(load(data, i + 1), lf),
+                );
+                let b = _mm_and_si128(
+                    _mm_cmpeq_epi8(load(data, i + 2), cr),
+                    _mm_cmpeq_epi8(load(data, i + 3), lf),
+                );
+                _mm_movemask_epi8(_mm_and_si128(a, b))
+            };
+            if mask != 0 {
+                return Some(i + mask.trailing_zeros() as usize);
+            }
+            i += 16;
+        }
+        data[i..]
+            .windows(4)
+            .position(|w| w == b"\r\n\r\n")
+            .map(|j| i + j)
+    }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+mod simd {
+    pub fn find_byte(data: &[u8], byte: u8) -> Option<usize> {
+        data.iter().position(|&b| b == byte)
+    }
+
+    pub fn find_head_end(data: &[u8]) -> Option<usize> {
+        data.windows(4).position(|w| w == b"\r\n\r\n")
+    }
+}
+
+// Returns the value of the `Content-Length` header among `headers`, the lines after the start
+// line, 0 if there is none, or None if a line is malformed.
+fn content_length(mut headers: &[u8]) -> Option<usize> {
+    let mut length = 0;
+    while !headers.is_empty() {
+        let end = find_byte(headers, b'\n').unwrap_or(headers.len());
+        let line = headers[..end].strip_suffix(b"\r")?;
+        headers = &headers[(end + 1).min(headers.len())..];
+        let colon = find_byte(line, b':')?;
+        if line[..colon].eq_ignore_ascii_case(b"content-length") {
+            let value = std::str::from_utf8(&line[colon + 1..]).ok()?;
+            length = value.trim().parse().ok()?;
+        }
+    }
+    Some(length)
+}
+
+// Finds the end of the head of the message at the start of `data` and the length of its body.
+fn parse_head(data: &[u8]) -> Result<Option<(usize, &[u8], usize)>, ()> {
+    let Some(end) = find_head_end(data) else {
+        return if data.len() > MAX_HEAD {
+            Err(())
+        } else {
+            Ok(None)
+        };
+    };
+    let head = &data[..end + 2];
+    let start_end = find_byte(head, b'\n').unwrap();
+    let start_line = head[..start_end].strip_suffix(b"\r").ok_or(())?;
+    let body = content_length(&head[start_end + 1..]).ok_or(())?;
+    Ok(Some((end + 4, start_line, body)))
+}
+
+fn complete(head: usize, body: usize, available: usize) -> Parse {
+    match head.checked_add(body) {
+        Some(len) if available >= len => Parse::Complete(len),
+        Some(_) => Parse::Partial,
+        None => Parse::Invalid,
+    }
+}
+
+// Parses the request at the start of `data`: a request line of method, target and version
+// separated by single spaces, headers and a body of `Content-Length` bytes.
+pub fn parse_request(data: &[u8]) -> Parse {
+    let Ok(parsed) = parse_head(data) else {
+        return Parse::Invalid;
+    };
+    let Some((head, line, body)) = parsed else {
+        return Parse::Partial;
+    };
+    let Some(method) = find_byte(line, b' ') else {
+        return Parse::Invalid;
+    };
+    let rest = &line[method + 1..];
+    let Some(target) = find_byte(rest, b' ') else {
+        return Parse::Invalid;
+    };
+    let version = &rest[target + 1..];
+    if method == 0 || target == 0 || !matches!(version, b"HTTP/1.1" | b"HTTP/1.0") {
+        return Parse::Invalid;
+    }
+    if body > MAX_BODY {
+        return Parse::Invalid;
+    }
+    complete(head, body, data.len())
+}
+
+// Parses the response at the start of `data`, for clients.
+pub fn parse_response(data: &[u8]) -> Parse {
+    match parse_head(data) {
+        Ok(Some((head, line, body))) if line.starts_with(b"HTTP/1.") => {
+            complete(head, body, data.len())
+        }
+        Ok(None) => Parse::Partial,
+        _ => Parse::Invalid,
+    }
+}
+
+// Appends a response to `out` for every complete request at the start of `data` and returns the
+// number of bytes they took. An invalid request is answered with 400 and the rest of `data`, which
+// cannot be framed any more, is dropped.
+fn respond(data: &[u8], out: &mut Vec<u8>) -> usize {
+    let mut offset = 0;
+    loop {
+        match parse_request(&data[offset..]) {
+            Parse::Complete(len) => {
+                out.extend_from_slice(RESPONSE);
+                offset += len;
+            }
+            Parse::Partial => return offset,
+            Parse::Invalid => {
+                out.extend_from_slice(BAD_REQUEST);
+                return data.len();
+            }
+        }
+    }
+}
+
+// Answers pipelined HTTP/1.1 requests with `RESPONSE`. Requests are parsed in place in the receive
+// buffer; only the tail of a request that is split across receives is copied, and parsed again
+// once the rest arrives, unless the backend keeps it in its receive buffer. The responses to a
+// receive go out in a single send.
+#[derive(Clone, Default)]
+pub struct Http {
+    partial: HashMap<u32, Vec<u8>>,
+    pool: BufferPool,
+}
+
+impl Handler for Http {
+    #[inline]
+    fn on_recv(&mut self, conn: u32, data: &[u8], out: &mut Vec<u8>) {
+        match self.partial.get_mut(&conn) {
+            Some(partial) => {
+                partial.extend_from_slice(data);
+                let consumed = respond(partial, out);
+                partial.drain(..consumed);
+                if partial.is_empty() {
+                    let partial = self.partial.remove(&conn).unwrap();
+                    self.pool.give(partial);
+                }
+            }
+            None => {
+                let consumed = respond(data, out);
+                if consumed < data.len() {
+                    let mut partial = self.pool.take();
+                    partial.extend_from_slice(&data[consumed..]);
+                    self.partial.insert(conn, partial);
+                }
+            }
+        }
+    }
+
+    #[inline]
+    fn on_recv_buffered(&mut self, _conn: u32, data: &[u8], out: &mut Vec<u8>) -> usize {
+        respond(data, out)
+    }
+
+    fn on_close(&mut self, conn: u32) {
+        if let Some(partial) = self.partial.remove(&conn) {
+            self.pool.give(partial);
+        }
+    }
+
+    fn on_detach(&mut self, conn: u32, state: &mut Vec<u8>) {
+        if let Some(partial) = self.partial.remove(&conn) {
+            state.extend_from_slice(&partial);
+            self.pool.give(partial);
+        }
+    }
+
+    fn on_attach(&mut self, conn: u32, state: &[u8]) {
+        if !state.is_empty() {
+            let mut partial = self.pool.take();
+            partial.extend_from_slice(state);
+            self.partial.insert(conn, partial);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // A deterministic stream of bytes where `\r` and `\n` are frequent enough to form many
+    // partial matches of the patterns.
+    fn noise(len: usize, seed: u64) -> Vec<u8> {
+        let mut state = seed;
+        (0..len)
+            .map(|_| {
+                state = state
+                    .wrapping_mul(6364136223846793005)
+                    .wrapping_add(1442695040888963407);
+                b"\r\n\r\nab:"[(state >> 59) as usize % 7]
+            })
+            .collect()
+    }
+
+    #[test]
+    fn kernels_match_scalar() {
+        for seed in 0..64 {
+            let data = noise(80, seed);
+            for start in 0..data.len() {
+                for end in start..data.len() {
+                    let data = &data[start..end];
+                    assert_eq!(
+                        find_head_end(data),
+                        data.windows(4).position(|w| w == b"\r\n\r\n")
+                    );
+                    for byte in [b'\n', b':', b'x'] {
+                        assert_eq!(find_byte(data, byte), data.iter().position(|&b| b == byte));
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn content_length_of_headers() {
+        assert_eq!(content_length(b""), Some(0));
+        assert_eq!(content_length(b"Host: a\r\n"), Some(0));
+        assert_eq!(
+            content_length(b"Host: a\r\ncontent-LENGTH:  12 \r\n"),
+            Some(12)
+        );
+        assert_eq!(content_length(b"Content-Length: x\r\n"), None);
+        assert_eq!(content_length(b"Content-Length: -1\r\n"), None);
+        assert_eq!(content_length(b"Host a\r\n"), None);
+        assert_eq!(content_length(b"Host: a\n"), None);
+    }
+
+    #[test]
+    fn parse_requests() {
+        assert_eq!(
+            parse_request(b"GET / HTTP/1.1\r\n\r\n"),
+            Parse::Complete(18)
+        );
+        assert_eq!(
+            parse_request(b"GET / HTTP/1.0\r\n\r\nGET"),
+            Parse::Complete(18)
+        );
+        assert_eq!(parse_request(b"GET / HTTP/1.1\r\n\r"), Parse::Partial);
+        assert_eq!(
+            parse_request(b"POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nab"),
+            Parse::Partial
+        );
+        assert_eq!(
+            parse_request(b"POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"),
+            Parse::Complete(41)
+        );
+        assert_eq!(parse_request(b"GET / HTTP/2\r\n\r\n"), Parse::Invalid);
+        assert_eq!(parse_request(b"GET  HTTP/1.1\r\n\r\n"), Parse::Invalid);
+        assert_eq!(parse_request(b"GET /\r\n\r\n"), Parse::Invalid);
+        assert_eq!(parse_request(&[b'a'; MAX_HEAD + 1]), Parse::Invalid);
+    }
+
+    #[test]
+    fn body_length_is_bounded() {
+        let request = |length: &str| format!("POST / HTTP/1.1\r\nContent-Length: {length}\r\n\r\n");
+        assert_eq!(
+            parse_request(request(&MAX_BODY.to_string()).as_bytes()),
+            Parse::Partial
+        );
+        let over = (MAX_BODY + 1).to_string();
+        assert_eq!(parse_request(request(&over).as_bytes()), Parse::Invalid);
+        let max = u64::MAX.to_string();
+        assert_eq!(parse_request(request(&max).as_bytes()), Parse::Invalid);
+        assert_eq!(complete(usize::MAX, 1, usize::MAX), Parse::Invalid);
+    }
+
+    #[test]
+    fn pipelined_stream_split_anywhere() {
+        let requests: [&[u8]; 3] = [
+            b"GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+            b"POST /x HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello",
+            b"GET /y HTTP/1.0\r\n\r\n",
+        ];
+        let stream = requests.concat();
+        let expected = RESPONSE.repeat(requests.len());
+        for split in 0..=stream.len() {
+            let mut http = Http::default();
+            let mut out = Vec::new();
+            http.on_recv(1, &stream[..split], &mut out);
+            http.on_recv(1, &stream[split..], &mut out);
+            assert_eq!(out, expected, "split at {split}");
+            assert!(http.partial.is_empty());
+        }
+    }
+}
@@ -0,0 +1,674 @@
+use std::{
+    collections::HashMap,
+    io::Write,
+    str,
+    sync::{Arc, Mutex},
+};
+
+use crate::{engine::Handler, http::find_byte, pool::BufferPool};
+
+#[derive(clap::Args)]
+pub struct KvArgs {
+    /// Serve `get`, `set` and `delete` of the memcached text protocol from an in-memory table
+    /// shared by all threads. Expiration times are ignored.
+    #[clap(long)]
+    pub kv: bool,
+
+    /// Memory for the values of the table in MiB. Once it is used up, a `set` evicts the least
+    /// recently used item of its size class.
+    #[clap(long, default_value_t = 1024)]
+    pub kv_memory: usize,
+}
+
+// Longest key of the protocol.
+const MAX_KEY: usize = 250;
+
+// Longest command line that is buffered while waiting for its end.
+const MAX_LINE: usize = 2048;
+
+// Size of the pages that slab classes grow by, which is also the largest item.
+const PAGE_SIZE: usize = 1 << 20;
+
+// Chunk sizes of the slab classes, powers of two from 64 B to a page.
+const CLASSES: usize = 15;
+
+// Key length, flags and value length.
+const ITEM_HEADER: usize = 9;
+
+// A handle to an item: its class in the top 8 bits and its chunk in the others.
+type Item = u32;
+
+const EMPTY: Item = u32::MAX;
+
+// The end of a list of chunks.
+const NIL: u32 = u32::MAX;
+
+#[derive(Clone, Copy)]
+struct Link {
+    prev: u32,
+    next: u32,
+}
+
+struct Class {
+    chunk_size: usize,
+    pages: Vec<Box<[u8]>>,
+    // Chunks that were used and freed, then chunks of the last page that were never used.
+    free: Vec<u32>,
+    next: u32,
+    // The chunks in use by chunk, in a list from the most recently used at `head` to the least
+    // recently used at `tail`, which is evicted when the class cannot grow any more.
+    links: Vec<Link>,
+    head: u32,
+    tail: u32,
+}
+
+impl Class {
+    fn push_front(&mut self, chunk: u32) {
+        self.links[chunk as usize] = Link {
+            prev: NIL,
+            next: self.head,
+        };
+        match self.head {
+            NIL => self.tail = chunk,
+            head => self.links[head as usize].prev = chunk,
+        }
+        self.head = chunk;
+    }
+
+    fn unlink(&mut self, chunk: u32) {
+        let Link { prev, next } = self.links[chunk as usize];
+        match prev {
+            NIL => self.head = next,
+            prev => self.links[prev as usize].next = next,
+        }
+        match next {
+            NIL => self.tail = prev,
+            next => self.links[next as usize].prev = prev,
+        }
+    }
+
+    // Returns the page of `chunk` and its offset in it.
+    fn locate(&self, chunk: u32) -> (usize, usize) {
+        let per_page = PAGE_SIZE / self.chunk_size;
+        (
+            chunk as usize / per_page,
+            chunk as usize % per_page * self.chunk_size,
+        )
+    }
+}
+
+// Values are kept in fixed-size chunks of a few size classes, carved out of pages that are never
+// returned, like memcached's slab allocator: a `set` reuses a freed chunk of its class instead of
+// allocating. Pages stay with the class that took them, so once all of them are taken, a class
+// only makes room by evicting its own items.
+struct Slabs {
+    classes: Vec<Class>,
+    pages: usize,
+    max_pages: usize,
+}
+
+impl Slabs {
+    fn new(max_pages: usize) -> Self {
+        Slabs {
+            classes: (0..CLASSES)
+                .map(|i| Class {
+                    chunk_size: 64 << i,
+                    pages: Vec::new(),
+                    free: Vec::new(),
+                    next: 0,
+                    links: Vec::new(),
+                    head: NIL,
+                    tail: NIL,
+                })
+                .collect(),
+            pages: 0,
+            max_pages,
+        }
+    }
+
+    fn class_index(size: usize) -> usize {
+        (size.max(64).next_power_of_two().trailing_zeros() - 6) as usize
+    }
+
+    // Returns a free chunk for an item of `size` bytes, at most `PAGE_SIZE`, or None if its class
+    // has none left and no page can be added.
+    fn alloc(&mut self, size: usize) -> Option<Item> {
+        let class_index = Self::class_index(size);
+        let class = &mut self.classes[class_index];
+        let chunk = match class.free.pop() {
+            Some(chunk) => chunk,
+            None => {
+                let per_page = (PAGE_SIZE / class.chunk_size) as u32;
+                if class.next == class.pages.len() as u32 * per_page {
+                    if self.pages == self.max_pages {
+                        return None;
+                    }
+                    class.pages.push(vec![0; PAGE_SIZE].into_boxed_slice());
+                    let link = Link {
+                        prev: NIL,
+                        next: NIL,
+                    };
+                    class
+                        .links
+                        .resize(class.links.len() + per_page as usize, link);
+                    self.pages += 1;
+                }
+                class.next += 1;
+                class.next - 1
+            }
+        };
+        class.push_front(chunk);
+        Some((class_index as u32) << 24 | chunk)
+    }
+
+    fn free(&mut self, item: Item) {
+        let class = &mut self.classes[(item >> 24) as usize];
+        class.unlink(item & 0xffffff);
+        class.free.push(item & 0xffffff);
+    }
+
+    // Marks an item as the most recently used of its class.
+    fn touch(&mut self, item: Item) {
+        let class = &mut self.classes[(item >> 24) as usize];
+        class.unlink(item & 0xffffff);
+        class.push_front(item & 0xffffff);
+    }
+
+    // Returns the least recently used item of the class of items of `size` bytes, if it has any.
+    fn least_recent(&self, size: usize) -> Option<Item> {
+        let class_index = Self::class_index(size);
+        match self.classes[class_index].tail {
+            NIL => None,
+            chunk => Some((class_index as u32) << 24 | chunk),
+        }
+    }
+
+    fn get(&self, item: Item) -> &[u8] {
+        let class = &self.classes[(item >> 24) as usize];
+        let (page, offset) = class.locate(item & 0xffffff);
+        &class.pages[page][offset..offset + class.chunk_size]
+    }
+
+    fn get_mut(&mut self, item: Item) -> &mut [u8] {
+        let class = &mut self.classes[(item >> 24) as usize];
+        let (page, offset) = class.locate(item & 0xffffff);
+        &mut class.pages[page][offset..offset + class.chunk_size]
+    }
+}
+
+fn key(item: &[u8]) -> &[u8] {
+    &item[ITEM_HEADER..ITEM_HEADER + item[0] as usize]
+}
+
+fn flags(item: &[u8]) -> u32 {
+    u32::from_le_bytes(item[1..5].try_into().unwrap())
+}
+
+fn value(item: &[u8]) -> &[u8] {
+    let len = u32::from_le_bytes(item[5..9].try_into().unwrap()) as usize;
+    let start = ITEM_HEADER + item[0] as usize;
+    &item[start..start + len]
+}
+
+#[derive(Clone, Copy)]
+struct Entry {
+    hash: u64,
+    item: Item,
+}
+
+// One shard of the table: an open-addressing hash table with linear probing over handles to items
+// in its own slabs.
+struct Shard {
+    entries: Vec<Entry>,
+    len: usize,
+    slabs: Slabs,
+}
+
+impl Shard {
+    fn new(max_pages: usize) -> Self {
+        let empty = Entry {
+            hash: 0,
+            item: EMPTY,
+        };
+        Shard {
+            entries: vec![empty; 1024],
+            len: 0,
+            slabs: Slabs::new(max_pages),
+        }
+    }
+
+    fn find(&self, hash: u64, key_bytes: &[u8]) -> Result<usize, usize> {
+        let mask = self.entries.len() - 1;
+        let mut i = hash as usize & mask;
+        loop {
+            let entry = self.entries[i];
+            if entry.item == EMPTY {
+                return Err(i);
+            }
+            if entry.hash == hash && key(self.slabs.get(entry.item)) == key_bytes {
+                return Ok(i);
+            }
+            i = (i + 1) & mask;
+        }
+    }
+
+    fn grow(&mut self) {
+        let empty = Entry {
+            hash: 0,
+            item: EMPTY,
+        };
+        let capacity = self.entries.len() * 2;
+        let old = std::mem::replace(&mut self.entries, vec![empty; capacity]);
+        let mask = self.entries.len() - 1;
+        for entry in old.into_iter().filter(|entry| entry.item != EMPTY) {
+            let mut i = entry.hash as usize & mask;
+            while self.entries[i].item != EMPTY {
+                i = (i + 1) & mask;
+            }
+            self.entries[i] = entry;
+        }
+    }
+
+    // Stores an item of at most `PAGE_SIZE` bytes, evicting the least recently used item of its
+    // class if there is no room. Fails only if the class holds no chunks at all.
+    fn set(&mut self, hash: u64, key_bytes: &[u8], flags: u32, value: &[u8]) -> bool {
+        let size = ITEM_HEADER + key_bytes.len() + value.len();
+        let item = match self.slabs.alloc(size) {
+            Some(item) => item,
+            None => {
+                let Some(victim) = self.slabs.least_recent(size) else {
+                    return false;
+                };
+                self.evict(victim);
+                self.slabs.alloc(size).unwrap()
+            }
+        };
+        let chunk = self.slabs.get_mut(item);
+        chunk[0] = key_bytes.len() as u8;
+        chunk[1..5].copy_from_slice(&flags.to_le_bytes());
+        chunk[5..9].copy_from_slice(&(value.len() as u32).to_le_bytes());
+        chunk[ITEM_HEADER..ITEM_HEADER + key_bytes.len()].copy_from_slice(key_bytes);
+        chunk[ITEM_HEADER + key_bytes.len()..][..value.len()].copy_from_slice(value);
+
+        match self.find(hash, key_bytes) {
+            Ok(i) => {
+                let old = std::mem::replace(&mut self.entries[i].item, item);
+                self.slabs.free(old);
+            }
+            Err(i) => {
+                self.entries[i] = Entry { hash, item };
+                self.len += 1;
+                if self.len * 4 > self.entries.len() * 3 {
+                    self.grow();
+                }
+            }
+        }
+        true
+    }
+
+    fn delete(&mut self, hash: u64, key_bytes: &[u8]) -> bool {
+        let Ok(i) = self.find(hash, key_bytes) else {
+            return false;
+        };
+        self.remove(i);
+        true
+    }
+
+    fn evict(&mut self, victim: Item) {
+        let mask = self.entries.len() - 1;
+        let mut i = hash(key(self.slabs.get(victim))) as usize & mask;
+        while self.entries[i].item != victim {
+            i = (i + 1) & mask;
+        }
+        self.remove(i);
+    }
+
+    // Removes entry `hole` and shifts the entries that follow it in its probe sequence back, so
+    // that lookups need no tombstones.
+    fn remove(&mut self, mut hole: usize) {
+        self.slabs.free(self.entries[hole].item);
+        self.len -= 1;
+        let mask = self.entries.len() - 1;
+        let mut i = hole;
+        loop {
+            i = (i + 1) & mask;
+            let entry = self.entries[i];
+            if entry.item == EMPTY {
+                break;
+            }
+            let ideal = entry.hash as usize & mask;
+            if i.wrapping_sub(ideal) & mask >= i.wrapping_sub(hole) & mask {
+                self.entries[hole] = entry;
+                hole = i;
+            }
+        }
+        self.entries[hole].item = EMPTY;
+    }
+}
+
+#[repr(align(64))]
+struct Padded(Mutex<Shard>);
+
+// The table, split into independently locked shards, each with its own slabs, so that threads
+// rarely wait for each other.
+pub struct Store {
+    shards: Box<[Padded]>,
+}
+
+impl Store {
+    // Creates a table with about four shards per thread and `memory` MiB of values.
+    pub fn new(threads: usize, memory: usize) -> Self {
+        let shards = (threads * 4).next_power_of_two();
+        let pages = (memory / shards).max(CLASSES);
+        Store {
+            shards: (0..shards)
+                .map(|_| Padded(Mutex::new(Shard::new(pages))))
+                .collect(),
+        }
+    }
+
+    fn shard(&self, key: &[u8]) -> (u64, &Mutex<Shard>) {
+        let hash = hash(key);
+        // The table index uses the low bits of the hash.
+        let shard = (hash >> 48) as usize & (self.shards.len() - 1);
+        (hash, &self.shards[shard].0)
+    }
+}
+
+// FNV-1a over 8-byte words, mixed at the end so that the low and high bits both depend on the
+// whole key.
+fn hash(key: &[u8]) -> u64 {
+    let mut hash = 0xcbf29ce484222325u64;
+    let mut words = key.chunks_exact(8);
+    for word in &mut words {
+        let word = u64::from_le_bytes(word.try_into().unwrap());
+        hash = (hash ^ word).wrapping_mul(0x100000001b3);
+    }
+    for &byte in words.remainder() {
+        hash = (hash ^ u64::from(byte)).wrapping_mul(0x100000001b3);
+    }
+    hash ^= hash >> 33;
+    hash = hash.wrapping_mul(0xff51afd7ed558ccd);
+    hash ^ hash >> 33
+}
+
+enum Command {
+    // A command of this many bytes was executed.
+    Done(usize),
+    Partial,
+    // The stream cannot be framed any more.
+    Invalid,
+}
+
+// Serves the memcached text protocol from a shared `Store`. Commands are parsed in place in the
+// receive buffer like HTTP requests, and replies are written straight into the output buffer,
+// values included, while the shard is locked.
+#[derive(Clone)]
+pub struct Kv {
+    store: Arc<Store>,
+    partial: HashMap<u32, Vec<u8>>,
+    pool: BufferPool,
+}
+
+impl Kv {
+    pub fn new(store: Arc<Store>) -> Self {
+        Kv {
+            store,
+            partial: HashMap::new(),
+            pool: BufferPool::default(),
+        }
+    }
+}
+
+fn execute(store: &Store, data: &[u8], out: &mut Vec<u8>) -> Command {
+    let Some(end) = find_byte(data, b'\n') else {
+        return if data.len() > MAX_LINE {
+            Command::Invalid
+        } else {
+            Command::Partial
+        };
+    };
+    let line = data[..end].strip_suffix(b"\r").unwrap_or(&data[..end]);
+    let mut tokens = line.split(|&b| b == b' ').filter(|token| !token.is_empty());
+    let consumed = end + 1;
+    match tokens.next() {
+        Some(b"get") => {
+            let mut keys = tokens.peekable();
+            // Like memcached, which does not treat a `get` of no keys as a miss.
+            if keys.peek().is_none() {
+                out.extend_from_slice(b"ERROR\r\n");
+                return Command::Done(consumed);
+            }
+            for key in keys {
+                let (hash, shard) = store.shard(key);
+                let mut shard = shard.lock().unwrap();
+                if let Ok(i) = shard.find(hash, key) {
+                    let item = shard.entries[i].item;
+                    shard.slabs.touch(item);
+                    let item = shard.slabs.get(item);
+                    let value = value(item);
+                    out.extend_from_slice(b"VALUE ");
+                    out.extend_from_slice(key);
+                    write!(out, " {} {}\r\n", flags(item), value.len()).unwrap();
+                    out.extend_from_slice(value);
+                    out.extend_from_slice(b"\r\n");
+                }
+            }
+            out.extend_from_slice(b"END\r\n");
+            Command::Done(consumed)
+        }
+        Some(b"set") => {
+            let key = tokens.next().unwrap_or_default();
+            let mut numbers = tokens.by_ref().take(3).map(|token| {
+                str::from_utf8(token)
+                    .ok()
+                    .and_then(|token| token.parse::<u64>().ok())
+            });
+            let (Some(Some(flags)), Some(Some(_exptime)), Some(Some(bytes))) =
+                (numbers.next(), numbers.next(), numbers.next())
+            else {
+                out.extend_from_slice(b"CLIENT_ERROR bad command line format\r\n");
+                return Command::Done(consumed);
+            };
+            let noreply = tokens.next() == Some(b"noreply");
+            // The length comes from the client, so it is bounded before anything is added to it.
+            if bytes > PAGE_SIZE as u64 || ITEM_HEADER + key.len() + bytes as usize > PAGE_SIZE {
+                // The value cannot be skipped without buffering it, so drop the stream.
+                out.extend_from_slice(b"SERVER_ERROR object too large for cache\r\n");
+                return Command::Invalid;
+            }
+            let bytes = bytes as usize;
+            let Some(block) = data.get(consumed..consumed + bytes + 2) else {
+                return Command::Partial;
+            };
+            if !block.ends_with(b"\r\n") {
+                out.extend_from_slice(b"CLIENT_ERROR bad data chunk\r\n");
+                return Command::Invalid;
+            }
+            let reply: &[u8] = if key.is_empty() || key.len() > MAX_KEY || flags > u32::MAX.into() {
+                b"CLIENT_ERROR bad command line format\r\n"
+            } else {
+                let (hash, shard) = store.shard(key);
+                let stored = shard
+                    .lock()
+                    .unwrap()
+                    .set(hash, key, flags as u32, &block[..bytes]);
+                if stored {
+                    b"STORED\r\n"
+                } else {
+                    b"SERVER_ERROR out of memory storing object\r\n"
+                }
+            };
+            if !noreply {
+                out.extend_from_slice(reply);
+            }
+            Command::Done(consumed + bytes + 2)
+        }
+        Some(b"delete") => {
+            let key = tokens.next().unwrap_or_default();
+            let noreply = tokens.next() == Some(b"noreply");
+            let (hash, shard) = store.shard(key);
+            let deleted = shard.lock().unwrap().delete(hash, key);
+            if !noreply {
+                out.extend_from_slice(if deleted {
+                    b"DELETED\r\n"
+                } else {
+                    b"NOT_FOUND\r\n"
+                });
+            }
+            Command::Done(consumed)
+        }
+        _ => {
+            out.extend_from_slice(b"ERROR\r\n");
+            Command::Done(consumed)
+        }
+    }
+}
+
+// Executes every complete command at the start of `data` and returns the number of bytes they
+// took.
+fn execute_all(store: &Store, data: &[u8], out: &mut Vec<u8>) -> usize {
+    let mut offset = 0;
+    loop {
+        match execute(store, &data[offset..], out) {
+            Command::Done(len) => offset += len,
+            Command::Partial => return offset,
+            Command::Invalid => return data.len(),
+        }
+    }
+}
+
+impl Handler for Kv {
+    #[inline]
+    fn on_recv(&mut self, conn: u32, data: &[u8], out: &mut Vec<u8>) {
+        match self.partial.get_mut(&conn) {
+            Some(partial) => {
+                partial.extend_from_slice(data);
+                let consumed = execute_all(&self.store, partial, out);
+                partial.drain(..consumed);
+                if partial.is_empty() {
+                    let partial = self.partial.remove(&conn).unwrap();
+                    self.pool.give(partial);
+                }
+            }
+            None => {
+                let consumed = execute_all(&self.store, data, out);
+                if consumed < data.len() {
+                    let mut partial = self.pool.take();
+                    partial.extend_from_slice(&data[consumed..]);
+                    self.partial.insert(conn, partial);
+                }
+            }
+        }
+    }
+
+    #[inline]
+    fn on_recv_buffered(&mut self, _conn: u32, data: &[u8], out: &mut Vec<u8>) -> usize {
+        execute_all(&self.store, data, out)
+    }
+
+    fn on_close(&mut self, conn: u32) {
+        if let Some(partial) = self.partial.remove(&conn) {
+            self.pool.give(partial);
+        }
+    }
+
+    fn on_detach(&mut self, conn: u32, state: &mut Vec<u8>) {
+        if let Some(partial) = self.partial.remove(&conn) {
+            state.extend_from_slice(&partial);
+            self.pool.give(partial);
+        }
+    }
+
+    fn on_attach(&mut self, conn: u32, state: &[u8]) {
+        if !state.is_empty() {
+            let mut partial = self.pool.take();
+            partial.extend_from_slice(state);
+            self.partial.insert(conn, partial);
+        }
+    }
+}
+
+// Returns the length of the reply at the start of `data`, for clients, and whether it was a hit
+// of a `get`.
+pub fn parse_reply(data: &[u8]) -> Option<(usize, bool)> {
+    let mut offset = 0;
+    let mut hit = false;
+    loop {
+        let end = offset + find_byte(&data[offset..], b'\n')?;
+        let line = &data[offset..end];
+        if let Some(header) = line.strip_prefix(b"VALUE ") {
+            let bytes = header.split(|&b| b == b' ').nth(2)?;
+            let bytes: usize = str::from_utf8(bytes).ok()?.trim_end().parse().ok()?;
+            offset = end + 1 + bytes + 2;
+            if offset > data.len() {
+                return None;
+            }
+            hit = true;
+        } else {
+            return Some((end + 1, hit));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn get(shard: &mut Shard, key: &[u8]) -> Option<Vec<u8>> {
+        let i = shard.find(hash(key), key).ok()?;
+        let item = shard.entries[i].item;
+        shard.slabs.touch(item);
+        Some(value(shard.slabs.get(item)).to_vec())
+    }
+
+    #[test]
+    fn full_class_evicts_least_recently_used() {
+        // A single page holds 16 chunks of 64 KiB.
+        let mut shard = Shard::new(1);
+        let value = vec![7; 60000];
+        let key = |i: usize| format!("key{i}").into_bytes();
+        for i in 0..16 {
+            assert!(shard.set(hash(&key(i)), &key(i), 0, &value));
+        }
+        assert!(get(&mut shard, &key(0)).is_some());
+        assert!(shard.set(hash(&key(16)), &key(16), 0, &value));
+        assert!(get(&mut shard, &key(1)).is_none());
+        for i in [0, 2, 15, 16] {
+            assert_eq!(get(&mut shard, &key(i)).as_deref(), Some(&value[..]));
+        }
+        assert_eq!(shard.len, 16);
+        // Other classes got no page.
+        assert!(!shard.set(hash(b"small"), b"small", 0, b"value"));
+    }
+
+    #[test]
+    fn item_larger_than_a_page_is_too_large() {
+        let store = Store::new(1, 16);
+        let mut out = Vec::new();
+        let command = format!("set key 0 0 {}\r\n", PAGE_SIZE - ITEM_HEADER);
+        assert!(matches!(
+            execute(&store, command.as_bytes(), &mut out),
+            Command::Invalid
+        ));
+        assert_eq!(out, b"SERVER_ERROR object too large for cache\r\n");
+
+        out.clear();
+        assert!(matches!(
+            execute(&store, b"set k 0 0 18446744073709551615\r\n", &mut out),
+            Command::Invalid
+        ));
+        assert_eq!(out, b"SERVER_ERROR object too large for cache\r\n");
+    }
+
+    #[test]
+    fn get_without_keys() {
+        let store = Store::new(1, 16);
+        let mut out = Vec::new();
+        assert!(matches!(
+            execute(&store, b"get\r\n", &mut out),
+            Command::Done(5)
+        ));
+        assert_eq!(out, b"ERROR\r\n");
+    }
+}
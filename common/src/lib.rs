@@ -0,0 +1,15 @@
+pub mod alloc;
+pub mod balance;
+pub mod checksum;
+pub mod engine;
+pub mod histogram;
+pub mod http;
+pub mod kv;
+pub mod metrics;
+pub mod net;
+pub mod numa;
+pub mod perf;
+pub mod pipeline;
+pub mod pool;
+pub mod results;
+pub mod ring;
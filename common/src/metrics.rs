@@ -0,0 +1,442 @@
+use std::{
+    io, mem, process, ptr,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex, OnceLock,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+use crate::{
+    alloc::count_into,
+    histogram::Histogram,
+    perf::{PerfGroup, PerfValues},
+};
+
+#[derive(clap::Args)]
+pub struct ReportArgs {
+    /// Seconds between two metric reports, or 0 to only report on `SIGUSR1`.
+    #[clap(long, default_value_t = 1.0)]
+    pub report_interval: f64,
+
+    /// Count cycles, instructions, LLC and dTLB misses of every event loop thread with
+    /// `perf_event_open` and report them per byte and per receive operation.
+    #[clap(long)]
+    pub perf: bool,
+
+    /// Timestamp received packets in the kernel with `SO_TIMESTAMPING` and report how long they
+    /// waited before the event loop read them.
+    #[clap(long)]
+    pub rx_timestamps: bool,
+
+    /// Exit with an error if an event loop allocates memory after this many seconds, once the
+    /// connections are established. Requires the `count-allocations` feature of `common`.
+    #[clap(long)]
+    pub assert_no_allocations_after: Option<f64>,
+}
+
+// A counter that is only ever written by the thread that owns it. Incrementing it is a plain load
+// and store, which avoids the locked read-modify-write of `fetch_add` on the hot path.
+#[derive(Default)]
+pub struct Counter(AtomicU64);
+
+impl Counter {
+    #[inline]
+    pub fn add(&self, n: u64) {
+        self.0
+            .store(self.0.load(Ordering::Relaxed) + n, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+// Counters of one event loop thread. The block is cache-line aligned so that two threads never
+// write to the same line; only the reporter thread reads it, once per interval.
+#[derive(Default)]
+#[repr(align(64))]
+pub struct Metrics {
+    pub bytes: Counter,
+    // Receive operations: `read` calls for epoll and receive CQEs for io_uring.
+    pub recvs: Counter,
+    // Calls to `epoll_wait` or `submit_and_wait`.
+    pub waits: Counter,
+    // Events returned by `epoll_wait` or CQEs reaped after `submit_and_wait`.
+    pub events: Counter,
+    pub accepts: Counter,
+    pub closes: Counter,
+    pub errors: Counter,
+    // Nanoseconds spent handling events, by event loops that measure it, and processing segments,
+    // by pipeline workers.
+    pub busy: Counter,
+    pub worker_busy: Counter,
+    // Connections given to another event loop by the balancer.
+    pub migrations: Counter,
+    // Connections accepted by an event loop on another CPU than the one that received them.
+    pub remote_accepts: Counter,
+    // Bytes written to files and `fdatasync` calls, by event loops that store what they receive.
+    pub disk_bytes: Counter,
+    pub fsyncs: Counter,
+    // Frames written to a capture, and frames missing from it because every capture buffer was
+    // being written.
+    pub captured: Counter,
+    pub capture_drops: Counter,
+    // Heap allocations, counted with the `count-allocations` feature.
+    pub allocations: Counter,
+    // Bytes of the provided buffers of the thread, added once, the capacity of the buffers that
+    // receive completions filled, and connections moved to a group of larger buffers.
+    pub buffer_memory: Counter,
+    pub buffer_bytes: Counter,
+    pub promotions: Counter,
+
+    // Cold fields that are only written once, when the thread starts.
+    perf_enabled: bool,
+    perf: OnceLock<PerfGroup>,
+    rx_timestamps: bool,
+    // Nanoseconds between the kernel receive timestamp and the read, since the last report. The
+    // lock is uncontended except when the reporter takes the histogram.
+    rx_delay: Mutex<Histogram>,
+}
+
+#[derive(Clone, Copy, Default)]
+pub struct Snapshot {
+    pub bytes: u64,
+    pub recvs: u64,
+    pub waits: u64,
+    pub events: u64,
+    pub accepts: u64,
+    pub closes: u64,
+    pub errors: u64,
+    pub busy: u64,
+    pub worker_busy: u64,
+    pub migrations: u64,
+    pub remote_accepts: u64,
+    pub disk_bytes: u64,
+    pub fsyncs: u64,
+    pub captured: u64,
+    pub capture_drops: u64,
+    pub allocations: u64,
+    pub buffer_memory: u64,
+    pub buffer_bytes: u64,
+    pub promotions: u64,
+    pub perf: Option<PerfValues>,
+}
+
+impl Metrics {
+    // Must be called by the event loop thread that owns this block before entering its loop.
+    pub fn init_thread(&self) {
+        count_into(&self.allocations);
+        if !self.perf_enabled {
+            return;
+        }
+        match PerfGroup::open() {
+            Ok(group) => {
+                let _ = self.perf.set(group);
+            }
+            Err(err) => eprintln!("warning: hardware counters are unavailable: {err}"),
+        }
+    }
+
+    pub fn rx_timestamps(&self) -> bool {
+        self.rx_timestamps
+    }
+
+    pub fn record_rx_delay(&self, nanos: u64) {
+        self.rx_delay.lock().unwrap().record(nanos);
+    }
+
+    pub fn snapshot(&self) -> Snapshot {
+        Snapshot {
+            bytes: self.bytes.get(),
+            recvs: self.recvs.get(),
+            waits: self.waits.get(),
+            events: self.events.get(),
+            accepts: self.accepts.get(),
+            closes: self.closes.get(),
+            errors: self.errors.get(),
+            busy: self.busy.get(),
+            worker_busy: self.worker_busy.get(),
+            migrations: self.migrations.get(),
+            remote_accepts: self.remote_accepts.get(),
+            disk_bytes: self.disk_bytes.get(),
+            fsyncs: self.fsyncs.get(),
+            captured: self.captured.get(),
+            capture_drops: self.capture_drops.get(),
+            allocations: self.allocations.get(),
+            buffer_memory: self.buffer_memory.get(),
+            buffer_bytes: self.buffer_bytes.get(),
+            promotions: self.promotions.get(),
+            perf: self.perf.get().and_then(|group| group.read().ok()),
+        }
+    }
+}
+
+impl Snapshot {
+    fn sum(metrics: &[Metrics]) -> Self {
+        metrics.iter().fold(Snapshot::default(), |sum, m| {
+            let s = m.snapshot();
+            Snapshot {
+                bytes: sum.bytes + s.bytes,
+                recvs: sum.recvs + s.recvs,
+                waits: sum.waits + s.waits,
+                events: sum.events + s.events,
+                accepts: sum.accepts + s.accepts,
+                closes: sum.closes + s.closes,
+                errors: sum.errors + s.errors,
+                busy: sum.busy + s.busy,
+                worker_busy: sum.worker_busy + s.worker_busy,
+                migrations: sum.migrations + s.migrations,
+                remote_accepts: sum.remote_accepts + s.remote_accepts,
+                disk_bytes: sum.disk_bytes + s.disk_bytes,
+                fsyncs: sum.fsyncs + s.fsyncs,
+                captured: sum.captured + s.captured,
+                capture_drops: sum.capture_drops + s.capture_drops,
+                allocations: sum.allocations + s.allocations,
+                buffer_memory: sum.buffer_memory + s.buffer_memory,
+                buffer_bytes: sum.buffer_bytes + s.buffer_bytes,
+                promotions: sum.promotions + s.promotions,
+                perf: match (sum.perf, s.perf) {
+                    (Some(a), Some(b)) => Some(a.add(&b)),
+                    (a, b) => a.or(b),
+                },
+            }
+        })
+    }
+
+    fn delta(&self, prev: &Snapshot) -> Snapshot {
+        Snapshot {
+            bytes: self.bytes - prev.bytes,
+            recvs: self.recvs - prev.recvs,
+            waits: self.waits - prev.waits,
+            events: self.events - prev.events,
+            accepts: self.accepts - prev.accepts,
+            closes: self.closes - prev.closes,
+            errors: self.errors - prev.errors,
+            busy: self.busy - prev.busy,
+            worker_busy: self.worker_busy - prev.worker_busy,
+            migrations: self.migrations - prev.migrations,
+            remote_accepts: self.remote_accepts - prev.remote_accepts,
+            disk_bytes: self.disk_bytes - prev.disk_bytes,
+            fsyncs: self.fsyncs - prev.fsyncs,
+            captured: self.captured - prev.captured,
+            capture_drops: self.capture_drops - prev.capture_drops,
+            allocations: self.allocations - prev.allocations,
+            buffer_memory: self.buffer_memory - prev.buffer_memory,
+            buffer_bytes: self.buffer_bytes - prev.buffer_bytes,
+            promotions: self.promotions - prev.promotions,
+            perf: self
+                .perf
+                .map(|perf| perf.delta(&prev.perf.unwrap_or_default())),
+        }
+    }
+}
+
+fn ratio(num: u64, den: u64) -> f64 {
+    if den == 0 {
+        0.0
+    } else {
+        num as f64 / den as f64
+    }
+}
+
+// `total` holds the counters since the start, for the state they add up to.
+fn report(elapsed: Duration, interval: Duration, d: &Snapshot, total: &Snapshot) {
+    let secs = interval.as_secs_f64();
+    println!(
+        "{:>8.3}s {:>8.3} Gbit/s {:>10.0} recv/s {:>8.0} B/recv {:>10.0} waits/s \
+         {:>6.2} events/wait accepts {} closes {} errors {}",
+        elapsed.as_secs_f64(),
+        d.bytes as f64 * 8.0 / 1e9 / secs,
+        d.recvs as f64 / secs,
+        ratio(d.bytes, d.recvs),
+        d.waits as f64 / secs,
+        ratio(d.events, d.waits),
+        d.accepts,
+        d.closes,
+        d.errors,
+    );
+
+    // Busy time over the interval is the number of CPUs kept busy.
+    if d.busy > 0 || d.worker_busy > 0 {
+        println!(
+            "          busy: event loops {:.2} CPUs, workers {:.2} CPUs",
+            d.busy as f64 / 1e9 / secs,
+            d.worker_busy as f64 / 1e9 / secs,
+        );
+    }
+
+    if d.migrations > 0 {
+        println!("          migrated {} connections", d.migrations);
+    }
+    if d.remote_accepts > 0 {
+        println!(
+            "          {} connections accepted on another CPU than the one that received them",
+            d.remote_accepts
+        );
+    }
+    if d.disk_bytes > 0 || d.fsyncs > 0 {
+        println!(
+            "          disk: {:.3} GB/s written, {} fsyncs",
+            d.disk_bytes as f64 / 1e9 / secs,
+            d.fsyncs
+        );
+    }
+    if d.captured > 0 || d.capture_drops > 0 {
+        println!(
+            "          capture: {:.3} Mpps, {} frames dropped",
+            d.captured as f64 / 1e6 / secs,
+            d.capture_drops
+        );
+    }
+    // Received bytes over the capacity of the buffers they took shows how much of the buffers is
+    // wasted, and the buffers over the open connections what each costs.
+    if d.buffer_bytes > 0 || d.promotions > 0 {
+        let connections = total.accepts - total.closes;
+        println!(
+            "          buffers: {:.1}% filled, {:.1} KiB per connection, promoted {} connections",
+            ratio(d.bytes, d.buffer_bytes) * 100.0,
+            ratio(total.buffer_memory, connections.max(1)) / 1024.0,
+            d.promotions
+        );
+    }
+    if d.allocations > 0 {
+        println!(
+            "          allocations: {} ({:.3} per event)",
+            d.allocations,
+            ratio(d.allocations, d.events)
+        );
+    }
+
+    if let Some(perf) = &d.perf {
+        let per = |value: Option<u64>| match value {
+            Some(value) => format!(
+                "{:.3}/B {:.1}/recv",
+                ratio(value, d.bytes),
+                ratio(value, d.recvs)
+            ),
+            None => "n/a".to_string(),
+        };
+        println!(
+            "          cycles {} instructions {} LLC-misses {} dTLB-misses {}",
+            per(perf.cycles()),
+            per(perf.instructions()),
+            per(perf.llc_misses()),
+            per(perf.dtlb_misses()),
+        );
+    }
+}
+
+fn report_rx_delay(metrics: &[Metrics], sum: &mut Histogram) {
+    for m in metrics {
+        let mut rx_delay = m.rx_delay.lock().unwrap();
+        sum.merge(&rx_delay);
+        rx_delay.reset();
+    }
+    let micros = |nanos: u64| nanos as f64 / 1e3;
+    println!(
+        "          rx delay p50 {:.1} p99 {:.1} p99.9 {:.1} max {:.1} us over {} reads",
+        micros(sum.percentile(50.0)),
+        micros(sum.percentile(99.0)),
+        micros(sum.percentile(99.9)),
+        micros(sum.max()),
+        sum.count(),
+    );
+    sum.reset();
+}
+
+fn report_signal_set() -> libc::sigset_t {
+    let mut set: libc::sigset_t = unsafe { mem::zeroed() };
+    unsafe {
+        libc::sigemptyset(&mut set);
+        libc::sigaddset(&mut set, libc::SIGUSR1);
+    }
+    set
+}
+
+// Allocates one metrics block per event loop thread and starts a thread that prints the deltas of
+// their sums every `interval` and whenever the process receives `SIGUSR1`.
+//
+// This must be called before spawning the event loop threads: it blocks `SIGUSR1` in the calling
+// thread so that the threads spawned afterwards inherit the mask and the signal is only ever
+// consumed by the reporter.
+pub fn start_reporter(threads: usize, args: &ReportArgs) -> Arc<[Metrics]> {
+    let metrics: Arc<[Metrics]> = (0..threads)
+        .map(|_| Metrics {
+            perf_enabled: args.perf,
+            rx_timestamps: args.rx_timestamps,
+            ..Default::default()
+        })
+        .collect();
+
+    let set = report_signal_set();
+    let ret = unsafe { libc::pthread_sigmask(libc::SIG_BLOCK, &set, ptr::null_mut()) };
+    if ret != 0 {
+        let err = io::Error::from_raw_os_error(ret);
+        panic!("failed to block SIGUSR1: {err}");
+    }
+
+    assert!(
+        args.assert_no_allocations_after.is_none() || cfg!(feature = "count-allocations"),
+        "--assert-no-allocations-after requires the count-allocations feature of common"
+    );
+    let allocation_free_after = args
+        .assert_no_allocations_after
+        .map(Duration::from_secs_f64);
+    let interval =
+        (args.report_interval > 0.0).then(|| Duration::from_secs_f64(args.report_interval));
+    let rx_timestamps = args.rx_timestamps;
+    let reporter_metrics = metrics.clone();
+    thread::spawn(move || {
+        let mut rx_delay = Histogram::default();
+        let start = Instant::now();
+        let mut prev = Snapshot::default();
+        let mut prev_time = start;
+        loop {
+            let ret = match interval {
+                Some(interval) => {
+                    let next = prev_time + interval;
+                    let timeout = next.saturating_duration_since(Instant::now());
+                    let timeout = libc::timespec {
+                        tv_sec: timeout.as_secs() as libc::time_t,
+                        tv_nsec: timeout.subsec_nanos().into(),
+                    };
+                    unsafe { libc::sigtimedwait(&set, ptr::null_mut(), &timeout) }
+                }
+                None => unsafe { libc::sigwaitinfo(&set, ptr::null_mut()) },
+            };
+            if ret == -1 {
+                let err = io::Error::last_os_error();
+                match err.raw_os_error() {
+                    Some(libc::EAGAIN) => {}
+                    Some(libc::EINTR) => continue,
+                    _ => panic!("failed to wait for SIGUSR1: {err}"),
+                }
+            }
+
+            let now = Instant::now();
+            let snapshot = Snapshot::sum(&reporter_metrics);
+            let delta = snapshot.delta(&prev);
+            report(now - start, now - prev_time, &delta, &snapshot);
+            // The whole interval must be past the warm-up.
+            if let Some(after) = allocation_free_after {
+                if prev_time - start >= after && delta.allocations > 0 {
+                    eprintln!(
+                        "error: the event loops allocated {} times after {:.1} s",
+                        delta.allocations,
+                        after.as_secs_f64()
+                    );
+                    process::exit(1);
+                }
+            }
+            if rx_timestamps {
+                report_rx_delay(&reporter_metrics, &mut rx_delay);
+            }
+            prev = snapshot;
+            prev_time = now;
+        }
+    });
+
+    metrics
+}
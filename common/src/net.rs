@@ -0,0 +1,236 @@
+use std::{
+    io, mem,
+    net::{SocketAddr, TcpListener, ToSocketAddrs},
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+};
+
+#[derive(clap::Args)]
+pub struct ListenArgs {
+    /// Length of the accept queue of every listener.
+    #[clap(long, default_value_t = libc::SOMAXCONN)]
+    pub backlog: i32,
+
+    /// Only complete the accept of a connection once it has sent data, or after this many
+    /// seconds (`TCP_DEFER_ACCEPT`). This saves a wakeup per connection for request/response
+    /// protocols where the client speaks first.
+    #[clap(long)]
+    pub defer_accept: Option<i32>,
+
+    /// Pin every event loop to a CPU and attach a `SO_REUSEPORT` CBPF program that gives each
+    /// new connection to the listener of the event loop on the CPU that received it, so that the
+    /// softirq processing and the application of a connection share a core.
+    #[clap(long)]
+    pub steer_by_cpu: bool,
+}
+
+pub fn setsockopt<T>(fd: &impl AsRawFd, level: i32, name: i32, value: &T) -> io::Result<()> {
+    let ret = unsafe {
+        libc::setsockopt(
+            fd.as_raw_fd(),
+            level,
+            name,
+            value as *const _ as *const _,
+            mem::size_of::<T>() as libc::socklen_t,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn to_sockaddr(addr: &SocketAddr) -> (libc::sockaddr_storage, libc::socklen_t) {
+    let mut storage: libc::sockaddr_storage = unsafe { mem::zeroed() };
+    let len = match addr {
+        SocketAddr::V4(addr) => {
+            let sin = unsafe { &mut *(&mut storage as *mut _ as *mut libc::sockaddr_in) };
+            sin.sin_family = libc::AF_INET as libc::sa_family_t;
+            sin.sin_port = addr.port().to_be();
+            sin.sin_addr.s_addr = u32::from(*addr.ip()).to_be();
+            mem::size_of::<libc::sockaddr_in>()
+        }
+        SocketAddr::V6(addr) => {
+            let sin6 = unsafe { &mut *(&mut storage as *mut _ as *mut libc::sockaddr_in6) };
+            sin6.sin6_family = libc::AF_INET6 as libc::sa_family_t;
+            sin6.sin6_port = addr.port().to_be();
+            sin6.sin6_addr.s6_addr = addr.ip().octets();
+            sin6.sin6_flowinfo = addr.flowinfo();
+            sin6.sin6_scope_id = addr.scope_id();
+            mem::size_of::<libc::sockaddr_in6>()
+        }
+    };
+    (storage, len as libc::socklen_t)
+}
+
+// Creates a listening socket with `SO_REUSEPORT` set so that every event loop thread can have its
+// own listener on the same address and let the kernel shard incoming connections between them.
+pub fn bind_reuseport(addr: impl ToSocketAddrs, args: &ListenArgs) -> io::Result<TcpListener> {
+    let addr = addr
+        .to_socket_addrs()?
+        .next()
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "no address to bind to"))?;
+    let family = match addr {
+        SocketAddr::V4(_) => libc::AF_INET,
+        SocketAddr::V6(_) => libc::AF_INET6,
+    };
+
+    let ret = unsafe { libc::socket(family, libc::SOCK_STREAM | libc::SOCK_CLOEXEC, 0) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let socket = unsafe { OwnedFd::from_raw_fd(ret) };
+
+    setsockopt(&socket, libc::SOL_SOCKET, libc::SO_REUSEADDR, &1i32)?;
+    setsockopt(&socket, libc::SOL_SOCKET, libc::SO_REUSEPORT, &1i32)?;
+    if let Some(timeout) = args.defer_accept {
+        setsockopt(&socket, libc::IPPROTO_TCP, libc::TCP_DEFER_ACCEPT, &timeout)?;
+    }
+
+    let (storage, len) = to_sockaddr(&addr);
+    let ret = unsafe { libc::bind(socket.as_raw_fd(), &storage as *const _ as *const _, len) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let ret = unsafe { libc::listen(socket.as_raw_fd(), args.backlog) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(TcpListener::from(socket))
+}
+
+// Attaches a program to the reuseport group of `listener` that selects, for every connection, the
+// listener `i` such that `cpus[i]` is the CPU that received its SYN. Listeners are numbered in the
+// order they were bound, and connections received on other CPUs are hashed as usual.
+pub fn steer_by_cpu(listener: &impl AsRawFd, cpus: &[usize]) -> io::Result<()> {
+    let insn = |code: u32, jt: u8, jf: u8, k: u32| libc::sock_filter {
+        code: code as u16,
+        jt,
+        jf,
+        k,
+    };
+    let mut filter = vec![insn(
+        libc::BPF_LD | libc::BPF_W | libc::BPF_ABS,
+        0,
+        0,
+        (libc::SKF_AD_OFF + libc::SKF_AD_CPU) as u32,
+    )];
+    for (i, &cpu) in cpus.iter().enumerate() {
+        // Returns `i` if the CPU is `cpu`, and skips the return otherwise.
+        filter.push(insn(
+            libc::BPF_JMP | libc::BPF_JEQ | libc::BPF_K,
+            0,
+            1,
+            cpu as u32,
+        ));
+        filter.push(insn(libc::BPF_RET | libc::BPF_K, 0, 0, i as u32));
+    }
+    // An index past the last listener makes the kernel fall back to the hash.
+    filter.push(insn(libc::BPF_RET | libc::BPF_K, 0, 0, u32::MAX));
+    let program = libc::sock_fprog {
+        len: filter.len() as u16,
+        filter: filter.as_mut_ptr(),
+    };
+    setsockopt(
+        listener,
+        libc::SOL_SOCKET,
+        libc::SO_ATTACH_REUSEPORT_CBPF,
+        &program,
+    )
+}
+
+// Returns the CPU that last processed packets of the socket in the kernel.
+pub fn incoming_cpu(fd: &impl AsRawFd) -> io::Result<usize> {
+    let mut cpu = 0i32;
+    let mut len = mem::size_of_val(&cpu) as libc::socklen_t;
+    let ret = unsafe {
+        libc::getsockopt(
+            fd.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_INCOMING_CPU,
+            &mut cpu as *mut _ as *mut _,
+            &mut len,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(cpu as usize)
+}
+
+// `struct scm_timestamping`: the software timestamp followed by two legacy and hardware ones. The
+// libc crate does not define it.
+type ScmTimestamping = [libc::timespec; 3];
+
+// Size of a control buffer that fits an `SCM_TIMESTAMPING` message.
+pub const RX_TIMESTAMP_CONTROL_LEN: usize =
+    unsafe { libc::CMSG_SPACE(mem::size_of::<ScmTimestamping>() as u32) } as usize;
+
+// Makes the kernel timestamp packets in software when they enter the network stack and report the
+// timestamp of the last packet read in an `SCM_TIMESTAMPING` control message of every `recvmsg`.
+// Sockets accepted from a listener inherit the option.
+pub fn enable_rx_timestamps(fd: &impl AsRawFd) -> io::Result<()> {
+    let flags = libc::SOF_TIMESTAMPING_RX_SOFTWARE | libc::SOF_TIMESTAMPING_SOFTWARE;
+    setsockopt(fd, libc::SOL_SOCKET, libc::SO_TIMESTAMPING, &flags)
+}
+
+// Finds the software receive timestamp in the control messages returned by `recvmsg`.
+pub fn rx_timestamp(control: &[u8]) -> Option<libc::timespec> {
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_control = control.as_ptr() as *mut _;
+    msg.msg_controllen = control.len();
+
+    let mut cmsg = unsafe { libc::CMSG_FIRSTHDR(&msg) };
+    while !cmsg.is_null() {
+        let hdr = unsafe { &*cmsg };
+        if hdr.cmsg_level == libc::SOL_SOCKET && hdr.cmsg_type == libc::SCM_TIMESTAMPING {
+            let timestamps = unsafe {
+                libc::CMSG_DATA(cmsg)
+                    .cast::<ScmTimestamping>()
+                    .read_unaligned()
+            };
+            let software = timestamps[0];
+            return (software.tv_sec != 0 || software.tv_nsec != 0).then_some(software);
+        }
+        cmsg = unsafe { libc::CMSG_NXTHDR(&msg, cmsg) };
+    }
+    None
+}
+
+// Returns the nanoseconds elapsed since `timestamp`, which must come from `CLOCK_REALTIME` like
+// the kernel's software timestamps.
+pub fn nanos_since(timestamp: &libc::timespec) -> u64 {
+    let mut now: libc::timespec = unsafe { mem::zeroed() };
+    unsafe { libc::clock_gettime(libc::CLOCK_REALTIME, &mut now) };
+    let nanos = |ts: &libc::timespec| ts.tv_sec as i64 * 1_000_000_000 + ts.tv_nsec as i64;
+    (nanos(&now) - nanos(timestamp)).max(0) as u64
+}
+
+// Raises the limit on open file descriptors as far as possible: to `fs.nr_open` if the process may
+// raise its hard limit, or to the hard limit otherwise. Returns the new limit.
+pub fn raise_fd_limit() -> io::Result<u64> {
+    let nr_open = std::fs::read_to_string("/proc/sys/fs/nr_open")?;
+    let nr_open: u64 = nr_open
+        .trim()
+        .parse()
+        .map_err(|err| io::Error::new(io::ErrorKind::InvalidData, err))?;
+
+    let mut limit: libc::rlimit = unsafe { mem::zeroed() };
+    if unsafe { libc::getrlimit(libc::RLIMIT_NOFILE, &mut limit) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    if limit.rlim_max < nr_open {
+        let raised = libc::rlimit {
+            rlim_cur: nr_open,
+            rlim_max: nr_open,
+        };
+        if unsafe { libc::setrlimit(libc::RLIMIT_NOFILE, &raised) } == 0 {
+            return Ok(nr_open);
+        }
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if unsafe { libc::setrlimit(libc::RLIMIT_NOFILE, &limit) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(limit.rlim_cur)
+}
@@ -0,0 +1,362 @@
+use std::{
+    collections::BTreeSet,
+    ffi::CStr,
+    fs, io, mem,
+    net::{IpAddr, Ipv4Addr, Ipv6Addr, ToSocketAddrs},
+    ptr,
+};
+
+#[derive(Clone, Copy)]
+pub enum NumaMode {
+    Off,
+    Auto,
+    Node(u32),
+}
+
+fn parse_numa_mode(s: &str) -> Result<NumaMode, String> {
+    match s {
+        "off" => Ok(NumaMode::Off),
+        "auto" => Ok(NumaMode::Auto),
+        _ => s
+            .parse()
+            .map(NumaMode::Node)
+            .map_err(|_| format!("expected `off`, `auto` or a node number, got `{s}`")),
+    }
+}
+
+#[derive(clap::Args)]
+pub struct NumaArgs {
+    /// Pin every thread to a CPU of one NUMA node and allocate its memory there: `auto` picks the
+    /// node of the NIC, a node number forces that node (e.g. to measure traffic crossing nodes)
+    /// and `off` leaves placement to the scheduler and first-touch policy.
+    #[clap(long, default_value = "off", value_parser = parse_numa_mode)]
+    pub numa: NumaMode,
+}
+
+// Where one thread runs and allocates its memory.
+#[derive(Clone, Copy, Default)]
+pub struct Placement {
+    pub cpu: Option<usize>,
+    pub node: Option<u32>,
+}
+
+fn sched_setaffinity(cpu: usize) -> io::Result<()> {
+    let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+    unsafe { libc::CPU_SET(cpu, &mut set) };
+    if unsafe { libc::sched_setaffinity(0, mem::size_of_val(&set), &set) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+// Makes the calling thread allocate its pages on `node` while it has free memory.
+fn set_mempolicy(node: u32) -> io::Result<()> {
+    assert!(node < 64, "NUMA nodes above 63 are not supported");
+    let nodemask: libc::c_ulong = 1 << node;
+    let ret = unsafe {
+        libc::syscall(
+            libc::SYS_set_mempolicy,
+            libc::MPOL_PREFERRED,
+            &nodemask,
+            libc::c_ulong::BITS,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+impl Placement {
+    // Must be called on the thread being placed, before it allocates its rings and buffers, so
+    // that they are first touched under the new policy.
+    pub fn apply(&self) -> io::Result<()> {
+        if let Some(cpu) = self.cpu {
+            sched_setaffinity(cpu)?;
+        }
+        if let Some(node) = self.node {
+            set_mempolicy(node)?;
+        }
+        Ok(())
+    }
+}
+
+fn allowed_cpus() -> io::Result<Vec<usize>> {
+    let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+    if unsafe { libc::sched_getaffinity(0, mem::size_of_val(&set), &mut set) } == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok((0..libc::CPU_SETSIZE as usize)
+        .filter(|&cpu| unsafe { libc::CPU_ISSET(cpu, &set) })
+        .collect())
+}
+
+// Pins the threads that `place` left to the scheduler to the CPUs the process may run on, round
+// robin, and returns the CPU of every thread.
+pub fn pin_threads(placements: &mut [Placement]) -> Vec<usize> {
+    let cpus = allowed_cpus().expect("failed to get the CPU affinity");
+    placements
+        .iter_mut()
+        .enumerate()
+        .map(|(i, placement)| *placement.cpu.get_or_insert(cpus[i % cpus.len()]))
+        .collect()
+}
+
+// Parses the `0-3,8,10-11` format of sysfs CPU lists.
+fn parse_cpu_list(s: &str) -> Vec<usize> {
+    let mut cpus = Vec::new();
+    for part in s.trim().split(',').filter(|part| !part.is_empty()) {
+        let parse = |s: &str| s.parse::<usize>().ok();
+        match part.split_once('-') {
+            Some((first, last)) => {
+                if let (Some(first), Some(last)) = (parse(first), parse(last)) {
+                    cpus.extend(first..=last);
+                }
+            }
+            None => cpus.extend(parse(part)),
+        }
+    }
+    cpus
+}
+
+fn format_cpu_list(cpus: &[usize]) -> String {
+    let mut ranges: Vec<String> = Vec::new();
+    let mut i = 0;
+    while i < cpus.len() {
+        let mut j = i;
+        while j + 1 < cpus.len() && cpus[j + 1] == cpus[j] + 1 {
+            j += 1;
+        }
+        ranges.push(if i == j {
+            cpus[i].to_string()
+        } else {
+            format!("{}-{}", cpus[i], cpus[j])
+        });
+        i = j + 1;
+    }
+    ranges.join(",")
+}
+
+// The CPUs of every NUMA node, from `/sys/devices/system/node`.
+struct Topology {
+    nodes: Vec<(u32, Vec<usize>)>,
+}
+
+impl Topology {
+    fn discover() -> io::Result<Self> {
+        let mut nodes = Vec::new();
+        for entry in fs::read_dir("/sys/devices/system/node")? {
+            let entry = entry?;
+            let name = entry.file_name();
+            let Some(id) = name
+                .to_str()
+                .and_then(|name| name.strip_prefix("node"))
+                .and_then(|id| id.parse().ok())
+            else {
+                continue;
+            };
+            let cpus = fs::read_to_string(entry.path().join("cpulist"))?;
+            nodes.push((id, parse_cpu_list(&cpus)));
+        }
+        nodes.sort();
+        Ok(Topology { nodes })
+    }
+
+    fn cpus(&self, node: u32) -> Option<&[usize]> {
+        self.nodes
+            .iter()
+            .find(|(id, _)| *id == node)
+            .map(|(_, cpus)| &cpus[..])
+    }
+
+    fn node_of(&self, cpu: usize) -> Option<u32> {
+        self.nodes
+            .iter()
+            .find(|(_, cpus)| cpus.contains(&cpu))
+            .map(|(id, _)| *id)
+    }
+}
+
+// Returns the node the NIC behind `interface` is attached to, if the platform reports one.
+pub fn interface_node(interface: &str) -> Option<u32> {
+    let node = fs::read_to_string(format!("/sys/class/net/{interface}/device/numa_node")).ok()?;
+    // -1 means that the device is not attached to a particular node.
+    node.trim().parse().ok()
+}
+
+fn ifaddr_ip(addr: *const libc::sockaddr) -> Option<IpAddr> {
+    if addr.is_null() {
+        return None;
+    }
+    match unsafe { (*addr).sa_family } as i32 {
+        libc::AF_INET => {
+            let sin = unsafe { &*(addr as *const libc::sockaddr_in) };
+            Some(IpAddr::V4(Ipv4Addr::from(u32::from_be(
+                sin.sin_addr.s_addr,
+            ))))
+        }
+        libc::AF_INET6 => {
+            let sin6 = unsafe { &*(addr as *const libc::sockaddr_in6) };
+            Some(IpAddr::V6(Ipv6Addr::from(sin6.sin6_addr.s6_addr)))
+        }
+        _ => None,
+    }
+}
+
+fn interface_for_addr(ip: IpAddr) -> Option<String> {
+    let mut ifaddrs = ptr::null_mut();
+    if unsafe { libc::getifaddrs(&mut ifaddrs) } == -1 {
+        return None;
+    }
+    let mut interface = None;
+    let mut cursor = ifaddrs;
+    while !cursor.is_null() {
+        let ifaddr = unsafe { &*cursor };
+        if ifaddr_ip(ifaddr.ifa_addr) == Some(ip) {
+            let name = unsafe { CStr::from_ptr(ifaddr.ifa_name) };
+            interface = Some(name.to_string_lossy().into_owned());
+            break;
+        }
+        cursor = ifaddr.ifa_next;
+    }
+    unsafe { libc::freeifaddrs(ifaddrs) };
+    interface
+}
+
+// Returns the interface that receives the connections of a listener bound to `addr`, which is
+// the one that has its address assigned. Wildcard addresses have no single interface.
+pub fn interface_for_bind(addr: &str) -> Option<String> {
+    let addr = addr.to_socket_addrs().ok()?.next()?;
+    if addr.ip().is_unspecified() {
+        return None;
+    }
+    interface_for_addr(addr.ip())
+}
+
+// Returns the IRQs of the NIC behind `interface` with their names. They are found by their MSI
+// vectors, or by a name that mentions the interface or its device, like `eth0-TxRx-0`,
+// `virtio0-input.0` or `mlx5_comp0@pci:0000:3b:00.0`.
+fn interface_irqs(interface: &str) -> Vec<(u32, String)> {
+    let device = format!("/sys/class/net/{interface}/device");
+    let device_name = fs::read_link(&device)
+        .ok()
+        .and_then(|path| Some(path.file_name()?.to_string_lossy().into_owned()));
+    let msi: BTreeSet<u32> = fs::read_dir(format!("{device}/msi_irqs"))
+        .into_iter()
+        .flatten()
+        .filter_map(|entry| entry.ok()?.file_name().to_str()?.parse().ok())
+        .collect();
+
+    let interrupts = fs::read_to_string("/proc/interrupts").unwrap_or_default();
+    let mut irqs = Vec::new();
+    for line in interrupts.lines() {
+        let Some((irq, rest)) = line.trim_start().split_once(':') else {
+            continue;
+        };
+        let Ok(irq) = irq.parse::<u32>() else {
+            continue;
+        };
+        let name = rest.split_whitespace().last().unwrap_or_default();
+        let matches = msi.contains(&irq)
+            || name.contains(interface)
+            || device_name
+                .as_deref()
+                .is_some_and(|device| name.contains(device));
+        if matches {
+            irqs.push((irq, name.to_string()));
+        }
+    }
+    irqs
+}
+
+fn irq_affinity(irq: u32) -> Vec<usize> {
+    ["effective_affinity_list", "smp_affinity_list"]
+        .iter()
+        .find_map(|file| fs::read_to_string(format!("/proc/irq/{irq}/{file}")).ok())
+        .map(|cpus| parse_cpu_list(&cpus))
+        .unwrap_or_default()
+}
+
+// Warns about the IRQs of the NIC that are handled outside `node`. Their packets are processed
+// by the kernel on one node and read by the workers on another, which is the traffic placement
+// is meant to avoid.
+fn check_irqs(topology: &Topology, interface: &str, node: u32) {
+    for (irq, name) in interface_irqs(interface) {
+        let cpus = irq_affinity(irq);
+        let nodes: BTreeSet<u32> = cpus
+            .iter()
+            .filter_map(|&cpu| topology.node_of(cpu))
+            .collect();
+        if !nodes.is_empty() && !nodes.contains(&node) {
+            eprintln!(
+                "warning: IRQ {irq} ({name}) is handled on CPUs {} of node {}, not on node \
+                 {node} where the workers run",
+                format_cpu_list(&cpus),
+                nodes
+                    .iter()
+                    .map(u32::to_string)
+                    .collect::<Vec<_>>()
+                    .join(","),
+            );
+        }
+    }
+}
+
+// Returns the placement of each of `threads` threads and reports it. `interface` is the NIC the
+// threads receive from, if known.
+pub fn place(args: &NumaArgs, interface: Option<&str>, threads: usize) -> Vec<Placement> {
+    let unplaced = vec![Placement::default(); threads];
+    let nic_node = interface.and_then(interface_node);
+    let node = match args.numa {
+        NumaMode::Off => return unplaced,
+        NumaMode::Auto => match nic_node {
+            Some(node) => node,
+            None => {
+                eprintln!("warning: the NUMA node of the NIC is unknown, threads are not placed");
+                return unplaced;
+            }
+        },
+        NumaMode::Node(node) => node,
+    };
+
+    let topology = match Topology::discover() {
+        Ok(topology) => topology,
+        Err(err) => {
+            eprintln!("warning: failed to read the NUMA topology: {err}");
+            return unplaced;
+        }
+    };
+    let cpus = topology
+        .cpus(node)
+        .filter(|cpus| !cpus.is_empty())
+        .unwrap_or_else(|| panic!("NUMA node {node} does not exist or has no CPUs"));
+    if threads > cpus.len() {
+        eprintln!(
+            "warning: {threads} threads share the {} CPUs of node {node}",
+            cpus.len()
+        );
+    }
+
+    let placements: Vec<_> = (0..threads)
+        .map(|i| Placement {
+            cpu: Some(cpus[i % cpus.len()]),
+            node: Some(node),
+        })
+        .collect();
+    let placed: Vec<usize> = placements.iter().filter_map(|p| p.cpu).collect();
+    eprint!(
+        "NUMA: threads on node {node}, CPUs {}",
+        format_cpu_list(&placed)
+    );
+    match (interface, nic_node) {
+        (Some(interface), Some(nic_node)) if nic_node != node => {
+            eprintln!(", remote from {interface} on node {nic_node}")
+        }
+        (Some(interface), Some(_)) => eprintln!(", local to {interface}"),
+        _ => eprintln!(),
+    }
+    if let Some(interface) = interface {
+        check_irqs(&topology, interface, node);
+    }
+    placements
+}
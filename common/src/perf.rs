@@ -0,0 +1,222 @@
+use std::{
+    io, mem,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+};
+
+// `struct perf_event_attr` up to `PERF_ATTR_SIZE_VER1`, which is all we need. The libc crate does
+// not define it.
+#[derive(Default)]
+#[repr(C)]
+struct PerfEventAttr {
+    type_: u32,
+    size: u32,
+    config: u64,
+    sample_period: u64,
+    sample_type: u64,
+    read_format: u64,
+    flags: u64,
+    wakeup_events: u32,
+    bp_type: u32,
+    config1: u64,
+    config2: u64,
+}
+
+const PERF_TYPE_HARDWARE: u32 = 0;
+const PERF_TYPE_HW_CACHE: u32 = 3;
+
+const PERF_COUNT_HW_CPU_CYCLES: u64 = 0;
+const PERF_COUNT_HW_INSTRUCTIONS: u64 = 1;
+
+const PERF_COUNT_HW_CACHE_LL: u64 = 2;
+const PERF_COUNT_HW_CACHE_DTLB: u64 = 3;
+const PERF_COUNT_HW_CACHE_OP_READ: u64 = 0;
+const PERF_COUNT_HW_CACHE_RESULT_MISS: u64 = 1;
+
+const PERF_FORMAT_TOTAL_TIME_ENABLED: u64 = 1 << 0;
+const PERF_FORMAT_TOTAL_TIME_RUNNING: u64 = 1 << 1;
+const PERF_FORMAT_GROUP: u64 = 1 << 3;
+
+const FLAG_DISABLED: u64 = 1 << 0;
+const FLAG_EXCLUDE_KERNEL: u64 = 1 << 5;
+const FLAG_EXCLUDE_HV: u64 = 1 << 6;
+
+const PERF_FLAG_FD_CLOEXEC: libc::c_ulong = 1 << 3;
+
+const PERF_EVENT_IOC_ENABLE: libc::c_ulong = 0x2400;
+const PERF_EVENT_IOC_FLAG_GROUP: libc::c_ulong = 1;
+
+const fn cache_miss(cache: u64) -> u64 {
+    cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+}
+
+const EVENTS: [(u32, u64); 4] = [
+    (PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+    (PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+    (PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)),
+    (PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)),
+];
+const EVENT_NAMES: [&str; EVENTS.len()] = ["cycles", "instructions", "LLC misses", "dTLB misses"];
+
+// Values of `EVENTS`, in the same order, or `None` for events the CPU or hypervisor does not
+// support.
+#[derive(Clone, Copy, Default)]
+pub struct PerfValues(pub [Option<u64>; EVENTS.len()]);
+
+impl PerfValues {
+    pub fn cycles(&self) -> Option<u64> {
+        self.0[0]
+    }
+
+    pub fn instructions(&self) -> Option<u64> {
+        self.0[1]
+    }
+
+    pub fn llc_misses(&self) -> Option<u64> {
+        self.0[2]
+    }
+
+    pub fn dtlb_misses(&self) -> Option<u64> {
+        self.0[3]
+    }
+
+    pub fn add(&self, other: &PerfValues) -> PerfValues {
+        let mut sum = *self;
+        for (a, b) in sum.0.iter_mut().zip(other.0) {
+            *a = match (*a, b) {
+                (Some(a), Some(b)) => Some(a + b),
+                (a, b) => a.or(b),
+            };
+        }
+        sum
+    }
+
+    pub fn delta(&self, prev: &PerfValues) -> PerfValues {
+        let mut delta = *self;
+        // Values scaled for multiplexing can go backwards.
+        for (a, b) in delta.0.iter_mut().zip(prev.0) {
+            *a = a.map(|a| a.saturating_sub(b.unwrap_or(0)));
+        }
+        delta
+    }
+}
+
+fn perf_event_open(attr: &PerfEventAttr, group_fd: i32) -> io::Result<OwnedFd> {
+    // Count the calling thread on whatever CPU it runs.
+    let ret = unsafe {
+        libc::syscall(
+            libc::SYS_perf_event_open,
+            attr as *const PerfEventAttr,
+            0,
+            -1,
+            group_fd,
+            PERF_FLAG_FD_CLOEXEC,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(ret as i32) })
+}
+
+// A group of hardware counters scoped to the thread that opened it. The counters of a group are
+// scheduled on the PMU together, so ratios between them are meaningful even when the kernel has
+// to multiplex them.
+pub struct PerfGroup {
+    leader: OwnedFd,
+    _members: Vec<OwnedFd>,
+    // Index in the group read buffer of each of `EVENTS`, if it could be opened.
+    slots: [Option<usize>; EVENTS.len()],
+}
+
+impl PerfGroup {
+    // Opens the counters for the calling thread. Events the machine does not support are left out
+    // of the group; this only fails if not even the cycle counter is available, which is common
+    // in virtual machines without a virtual PMU.
+    pub fn open() -> io::Result<Self> {
+        match Self::open_with_flags(0) {
+            // `perf_event_paranoid` may forbid counting in the kernel without `CAP_PERFMON`.
+            Err(err) if err.raw_os_error() == Some(libc::EACCES) => {
+                eprintln!(
+                    "warning: counting user space only because kernel counting failed: {err}"
+                );
+                Self::open_with_flags(FLAG_EXCLUDE_KERNEL | FLAG_EXCLUDE_HV)
+            }
+            ret => ret,
+        }
+    }
+
+    fn open_with_flags(flags: u64) -> io::Result<Self> {
+        let attr = |(type_, config): (u32, u64), flags: u64| PerfEventAttr {
+            type_,
+            size: mem::size_of::<PerfEventAttr>() as u32,
+            config,
+            read_format: PERF_FORMAT_GROUP
+                | PERF_FORMAT_TOTAL_TIME_ENABLED
+                | PERF_FORMAT_TOTAL_TIME_RUNNING,
+            flags,
+            ..Default::default()
+        };
+
+        let leader = perf_event_open(&attr(EVENTS[0], flags | FLAG_DISABLED), -1)?;
+        let mut members = Vec::new();
+        let mut slots = [None; EVENTS.len()];
+        slots[0] = Some(0);
+        for (i, &event) in EVENTS.iter().enumerate().skip(1) {
+            match perf_event_open(&attr(event, flags), leader.as_raw_fd()) {
+                Ok(fd) => {
+                    members.push(fd);
+                    slots[i] = Some(members.len());
+                }
+                Err(err) => eprintln!("warning: {} are unavailable: {err}", EVENT_NAMES[i]),
+            }
+        }
+
+        let ret = unsafe {
+            libc::ioctl(
+                leader.as_raw_fd(),
+                PERF_EVENT_IOC_ENABLE,
+                PERF_EVENT_IOC_FLAG_GROUP,
+            )
+        };
+        if ret == -1 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(PerfGroup {
+            leader,
+            _members: members,
+            slots,
+        })
+    }
+
+    // Reads the counters, scaled up to compensate for the time they were not scheduled on the PMU.
+    // This can be called from any thread.
+    pub fn read(&self) -> io::Result<PerfValues> {
+        // nr, time_enabled, time_running, then one value per event.
+        let mut buf = [0u64; 3 + EVENTS.len()];
+        let ret = unsafe {
+            libc::read(
+                self.leader.as_raw_fd(),
+                buf.as_mut_ptr().cast(),
+                mem::size_of_val(&buf),
+            )
+        };
+        if ret == -1 {
+            return Err(io::Error::last_os_error());
+        }
+
+        let (enabled, running) = (buf[1], buf[2]);
+        let scale = |value: u64| {
+            if running == 0 {
+                0
+            } else {
+                (value as f64 * enabled as f64 / running as f64) as u64
+            }
+        };
+        let mut values = PerfValues::default();
+        for (value, slot) in values.0.iter_mut().zip(self.slots) {
+            *value = slot.map(|slot| scale(buf[3 + slot]));
+        }
+        Ok(values)
+    }
+}
@@ -0,0 +1,346 @@
+use std::{
+    cell::UnsafeCell,
+    hint,
+    mem::MaybeUninit,
+    slice,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    thread,
+    time::Instant,
+};
+
+use crate::{engine::Handler, metrics::Metrics, numa::Placement};
+
+#[derive(clap::Args)]
+pub struct PipelineArgs {
+    /// Number of worker threads per event loop that run the handler, fed through lock-free rings
+    /// with the buffers the event loop received into. With 0, the event loop runs the handler
+    /// itself.
+    #[clap(long, default_value_t = 0)]
+    pub workers: usize,
+
+    /// Number of receive blocks per event loop shared with its workers. When all of them are
+    /// queued, the event loop stops reading until the workers return some.
+    #[clap(long, default_value_t = 1024)]
+    pub blocks: u32,
+}
+
+impl PipelineArgs {
+    // Number of threads of `threads` event loops and their workers.
+    pub fn threads(&self, threads: usize) -> usize {
+        threads * (1 + self.workers)
+    }
+}
+
+// Size of the blocks that I/O threads receive into, the same as the stack buffer of the inline
+// model so that both make the same receive calls.
+pub const BLOCK_SIZE: usize = 4096;
+
+// Maximum number of segments a worker takes from its ring at once.
+const BATCH: usize = 64;
+
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+// A bounded single-producer single-consumer ring. The producer only writes `tail` and the consumer
+// only writes `head`, each on its own cache line, so the two sides only share a line when one of
+// them has to refresh its view of the other.
+struct Ring<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    mask: usize,
+    head: CachePadded<AtomicUsize>,
+    tail: CachePadded<AtomicUsize>,
+}
+
+// The slots between `head` and `tail` belong to the consumer and the others to the producer, and
+// ownership only changes hands through the release stores of the indices.
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+pub struct Producer<T> {
+    ring: Arc<Ring<T>>,
+    tail: usize,
+    // Last value of `head` that was read, which bounds the free slots until the producer runs out
+    // of them.
+    head: usize,
+}
+
+pub struct Consumer<T> {
+    ring: Arc<Ring<T>>,
+    head: usize,
+    tail: usize,
+}
+
+// Creates a ring of `capacity` slots, rounded up to a power of two.
+pub fn ring<T: Copy + Send>(capacity: usize) -> (Producer<T>, Consumer<T>) {
+    let capacity = capacity.next_power_of_two();
+    let ring = Arc::new(Ring {
+        slots: (0..capacity)
+            .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+            .collect(),
+        mask: capacity - 1,
+        head: CachePadded(AtomicUsize::new(0)),
+        tail: CachePadded(AtomicUsize::new(0)),
+    });
+    let producer = Producer {
+        ring: ring.clone(),
+        tail: 0,
+        head: 0,
+    };
+    let consumer = Consumer {
+        ring,
+        head: 0,
+        tail: 0,
+    };
+    (producer, consumer)
+}
+
+impl<T: Copy> Producer<T> {
+    // Moves as many items from the front of `items` as fit into the ring, with a single release
+    // store, and returns how many were moved.
+    pub fn push_batch(&mut self, items: &mut Vec<T>) -> usize {
+        let ring = &*self.ring;
+        let capacity = ring.mask + 1;
+        if self.tail - self.head + items.len() > capacity {
+            self.head = ring.head.0.load(Ordering::Acquire);
+        }
+        let n = items.len().min(capacity - (self.tail - self.head));
+        for (i, item) in items.drain(..n).enumerate() {
+            let slot = &ring.slots[(self.tail + i) & ring.mask];
+            unsafe { (*slot.get()).write(item) };
+        }
+        self.tail += n;
+        ring.tail.0.store(self.tail, Ordering::Release);
+        n
+    }
+}
+
+impl<T: Copy> Consumer<T> {
+    // Appends up to `max` items to `out`, with a single release store, and returns how many were
+    // taken.
+    pub fn pop_batch(&mut self, out: &mut Vec<T>, max: usize) -> usize {
+        let ring = &*self.ring;
+        if self.tail - self.head < max {
+            self.tail = ring.tail.0.load(Ordering::Acquire);
+        }
+        let n = max.min(self.tail - self.head);
+        if n == 0 {
+            return 0;
+        }
+        out.extend((0..n).map(|i| {
+            let slot = &ring.slots[(self.head + i) & ring.mask];
+            unsafe { (*slot.get()).assume_init() }
+        }));
+        self.head += n;
+        ring.head.0.store(self.head, Ordering::Release);
+        n
+    }
+}
+
+// Receive buffers shared by an I/O thread and its workers. A block is written by the I/O thread
+// until it hands its index to a worker, and read by the worker until it hands the index back.
+struct Blocks {
+    memory: Box<[UnsafeCell<MaybeUninit<u8>>]>,
+}
+
+unsafe impl Sync for Blocks {}
+
+impl Blocks {
+    fn ptr(&self, block: u32) -> *mut MaybeUninit<u8> {
+        let memory = UnsafeCell::raw_get(self.memory.as_ptr());
+        unsafe { memory.add(block as usize * BLOCK_SIZE) }
+    }
+}
+
+// Bytes received by an I/O thread, or the end of a connection if `len` is 0.
+#[derive(Clone, Copy)]
+struct Segment {
+    conn: u32,
+    block: u32,
+    len: u32,
+}
+
+// The slot of a worker thread: where it runs and which metrics block it owns.
+#[derive(Clone)]
+pub struct Worker {
+    pub placement: Placement,
+    pub metrics: Arc<[Metrics]>,
+    pub index: usize,
+}
+
+// Assigns placements and metrics blocks to the `workers` workers of each of `threads` I/O threads.
+// They follow those of the I/O threads, which are the first `threads` of each.
+pub fn assign_workers(
+    threads: usize,
+    workers: usize,
+    placements: &[Placement],
+    metrics: &Arc<[Metrics]>,
+) -> Vec<Vec<Worker>> {
+    (0..threads)
+        .map(|thread| {
+            (0..workers)
+                .map(|i| {
+                    let index = threads + thread * workers + i;
+                    Worker {
+                        placement: placements[index],
+                        metrics: metrics.clone(),
+                        index,
+                    }
+                })
+                .collect()
+        })
+        .collect()
+}
+
+struct Queue {
+    segments: Producer<Segment>,
+    returned: Consumer<u32>,
+    // Segments received since the last flush, or that did not fit in the ring.
+    pending: Vec<Segment>,
+}
+
+// The I/O thread side of a pipeline. Received bytes are handed to workers as block indices
+// instead of copies, and every connection is processed by the same worker so that its bytes stay
+// in order.
+pub struct Pipeline {
+    blocks: Arc<Blocks>,
+    free: Vec<u32>,
+    queues: Vec<Queue>,
+    returned: Vec<u32>,
+}
+
+impl Pipeline {
+    // Starts a thread per worker that runs a clone of `handler` over the segments of its
+    // connections. Replies of the handler are dropped, since workers have no access to the
+    // sockets.
+    pub fn start<H: Handler + Clone + Send + 'static>(
+        workers: Vec<Worker>,
+        blocks: u32,
+        handler: &H,
+    ) -> Self {
+        assert!(!workers.is_empty());
+        // Allocated by the I/O thread, so on its NUMA node.
+        let memory = (0..blocks as usize * BLOCK_SIZE)
+            .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+            .collect();
+        let blocks_memory = Arc::new(Blocks { memory });
+
+        let queues = workers
+            .into_iter()
+            .map(|worker| {
+                // Every data segment holds a block, so the rings never hold more than `blocks`
+                // of them and returning a block never waits.
+                let (segments, segment_consumer) = ring(blocks as usize);
+                let (return_producer, returned) = ring(blocks as usize);
+                let (blocks, handler) = (blocks_memory.clone(), handler.clone());
+                thread::spawn(move || {
+                    if let Err(err) = worker.placement.apply() {
+                        eprintln!("warning: failed to place worker {}: {err}", worker.index);
+                    }
+                    let metrics = &worker.metrics[worker.index];
+                    work(segment_consumer, return_producer, &blocks, handler, metrics)
+                });
+                Queue {
+                    segments,
+                    returned,
+                    pending: Vec::new(),
+                }
+            })
+            .collect();
+
+        Pipeline {
+            blocks: blocks_memory,
+            free: (0..blocks).rev().collect(),
+            queues,
+            returned: Vec::new(),
+        }
+    }
+
+    // Returns a free block to receive into, or None if all of them are queued or being processed,
+    // in which case the caller must stop receiving until the workers catch up.
+    pub fn take_block(&mut self) -> Option<u32> {
+        if self.free.is_empty() {
+            self.flush();
+            for queue in &mut self.queues {
+                queue.returned.pop_batch(&mut self.returned, usize::MAX);
+            }
+            self.free.append(&mut self.returned);
+        }
+        self.free.pop()
+    }
+
+    pub fn block(&mut self, block: u32) -> &mut [MaybeUninit<u8>] {
+        unsafe { slice::from_raw_parts_mut(self.blocks.ptr(block), BLOCK_SIZE) }
+    }
+
+    fn queue(&mut self, conn: u32) -> &mut Queue {
+        let n = self.queues.len();
+        &mut self.queues[conn as usize % n]
+    }
+
+    // Queues the first `len` bytes of `block` for the worker of `conn`. They are handed over by
+    // the next `flush`.
+    pub fn push(&mut self, conn: u32, block: u32, len: usize) {
+        let len = len as u32;
+        self.queue(conn).pending.push(Segment { conn, block, len });
+    }
+
+    // Returns a block that was taken but not filled.
+    pub fn put_back(&mut self, block: u32) {
+        self.free.push(block);
+    }
+
+    // Queues the end of `conn`, after its last bytes.
+    pub fn close(&mut self, conn: u32) {
+        let segment = Segment {
+            conn,
+            block: u32::MAX,
+            len: 0,
+        };
+        self.queue(conn).pending.push(segment);
+    }
+
+    // Hands the queued segments to the workers, a batch per worker.
+    pub fn flush(&mut self) {
+        for queue in &mut self.queues {
+            if !queue.pending.is_empty() {
+                queue.segments.push_batch(&mut queue.pending);
+            }
+        }
+    }
+}
+
+fn work<H: Handler>(
+    mut segments: Consumer<Segment>,
+    mut returns: Producer<u32>,
+    blocks: &Blocks,
+    mut handler: H,
+    metrics: &Metrics,
+) {
+    metrics.init_thread();
+    let mut batch = Vec::with_capacity(BATCH);
+    let mut returned = Vec::with_capacity(BATCH);
+    let mut out = Vec::new();
+    loop {
+        if segments.pop_batch(&mut batch, BATCH) == 0 {
+            hint::spin_loop();
+            continue;
+        }
+        let start = Instant::now();
+        for segment in batch.drain(..) {
+            if segment.len == 0 {
+                handler.on_close(segment.conn);
+                continue;
+            }
+            let data = unsafe {
+                slice::from_raw_parts(blocks.ptr(segment.block).cast(), segment.len as _)
+            };
+            handler.on_recv(segment.conn, data, &mut out);
+            out.clear();
+            returned.push(segment.block);
+        }
+        returns.push_batch(&mut returned);
+        metrics.worker_busy.add(start.elapsed().as_nanos() as u64);
+    }
+}
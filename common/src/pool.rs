@@ -0,0 +1,30 @@
+// Byte buffers that are reused instead of allocated, such as the bytes of a message split across
+// receives or a reply being sent. A buffer goes back to the pool at the end of its message, so
+// idle connections hold none, and steady-state traffic allocates nothing once the pool holds as
+// many buffers as there are messages in progress.
+#[derive(Clone, Default)]
+pub struct BufferPool {
+    buffers: Vec<Vec<u8>>,
+}
+
+// Larger buffers are freed, so that a few large messages do not pin their memory for good.
+const MAX_CAPACITY: usize = 64 * 1024;
+const MAX_BUFFERS: usize = 1024;
+
+impl BufferPool {
+    // Returns an empty buffer, with the capacity it had when it was given back.
+    pub fn take(&mut self) -> Vec<u8> {
+        self.buffers.pop().unwrap_or_default()
+    }
+
+    pub fn give(&mut self, mut buffer: Vec<u8>) {
+        if buffer.capacity() == 0
+            || buffer.capacity() > MAX_CAPACITY
+            || self.buffers.len() == MAX_BUFFERS
+        {
+            return;
+        }
+        buffer.clear();
+        self.buffers.push(buffer);
+    }
+}
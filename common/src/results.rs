@@ -0,0 +1,155 @@
+use std::{
+    collections::BTreeMap,
+    ffi::CStr,
+    fs::{self, File},
+    io::{self, BufReader, BufWriter},
+    mem,
+    path::{Path, PathBuf},
+    process::Command,
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+use serde::{Deserialize, Serialize};
+
+use crate::histogram::Histogram;
+
+// One benchmark run as stored in a results directory, so that any two runs can be compared with
+// `bench-compare`. Every measurement keeps one value per trial rather than a summary, which is
+// what the significance test needs.
+#[derive(Deserialize, Serialize)]
+pub struct Run {
+    pub environment: Environment,
+    pub records: Vec<Record>,
+}
+
+#[derive(Deserialize, Serialize)]
+pub struct Environment {
+    pub tool: String,
+    // Seconds since the Unix epoch.
+    pub timestamp: u64,
+    pub commit: Option<String>,
+    pub kernel: String,
+    pub cpu_model: String,
+}
+
+// The results of one configuration. Records of two runs are compared when their backends and
+// configurations are equal.
+#[derive(Deserialize, Serialize)]
+pub struct Record {
+    pub backend: String,
+    // Every parameter that affects the results, such as thread counts and sizes.
+    pub config: BTreeMap<String, String>,
+    pub throughput_unit: String,
+    pub throughput: Vec<f64>,
+    // Latency percentiles per trial, if the tool measures latency.
+    #[serde(default)]
+    pub latency: Vec<Latency>,
+    // CPUs used by the server per trial, e.g. 1.5 for one and a half cores busy.
+    #[serde(default)]
+    pub cpu: Vec<f64>,
+}
+
+// Latencies are in nanoseconds.
+#[derive(Clone, Copy, Deserialize, Serialize)]
+pub struct Latency {
+    pub p50: u64,
+    pub p90: u64,
+    pub p99: u64,
+    pub p999: u64,
+    pub max: u64,
+}
+
+impl Latency {
+    pub fn new(histogram: &Histogram) -> Self {
+        Latency {
+            p50: histogram.percentile(50.0),
+            p90: histogram.percentile(90.0),
+            p99: histogram.percentile(99.0),
+            p999: histogram.percentile(99.9),
+            max: histogram.max(),
+        }
+    }
+}
+
+fn kernel() -> String {
+    let mut uts: libc::utsname = unsafe { mem::zeroed() };
+    if unsafe { libc::uname(&mut uts) } == -1 {
+        return "unknown".to_string();
+    }
+    let release = unsafe { CStr::from_ptr(uts.release.as_ptr()) };
+    release.to_string_lossy().into_owned()
+}
+
+fn cpu_model() -> String {
+    let cpuinfo = fs::read_to_string("/proc/cpuinfo").unwrap_or_default();
+    cpuinfo
+        .lines()
+        .find_map(|line| {
+            let (key, value) = line.split_once(':')?;
+            (key.trim() == "model name").then(|| value.trim().to_string())
+        })
+        .unwrap_or_else(|| "unknown".to_string())
+}
+
+// Returns the commit of the working directory, suffixed with `-dirty` if it has uncommitted
+// changes, or `None` outside a Git repository.
+fn commit() -> Option<String> {
+    let git = |args: &[&str]| {
+        let output = Command::new("git").args(args).output().ok()?;
+        output
+            .status
+            .success()
+            .then(|| String::from_utf8_lossy(&output.stdout).trim().to_string())
+    };
+    let commit = git(&["rev-parse", "--short=12", "HEAD"])?;
+    let dirty = git(&["status", "--porcelain", "--untracked-files=no"])?;
+    Some(if dirty.is_empty() {
+        commit
+    } else {
+        format!("{commit}-dirty")
+    })
+}
+
+impl Environment {
+    pub fn detect(tool: &str) -> Self {
+        Environment {
+            tool: tool.to_string(),
+            timestamp: SystemTime::now()
+                .duration_since(UNIX_EPOCH)
+                .unwrap()
+                .as_secs(),
+            commit: commit(),
+            kernel: kernel(),
+            cpu_model: cpu_model(),
+        }
+    }
+}
+
+impl Run {
+    pub fn new(tool: &str) -> Self {
+        Run {
+            environment: Environment::detect(tool),
+            records: Vec::new(),
+        }
+    }
+
+    pub fn load(path: &Path) -> io::Result<Self> {
+        let file = BufReader::new(File::open(path)?);
+        Ok(serde_json::from_reader(file)?)
+    }
+
+    // Writes the run to `dir`, named after its tool, time and commit so that runs sort in the
+    // order they were made, and returns its path.
+    pub fn store(&self, dir: &Path) -> io::Result<PathBuf> {
+        fs::create_dir_all(dir)?;
+        let env = &self.environment;
+        let name = match &env.commit {
+            Some(commit) => format!("{}-{}-{commit}.json", env.timestamp, env.tool),
+            None => format!("{}-{}.json", env.timestamp, env.tool),
+        };
+        let path = dir.join(name);
+        let file = BufWriter::new(File::create(&path)?);
+        serde_json::to_writer_pretty(file, self)?;
+        Ok(path)
+    }
+}
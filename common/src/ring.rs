@@ -0,0 +1,136 @@
+use std::{
+    ffi::CStr,
+    io,
+    mem::MaybeUninit,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+    ptr, slice,
+};
+
+fn memfd_create(name: &CStr) -> io::Result<OwnedFd> {
+    let ret = unsafe { libc::memfd_create(name.as_ptr(), libc::MFD_CLOEXEC) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(ret) })
+}
+
+fn mmap(addr: *mut u8, len: usize, prot: i32, flags: i32, fd: i32) -> io::Result<*mut u8> {
+    let ptr = unsafe { libc::mmap(addr.cast(), len, prot, flags, fd, 0) };
+    if ptr == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ptr.cast())
+}
+
+// A receive buffer whose memory is mapped twice, back to back, so that both the bytes it holds and
+// its free space are contiguous even when they wrap around its end. Messages are parsed in place
+// however they were split across reads, and a read fills all the free space at once.
+pub struct RingBuffer {
+    ptr: *mut u8,
+    capacity: usize,
+    // Offset of the first byte held, in `0..capacity`, and the number of bytes held, which start
+    // there and may run into the second mapping.
+    head: usize,
+    len: usize,
+}
+
+impl RingBuffer {
+    // `capacity` is rounded up to a multiple of the page size. Both mappings share the pages of a
+    // memfd, which are only allocated once written to.
+    pub fn new(capacity: usize) -> io::Result<Self> {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        let capacity = capacity.max(1).next_multiple_of(page_size);
+        let fd = memfd_create(c"ring")?;
+        if unsafe { libc::ftruncate(fd.as_raw_fd(), capacity as libc::off_t) } == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        // Reserve the address range of both mappings, then replace each half with the memfd.
+        let ptr = mmap(
+            ptr::null_mut(),
+            2 * capacity,
+            libc::PROT_NONE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+            -1,
+        )?;
+        let ring = RingBuffer {
+            ptr,
+            capacity,
+            head: 0,
+            len: 0,
+        };
+        for half in [ptr, unsafe { ptr.add(capacity) }] {
+            mmap(
+                half,
+                capacity,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_FIXED,
+                fd.as_raw_fd(),
+            )?;
+        }
+        // The mappings keep the memory alive without the descriptor.
+        Ok(ring)
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.capacity
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    pub fn is_full(&self) -> bool {
+        self.len == self.capacity
+    }
+
+    // The bytes held, oldest first.
+    pub fn data(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ptr.add(self.head), self.len) }
+    }
+
+    // The free space, to read into before calling `commit`.
+    pub fn free(&mut self) -> &mut [MaybeUninit<u8>] {
+        let tail = self.head + self.len;
+        unsafe { slice::from_raw_parts_mut(self.ptr.add(tail).cast(), self.capacity - self.len) }
+    }
+
+    // Appends the first `n` bytes of the free space.
+    pub fn commit(&mut self, n: usize) {
+        assert!(n <= self.capacity - self.len);
+        self.len += n;
+    }
+
+    // Copies `data`, which must fit in the free space, after the bytes held.
+    pub fn extend_from_slice(&mut self, data: &[u8]) {
+        let free = self.free();
+        assert!(data.len() <= free.len());
+        unsafe { ptr::copy_nonoverlapping(data.as_ptr(), free.as_mut_ptr().cast(), data.len()) };
+        self.commit(data.len());
+    }
+
+    // Drops the first `n` bytes held.
+    pub fn consume(&mut self, n: usize) {
+        assert!(n <= self.len);
+        self.len -= n;
+        // Start over at the beginning when empty, so that short messages stay in the first pages.
+        self.head = if self.len == 0 {
+            0
+        } else {
+            (self.head + n) % self.capacity
+        };
+    }
+
+    pub fn clear(&mut self) {
+        self.head = 0;
+        self.len = 0;
+    }
+}
+
+impl Drop for RingBuffer {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr.cast(), 2 * self.capacity) };
+    }
+}
+
+// The buffer is only ever accessed through `&mut self` or `&self`, like a `Vec`.
+unsafe impl Send for RingBuffer {}
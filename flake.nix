@@ -30,7 +30,9 @@
               pkgs.clang
               pkgs.clippy
               pkgs.elfutils
+              pkgs.ethtool
               pkgs.glibc_multi
+              pkgs.iproute2
               pkgs.libcap
               pkgs.libmnl
               pkgs.libpcap
@@ -0,0 +1,270 @@
+use std::{
+    collections::BTreeMap,
+    fs::File,
+    io::{self, Read, Write},
+    net::TcpStream,
+    os::fd::AsRawFd,
+    path::PathBuf,
+    ptr, thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::{
+    http::{parse_response, Parse},
+    results::{Record, Run},
+};
+use serde::Serialize;
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: String,
+
+    /// Total number of connections, spread round-robin across threads.
+    #[clap(short = 'n', long, default_value_t = 16)]
+    connections: usize,
+
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    /// Comma-separated numbers of requests kept in flight on every connection. The server must be
+    /// started with `--http`.
+    #[clap(short, long, value_delimiter = ',', default_value = "1,16,256")]
+    depths: Vec<usize>,
+
+    /// Seconds measured at every depth, after the warm-up.
+    #[clap(long, default_value_t = 10.0)]
+    duration: f64,
+
+    /// Seconds at the start of every depth whose responses are not counted.
+    #[clap(long, default_value_t = 1.0)]
+    warmup: f64,
+
+    /// Target of the requests.
+    #[clap(long, default_value = "/")]
+    path: String,
+
+    /// Write the results of every depth to this file as JSON.
+    #[clap(long)]
+    json: Option<String>,
+
+    /// Also store the results in this directory in the format read by `bench-compare`.
+    #[clap(long)]
+    store: Option<PathBuf>,
+
+    /// Name of the server under test, which `bench-compare` matches runs by.
+    #[clap(long, default_value = "unknown")]
+    backend: String,
+}
+
+#[derive(Serialize)]
+struct Level {
+    depth: usize,
+    requests_per_second: f64,
+    responses: u64,
+}
+
+struct Connection {
+    stream: TcpStream,
+    // Requests that are due but not completely written, in bytes.
+    unsent: usize,
+    // Offset of the next byte to write within a request.
+    offset: usize,
+    // Bytes of a response that is not complete yet.
+    partial: Vec<u8>,
+}
+
+fn ppoll(pollfds: &mut [libc::pollfd], timeout: Duration) -> io::Result<()> {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos().into(),
+    };
+    let ret = unsafe {
+        libc::ppoll(
+            pollfds.as_mut_ptr(),
+            pollfds.len() as libc::nfds_t,
+            &timeout,
+            ptr::null(),
+        )
+    };
+    if ret == -1 {
+        let err = io::Error::last_os_error();
+        if err.kind() != io::ErrorKind::Interrupted {
+            return Err(err);
+        }
+    }
+    Ok(())
+}
+
+impl Connection {
+    // Writes as much of the due requests as possible without blocking. `requests` holds enough
+    // copies of the request to write any number of them from any offset in a few calls.
+    fn flush(&mut self, requests: &[u8], request_len: usize) -> io::Result<()> {
+        while self.unsent > 0 {
+            let len = self.unsent.min(requests.len() - self.offset);
+            match self.stream.write(&requests[self.offset..self.offset + len]) {
+                Ok(n) => {
+                    self.unsent -= n;
+                    self.offset = (self.offset + n) % request_len;
+                }
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(())
+    }
+
+    // Reads what arrived and returns the number of complete responses in it.
+    fn receive(&mut self, buf: &mut [u8]) -> usize {
+        let mut responses = 0;
+        loop {
+            let n = match self.stream.read(buf) {
+                Ok(0) => panic!("the server closed the connection"),
+                Ok(n) => n,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => panic!("failed to receive: {err}"),
+            };
+            self.partial.extend_from_slice(&buf[..n]);
+            let mut offset = 0;
+            loop {
+                match parse_response(&self.partial[offset..]) {
+                    Parse::Complete(len) => {
+                        offset += len;
+                        responses += 1;
+                    }
+                    Parse::Partial => break,
+                    Parse::Invalid => panic!("invalid response"),
+                }
+            }
+            self.partial.drain(..offset);
+        }
+        responses
+    }
+}
+
+// Keeps `depth` requests in flight on every connection and sends a new one for every response,
+// until `end`. Returns the number of responses received after `count_from`.
+fn run(
+    streams: Vec<TcpStream>,
+    depth: usize,
+    request: &[u8],
+    count_from: Instant,
+    end: Instant,
+) -> u64 {
+    let mut connections: Vec<_> = streams
+        .into_iter()
+        .map(|stream| {
+            stream.set_nodelay(true).unwrap();
+            stream.set_nonblocking(true).unwrap();
+            Connection {
+                stream,
+                unsent: depth * request.len(),
+                offset: 0,
+                partial: Vec::new(),
+            }
+        })
+        .collect();
+    let mut pollfds: Vec<_> = connections
+        .iter()
+        .map(|connection| libc::pollfd {
+            fd: connection.stream.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        })
+        .collect();
+    let requests = request.repeat(depth + 1);
+    let mut recv_buf = vec![0; 65536];
+    let mut counted = 0;
+
+    loop {
+        let now = Instant::now();
+        if now >= end {
+            break;
+        }
+        for (connection, pollfd) in connections.iter_mut().zip(&mut pollfds) {
+            connection
+                .flush(&requests, request.len())
+                .expect("failed to send");
+            pollfd.events = if connection.unsent > 0 {
+                libc::POLLIN | libc::POLLOUT
+            } else {
+                libc::POLLIN
+            };
+        }
+        ppoll(&mut pollfds, end - now).expect("failed to poll");
+        let now = Instant::now();
+        for (connection, pollfd) in connections.iter_mut().zip(&pollfds) {
+            if pollfd.revents & libc::POLLIN != 0 {
+                let responses = connection.receive(&mut recv_buf);
+                connection.unsent += responses * request.len();
+                if now >= count_from && now < end {
+                    counted += responses as u64;
+                }
+            }
+        }
+    }
+    counted
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.threads > 0 && args.connections >= args.threads);
+    assert!(args.depths.iter().all(|&depth| depth > 0));
+    let request = format!(
+        "GET {} HTTP/1.1\r\nHost: {}\r\nUser-Agent: http-client\r\n\r\n",
+        args.path, args.connect
+    );
+
+    let mut levels = Vec::new();
+    let mut stored = Run::new("http-client");
+    for &depth in &args.depths {
+        let mut streams: Vec<Vec<TcpStream>> = (0..args.threads).map(|_| Vec::new()).collect();
+        for i in 0..args.connections {
+            let stream = TcpStream::connect(&args.connect).expect("failed to connect");
+            streams[i % args.threads].push(stream);
+        }
+
+        let count_from = Instant::now() + Duration::from_secs_f64(args.warmup);
+        let end = count_from + Duration::from_secs_f64(args.duration);
+        let responses: u64 = thread::scope(|s| {
+            let workers: Vec<_> = streams
+                .into_iter()
+                .map(|streams| {
+                    let request = request.as_bytes();
+                    s.spawn(move || run(streams, depth, request, count_from, end))
+                })
+                .collect();
+            workers.into_iter().map(|w| w.join().unwrap()).sum()
+        });
+
+        let requests_per_second = responses as f64 / args.duration;
+        println!("depth {depth:>4} {requests_per_second:>12.0} req/s");
+        levels.push(Level {
+            depth,
+            requests_per_second,
+            responses,
+        });
+        stored.records.push(Record {
+            backend: args.backend.clone(),
+            config: BTreeMap::from([
+                ("connections".to_string(), args.connections.to_string()),
+                ("threads".to_string(), args.threads.to_string()),
+                ("depth".to_string(), depth.to_string()),
+            ]),
+            throughput_unit: "req/s".to_string(),
+            throughput: vec![requests_per_second],
+            latency: Vec::new(),
+            cpu: Vec::new(),
+        });
+    }
+
+    if let Some(path) = &args.json {
+        let file = File::create(path).expect("failed to create the JSON file");
+        serde_json::to_writer_pretty(file, &levels).unwrap();
+    }
+    if let Some(dir) = &args.store {
+        let path = stored.store(dir).expect("failed to store the run");
+        eprintln!("stored the run in {}", path.display());
+    }
+}
@@ -0,0 +1,390 @@
+use std::{
+    collections::{BTreeMap, VecDeque},
+    fs::File,
+    io::{self, Read, Write},
+    net::TcpStream,
+    os::fd::AsRawFd,
+    path::PathBuf,
+    ptr, thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::{
+    histogram::Histogram,
+    kv::parse_reply,
+    results::{Latency, Record, Run},
+};
+use serde::Serialize;
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: String,
+
+    /// Total number of connections, spread round-robin across threads.
+    #[clap(short = 'n', long, default_value_t = 16)]
+    connections: usize,
+
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    /// Number of requests kept in flight on every connection.
+    #[clap(short, long, default_value_t = 1)]
+    depth: usize,
+
+    /// Number of distinct keys, all of which are set before the measurement. The server must be
+    /// started with `--kv`.
+    #[clap(short, long, default_value_t = 100_000)]
+    keys: usize,
+
+    /// Size of every value in bytes.
+    #[clap(short = 's', long, default_value_t = 100)]
+    value_size: usize,
+
+    /// Fraction of the requests that are `get`, the others being `set` of a random key.
+    #[clap(long, default_value_t = 0.8)]
+    get_ratio: f64,
+
+    /// Seconds measured, after the warm-up.
+    #[clap(long, default_value_t = 10.0)]
+    duration: f64,
+
+    /// Seconds at the start whose requests are not recorded.
+    #[clap(long, default_value_t = 1.0)]
+    warmup: f64,
+
+    /// Write the results to this file as JSON.
+    #[clap(long)]
+    json: Option<String>,
+
+    /// Also store the results in this directory in the format read by `bench-compare`.
+    #[clap(long)]
+    store: Option<PathBuf>,
+
+    /// Name of the server under test, which `bench-compare` matches runs by.
+    #[clap(long, default_value = "unknown")]
+    backend: String,
+}
+
+#[derive(Default)]
+struct Results {
+    get: Histogram,
+    set: Histogram,
+    hits: u64,
+}
+
+impl Results {
+    fn merge(&mut self, other: &Results) {
+        self.get.merge(&other.get);
+        self.set.merge(&other.set);
+        self.hits += other.hits;
+    }
+}
+
+// Latencies are in nanoseconds.
+#[derive(Serialize)]
+struct Summary {
+    ops_per_second: f64,
+    gets: u64,
+    sets: u64,
+    hit_ratio: f64,
+    get: Latency,
+    set: Latency,
+}
+
+// A xorshift generator, so that picking a key costs a few instructions.
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+struct Request {
+    sent: Instant,
+    get: bool,
+}
+
+struct Connection {
+    stream: TcpStream,
+    requests: VecDeque<Request>,
+    out: Vec<u8>,
+    written: usize,
+    partial: Vec<u8>,
+}
+
+fn ppoll(pollfds: &mut [libc::pollfd], timeout: Duration) -> io::Result<()> {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos().into(),
+    };
+    let ret = unsafe {
+        libc::ppoll(
+            pollfds.as_mut_ptr(),
+            pollfds.len() as libc::nfds_t,
+            &timeout,
+            ptr::null(),
+        )
+    };
+    if ret == -1 {
+        let err = io::Error::last_os_error();
+        if err.kind() != io::ErrorKind::Interrupted {
+            return Err(err);
+        }
+    }
+    Ok(())
+}
+
+fn key(i: u64) -> String {
+    format!("key:{i:010}")
+}
+
+fn push_set(out: &mut Vec<u8>, key: &str, value: &[u8], noreply: bool) {
+    let noreply = if noreply { " noreply" } else { "" };
+    write!(out, "set {key} 0 0 {}{noreply}\r\n", value.len()).unwrap();
+    out.extend_from_slice(value);
+    out.extend_from_slice(b"\r\n");
+}
+
+// Sets every key on a single connection and waits until the server executed all of them.
+fn preload(connect: &str, keys: usize, value: &[u8]) {
+    let mut stream = TcpStream::connect(connect).expect("failed to connect");
+    let mut out = Vec::new();
+    for i in 0..keys {
+        push_set(&mut out, &key(i as u64), value, true);
+        if out.len() > 1 << 20 {
+            stream.write_all(&out).expect("failed to send");
+            out.clear();
+        }
+    }
+    // Commands of a connection are executed in order, so the reply to this one comes last.
+    out.extend_from_slice(b"get preload-done\r\n");
+    stream.write_all(&out).expect("failed to send");
+    let mut reply = [0; 5];
+    stream.read_exact(&mut reply).expect("failed to receive");
+    assert_eq!(&reply, b"END\r\n", "unexpected reply to the preload");
+}
+
+impl Connection {
+    fn queue(&mut self, rng: &mut Rng, args: &Args, value: &[u8]) {
+        let get = (rng.next() % 1_000_000) as f64 / 1e6 < args.get_ratio;
+        let key = key(rng.next() % args.keys as u64);
+        if get {
+            write!(self.out, "get {key}\r\n").unwrap();
+        } else {
+            push_set(&mut self.out, &key, value, false);
+        }
+        self.requests.push_back(Request {
+            sent: Instant::now(),
+            get,
+        });
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        while self.written < self.out.len() {
+            match self.stream.write(&self.out[self.written..]) {
+                Ok(n) => self.written += n,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => return Err(err),
+            }
+        }
+        if self.written == self.out.len() {
+            self.out.clear();
+            self.written = 0;
+        }
+        Ok(())
+    }
+
+    // Reads what arrived, records the latency of every complete reply if `record`, and returns
+    // the number of replies.
+    fn receive(&mut self, buf: &mut [u8], record: bool, results: &mut Results) -> usize {
+        let now = Instant::now();
+        let mut replies = 0;
+        loop {
+            let n = match self.stream.read(buf) {
+                Ok(0) => panic!("the server closed the connection"),
+                Ok(n) => n,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => panic!("failed to receive: {err}"),
+            };
+            self.partial.extend_from_slice(&buf[..n]);
+            let mut offset = 0;
+            while let Some((len, hit)) = parse_reply(&self.partial[offset..]) {
+                let request = self.requests.pop_front().expect("reply without a request");
+                if record {
+                    let latency = (now - request.sent).as_nanos() as u64;
+                    if request.get {
+                        results.get.record(latency);
+                        results.hits += u64::from(hit);
+                    } else {
+                        assert!(self.partial[offset..].starts_with(b"STORED\r\n"));
+                        results.set.record(latency);
+                    }
+                }
+                offset += len;
+                replies += 1;
+            }
+            self.partial.drain(..offset);
+        }
+        replies
+    }
+}
+
+// Keeps `depth` requests in flight on every connection, replacing every answered one with a new
+// one, until `end`. Only requests answered after `record_from` are recorded.
+fn run(
+    streams: Vec<TcpStream>,
+    args: &Args,
+    seed: u64,
+    record_from: Instant,
+    end: Instant,
+) -> Results {
+    let value = vec![b'v'; args.value_size];
+    let mut rng = Rng(seed | 1);
+    let mut connections: Vec<_> = streams
+        .into_iter()
+        .map(|stream| {
+            stream.set_nodelay(true).unwrap();
+            stream.set_nonblocking(true).unwrap();
+            Connection {
+                stream,
+                requests: VecDeque::new(),
+                out: Vec::new(),
+                written: 0,
+                partial: Vec::new(),
+            }
+        })
+        .collect();
+    for connection in &mut connections {
+        for _ in 0..args.depth {
+            connection.queue(&mut rng, args, &value);
+        }
+    }
+    let mut pollfds: Vec<_> = connections
+        .iter()
+        .map(|connection| libc::pollfd {
+            fd: connection.stream.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        })
+        .collect();
+    let mut recv_buf = vec![0; 65536];
+    let mut results = Results::default();
+
+    loop {
+        let now = Instant::now();
+        if now >= end {
+            break;
+        }
+        for (connection, pollfd) in connections.iter_mut().zip(&mut pollfds) {
+            connection.flush().expect("failed to send");
+            pollfd.events = if connection.out.is_empty() {
+                libc::POLLIN
+            } else {
+                libc::POLLIN | libc::POLLOUT
+            };
+        }
+        ppoll(&mut pollfds, end - now).expect("failed to poll");
+        let record = Instant::now() >= record_from;
+        for (connection, pollfd) in connections.iter_mut().zip(&pollfds) {
+            if pollfd.revents & libc::POLLIN != 0 {
+                let replies = connection.receive(&mut recv_buf, record, &mut results);
+                for _ in 0..replies {
+                    connection.queue(&mut rng, args, &value);
+                }
+            }
+        }
+    }
+    results
+}
+
+fn micros(nanos: u64) -> f64 {
+    nanos as f64 / 1e3
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.threads > 0 && args.connections >= args.threads);
+    assert!(args.depth > 0 && args.keys > 0);
+
+    let value = vec![b'v'; args.value_size];
+    preload(&args.connect, args.keys, &value);
+    eprintln!("set {} keys of {} B", args.keys, args.value_size);
+
+    let mut streams: Vec<Vec<TcpStream>> = (0..args.threads).map(|_| Vec::new()).collect();
+    for i in 0..args.connections {
+        let stream = TcpStream::connect(&args.connect).expect("failed to connect");
+        streams[i % args.threads].push(stream);
+    }
+    let record_from = Instant::now() + Duration::from_secs_f64(args.warmup);
+    let end = record_from + Duration::from_secs_f64(args.duration);
+    let mut results = Results::default();
+    thread::scope(|s| {
+        let workers: Vec<_> = streams
+            .into_iter()
+            .zip(1..)
+            .map(|(streams, seed)| {
+                let args = &args;
+                s.spawn(move || run(streams, args, seed, record_from, end))
+            })
+            .collect();
+        for worker in workers {
+            results.merge(&worker.join().unwrap());
+        }
+    });
+
+    let (gets, sets) = (results.get.count(), results.set.count());
+    let ops_per_second = (gets + sets) as f64 / args.duration;
+    let hit_ratio = results.hits as f64 / gets.max(1) as f64;
+    println!(
+        "{ops_per_second:.0} ops/s ({gets} gets, {sets} sets, {:.1}% hits) \
+         get p50 {:.1} p99 {:.1} p99.9 {:.1} us, set p50 {:.1} p99 {:.1} p99.9 {:.1} us",
+        hit_ratio * 100.0,
+        micros(results.get.percentile(50.0)),
+        micros(results.get.percentile(99.0)),
+        micros(results.get.percentile(99.9)),
+        micros(results.set.percentile(50.0)),
+        micros(results.set.percentile(99.0)),
+        micros(results.set.percentile(99.9)),
+    );
+
+    if let Some(path) = &args.json {
+        let summary = Summary {
+            ops_per_second,
+            gets,
+            sets,
+            hit_ratio,
+            get: Latency::new(&results.get),
+            set: Latency::new(&results.set),
+        };
+        let file = File::create(path).expect("failed to create the JSON file");
+        serde_json::to_writer_pretty(file, &summary).unwrap();
+    }
+    if let Some(dir) = &args.store {
+        let mut all = results.get.clone();
+        all.merge(&results.set);
+        let mut stored = Run::new("kv-client");
+        stored.records.push(Record {
+            backend: args.backend.clone(),
+            config: BTreeMap::from([
+                ("connections".to_string(), args.connections.to_string()),
+                ("threads".to_string(), args.threads.to_string()),
+                ("depth".to_string(), args.depth.to_string()),
+                ("keys".to_string(), args.keys.to_string()),
+                ("value_size".to_string(), args.value_size.to_string()),
+                ("get_ratio".to_string(), args.get_ratio.to_string()),
+            ]),
+            throughput_unit: "ops/s".to_string(),
+            throughput: vec![ops_per_second],
+            latency: vec![Latency::new(&all)],
+            cpu: Vec::new(),
+        });
+        let path = stored.store(dir).expect("failed to store the run");
+        eprintln!("stored the run in {}", path.display());
+    }
+}
@@ -0,0 +1,422 @@
+use std::{
+    collections::{BTreeMap, VecDeque},
+    fs::File,
+    io::{self, Read, Write},
+    net::TcpStream,
+    os::fd::AsRawFd,
+    path::PathBuf,
+    ptr, thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::{
+    histogram::Histogram,
+    results::{Latency, Record, Run},
+};
+use serde::Serialize;
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: String,
+
+    /// Total number of connections, spread round-robin across threads.
+    #[clap(short = 'n', long, default_value_t = 16)]
+    connections: usize,
+
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    /// Size of every request in bytes. The server must be started with `--reply`, which echoes
+    /// them back.
+    #[clap(short, long, default_value_t = 64)]
+    size: usize,
+
+    /// Comma-separated target request rates in requests per second for all threads combined
+    /// (accepts K/M/G suffixes). The sweep stops at the first rate the server cannot sustain.
+    #[clap(
+        short,
+        long,
+        value_parser = parse_size,
+        value_delimiter = ',',
+        default_value = "10k,20k,50k,100k,200k,500k,1M"
+    )]
+    rates: Vec<u64>,
+
+    /// Seconds measured at every rate, after the warm-up.
+    #[clap(short, long, default_value_t = 10.0)]
+    duration: f64,
+
+    /// Seconds at the start of every rate whose requests are not recorded.
+    #[clap(long, default_value_t = 2.0)]
+    warmup: f64,
+
+    /// Seconds to wait for outstanding replies at the end of every rate.
+    #[clap(long, default_value_t = 1.0)]
+    drain: f64,
+
+    /// Write the results of every rate to this file as JSON.
+    #[clap(long)]
+    json: Option<String>,
+
+    /// Also store the results in this directory in the format read by `bench-compare`.
+    #[clap(long)]
+    store: Option<PathBuf>,
+
+    /// Name of the server under test, which `bench-compare` matches runs by.
+    #[clap(long, default_value = "unknown")]
+    backend: String,
+}
+
+fn parse_size(s: &str) -> Result<u64, String> {
+    let (digits, multiplier) = match s.as_bytes().last() {
+        Some(b'k' | b'K') => (&s[..s.len() - 1], 1_000),
+        Some(b'm' | b'M') => (&s[..s.len() - 1], 1_000_000),
+        Some(b'g' | b'G') => (&s[..s.len() - 1], 1_000_000_000),
+        _ => (s, 1),
+    };
+    let value: f64 = digits.parse().map_err(|err| format!("{err}"))?;
+    Ok((value * multiplier as f64) as u64)
+}
+
+struct Request {
+    // When the request should have been sent according to the schedule.
+    intended: Instant,
+    // When its last byte was handed to the kernel.
+    sent: Option<Instant>,
+    // Offset of the end of the request in the byte stream of its connection.
+    end: u64,
+}
+
+struct Connection {
+    stream: TcpStream,
+    requests: VecDeque<Request>,
+    // Number of requests at the front of `requests` that are completely written.
+    stamped: usize,
+    queued: u64,
+    written: u64,
+    received: u64,
+}
+
+#[derive(Default)]
+struct Results {
+    // Latency from the intended send time, which accounts for the requests that queued up behind
+    // a stall instead of omitting them.
+    corrected: Histogram,
+    // Latency from the actual send time, which is what a closed-loop client would measure.
+    uncorrected: Histogram,
+    completed: u64,
+    // Replies received before the end of the schedule, which measure the sustained rate.
+    in_window: u64,
+    timeouts: u64,
+}
+
+impl Results {
+    fn merge(&mut self, other: &Results) {
+        self.corrected.merge(&other.corrected);
+        self.uncorrected.merge(&other.uncorrected);
+        self.completed += other.completed;
+        self.in_window += other.in_window;
+        self.timeouts += other.timeouts;
+    }
+}
+
+#[derive(Serialize)]
+struct Percentiles {
+    p50: u64,
+    p90: u64,
+    p99: u64,
+    p999: u64,
+    max: u64,
+    mean: f64,
+}
+
+impl Percentiles {
+    fn new(histogram: &Histogram) -> Self {
+        Percentiles {
+            p50: histogram.percentile(50.0),
+            p90: histogram.percentile(90.0),
+            p99: histogram.percentile(99.0),
+            p999: histogram.percentile(99.9),
+            max: histogram.max(),
+            mean: histogram.mean(),
+        }
+    }
+}
+
+// Latencies are in nanoseconds.
+#[derive(Serialize)]
+struct Level {
+    target_rate: u64,
+    achieved_rate: f64,
+    completed: u64,
+    timeouts: u64,
+    corrected: Percentiles,
+    uncorrected: Percentiles,
+}
+
+fn ppoll(pollfds: &mut [libc::pollfd], timeout: Duration) -> io::Result<()> {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos().into(),
+    };
+    let ret = unsafe {
+        libc::ppoll(
+            pollfds.as_mut_ptr(),
+            pollfds.len() as libc::nfds_t,
+            &timeout,
+            ptr::null(),
+        )
+    };
+    if ret == -1 {
+        let err = io::Error::last_os_error();
+        if err.kind() != io::ErrorKind::Interrupted {
+            return Err(err);
+        }
+    }
+    Ok(())
+}
+
+struct Schedule {
+    start: Instant,
+    interval: Duration,
+    // Requests intended before this instant are not recorded.
+    record_from: Instant,
+    end: Instant,
+    drain: Duration,
+}
+
+impl Connection {
+    fn flush(&mut self, buf: &[u8]) -> io::Result<()> {
+        while self.written < self.queued {
+            let len = buf.len().min((self.queued - self.written) as usize);
+            match self.stream.write(&buf[..len]) {
+                Ok(n) => self.written += n as u64,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => return Err(err),
+            }
+        }
+        let now = Instant::now();
+        while let Some(request) = self.requests.get_mut(self.stamped) {
+            if request.end > self.written {
+                break;
+            }
+            request.sent = Some(now);
+            self.stamped += 1;
+        }
+        Ok(())
+    }
+
+    fn receive(&mut self, buf: &mut [u8], schedule: &Schedule, results: &mut Results) {
+        loop {
+            match self.stream.read(buf) {
+                Ok(0) => panic!("the server closed the connection"),
+                Ok(n) => self.received += n as u64,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => panic!("failed to receive: {err}"),
+            }
+        }
+        let now = Instant::now();
+        while let Some(request) = self.requests.front() {
+            if request.end > self.received {
+                break;
+            }
+            // The reply cannot arrive before the whole request was written.
+            let sent = request.sent.unwrap();
+            if request.intended >= schedule.record_from {
+                results
+                    .corrected
+                    .record((now - request.intended).as_nanos() as u64);
+                results.uncorrected.record((now - sent).as_nanos() as u64);
+                results.completed += 1;
+                results.in_window += u64::from(now <= schedule.end);
+            }
+            self.requests.pop_front();
+            self.stamped -= 1;
+        }
+    }
+}
+
+// Sends requests on `streams` at the times given by `schedule`, regardless of whether the replies
+// to previous requests arrived, so that a stall of the server delays the replies of every request
+// scheduled meanwhile instead of delaying the requests themselves.
+fn run(streams: Vec<TcpStream>, size: usize, schedule: &Schedule) -> Results {
+    let mut connections: Vec<_> = streams
+        .into_iter()
+        .map(|stream| {
+            stream.set_nodelay(true).unwrap();
+            stream.set_nonblocking(true).unwrap();
+            Connection {
+                stream,
+                requests: VecDeque::new(),
+                stamped: 0,
+                queued: 0,
+                written: 0,
+                received: 0,
+            }
+        })
+        .collect();
+    let mut pollfds: Vec<_> = connections
+        .iter()
+        .map(|connection| libc::pollfd {
+            fd: connection.stream.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        })
+        .collect();
+    let request_buf = vec![0xa5; size.max(65536)];
+    let mut recv_buf = vec![0; 65536];
+    let mut results = Results::default();
+
+    let mut next = 0u32;
+    loop {
+        let now = Instant::now();
+        let mut due = schedule.start + schedule.interval * next;
+        while due <= now && due < schedule.end {
+            let connection = &mut connections[next as usize % pollfds.len()];
+            connection.queued += size as u64;
+            connection.requests.push_back(Request {
+                intended: due,
+                sent: None,
+                end: connection.queued,
+            });
+            next += 1;
+            due = schedule.start + schedule.interval * next;
+        }
+
+        let outstanding = connections.iter().any(|c| !c.requests.is_empty());
+        let deadline = if due < schedule.end {
+            due
+        } else if outstanding {
+            schedule.end + schedule.drain
+        } else {
+            break;
+        };
+        if now >= deadline {
+            // Only reached once the drain timed out.
+            break;
+        }
+
+        for (connection, pollfd) in connections.iter_mut().zip(&mut pollfds) {
+            connection.flush(&request_buf).expect("failed to send");
+            pollfd.events = if connection.written < connection.queued {
+                libc::POLLIN | libc::POLLOUT
+            } else {
+                libc::POLLIN
+            };
+        }
+        ppoll(
+            &mut pollfds,
+            deadline.saturating_duration_since(Instant::now()),
+        )
+        .expect("failed to poll");
+        for (connection, pollfd) in connections.iter_mut().zip(&pollfds) {
+            if pollfd.revents & libc::POLLIN != 0 {
+                connection.receive(&mut recv_buf, schedule, &mut results);
+            }
+        }
+    }
+
+    results.timeouts = connections
+        .iter()
+        .flat_map(|c| &c.requests)
+        .filter(|request| request.intended >= schedule.record_from)
+        .count() as u64;
+    results
+}
+
+fn micros(nanos: u64) -> f64 {
+    nanos as f64 / 1e3
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.threads > 0 && args.connections >= args.threads);
+
+    let mut levels = Vec::new();
+    let mut stored = Run::new("latency-client");
+    for &rate in &args.rates {
+        let mut streams: Vec<Vec<TcpStream>> = (0..args.threads).map(|_| Vec::new()).collect();
+        for i in 0..args.connections {
+            let stream = TcpStream::connect(&args.connect).expect("failed to connect");
+            streams[i % args.threads].push(stream);
+        }
+
+        let start = Instant::now();
+        let record_from = start + Duration::from_secs_f64(args.warmup);
+        let schedule = Schedule {
+            start,
+            // Every thread runs its own schedule at its share of the rate.
+            interval: Duration::from_secs_f64(args.threads as f64 / rate as f64),
+            record_from,
+            end: record_from + Duration::from_secs_f64(args.duration),
+            drain: Duration::from_secs_f64(args.drain),
+        };
+
+        let mut results = Results::default();
+        thread::scope(|s| {
+            let workers: Vec<_> = streams
+                .into_iter()
+                .map(|streams| {
+                    let schedule = &schedule;
+                    s.spawn(move || run(streams, args.size, schedule))
+                })
+                .collect();
+            for worker in workers {
+                results.merge(&worker.join().unwrap());
+            }
+        });
+
+        let achieved_rate = results.in_window as f64 / args.duration;
+        let c = &results.corrected;
+        println!(
+            "target {rate:>9} req/s achieved {achieved_rate:>11.0} req/s \
+             p50 {:>9.1} p99 {:>9.1} p99.9 {:>9.1} max {:>9.1} us \
+             (uncorrected p99 {:>9.1} max {:>9.1} us) timeouts {}",
+            micros(c.percentile(50.0)),
+            micros(c.percentile(99.0)),
+            micros(c.percentile(99.9)),
+            micros(c.max()),
+            micros(results.uncorrected.percentile(99.0)),
+            micros(results.uncorrected.max()),
+            results.timeouts,
+        );
+        levels.push(Level {
+            target_rate: rate,
+            achieved_rate,
+            completed: results.completed,
+            timeouts: results.timeouts,
+            corrected: Percentiles::new(&results.corrected),
+            uncorrected: Percentiles::new(&results.uncorrected),
+        });
+        stored.records.push(Record {
+            backend: args.backend.clone(),
+            config: BTreeMap::from([
+                ("connections".to_string(), args.connections.to_string()),
+                ("threads".to_string(), args.threads.to_string()),
+                ("size".to_string(), args.size.to_string()),
+                ("rate".to_string(), rate.to_string()),
+            ]),
+            throughput_unit: "req/s".to_string(),
+            throughput: vec![achieved_rate],
+            latency: vec![Latency::new(&results.corrected)],
+            cpu: Vec::new(),
+        });
+
+        // Beyond saturation the queues only grow, so higher rates measure the length of the run.
+        if results.timeouts > 0 || achieved_rate < 0.95 * rate as f64 {
+            println!("saturated at {rate} req/s");
+            break;
+        }
+    }
+
+    if let Some(path) = &args.json {
+        let file = File::create(path).expect("failed to create the JSON file");
+        serde_json::to_writer_pretty(file, &levels).unwrap();
+    }
+    if let Some(dir) = &args.store {
+        let path = stored.store(dir).expect("failed to store the run");
+        eprintln!("stored the run in {}", path.display());
+    }
+}
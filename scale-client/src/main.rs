@@ -0,0 +1,400 @@
+use std::{
+    fs, io, mem,
+    net::{Ipv4Addr, SocketAddrV4},
+    os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use common::{
+    histogram::Histogram,
+    net::{raise_fd_limit, setsockopt},
+};
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: SocketAddrV4,
+
+    /// Comma-separated numbers of connections at which to take measurements (accepts K/M/G
+    /// suffixes). The last one is the total number of connections opened.
+    #[clap(
+        short = 'n',
+        long,
+        value_parser = parse_size,
+        value_delimiter = ',',
+        default_value = "10k,100k,250k,500k,1M"
+    )]
+    connections: Vec<u64>,
+
+    /// First source address. Connections are spread over consecutive addresses from this one,
+    /// each of which provides one range of ephemeral ports; any address in 127.0.0.0/8 works for a
+    /// server on loopback.
+    #[clap(long, default_value = "127.0.0.2")]
+    source_base: Ipv4Addr,
+
+    /// Connections per source address, by default the size of `net.ipv4.ip_local_port_range`.
+    #[clap(long)]
+    ports_per_source: Option<u64>,
+
+    /// Number of connects in flight.
+    #[clap(long, default_value_t = 512)]
+    parallel: usize,
+
+    /// Process ID of the server whose resident memory is reported.
+    #[clap(long)]
+    server_pid: Option<u32>,
+
+    /// Number of round trips on random idle connections at every measurement. The server must be
+    /// started with `--reply`.
+    #[clap(long, default_value_t = 1000)]
+    pings: usize,
+
+    /// Size of every ping in bytes.
+    #[clap(short, long, default_value_t = 64)]
+    size: usize,
+
+    /// Keep the connections open for this many seconds after the last measurement.
+    #[clap(long, default_value_t = 0.0)]
+    hold: f64,
+}
+
+fn parse_size(s: &str) -> Result<u64, String> {
+    let (digits, multiplier) = match s.as_bytes().last() {
+        Some(b'k' | b'K') => (&s[..s.len() - 1], 1_000),
+        Some(b'm' | b'M') => (&s[..s.len() - 1], 1_000_000),
+        Some(b'g' | b'G') => (&s[..s.len() - 1], 1_000_000_000),
+        _ => (s, 1),
+    };
+    let value: f64 = digits.parse().map_err(|err| format!("{err}"))?;
+    Ok((value * multiplier as f64) as u64)
+}
+
+fn sockaddr(addr: &SocketAddrV4) -> libc::sockaddr_in {
+    let mut sin: libc::sockaddr_in = unsafe { mem::zeroed() };
+    sin.sin_family = libc::AF_INET as libc::sa_family_t;
+    sin.sin_port = addr.port().to_be();
+    sin.sin_addr.s_addr = u32::from(*addr.ip()).to_be();
+    sin
+}
+
+// Starts a nonblocking connect from `source`, leaving the choice of the port to `connect` so that
+// the kernel can reuse it for other destinations.
+fn start_connect(dest: &SocketAddrV4, source: Ipv4Addr) -> io::Result<OwnedFd> {
+    let ret = unsafe {
+        libc::socket(
+            libc::AF_INET,
+            libc::SOCK_STREAM | libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC,
+            0,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let socket = unsafe { OwnedFd::from_raw_fd(ret) };
+    setsockopt(
+        &socket,
+        libc::IPPROTO_IP,
+        libc::IP_BIND_ADDRESS_NO_PORT,
+        &1i32,
+    )?;
+
+    let len = mem::size_of::<libc::sockaddr_in>() as libc::socklen_t;
+    let source = sockaddr(&SocketAddrV4::new(source, 0));
+    let ret = unsafe { libc::bind(socket.as_raw_fd(), &source as *const _ as *const _, len) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let dest = sockaddr(dest);
+    let ret = unsafe { libc::connect(socket.as_raw_fd(), &dest as *const _ as *const _, len) };
+    if ret == -1 {
+        let err = io::Error::last_os_error();
+        if err.raw_os_error() != Some(libc::EINPROGRESS) {
+            return Err(err);
+        }
+    }
+    Ok(socket)
+}
+
+fn socket_error(fd: &impl AsRawFd) -> io::Result<()> {
+    let mut err = 0i32;
+    let mut len = mem::size_of_val(&err) as libc::socklen_t;
+    let ret = unsafe {
+        libc::getsockopt(
+            fd.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_ERROR,
+            &mut err as *mut _ as *mut _,
+            &mut len,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    if err != 0 {
+        return Err(io::Error::from_raw_os_error(err));
+    }
+    Ok(())
+}
+
+fn epoll_ctl(epoll_fd: &impl AsRawFd, op: i32, fd: RawFd, events: u32) -> io::Result<()> {
+    let mut event = libc::epoll_event {
+        events,
+        u64: fd as u64,
+    };
+    let ret = unsafe { libc::epoll_ctl(epoll_fd.as_raw_fd(), op, fd, &mut event) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+// Opens connections until there are `target`, keeping `parallel` connects in flight. Stops at the
+// first failure, which usually means a limit was reached.
+fn open_connections(
+    args: &Args,
+    ports_per_source: u64,
+    connections: &mut Vec<OwnedFd>,
+    target: u64,
+) -> io::Result<()> {
+    let ret = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let epoll_fd = unsafe { OwnedFd::from_raw_fd(ret) };
+
+    let mut pending: Vec<Option<OwnedFd>> = Vec::new();
+    let mut in_flight = 0;
+    let mut started = connections.len() as u64;
+    let mut events = Vec::with_capacity(1024);
+    while (connections.len() as u64) < target {
+        while in_flight < args.parallel && started < target {
+            let source = u32::from(args.source_base) + (started / ports_per_source) as u32;
+            let socket = start_connect(&args.connect, Ipv4Addr::from(source))?;
+            let fd = socket.as_raw_fd();
+            epoll_ctl(&epoll_fd, libc::EPOLL_CTL_ADD, fd, libc::EPOLLOUT as u32)?;
+            if pending.len() <= fd as usize {
+                pending.resize_with(fd as usize + 1, || None);
+            }
+            pending[fd as usize] = Some(socket);
+            in_flight += 1;
+            started += 1;
+        }
+
+        let ret = unsafe {
+            libc::epoll_wait(
+                epoll_fd.as_raw_fd(),
+                events.as_mut_ptr(),
+                events.capacity() as i32,
+                1000,
+            )
+        };
+        if ret == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        unsafe { events.set_len(ret as usize) };
+        for event in &events {
+            let fd = event.u64 as RawFd;
+            let socket = pending[fd as usize].take().unwrap();
+            in_flight -= 1;
+            epoll_ctl(&epoll_fd, libc::EPOLL_CTL_DEL, fd, 0)?;
+            socket_error(&socket)?;
+            connections.push(socket);
+        }
+    }
+    Ok(())
+}
+
+// Sends `size` bytes on a random idle connection and waits for the echo, `count` times.
+fn ping(connections: &[OwnedFd], count: usize, size: usize, seed: &mut u64) -> Histogram {
+    let request = vec![0xa5u8; size];
+    let mut reply = vec![0u8; size];
+    let mut histogram = Histogram::default();
+    for _ in 0..count {
+        // xorshift64
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 7;
+        *seed ^= *seed << 17;
+        let fd = connections[(*seed % connections.len() as u64) as usize].as_raw_fd();
+
+        let start = Instant::now();
+        let ret = unsafe { libc::send(fd, request.as_ptr().cast(), size, libc::MSG_NOSIGNAL) };
+        assert_eq!(ret, size as isize, "failed to send a ping");
+        let mut received = 0;
+        while received < size {
+            let mut pollfd = libc::pollfd {
+                fd,
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            let ret = unsafe { libc::poll(&mut pollfd, 1, 1000) };
+            assert!(ret == 1, "no reply to a ping within a second");
+            let ret = unsafe {
+                libc::recv(
+                    fd,
+                    reply[received..].as_mut_ptr().cast(),
+                    size - received,
+                    0,
+                )
+            };
+            assert!(ret > 0, "failed to receive a ping reply");
+            received += ret as usize;
+        }
+        histogram.record(start.elapsed().as_nanos() as u64);
+    }
+    histogram
+}
+
+// Returns the values of the `TCP:` line of `/proc/net/sockstat`, such as `inuse` and `mem`.
+fn sockstat_tcp(key: &str) -> u64 {
+    let sockstat = fs::read_to_string("/proc/net/sockstat").unwrap();
+    let line = sockstat
+        .lines()
+        .find(|line| line.starts_with("TCP:"))
+        .unwrap();
+    let fields: Vec<_> = line.split_whitespace().collect();
+    let i = fields.iter().position(|field| *field == key).unwrap();
+    fields[i + 1].parse().unwrap()
+}
+
+// Slab caches holding the kernel objects of a TCP connection. Reading them requires root.
+const SLAB_CACHES: [&str; 6] = [
+    "TCP",
+    "sock_inode_cache",
+    "dentry",
+    "filp",
+    "eventpoll_epi",
+    "io_kiocb",
+];
+
+fn slab_bytes() -> Option<u64> {
+    let slabinfo = fs::read_to_string("/proc/slabinfo").ok()?;
+    let bytes = slabinfo
+        .lines()
+        .filter_map(|line| {
+            let fields: Vec<_> = line.split_whitespace().collect();
+            if !SLAB_CACHES.contains(fields.first()?) {
+                return None;
+            }
+            // name active_objs num_objs objsize ...
+            let active: u64 = fields.get(1)?.parse().ok()?;
+            let size: u64 = fields.get(3)?.parse().ok()?;
+            Some(active * size)
+        })
+        .sum();
+    Some(bytes)
+}
+
+fn rss_bytes(pid: u32) -> u64 {
+    let status = fs::read_to_string(format!("/proc/{pid}/status")).unwrap();
+    let line = status
+        .lines()
+        .find(|line| line.starts_with("VmRSS:"))
+        .unwrap();
+    let kib: u64 = line.split_whitespace().nth(1).unwrap().parse().unwrap();
+    kib * 1024
+}
+
+#[derive(Clone, Copy)]
+struct Memory {
+    server_rss: Option<u64>,
+    tcp_sockets: u64,
+    tcp_mem: u64,
+    slab: Option<u64>,
+}
+
+impl Memory {
+    fn read(server_pid: Option<u32>) -> Self {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64;
+        Memory {
+            server_rss: server_pid.map(rss_bytes),
+            tcp_sockets: sockstat_tcp("inuse"),
+            tcp_mem: sockstat_tcp("mem") * page_size,
+            slab: slab_bytes(),
+        }
+    }
+}
+
+fn mib(bytes: u64) -> f64 {
+    bytes as f64 / (1 << 20) as f64
+}
+
+fn report(connections: usize, baseline: &Memory, memory: &Memory, pings: &Histogram) {
+    let per_connection = |now: Option<u64>, before: Option<u64>| match (now, before) {
+        (Some(now), Some(before)) => format!(
+            "{:>8.1} MiB {:>6.0} B/conn",
+            mib(now),
+            now.saturating_sub(before) as f64 / connections as f64
+        ),
+        _ => "n/a".to_string(),
+    };
+    let micros = |nanos: u64| nanos as f64 / 1e3;
+    println!(
+        "{connections:>8} conns TCP sockets {} server RSS {} TCP mem {} slab {} ping p50 {:.1} \
+         p99 {:.1} max {:.1} us",
+        memory.tcp_sockets,
+        per_connection(memory.server_rss, baseline.server_rss),
+        per_connection(Some(memory.tcp_mem), Some(baseline.tcp_mem)),
+        per_connection(memory.slab, baseline.slab),
+        micros(pings.percentile(50.0)),
+        micros(pings.percentile(99.0)),
+        micros(pings.max()),
+    );
+}
+
+fn main() {
+    let args = Args::parse();
+
+    let fd_limit = raise_fd_limit().expect("failed to raise the file descriptor limit");
+    let ports_per_source = args.ports_per_source.unwrap_or_else(|| {
+        let range = fs::read_to_string("/proc/sys/net/ipv4/ip_local_port_range").unwrap();
+        let range: Vec<u64> = range
+            .split_whitespace()
+            .map(|port| port.parse().unwrap())
+            .collect();
+        range[1] - range[0] + 1
+    });
+    let target = args.connections.iter().copied().max().unwrap_or(0);
+    println!(
+        "file descriptor limit {fd_limit}, {ports_per_source} connections per source address, \
+         {} source addresses",
+        target.div_ceil(ports_per_source)
+    );
+    if target > fd_limit {
+        eprintln!("warning: the file descriptor limit is lower than {target}");
+    }
+
+    // The kernel numbers describe the whole machine, so on loopback they include the client side
+    // of every connection.
+    let baseline = Memory::read(args.server_pid);
+    let mut connections = Vec::new();
+    let mut seed = 0x2545_f491_4f6c_dd1d;
+    let mut checkpoints = args.connections.clone();
+    checkpoints.sort_unstable();
+    for checkpoint in checkpoints {
+        let start = Instant::now();
+        let ret = open_connections(&args, ports_per_source, &mut connections, checkpoint);
+        if connections.is_empty() {
+            panic!("failed to connect: {}", ret.unwrap_err());
+        }
+        let opened = connections.len();
+        eprintln!(
+            "opened {opened} connections in {:.3}s",
+            start.elapsed().as_secs_f64()
+        );
+        // Let the server finish accepting before measuring it.
+        thread::sleep(Duration::from_secs(1));
+
+        let memory = Memory::read(args.server_pid);
+        let pings = ping(&connections, args.pings, args.size, &mut seed);
+        report(opened, &baseline, &memory, &pings);
+
+        if let Err(err) = ret {
+            eprintln!("stopped at {opened} connections: {err}");
+            break;
+        }
+    }
+
+    thread::sleep(Duration::from_secs_f64(args.hold));
+}
@@ -0,0 +1,297 @@
+use std::{
+    fs::File,
+    io,
+    os::fd::AsRawFd,
+    path::PathBuf,
+    ptr,
+    rc::Rc,
+    time::{SystemTime, UNIX_EPOCH},
+};
+
+use common::metrics::Metrics;
+use io_uring::{opcode::Write, types::Fd, IoUring};
+
+use crate::mmap;
+
+#[derive(clap::Args)]
+pub struct CaptureArgs {
+    /// Capture every received frame to pcapng files named `<capture>-<queue>-<number>.pcapng`.
+    #[clap(long)]
+    pub capture: Option<PathBuf>,
+
+    /// Bytes captured of every frame; the rest is truncated.
+    #[clap(long, default_value_t = 65535)]
+    pub snaplen: u32,
+
+    /// Size of every capture buffer in MiB. A buffer is written once full, or when the socket has
+    /// nothing to receive.
+    #[clap(long, default_value_t = 4)]
+    pub capture_buffer: usize,
+
+    /// Number of capture buffers per thread, filled while the others are written. Frames that
+    /// arrive while all of them are being written are not captured.
+    #[clap(long, default_value_t = 2)]
+    pub capture_buffers: usize,
+
+    /// Start a new file once the current one holds this many MiB, or never with 0.
+    #[clap(long, default_value_t = 0)]
+    pub rotate_size: u64,
+
+    /// Number of files that rotation cycles through, overwriting the oldest, or 0 to keep them
+    /// all.
+    #[clap(long, default_value_t = 0)]
+    pub rotate_files: u64,
+
+    /// Build the capture without writing it, to measure the cost of capturing without the disk.
+    #[clap(long)]
+    pub capture_no_write: bool,
+}
+
+// What every thread needs to set up its capture.
+#[derive(Clone)]
+pub struct CaptureOptions {
+    prefix: PathBuf,
+    snaplen: u32,
+    buffer_size: usize,
+    buffers: usize,
+    rotate_size: u64,
+    rotate_files: u64,
+    write: bool,
+}
+
+impl CaptureOptions {
+    pub fn new(args: &CaptureArgs) -> Option<Self> {
+        let prefix = args.capture.clone()?;
+        assert!(args.snaplen > 0, "--snaplen must be positive");
+        assert!(
+            args.capture_buffer > 0 && args.capture_buffers > 0,
+            "--capture-buffer and --capture-buffers must be positive"
+        );
+        Some(CaptureOptions {
+            prefix,
+            snaplen: args.snaplen,
+            buffer_size: args.capture_buffer << 20,
+            buffers: args.capture_buffers,
+            rotate_size: args.rotate_size << 20,
+            rotate_files: args.rotate_files,
+            write: !args.capture_no_write,
+        })
+    }
+}
+
+// Block types of pcapng.
+const SECTION_HEADER: u32 = 0x0a0d_0d0a;
+const INTERFACE_DESCRIPTION: u32 = 1;
+const ENHANCED_PACKET: u32 = 6;
+const LINKTYPE_ETHERNET: u16 = 1;
+// `if_tsresol` of 9: timestamps are in nanoseconds.
+const IF_TSRESOL: u16 = 9;
+
+// Length of an enhanced packet block without its data.
+const PACKET_OVERHEAD: usize = 32;
+
+struct Buffer {
+    ptr: *mut u8,
+    len: usize,
+    // The file the buffer is written to, which is closed once the last write to it completes.
+    file: Option<Rc<File>>,
+}
+
+impl Buffer {
+    fn put(&mut self, bytes: &[u8]) {
+        unsafe { ptr::copy_nonoverlapping(bytes.as_ptr(), self.ptr.add(self.len), bytes.len()) };
+        self.len += bytes.len();
+    }
+
+    fn put_u16(&mut self, value: u16) {
+        self.put(&value.to_ne_bytes());
+    }
+
+    fn put_u32(&mut self, value: u32) {
+        self.put(&value.to_ne_bytes());
+    }
+
+    // A section header block followed by the description of the only interface of the section.
+    fn put_headers(&mut self, snaplen: u32) {
+        self.put_u32(SECTION_HEADER);
+        self.put_u32(28);
+        self.put_u32(0x1a2b_3c4d);
+        self.put_u16(1);
+        self.put_u16(0);
+        // The length of the section is not known in advance.
+        self.put(&(-1i64).to_ne_bytes());
+        self.put_u32(28);
+
+        self.put_u32(INTERFACE_DESCRIPTION);
+        self.put_u32(32);
+        self.put_u16(LINKTYPE_ETHERNET);
+        self.put_u16(0);
+        self.put_u32(snaplen);
+        self.put_u16(IF_TSRESOL);
+        self.put_u16(1);
+        self.put(&[9, 0, 0, 0]);
+        // opt_endofopt
+        self.put_u32(0);
+        self.put_u32(32);
+    }
+
+    fn put_packet(&mut self, frame: &[u8], captured: usize, timestamp: u64) {
+        let padded = captured.next_multiple_of(4);
+        let block_len = (PACKET_OVERHEAD + padded) as u32;
+        self.put_u32(ENHANCED_PACKET);
+        self.put_u32(block_len);
+        // Interface 0.
+        self.put_u32(0);
+        self.put_u32((timestamp >> 32) as u32);
+        self.put_u32(timestamp as u32);
+        self.put_u32(captured as u32);
+        self.put_u32(frame.len() as u32);
+        self.put(&frame[..captured]);
+        self.put(&[0; 3][..padded - captured]);
+        self.put_u32(block_len);
+    }
+}
+
+// Writes the frames of one queue to pcapng files. Frames are appended to the active buffer while
+// the others are written by io_uring, so that receiving never waits for the disk.
+pub struct Capture {
+    options: CaptureOptions,
+    queue: u32,
+    io_uring: IoUring,
+    buffers: Vec<Buffer>,
+    free: Vec<usize>,
+    active: Option<usize>,
+    file: Option<Rc<File>>,
+    // Number of the current file and offset of the next write to it.
+    number: u64,
+    offset: u64,
+    // Timestamp of the frames of the current burst, in nanoseconds since the epoch.
+    timestamp: u64,
+}
+
+impl Capture {
+    pub fn new(options: CaptureOptions, queue: u32) -> io::Result<Self> {
+        let io_uring = IoUring::new(options.buffers.next_power_of_two() as u32)?;
+        let buffers = (0..options.buffers)
+            .map(|_| {
+                Ok(Buffer {
+                    ptr: mmap(None, options.buffer_size, 0)?,
+                    len: 0,
+                    file: None,
+                })
+            })
+            .collect::<io::Result<Vec<_>>>()?;
+        Ok(Capture {
+            free: (0..options.buffers).rev().collect(),
+            options,
+            queue,
+            io_uring,
+            buffers,
+            active: None,
+            file: None,
+            number: 0,
+            offset: 0,
+            timestamp: 0,
+        })
+    }
+
+    // Timestamps the frames recorded until the next call. The clock is read once per burst, which
+    // is as precise as a frame that waited in the RX ring anyway.
+    pub fn start_burst(&mut self) {
+        let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap();
+        self.timestamp = now.as_nanos() as u64;
+    }
+
+    fn open_next(&mut self) -> io::Result<Rc<File>> {
+        let mut number = self.number;
+        if self.options.rotate_files > 0 {
+            number %= self.options.rotate_files;
+        }
+        let mut path = self.options.prefix.clone().into_os_string();
+        path.push(format!("-{}-{number}.pcapng", self.queue));
+        self.number += 1;
+        self.offset = 0;
+        Ok(Rc::new(File::create(path)?))
+    }
+
+    // Returns the buffer to append to, with a new file started if the current one is full.
+    fn take_buffer(&mut self, metrics: &Metrics) -> Option<usize> {
+        if self.active.is_none() {
+            self.reap(metrics);
+            let index = self.free.pop()?;
+            let rotate = self.options.rotate_size > 0 && self.offset >= self.options.rotate_size;
+            if self.file.is_none() || rotate {
+                match self.open_next() {
+                    Ok(file) => self.file = Some(file),
+                    Err(err) => panic!("failed to create a capture file: {err}"),
+                }
+                self.buffers[index].put_headers(self.options.snaplen);
+            }
+            self.buffers[index].file = self.file.clone();
+            self.active = Some(index);
+        }
+        self.active
+    }
+
+    pub fn record(&mut self, frame: &[u8], metrics: &Metrics) {
+        let captured = frame.len().min(self.options.snaplen as usize);
+        let block_len = PACKET_OVERHEAD + captured.next_multiple_of(4);
+        if let Some(active) = self.active {
+            if self.buffers[active].len + block_len > self.options.buffer_size {
+                self.flush(metrics);
+            }
+        }
+        let Some(index) = self.take_buffer(metrics) else {
+            metrics.capture_drops.add(1);
+            return;
+        };
+        self.buffers[index].put_packet(frame, captured, self.timestamp);
+        metrics.captured.add(1);
+    }
+
+    // Starts writing the active buffer, if anything was appended to it.
+    pub fn flush(&mut self, metrics: &Metrics) {
+        self.reap(metrics);
+        let Some(index) = self.active.take() else {
+            return;
+        };
+        let buffer = &mut self.buffers[index];
+        if !self.options.write {
+            buffer.len = 0;
+            buffer.file = None;
+            self.free.push(index);
+            return;
+        }
+        let file = buffer.file.as_ref().unwrap();
+        let write = Write::new(Fd(file.as_raw_fd()), buffer.ptr, buffer.len as u32)
+            .offset(self.offset)
+            .build()
+            .user_data(index as u64);
+        self.offset += buffer.len as u64;
+        unsafe { self.io_uring.submission().push(&write).unwrap() };
+        if let Err(err) = self.io_uring.submit() {
+            eprintln!("failed to submit a capture write: {err}");
+            metrics.errors.add(1);
+        }
+    }
+
+    // Takes back the buffers whose writes completed.
+    fn reap(&mut self, metrics: &Metrics) {
+        for cqe in self.io_uring.completion() {
+            let index = cqe.user_data() as usize;
+            let buffer = &mut self.buffers[index];
+            let result = cqe.result();
+            if result < 0 || result as usize != buffer.len {
+                // For example because the disk is full; the rest of the buffer is lost.
+                eprintln!("capture write failed: {result}");
+                metrics.errors.add(1);
+            }
+            if result > 0 {
+                metrics.disk_bytes.add(result as u64);
+            }
+            buffer.len = 0;
+            buffer.file = None;
+            self.free.push(index);
+        }
+    }
+}
@@ -0,0 +1,484 @@
+use std::{
+    io, mem,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd},
+    ptr, slice,
+    sync::{
+        atomic::{AtomicU32, Ordering},
+        Arc,
+    },
+};
+
+use common::{
+    engine::{Engine, Handler},
+    metrics::Metrics,
+};
+
+mod capture;
+mod replay;
+
+pub use capture::{Capture, CaptureArgs, CaptureOptions};
+pub use replay::{Inject, Replay, ReplayArgs, Trace};
+
+// Constants of `linux/bpf.h` that libc does not define.
+const BPF_MAP_CREATE: i32 = 0;
+const BPF_MAP_UPDATE_ELEM: i32 = 2;
+const BPF_PROG_LOAD: i32 = 5;
+const BPF_LINK_CREATE: i32 = 28;
+const BPF_MAP_TYPE_XSKMAP: u32 = 17;
+const BPF_PROG_TYPE_XDP: u32 = 6;
+const BPF_XDP: u32 = 37;
+const BPF_PSEUDO_MAP_FD: u8 = 1;
+const BPF_FUNC_REDIRECT_MAP: i32 = 51;
+const XDP_PASS: i32 = 2;
+
+// Every frame of the UMEM holds one packet.
+pub const FRAME_SIZE: usize = 4096;
+
+// Prefixes of `union bpf_attr` for the commands used here. The kernel zeroes the rest.
+#[repr(C)]
+struct MapCreateAttr {
+    map_type: u32,
+    key_size: u32,
+    value_size: u32,
+    max_entries: u32,
+}
+
+#[repr(C)]
+struct MapUpdateAttr {
+    map_fd: u32,
+    key: u64,
+    value: u64,
+    flags: u64,
+}
+
+#[repr(C)]
+struct ProgLoadAttr {
+    prog_type: u32,
+    insn_cnt: u32,
+    insns: u64,
+    license: u64,
+    log_level: u32,
+    log_size: u32,
+    log_buf: u64,
+}
+
+#[repr(C)]
+struct LinkCreateAttr {
+    prog_fd: u32,
+    target_ifindex: u32,
+    attach_type: u32,
+    flags: u32,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct Insn {
+    code: u8,
+    // Destination register in the low nibble, source register in the high nibble.
+    regs: u8,
+    off: i16,
+    imm: i32,
+}
+
+fn bpf<T>(cmd: i32, attr: &T) -> io::Result<i32> {
+    let ret = unsafe { libc::syscall(libc::SYS_bpf, cmd, attr, mem::size_of::<T>()) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret as i32)
+}
+
+fn bpf_fd<T>(cmd: i32, attr: &T) -> io::Result<OwnedFd> {
+    let fd = bpf(cmd, attr)?;
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+// The XDP program, `bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)`: packets go to the
+// socket bound to their queue, or to the kernel stack if there is none.
+fn redirect_program(map_fd: i32) -> [Insn; 6] {
+    let insn = |code, dst: u8, src: u8, off, imm| Insn {
+        code,
+        regs: dst | src << 4,
+        off,
+        imm,
+    };
+    [
+        // r2 = ((struct xdp_md *)r1)->rx_queue_index
+        insn(0x61, 2, 1, 16, 0),
+        // r1 = map
+        insn(0x18, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        insn(0, 0, 0, 0, 0),
+        // r3 = XDP_PASS
+        insn(0xb7, 3, 0, 0, XDP_PASS),
+        insn(0x85, 0, 0, 0, BPF_FUNC_REDIRECT_MAP),
+        // exit
+        insn(0x95, 0, 0, 0, 0),
+    ]
+}
+
+fn load_program(insns: &[Insn]) -> io::Result<OwnedFd> {
+    let license = c"GPL";
+    let mut attr = ProgLoadAttr {
+        prog_type: BPF_PROG_TYPE_XDP,
+        insn_cnt: insns.len() as u32,
+        insns: insns.as_ptr() as u64,
+        license: license.as_ptr() as u64,
+        log_level: 0,
+        log_size: 0,
+        log_buf: 0,
+    };
+    let Err(err) = bpf_fd(BPF_PROG_LOAD, &attr) else {
+        return bpf_fd(BPF_PROG_LOAD, &attr);
+    };
+    // Load it again with the verifier log to explain the failure.
+    let mut log = vec![0u8; 65536];
+    attr.log_level = 1;
+    attr.log_size = log.len() as u32;
+    attr.log_buf = log.as_mut_ptr() as u64;
+    let _ = bpf(BPF_PROG_LOAD, &attr);
+    let len = log.iter().position(|&b| b == 0).unwrap_or(log.len());
+    Err(io::Error::new(
+        err.kind(),
+        format!("{err}: {}", String::from_utf8_lossy(&log[..len])),
+    ))
+}
+
+// The XDP program attached to an interface with the map of the sockets it redirects to. Dropping
+// it detaches the program.
+pub struct Program {
+    map: OwnedFd,
+    _prog: OwnedFd,
+    _link: OwnedFd,
+}
+
+impl Program {
+    // Attaches the program to the interface, with room for sockets on queues `0..queues`.
+    pub fn attach(interface_index: u32, queues: u32) -> io::Result<Self> {
+        let map = bpf_fd(
+            BPF_MAP_CREATE,
+            &MapCreateAttr {
+                map_type: BPF_MAP_TYPE_XSKMAP,
+                key_size: 4,
+                value_size: 4,
+                max_entries: queues,
+            },
+        )?;
+        let prog = load_program(&redirect_program(map.as_raw_fd()))?;
+        // A link detaches the program when its last descriptor is closed, even if the process
+        // crashes. The kernel attaches in driver mode if the driver supports XDP.
+        let link = bpf_fd(
+            BPF_LINK_CREATE,
+            &LinkCreateAttr {
+                prog_fd: prog.as_raw_fd() as u32,
+                target_ifindex: interface_index,
+                attach_type: BPF_XDP,
+                flags: 0,
+            },
+        )?;
+        Ok(Program {
+            map,
+            _prog: prog,
+            _link: link,
+        })
+    }
+
+    fn insert(&self, queue: u32, socket: &OwnedFd) -> io::Result<()> {
+        let fd = socket.as_raw_fd() as u32;
+        bpf(
+            BPF_MAP_UPDATE_ELEM,
+            &MapUpdateAttr {
+                map_fd: self.map.as_raw_fd() as u32,
+                key: &queue as *const u32 as u64,
+                value: &fd as *const u32 as u64,
+                flags: 0,
+            },
+        )?;
+        Ok(())
+    }
+}
+
+fn setsockopt<T>(fd: &OwnedFd, name: i32, value: &T) -> io::Result<()> {
+    let ret = unsafe {
+        libc::setsockopt(
+            fd.as_raw_fd(),
+            libc::SOL_XDP,
+            name,
+            value as *const T as *const libc::c_void,
+            mem::size_of::<T>() as libc::socklen_t,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn mmap(fd: Option<&OwnedFd>, len: usize, offset: u64) -> io::Result<*mut u8> {
+    let (fd, flags) = match fd {
+        Some(fd) => (fd.as_raw_fd(), libc::MAP_SHARED | libc::MAP_POPULATE),
+        None => (
+            -1,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+        ),
+    };
+    let ptr = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            flags,
+            fd,
+            offset as libc::off_t,
+        )
+    };
+    if ptr == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ptr.cast())
+}
+
+// A single-producer single-consumer ring shared with the kernel. The fill ring holds frame
+// addresses and the RX ring descriptors of received packets.
+struct Ring<T> {
+    producer: *const AtomicU32,
+    consumer: *const AtomicU32,
+    descs: *mut T,
+    mask: u32,
+}
+
+impl<T> Ring<T> {
+    fn map(
+        fd: &OwnedFd,
+        offsets: &libc::xdp_ring_offset,
+        size: u32,
+        pgoff: u64,
+    ) -> io::Result<Self> {
+        let len = offsets.desc as usize + size as usize * mem::size_of::<T>();
+        let base = mmap(Some(fd), len, pgoff)?;
+        let at = |offset: u64| unsafe { base.add(offset as usize) };
+        Ok(Ring {
+            producer: at(offsets.producer).cast(),
+            consumer: at(offsets.consumer).cast(),
+            descs: at(offsets.desc).cast(),
+            mask: size - 1,
+        })
+    }
+
+    fn producer(&self) -> &AtomicU32 {
+        unsafe { &*self.producer }
+    }
+
+    fn consumer(&self) -> &AtomicU32 {
+        unsafe { &*self.consumer }
+    }
+
+    fn desc(&self, index: u32) -> *mut T {
+        unsafe { self.descs.add((index & self.mask) as usize) }
+    }
+}
+
+// An AF_XDP socket bound to one queue, with a UMEM of `frames` frames that is both its fill ring
+// and RX ring size.
+struct Socket {
+    fd: OwnedFd,
+    umem: *mut u8,
+    fill: Ring<u64>,
+    rx: Ring<libc::xdp_desc>,
+}
+
+// Creates an AF_XDP socket with a UMEM of `frames` frames, and fill and completion rings of as
+// many entries, which the kernel requires whichever of the RX and TX rings are used.
+fn umem_socket(frames: u32) -> io::Result<(OwnedFd, *mut u8)> {
+    let ret = unsafe { libc::socket(libc::AF_XDP, libc::SOCK_RAW | libc::SOCK_CLOEXEC, 0) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    let fd = unsafe { OwnedFd::from_raw_fd(ret) };
+
+    let len = frames as usize * FRAME_SIZE;
+    let umem = mmap(None, len, 0)?;
+    setsockopt(
+        &fd,
+        libc::XDP_UMEM_REG,
+        &libc::xdp_umem_reg {
+            addr: umem as u64,
+            len: len as u64,
+            chunk_size: FRAME_SIZE as u32,
+            headroom: 0,
+            flags: 0,
+            tx_metadata_len: 0,
+        },
+    )?;
+    setsockopt(&fd, libc::XDP_UMEM_FILL_RING, &frames)?;
+    setsockopt(&fd, libc::XDP_UMEM_COMPLETION_RING, &frames)?;
+    Ok((fd, umem))
+}
+
+fn mmap_offsets(fd: &OwnedFd) -> io::Result<libc::xdp_mmap_offsets> {
+    let mut offsets: libc::xdp_mmap_offsets = unsafe { mem::zeroed() };
+    let mut optlen = mem::size_of_val(&offsets) as libc::socklen_t;
+    let ret = unsafe {
+        libc::getsockopt(
+            fd.as_raw_fd(),
+            libc::SOL_XDP,
+            libc::XDP_MMAP_OFFSETS,
+            &mut offsets as *mut _ as *mut libc::c_void,
+            &mut optlen,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(offsets)
+}
+
+fn bind(fd: &OwnedFd, interface_index: u32, queue: u32, flags: u16) -> io::Result<()> {
+    let addr = libc::sockaddr_xdp {
+        sxdp_family: libc::AF_XDP as u16,
+        sxdp_flags: flags,
+        sxdp_ifindex: interface_index,
+        sxdp_queue_id: queue,
+        sxdp_shared_umem_fd: 0,
+    };
+    let ret = unsafe {
+        libc::bind(
+            fd.as_raw_fd(),
+            &addr as *const _ as *const libc::sockaddr,
+            mem::size_of_val(&addr) as libc::socklen_t,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+impl Socket {
+    fn bind(interface_index: u32, queue: u32, frames: u32, zero_copy: bool) -> io::Result<Self> {
+        let (fd, umem) = umem_socket(frames)?;
+        setsockopt(&fd, libc::XDP_RX_RING, &frames)?;
+        let offsets = mmap_offsets(&fd)?;
+        let fill = Ring::map(&fd, &offsets.fr, frames, libc::XDP_UMEM_PGOFF_FILL_RING)?;
+        let rx = Ring::map(&fd, &offsets.rx, frames, libc::XDP_PGOFF_RX_RING as u64)?;
+
+        let mode = if zero_copy {
+            libc::XDP_ZEROCOPY
+        } else {
+            libc::XDP_COPY
+        };
+        bind(
+            &fd,
+            interface_index,
+            queue,
+            mode | libc::XDP_USE_NEED_WAKEUP,
+        )?;
+
+        // Hand every frame to the kernel.
+        for i in 0..frames {
+            unsafe { *fill.desc(i) = u64::from(i) * FRAME_SIZE as u64 };
+        }
+        fill.producer().store(frames, Ordering::Release);
+
+        Ok(Socket { fd, umem, fill, rx })
+    }
+
+    // Blocks until packets arrive. With `XDP_USE_NEED_WAKEUP` the driver only needs this system
+    // call to make progress when the rings run dry, which is exactly when it is made.
+    fn wait(&self) -> io::Result<()> {
+        let mut pollfd = libc::pollfd {
+            fd: self.fd.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let ret = unsafe { libc::poll(&mut pollfd, 1, -1) };
+        if ret == -1 {
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+        Ok(())
+    }
+}
+
+// One thread receiving the packets of `queue` of the interface through an AF_XDP socket. There is
+// no TCP stack on this path, so the handler sees whole Ethernet frames and its replies are
+// dropped.
+pub struct Server {
+    pub program: Arc<Program>,
+    pub interface_index: u32,
+    pub queue: u32,
+    // Number of UMEM frames, a power of two.
+    pub frames: u32,
+    pub zero_copy: bool,
+    // Where to capture the received frames, if anywhere.
+    pub capture: Option<CaptureOptions>,
+}
+
+impl Engine for Server {
+    fn run<H: Handler>(self, mut handler: H, metrics: &Metrics) {
+        metrics.init_thread();
+
+        let socket = Socket::bind(
+            self.interface_index,
+            self.queue,
+            self.frames,
+            self.zero_copy,
+        )
+        .expect("failed to bind the AF_XDP socket");
+        self.program
+            .insert(self.queue, &socket.fd)
+            .expect("failed to insert the socket into the XSKMAP");
+
+        let mut capture = self.capture.map(|options| {
+            Capture::new(options, self.queue).expect("failed to set up the capture")
+        });
+        let mut out = Vec::new();
+        let mut rx_consumer = 0u32;
+        let mut fill_producer = self.frames;
+        loop {
+            let available = socket
+                .rx
+                .producer()
+                .load(Ordering::Acquire)
+                .wrapping_sub(rx_consumer);
+            if available == 0 {
+                // Whatever was captured is written while the socket is idle.
+                if let Some(capture) = &mut capture {
+                    capture.flush(metrics);
+                }
+                socket.wait().unwrap();
+                metrics.waits.add(1);
+                continue;
+            }
+
+            if let Some(capture) = &mut capture {
+                capture.start_burst();
+            }
+            for i in 0..available {
+                let desc = unsafe { *socket.rx.desc(rx_consumer.wrapping_add(i)) };
+                let frame = unsafe {
+                    slice::from_raw_parts(socket.umem.add(desc.addr as usize), desc.len as usize)
+                };
+                metrics.bytes.add(frame.len() as u64);
+                if let Some(capture) = &mut capture {
+                    capture.record(frame, metrics);
+                }
+                handler.on_recv(self.queue, frame, &mut out);
+                out.clear();
+                // Return the frame, whose address may point past the start of its chunk.
+                let chunk = desc.addr & !(FRAME_SIZE as u64 - 1);
+                unsafe { *socket.fill.desc(fill_producer.wrapping_add(i)) = chunk };
+            }
+            rx_consumer = rx_consumer.wrapping_add(available);
+            fill_producer = fill_producer.wrapping_add(available);
+            socket.rx.consumer().store(rx_consumer, Ordering::Release);
+            socket
+                .fill
+                .producer()
+                .store(fill_producer, Ordering::Release);
+            metrics.recvs.add(u64::from(available));
+            metrics.events.add(u64::from(available));
+        }
+    }
+}
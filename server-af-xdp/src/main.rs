@@ -0,0 +1,92 @@
+use std::{ffi::CString, io, sync::Arc};
+
+use clap::Parser;
+use common::{
+    engine::{check_options, serve_with_handler, HandlerArgs, ServerOptions},
+    metrics::{start_reporter, ReportArgs},
+    numa::{place, NumaArgs},
+};
+use server_af_xdp::{CaptureArgs, CaptureOptions, Program, Server, FRAME_SIZE};
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    interface: String,
+
+    /// First queue of the interface to receive from. Thread `i` receives from queue `queue + i`.
+    #[clap(short, long, default_value_t = 0)]
+    queue: u32,
+
+    /// Number of receive threads, each with its own AF_XDP socket.
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    /// Number of UMEM frames per socket, which is also the size of its fill and RX rings.
+    #[clap(long, default_value_t = 4096)]
+    frames: u32,
+
+    /// Require zero-copy mode instead of copying packets into the UMEM.
+    #[clap(long)]
+    zero_copy: bool,
+
+    // With AF_XDP, `--checksum` covers every frame on its own.
+    #[clap(flatten)]
+    handler: HandlerArgs,
+
+    #[clap(flatten)]
+    capture: CaptureArgs,
+
+    #[clap(flatten)]
+    numa: NumaArgs,
+
+    #[clap(flatten)]
+    report: ReportArgs,
+}
+
+fn main() {
+    let args = Args::parse();
+    check_options(&args.handler, &ServerOptions::default());
+    assert!(
+        args.frames.is_power_of_two(),
+        "--frames must be a power of two"
+    );
+    // AF_XDP receives frames before the kernel timestamps them.
+    assert!(
+        !args.report.rx_timestamps,
+        "--rx-timestamps is not supported with AF_XDP"
+    );
+
+    let interface_cstring = CString::new(args.interface.as_str()).unwrap();
+    let interface_index = unsafe { libc::if_nametoindex(interface_cstring.as_c_str().as_ptr()) };
+    if interface_index == 0 {
+        let err = io::Error::last_os_error();
+        panic!("failed to convert interface name: {err}");
+    }
+    eprintln!(
+        "UMEM: {} frames of {FRAME_SIZE} B per thread, {} KiB",
+        args.frames,
+        args.frames as usize * FRAME_SIZE / 1024,
+    );
+
+    let capture = CaptureOptions::new(&args.capture);
+
+    let queues = args.queue + args.threads as u32;
+    let program = Arc::new(
+        Program::attach(interface_index, queues).expect("failed to attach the XDP program"),
+    );
+
+    let placements = place(&args.numa, Some(&args.interface), args.threads);
+    let metrics = start_reporter(args.threads, &args.report);
+
+    let servers = (args.queue..queues)
+        .map(|queue| Server {
+            program: program.clone(),
+            interface_index,
+            queue,
+            frames: args.frames,
+            zero_copy: args.zero_copy,
+            capture: capture.clone(),
+        })
+        .collect();
+    serve_with_handler(servers, &placements, &args.handler, metrics);
+}
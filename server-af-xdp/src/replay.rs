@@ -0,0 +1,552 @@
+use std::{
+    io,
+    os::fd::{AsRawFd, OwnedFd},
+    path::{Path, PathBuf},
+    ptr, slice,
+    sync::{atomic::Ordering, Arc},
+    thread,
+    time::{Duration, Instant},
+};
+
+use common::{
+    engine::{Engine, Handler},
+    metrics::Metrics,
+};
+
+use crate::{bind, mmap_offsets, setsockopt, umem_socket, Ring, FRAME_SIZE};
+
+#[derive(clap::Args)]
+pub struct ReplayArgs {
+    /// pcap or pcapng file of Ethernet frames to replay. Every thread replays all of it.
+    #[clap(long)]
+    pub replay: Option<PathBuf>,
+
+    /// Maximum number of frames handed over at once, like an RX burst of a driver.
+    #[clap(long, default_value_t = 64)]
+    pub burst: usize,
+
+    /// Replay the frames at the pace they were captured instead of as fast as possible.
+    #[clap(long)]
+    pub recorded_speed: bool,
+
+    /// Number of times the file is replayed, or 0 to replay it until interrupted.
+    #[clap(long, default_value_t = 1)]
+    pub loops: u64,
+
+    /// Transmit the frames on queue `queue + i` of `--interface` with AF_XDP, for example to a
+    /// veth whose peer runs a receiver, instead of handing them to the handler.
+    #[clap(long)]
+    pub inject: bool,
+}
+
+// Byte-order magics of pcap, with microsecond and nanosecond timestamps, and of pcapng.
+const PCAP_MICROS: u32 = 0xa1b2_c3d4;
+const PCAP_NANOS: u32 = 0xa1b2_3c4d;
+const PCAPNG_MAGIC: u32 = 0x1a2b_3c4d;
+const SECTION_HEADER: u32 = 0x0a0d_0d0a;
+const INTERFACE_DESCRIPTION: u32 = 1;
+const SIMPLE_PACKET: u32 = 3;
+const ENHANCED_PACKET: u32 = 6;
+const LINKTYPE_ETHERNET: u32 = 1;
+
+// Frames start on their own cache line, like the buffers of a driver.
+const FRAME_ALIGN: usize = 64;
+const HUGE_PAGE: usize = 2 << 20;
+
+struct Reader<'a> {
+    data: &'a [u8],
+    big_endian: bool,
+}
+
+impl Reader<'_> {
+    fn u16(&self, offset: usize) -> io::Result<u16> {
+        let bytes = self.bytes(offset, 2)?.try_into().unwrap();
+        Ok(if self.big_endian {
+            u16::from_be_bytes(bytes)
+        } else {
+            u16::from_le_bytes(bytes)
+        })
+    }
+
+    fn u32(&self, offset: usize) -> io::Result<u32> {
+        let bytes = self.bytes(offset, 4)?.try_into().unwrap();
+        Ok(if self.big_endian {
+            u32::from_be_bytes(bytes)
+        } else {
+            u32::from_le_bytes(bytes)
+        })
+    }
+
+    fn bytes(&self, offset: usize, len: usize) -> io::Result<&[u8]> {
+        self.data
+            .get(offset..offset + len)
+            .ok_or_else(|| invalid("truncated file"))
+    }
+}
+
+fn invalid(message: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message)
+}
+
+// A frame of the file: where its bytes are and when it was captured, in nanoseconds.
+struct Record {
+    offset: usize,
+    len: usize,
+    time: u64,
+}
+
+fn parse_pcap(data: &[u8]) -> io::Result<Vec<Record>> {
+    let magic = u32::from_le_bytes(data[..4].try_into().unwrap());
+    let (big_endian, nanos) = match magic {
+        PCAP_MICROS => (false, false),
+        PCAP_NANOS => (false, true),
+        _ if magic.swap_bytes() == PCAP_MICROS => (true, false),
+        _ if magic.swap_bytes() == PCAP_NANOS => (true, true),
+        _ => return Err(invalid("not a pcap or pcapng file")),
+    };
+    let reader = Reader { data, big_endian };
+    if reader.u32(20)? != LINKTYPE_ETHERNET {
+        return Err(invalid("only Ethernet captures can be replayed"));
+    }
+    let mut records = Vec::new();
+    let mut offset = 24;
+    while offset < data.len() {
+        let seconds = u64::from(reader.u32(offset)?);
+        let fraction = u64::from(reader.u32(offset + 4)?);
+        let len = reader.u32(offset + 8)? as usize;
+        reader.bytes(offset + 16, len)?;
+        let fraction = if nanos { fraction } else { fraction * 1000 };
+        records.push(Record {
+            offset: offset + 16,
+            len,
+            time: seconds * 1_000_000_000 + fraction,
+        });
+        offset += 16 + len;
+    }
+    Ok(records)
+}
+
+// Converts a timestamp in units of `if_tsresol` to nanoseconds: a negative power of 10, or of 2
+// if the most significant bit is set.
+fn nanos(timestamp: u64, tsresol: u8) -> u64 {
+    let timestamp = u128::from(timestamp);
+    let exponent = u32::from(tsresol & 0x7f);
+    let nanos = match (tsresol & 0x80 != 0, exponent) {
+        (true, _) => (timestamp * 1_000_000_000) >> exponent,
+        (false, 0..=9) => timestamp * 10u128.pow(9 - exponent),
+        (false, _) => timestamp / 10u128.pow(exponent.min(38) - 9),
+    };
+    nanos as u64
+}
+
+fn parse_pcapng(data: &[u8]) -> io::Result<Vec<Record>> {
+    let mut reader = Reader {
+        data,
+        big_endian: false,
+    };
+    // `if_tsresol` of every interface of the current section.
+    let mut interfaces: Vec<u8> = Vec::new();
+    let mut records = Vec::new();
+    let mut offset = 0;
+    while offset < data.len() {
+        let block_type = u32::from_le_bytes(reader.bytes(offset, 4)?.try_into().unwrap());
+        if block_type == SECTION_HEADER {
+            let magic = u32::from_le_bytes(reader.bytes(offset + 8, 4)?.try_into().unwrap());
+            reader.big_endian = magic != PCAPNG_MAGIC;
+            interfaces.clear();
+        }
+        let len = reader.u32(offset + 4)? as usize;
+        if len < 12 || len % 4 != 0 {
+            return Err(invalid("invalid pcapng block"));
+        }
+        let block = Reader {
+            data: reader.bytes(offset, len)?,
+            big_endian: reader.big_endian,
+        };
+        match reader.u32(offset)? {
+            INTERFACE_DESCRIPTION => {
+                if u32::from(block.u16(8)?) != LINKTYPE_ETHERNET {
+                    return Err(invalid("only Ethernet captures can be replayed"));
+                }
+                // Microseconds unless an option says otherwise.
+                let mut tsresol = 6;
+                let mut option = 16;
+                while option + 4 <= len - 4 {
+                    let (code, option_len) = (block.u16(option)?, block.u16(option + 2)? as usize);
+                    if code == 0 {
+                        break;
+                    }
+                    if code == 9 {
+                        tsresol = block.bytes(option + 4, 1)?[0];
+                    }
+                    option += 4 + option_len.next_multiple_of(4);
+                }
+                interfaces.push(tsresol);
+            }
+            ENHANCED_PACKET => {
+                let interface = block.u32(8)? as usize;
+                let tsresol = *interfaces
+                    .get(interface)
+                    .ok_or_else(|| invalid("packet of an undescribed interface"))?;
+                let timestamp = u64::from(block.u32(12)?) << 32 | u64::from(block.u32(16)?);
+                let captured = block.u32(20)? as usize;
+                block.bytes(28, captured)?;
+                records.push(Record {
+                    offset: offset + 28,
+                    len: captured,
+                    time: nanos(timestamp, tsresol),
+                });
+            }
+            SIMPLE_PACKET => {
+                if len < 16 {
+                    return Err(invalid("invalid pcapng block"));
+                }
+                // No timestamp: the frame is due with the one before it.
+                let captured = (block.u32(8)? as usize).min(len - 16);
+                block.bytes(12, captured)?;
+                records.push(Record {
+                    offset: offset + 12,
+                    len: captured,
+                    time: records.last().map_or(0, |record| record.time),
+                });
+            }
+            _ => {}
+        }
+        offset += len;
+    }
+    Ok(records)
+}
+
+struct Frame {
+    offset: usize,
+    len: usize,
+    // Nanoseconds since the first frame.
+    time: u64,
+}
+
+// The frames of a capture file, packed into memory backed by huge pages if there are any, so that
+// replaying them costs as few TLB misses as receiving them from a NIC.
+pub struct Trace {
+    memory: *mut u8,
+    frames: Vec<Frame>,
+}
+
+// The memory is only read once the trace is loaded.
+unsafe impl Send for Trace {}
+unsafe impl Sync for Trace {}
+
+fn mmap_huge(len: usize) -> io::Result<(*mut u8, bool)> {
+    let len = len.next_multiple_of(HUGE_PAGE);
+    let flags = libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE;
+    let prot = libc::PROT_READ | libc::PROT_WRITE;
+    let ptr = unsafe { libc::mmap(ptr::null_mut(), len, prot, flags | libc::MAP_HUGETLB, -1, 0) };
+    if ptr != libc::MAP_FAILED {
+        return Ok((ptr.cast(), true));
+    }
+    // No reserved huge pages: ask for transparent ones instead.
+    let ptr = unsafe { libc::mmap(ptr::null_mut(), len, prot, flags, -1, 0) };
+    if ptr == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    unsafe { libc::madvise(ptr, len, libc::MADV_HUGEPAGE) };
+    Ok((ptr.cast(), false))
+}
+
+impl Trace {
+    pub fn load(path: &Path) -> io::Result<Self> {
+        let data = std::fs::read(path)?;
+        if data.len() < 24 {
+            return Err(invalid("not a pcap or pcapng file"));
+        }
+        let records = match u32::from_le_bytes(data[..4].try_into().unwrap()) {
+            SECTION_HEADER => parse_pcapng(&data)?,
+            _ => parse_pcap(&data)?,
+        };
+        if records.is_empty() {
+            return Err(invalid("the file holds no frames"));
+        }
+
+        let size: usize = records
+            .iter()
+            .map(|record| record.len.next_multiple_of(FRAME_ALIGN))
+            .sum();
+        let (memory, huge) = mmap_huge(size.max(1))?;
+        let first = records.iter().map(|record| record.time).min().unwrap();
+        let mut frames = Vec::with_capacity(records.len());
+        let mut offset = 0;
+        for record in &records {
+            let bytes = &data[record.offset..record.offset + record.len];
+            unsafe { ptr::copy_nonoverlapping(bytes.as_ptr(), memory.add(offset), bytes.len()) };
+            frames.push(Frame {
+                offset,
+                len: record.len,
+                time: record.time - first,
+            });
+            offset += record.len.next_multiple_of(FRAME_ALIGN);
+        }
+        let pages = if huge {
+            "huge pages"
+        } else {
+            "transparent huge pages if any"
+        };
+        eprintln!(
+            "replay: {} frames, {} KiB in {pages}, {:.3} s captured",
+            frames.len(),
+            size / 1024,
+            frames.last().unwrap().time as f64 / 1e9,
+        );
+        Ok(Trace { memory, frames })
+    }
+
+    fn frame(&self, frame: &Frame) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.memory.add(frame.offset), frame.len) }
+    }
+}
+
+// An AF_XDP socket that only transmits. Frames are copied into free UMEM frames, which come back
+// through the completion ring once sent.
+struct TxSocket {
+    fd: OwnedFd,
+    umem: *mut u8,
+    tx: Ring<libc::xdp_desc>,
+    completion: Ring<u64>,
+    free: Vec<u64>,
+    tx_producer: u32,
+    completion_consumer: u32,
+}
+
+impl TxSocket {
+    fn bind(interface_index: u32, queue: u32, frames: u32) -> io::Result<Self> {
+        let (fd, umem) = umem_socket(frames)?;
+        setsockopt(&fd, libc::XDP_TX_RING, &frames)?;
+        let offsets = mmap_offsets(&fd)?;
+        let completion = Ring::map(
+            &fd,
+            &offsets.cr,
+            frames,
+            libc::XDP_UMEM_PGOFF_COMPLETION_RING,
+        )?;
+        let tx = Ring::map(&fd, &offsets.tx, frames, libc::XDP_PGOFF_TX_RING as u64)?;
+        // Drivers of virtual devices such as veth only copy.
+        bind(&fd, interface_index, queue, libc::XDP_COPY)?;
+        Ok(TxSocket {
+            fd,
+            umem,
+            tx,
+            completion,
+            free: (0..u64::from(frames))
+                .map(|i| i * FRAME_SIZE as u64)
+                .collect(),
+            tx_producer: 0,
+            completion_consumer: 0,
+        })
+    }
+
+    fn reap(&mut self) {
+        let completed = self
+            .completion
+            .producer()
+            .load(Ordering::Acquire)
+            .wrapping_sub(self.completion_consumer);
+        for i in 0..completed {
+            let addr = unsafe {
+                *self
+                    .completion
+                    .desc(self.completion_consumer.wrapping_add(i))
+            };
+            self.free.push(addr);
+        }
+        self.completion_consumer = self.completion_consumer.wrapping_add(completed);
+        self.completion
+            .consumer()
+            .store(self.completion_consumer, Ordering::Release);
+    }
+
+    // Makes the kernel transmit what is in the TX ring, which in copy mode only happens in this
+    // system call.
+    fn kick(&self) -> io::Result<()> {
+        let ret = unsafe {
+            libc::sendto(
+                self.fd.as_raw_fd(),
+                ptr::null(),
+                0,
+                libc::MSG_DONTWAIT,
+                ptr::null(),
+                0,
+            )
+        };
+        if ret == -1 {
+            let err = io::Error::last_os_error();
+            match err.raw_os_error() {
+                // The ring is being drained or the device is busy; the next call sends the rest.
+                Some(libc::EAGAIN | libc::EBUSY | libc::ENOBUFS) => {}
+                _ => return Err(err),
+            }
+        }
+        Ok(())
+    }
+
+    fn send(&mut self, frame: &[u8]) -> io::Result<()> {
+        // The frames queued since the last flush are published first, or the kernel would never
+        // complete any when a burst takes every frame.
+        while self.free.is_empty() {
+            self.flush()?;
+        }
+        let addr = self.free.pop().unwrap();
+        unsafe {
+            ptr::copy_nonoverlapping(frame.as_ptr(), self.umem.add(addr as usize), frame.len());
+            *self.tx.desc(self.tx_producer) = libc::xdp_desc {
+                addr,
+                len: frame.len() as u32,
+                options: 0,
+            };
+        }
+        self.tx_producer = self.tx_producer.wrapping_add(1);
+        Ok(())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.tx
+            .producer()
+            .store(self.tx_producer, Ordering::Release);
+        self.kick()?;
+        self.reap();
+        Ok(())
+    }
+}
+
+// Where replayed frames are transmitted instead of being handled.
+#[derive(Clone, Copy)]
+pub struct Inject {
+    pub interface_index: u32,
+    pub queue: u32,
+    // Number of UMEM frames, a power of two.
+    pub frames: u32,
+}
+
+// One thread replaying a trace in bursts, to the handler or onto an interface.
+pub struct Replay {
+    pub trace: Arc<Trace>,
+    // Passed to the handler as the connection of every frame.
+    pub thread: u32,
+    pub burst: usize,
+    pub recorded_speed: bool,
+    pub loops: u64,
+    pub inject: Option<Inject>,
+}
+
+// Waits until `due`, sleeping while it is far enough away for the wake-up to be on time.
+fn wait_until(due: Instant) {
+    loop {
+        let now = Instant::now();
+        if now >= due {
+            return;
+        }
+        let left = due - now;
+        if left > Duration::from_micros(200) {
+            thread::sleep(left - Duration::from_micros(100));
+        }
+    }
+}
+
+impl Engine for Replay {
+    fn run<H: Handler>(self, mut handler: H, metrics: &Metrics) {
+        metrics.init_thread();
+        let mut tx = self.inject.map(|inject| {
+            TxSocket::bind(inject.interface_index, inject.queue, inject.frames)
+                .expect("failed to bind the AF_XDP socket")
+        });
+
+        let frames = &self.trace.frames;
+        let mut out = Vec::new();
+        let start = Instant::now();
+        let mut replayed = 0u64;
+        let mut bytes = 0u64;
+        let mut done = 0;
+        while self.loops == 0 || done < self.loops {
+            let loop_start = Instant::now();
+            let mut next = 0;
+            while next < frames.len() {
+                // A burst is the frames that are due, up to its size.
+                let mut end = (next + self.burst).min(frames.len());
+                if self.recorded_speed {
+                    wait_until(loop_start + Duration::from_nanos(frames[next].time));
+                    let now = loop_start.elapsed().as_nanos() as u64;
+                    let due = frames[next..end]
+                        .iter()
+                        .take_while(|frame| frame.time <= now);
+                    end = next + due.count().max(1);
+                }
+
+                let mut burst_bytes = 0;
+                for frame in &frames[next..end] {
+                    let frame = self.trace.frame(frame);
+                    burst_bytes += frame.len() as u64;
+                    match &mut tx {
+                        // A frame must fit in a UMEM frame to be transmitted.
+                        Some(_) if frame.len() > FRAME_SIZE => metrics.errors.add(1),
+                        Some(tx) => tx.send(frame).expect("failed to transmit"),
+                        None => {
+                            handler.on_recv(self.thread, frame, &mut out);
+                            out.clear();
+                        }
+                    }
+                }
+                if let Some(tx) = &mut tx {
+                    tx.flush().expect("failed to transmit");
+                }
+                let count = (end - next) as u64;
+                metrics.bytes.add(burst_bytes);
+                metrics.recvs.add(count);
+                metrics.events.add(count);
+                replayed += count;
+                bytes += burst_bytes;
+                next = end;
+            }
+            done += 1;
+        }
+
+        let secs = start.elapsed().as_secs_f64();
+        eprintln!(
+            "replay thread {}: {replayed} frames in {secs:.3} s, {:.3} Mpps, {:.3} Gbit/s",
+            self.thread,
+            replayed as f64 / 1e6 / secs,
+            bytes as f64 * 8.0 / 1e9 / secs,
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn block(block_type: u32, body: &[u8]) -> Vec<u8> {
+        let len = (12 + body.len()) as u32;
+        [
+            &block_type.to_le_bytes()[..],
+            &len.to_le_bytes(),
+            body,
+            &len.to_le_bytes(),
+        ]
+        .concat()
+    }
+
+    fn section() -> Vec<u8> {
+        let body = [&PCAPNG_MAGIC.to_le_bytes()[..], &[1, 0, 0, 0], &[0xff; 8]].concat();
+        block(SECTION_HEADER, &body)
+    }
+
+    #[test]
+    fn simple_packets() {
+        let frame = [0xab; 6];
+        let body = [&6u32.to_le_bytes()[..], &frame, &[0, 0]].concat();
+        let data = [section(), block(SIMPLE_PACKET, &body)].concat();
+        let records = parse_pcapng(&data).unwrap();
+        assert_eq!(records.len(), 1);
+        assert_eq!(&data[records[0].offset..][..records[0].len], frame);
+
+        // Too short to hold the original length and the trailing length.
+        let data = [section(), block(SIMPLE_PACKET, &[])].concat();
+        assert!(parse_pcapng(&data).is_err_and(|err| err.kind() == io::ErrorKind::InvalidData));
+    }
+}
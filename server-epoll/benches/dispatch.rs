@@ -0,0 +1,78 @@
+use std::{
+    io::{Read, Write},
+    net::{TcpListener, TcpStream},
+    os::fd::OwnedFd,
+};
+
+use common::{
+    engine::{Discard, Echo, Handler},
+    metrics::Metrics,
+};
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use server_epoll::{AcceptOptions, EventLoop};
+
+const ACCEPT: AcceptOptions = AcceptOptions {
+    batch: 64,
+    read_first: false,
+    check_cpu: false,
+};
+
+fn event(user_data: u64) -> libc::epoll_event {
+    libc::epoll_event {
+        events: libc::EPOLLIN as u32,
+        u64: user_data,
+    }
+}
+
+// Returns an event loop with a listener on an ephemeral loopback port, one registered client and
+// the peer of that client.
+fn connected<H: Handler>(handler: H, metrics: &Metrics) -> (EventLoop<'_, H>, u64, TcpStream) {
+    let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+    let peer = TcpStream::connect(listener.local_addr().unwrap()).unwrap();
+    let (client, _) = listener.accept().unwrap();
+    client.set_nonblocking(true).unwrap();
+    peer.set_nodelay(true).unwrap();
+
+    let mut event_loop = EventLoop::new(listener, ACCEPT, handler, metrics).unwrap();
+    let client = event_loop.add_client(OwnedFd::from(client)).unwrap();
+    (event_loop, client, peer)
+}
+
+// Feeds synthetic events to the event loop. Every event is handled like one returned by
+// `epoll_wait`, including the system calls it triggers, so these measure the cost of an event
+// rather than of the dispatch alone.
+fn events(c: &mut Criterion) {
+    let metrics = Metrics::default();
+    let (mut event_loop, client, mut peer) = connected(Discard, &metrics);
+    let request = [0xa5; 64];
+
+    let mut group = c.benchmark_group("event");
+    // The listener is empty, so this is a single `accept4` returning `EAGAIN`.
+    group.bench_function("accept/empty", |b| {
+        b.iter(|| event_loop.handle_event(black_box(&event(u64::MAX))))
+    });
+    // A spurious wakeup: a single `read` returning `EAGAIN`.
+    group.bench_function("read/empty", |b| {
+        b.iter(|| event_loop.handle_event(black_box(&event(client))))
+    });
+    group.bench_function("read/64B", |b| {
+        b.iter(|| {
+            peer.write_all(&request).unwrap();
+            event_loop.handle_event(black_box(&event(client)));
+        })
+    });
+    group.finish();
+
+    let (mut event_loop, client, mut peer) = connected(Echo, &metrics);
+    let mut reply = [0; 64];
+    c.bench_function("event/read+reply/64B", |b| {
+        b.iter(|| {
+            peer.write_all(&request).unwrap();
+            event_loop.handle_event(black_box(&event(client)));
+            peer.read_exact(&mut reply).unwrap();
+        })
+    });
+}
+
+criterion_group!(benches, events);
+criterion_main!(benches);
@@ -0,0 +1,701 @@
+use std::{
+    collections::HashMap,
+    io,
+    mem::{self, MaybeUninit},
+    net::TcpListener,
+    os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, IntoRawFd, OwnedFd, RawFd},
+    ptr, slice,
+    sync::Arc,
+    time::Instant,
+};
+
+use common::{
+    balance::{Balancer, Mailboxes},
+    engine::{Engine, Handler},
+    metrics::Metrics,
+    net::{
+        enable_rx_timestamps, incoming_cpu, nanos_since, rx_timestamp, RX_TIMESTAMP_CONTROL_LEN,
+    },
+    pipeline::{Pipeline, Worker},
+    pool::BufferPool,
+    ring::RingBuffer,
+};
+
+// Replies that could not be written without blocking, by client file descriptor. While a
+// client has a backlog, it is only polled for `EPOLLOUT`, which stops reading from it until the
+// backlog is flushed. The buffers are pooled, so that clients that keep falling behind do not cost
+// an allocation per short write.
+#[derive(Default)]
+struct Backlog {
+    pending: HashMap<RawFd, Vec<u8>>,
+    pool: BufferPool,
+}
+
+impl Backlog {
+    fn queue(&mut self, fd: RawFd, data: &[u8]) {
+        let mut buffer = self.pool.take();
+        buffer.extend_from_slice(data);
+        self.pending.insert(fd, buffer);
+    }
+
+    fn discard(&mut self, fd: RawFd) {
+        if let Some(buffer) = self.pending.remove(&fd) {
+            self.pool.give(buffer);
+        }
+    }
+}
+
+#[derive(Clone, Copy)]
+pub struct AcceptOptions {
+    pub batch: usize,
+    // Read from accepted sockets right away instead of waiting for `epoll_wait` to report them,
+    // which saves a wait per connection when `TCP_DEFER_ACCEPT` guarantees there is data.
+    pub read_first: bool,
+    // Count the accepted connections that were received on another CPU than the one of the event
+    // loop, which must be pinned.
+    pub check_cpu: bool,
+}
+
+fn epoll_create1(flags: i32) -> io::Result<OwnedFd> {
+    let ret = unsafe { libc::epoll_create1(flags) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(ret) })
+}
+
+fn epoll_ctl_add(
+    epoll_fd: &impl AsRawFd,
+    fd: &impl AsRawFd,
+    event: &libc::epoll_event,
+) -> io::Result<()> {
+    let ret = unsafe {
+        libc::epoll_ctl(
+            epoll_fd.as_raw_fd(),
+            libc::EPOLL_CTL_ADD,
+            fd.as_raw_fd(),
+            event as *const _ as *mut _,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn epoll_ctl_mod(
+    epoll_fd: &impl AsRawFd,
+    fd: &impl AsRawFd,
+    event: &libc::epoll_event,
+) -> io::Result<()> {
+    let ret = unsafe {
+        libc::epoll_ctl(
+            epoll_fd.as_raw_fd(),
+            libc::EPOLL_CTL_MOD,
+            fd.as_raw_fd(),
+            event as *const _ as *mut _,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn epoll_ctl_del(epoll_fd: &impl AsRawFd, fd: &impl AsRawFd) -> io::Result<()> {
+    let ret = unsafe {
+        libc::epoll_ctl(
+            epoll_fd.as_raw_fd(),
+            libc::EPOLL_CTL_DEL,
+            fd.as_raw_fd(),
+            ptr::null_mut(),
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn epoll_wait(
+    epoll_fd: &impl AsRawFd,
+    events: *mut libc::epoll_event,
+    capacity: i32,
+    timeout: i32,
+) -> io::Result<i32> {
+    let ret = unsafe { libc::epoll_wait(epoll_fd.as_raw_fd(), events, capacity, timeout) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret)
+}
+
+fn accept4(fd: &impl AsRawFd, flags: i32) -> io::Result<OwnedFd> {
+    let ret = unsafe { libc::accept4(fd.as_raw_fd(), ptr::null_mut(), ptr::null_mut(), flags) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { OwnedFd::from_raw_fd(ret) })
+}
+
+fn read(fd: &impl AsRawFd, buf: &mut [MaybeUninit<u8>]) -> io::Result<isize> {
+    let ret = unsafe { libc::read(fd.as_raw_fd(), buf.as_mut_ptr().cast(), buf.len()) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret)
+}
+
+fn recvmsg(fd: &impl AsRawFd, msg: &mut libc::msghdr) -> io::Result<isize> {
+    let ret = unsafe { libc::recvmsg(fd.as_raw_fd(), msg, 0) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret)
+}
+
+// Reads like `read` and records how long ago the kernel received the last byte that was read.
+fn read_timestamped(
+    fd: &impl AsRawFd,
+    buf: &mut [MaybeUninit<u8>],
+    metrics: &Metrics,
+) -> io::Result<isize> {
+    let mut control = [0u64; RX_TIMESTAMP_CONTROL_LEN.div_ceil(8)];
+    let mut iov = libc::iovec {
+        iov_base: buf.as_mut_ptr().cast(),
+        iov_len: buf.len(),
+    };
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr().cast();
+    msg.msg_controllen = mem::size_of_val(&control);
+
+    let n = recvmsg(fd, &mut msg)?;
+    let control = unsafe { slice::from_raw_parts(control.as_ptr().cast(), msg.msg_controllen) };
+    if let Some(timestamp) = rx_timestamp(control) {
+        metrics.record_rx_delay(nanos_since(&timestamp));
+    }
+    Ok(n)
+}
+
+fn write(fd: &impl AsRawFd, buf: &[u8]) -> io::Result<isize> {
+    let ret = unsafe { libc::write(fd.as_raw_fd(), buf.as_ptr().cast(), buf.len()) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret)
+}
+
+// Writes as much of `buf` as possible without blocking and returns the number of bytes written.
+fn write_nonblocking(fd: RawFd, buf: &[u8]) -> io::Result<usize> {
+    let mut written = 0;
+    while written < buf.len() {
+        match write(&fd, &buf[written..]) {
+            Ok(n) => written += n as usize,
+            Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(written)
+}
+
+fn set_interest(epoll_fd: BorrowedFd, fd: RawFd, events: i32) {
+    epoll_ctl_mod(
+        &epoll_fd,
+        &fd,
+        &libc::epoll_event {
+            events: events as u32,
+            u64: fd as u64,
+        },
+    )
+    .unwrap();
+}
+
+// Writes `buf` to the client, queueing whatever does not fit in the socket buffer. Returns false if
+// the client must not be read from until its backlog is flushed.
+fn reply(epoll_fd: BorrowedFd, fd: RawFd, buf: &[u8], backlog: &mut Backlog) -> io::Result<bool> {
+    let written = write_nonblocking(fd, buf)?;
+    if written == buf.len() {
+        return Ok(true);
+    }
+    backlog.queue(fd, &buf[written..]);
+    set_interest(epoll_fd, fd, libc::EPOLLOUT);
+    Ok(false)
+}
+
+fn flush_backlog(epoll_fd: BorrowedFd, fd: RawFd, backlog: &mut Backlog) -> io::Result<bool> {
+    // Skip hashing the descriptor while no client has a backlog, which is always the case for
+    // handlers that do not reply.
+    if backlog.pending.is_empty() {
+        return Ok(true);
+    }
+    let Some(pending) = backlog.pending.get_mut(&fd) else {
+        return Ok(true);
+    };
+    let written = write_nonblocking(fd, pending)?;
+    pending.drain(..written);
+    if !pending.is_empty() {
+        return Ok(false);
+    }
+    backlog.discard(fd);
+    set_interest(epoll_fd, fd, libc::EPOLLIN);
+    Ok(true)
+}
+
+// A client moved to another event loop, with the replies it has not been sent yet, the state that
+// the handler kept for it and the bytes its receive buffer held that the handler did not consume.
+pub struct Migrated {
+    fd: OwnedFd,
+    backlog: Option<Vec<u8>>,
+    state: Vec<u8>,
+    unread: Vec<u8>,
+}
+
+// The balancer of an event loop and the mailboxes of all of them.
+pub struct Balance {
+    pub balancer: Balancer,
+    pub mailboxes: Arc<Mailboxes<Migrated>>,
+    // Clients received from the mailbox, kept to reuse its allocation.
+    arrived: Vec<Migrated>,
+}
+
+impl Balance {
+    // Connects the balancers of all the event loops through shared mailboxes.
+    pub fn for_balancers(balancers: Vec<Option<Balancer>>) -> Vec<Option<Balance>> {
+        let mailboxes = Arc::new(Mailboxes::new(balancers.len()));
+        balancers
+            .into_iter()
+            .map(|balancer| {
+                Some(Balance {
+                    balancer: balancer?,
+                    mailboxes: mailboxes.clone(),
+                    arrived: Vec::new(),
+                })
+            })
+            .collect()
+    }
+}
+
+// Maximum number of reads per client event, so that a client that sends faster than it is read
+// cannot starve the others, and busy time is accounted at least that often.
+const READ_BUDGET: usize = 64;
+
+// The user data is `u64::MAX` for the server socket and the client file descriptor for client
+// sockets.
+const LISTENER: u64 = u64::MAX;
+
+// The state of one event loop thread. Events are dispatched by `handle_event` whether they come
+// from `epoll_wait` or are built by hand, so the dispatch path can be measured on its own.
+pub struct EventLoop<'a, H> {
+    epoll_fd: OwnedFd,
+    listener: TcpListener,
+    accept: AcceptOptions,
+    // CPU the event loop is pinned to, if accepted connections are checked against it.
+    cpu: Option<usize>,
+    handler: H,
+    // Reply of the handler to the last read, kept to reuse its allocation.
+    out: Vec<u8>,
+    backlog: Backlog,
+    // Workers that the received bytes are handed to instead of running the handler inline.
+    pipeline: Option<Pipeline>,
+    // Moves the busiest clients to less loaded event loops.
+    balance: Option<Balance>,
+    // Receive buffers of the clients by file descriptor, which are small and dense enough to
+    // index, if each client has its own. Those of closed clients are kept for the next ones.
+    rings: Vec<Option<RingBuffer>>,
+    spare_rings: Vec<RingBuffer>,
+    ring_capacity: usize,
+    metrics: &'a Metrics,
+}
+
+impl<'a, H: Handler> EventLoop<'a, H> {
+    pub fn new(
+        listener: TcpListener,
+        accept: AcceptOptions,
+        handler: H,
+        metrics: &'a Metrics,
+    ) -> io::Result<Self> {
+        listener.set_nonblocking(true)?;
+        if metrics.rx_timestamps() {
+            enable_rx_timestamps(&listener)?;
+        }
+
+        let epoll_fd = epoll_create1(libc::EPOLL_CLOEXEC)?;
+        epoll_ctl_add(
+            &epoll_fd,
+            &listener,
+            &libc::epoll_event {
+                events: libc::EPOLLIN as u32,
+                u64: LISTENER,
+            },
+        )?;
+
+        Ok(EventLoop {
+            epoll_fd,
+            listener,
+            accept,
+            cpu: accept
+                .check_cpu
+                .then(|| unsafe { libc::sched_getcpu() } as usize),
+            handler,
+            out: Vec::new(),
+            backlog: Backlog::default(),
+            pipeline: None,
+            balance: None,
+            rings: Vec::new(),
+            spare_rings: Vec::new(),
+            ring_capacity: 0,
+            metrics,
+        })
+    }
+
+    pub fn with_pipeline(mut self, pipeline: Pipeline) -> Self {
+        self.pipeline = Some(pipeline);
+        self
+    }
+
+    pub fn with_balance(mut self, balance: Balance) -> Self {
+        self.balance = Some(balance);
+        self
+    }
+
+    // Gives every client a receive buffer of `capacity` bytes that keeps the bytes the handler has
+    // not consumed, instead of reading into a buffer shared by all of them.
+    pub fn with_rings(mut self, capacity: usize) -> Self {
+        self.ring_capacity = capacity;
+        self
+    }
+
+    // Registers a connected socket as if it had been accepted and returns the user data of its
+    // events. The socket must be nonblocking.
+    pub fn add_client(&mut self, client: OwnedFd) -> io::Result<u64> {
+        if self.ring_capacity > 0 {
+            let ring = match self.spare_rings.pop() {
+                Some(ring) => ring,
+                None => RingBuffer::new(self.ring_capacity)?,
+            };
+            let fd = client.as_raw_fd() as usize;
+            if self.rings.len() <= fd {
+                self.rings.resize_with(fd + 1, || None);
+            }
+            self.rings[fd] = Some(ring);
+        }
+        let added = epoll_ctl_add(
+            &self.epoll_fd,
+            &client,
+            &libc::epoll_event {
+                events: libc::EPOLLIN as u32,
+                u64: client.as_raw_fd() as u64,
+            },
+        );
+        if let Err(err) = added {
+            // The client is closed as it is dropped; its receive buffer goes to the next one.
+            self.recycle_ring(client.as_raw_fd());
+            return Err(err);
+        }
+        Ok(client.into_raw_fd() as u64)
+    }
+
+    // Keeps the receive buffer of a client that is gone for the next one, emptied.
+    fn recycle_ring(&mut self, fd: RawFd) {
+        if let Some(mut ring) = self.rings.get_mut(fd as usize).and_then(Option::take) {
+            ring.clear();
+            self.spare_rings.push(ring);
+        }
+    }
+
+    fn close_client(&mut self, fd: RawFd) {
+        self.backlog.discard(fd);
+        self.recycle_ring(fd);
+        if let Some(balance) = &mut self.balance {
+            balance.balancer.forget(fd as u32);
+        }
+        match &mut self.pipeline {
+            Some(pipeline) => pipeline.close(fd as u32),
+            None => self.handler.on_close(fd as u32),
+        }
+        epoll_ctl_del(&self.epoll_fd, &fd).unwrap();
+        drop(unsafe { OwnedFd::from_raw_fd(fd) });
+        self.metrics.closes.add(1);
+    }
+
+    fn accept_clients(&mut self) {
+        let metrics = self.metrics;
+        // The listener is level-triggered, so connections left in the accept queue are reported
+        // by the next `epoll_wait`.
+        for _ in 0..self.accept.batch {
+            let client = match accept4(&self.listener, libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC) {
+                Ok(client) => client,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) => {
+                    eprintln!("failed to accept: {err}");
+                    metrics.errors.add(1);
+                    break;
+                }
+            };
+            metrics.accepts.add(1);
+            if let Some(cpu) = self.cpu {
+                if incoming_cpu(&client).is_ok_and(|incoming| incoming != cpu) {
+                    metrics.remote_accepts.add(1);
+                }
+            }
+
+            let fd = match self.add_client(client) {
+                Ok(fd) => fd as RawFd,
+                // For example because the receive buffers exhausted `vm.max_map_count`.
+                Err(err) => {
+                    eprintln!("failed to add a client: {err}");
+                    metrics.errors.add(1);
+                    continue;
+                }
+            };
+            if self.accept.read_first {
+                self.handle_client(fd);
+            }
+        }
+    }
+
+    fn handle_client(&mut self, fd: RawFd) {
+        let metrics = self.metrics;
+        match flush_backlog(self.epoll_fd.as_fd(), fd, &mut self.backlog) {
+            Ok(true) => {}
+            Ok(false) => return,
+            Err(err) => {
+                eprintln!("failed to write: {err}");
+                metrics.errors.add(1);
+                self.close_client(fd);
+                return;
+            }
+        }
+
+        // Clients are level-triggered, so one that still has bytes after its budget is reported
+        // again by the next `epoll_wait`.
+        for _ in 0..READ_BUDGET {
+            let block = match &mut self.pipeline {
+                Some(pipeline) => match pipeline.take_block() {
+                    Some(block) => Some(block),
+                    // Every block is queued or being processed. The bytes stay in the socket,
+                    // whose window fills up, and the client is reported again by the next wait.
+                    None => break,
+                },
+                None => None,
+            };
+            let mut stack_buf = [MaybeUninit::uninit(); 4096];
+            let buf = match (block, &mut self.pipeline) {
+                (Some(block), Some(pipeline)) => pipeline.block(block),
+                _ if self.ring_capacity > 0 => self.rings[fd as usize].as_mut().unwrap().free(),
+                _ => &mut stack_buf[..],
+            };
+            let ret = if metrics.rx_timestamps() {
+                read_timestamped(&fd, buf, metrics)
+            } else {
+                read(&fd, buf)
+            };
+            metrics.recvs.add(1);
+            if let (Some(block), Some(pipeline), Ok(0) | Err(_)) = (block, &mut self.pipeline, &ret)
+            {
+                pipeline.put_back(block);
+            }
+            let n = match ret {
+                Ok(ret) => ret,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                // Clients may close with a RST to avoid `TIME_WAIT`, which is not worth reporting.
+                Err(err) if err.kind() == io::ErrorKind::ConnectionReset => {
+                    self.close_client(fd);
+                    break;
+                }
+                Err(err) => {
+                    eprintln!("failed to read: {err}");
+                    metrics.errors.add(1);
+                    self.close_client(fd);
+                    break;
+                }
+            };
+            if n == 0 {
+                self.close_client(fd);
+                break;
+            }
+            metrics.bytes.add(n as u64);
+            if let Some(balance) = &mut self.balance {
+                balance.balancer.record(fd as u32, n as usize);
+            }
+
+            if let (Some(block), Some(pipeline)) = (block, &mut self.pipeline) {
+                pipeline.push(fd as u32, block, n as usize);
+                continue;
+            }
+            if let Some(ring) = self.rings.get_mut(fd as usize).and_then(Option::as_mut) {
+                ring.commit(n as usize);
+                let consumed = self
+                    .handler
+                    .on_recv_buffered(fd as u32, ring.data(), &mut self.out);
+                ring.consume(consumed);
+                // A message that does not fit could never be completed.
+                if ring.is_full() {
+                    eprintln!("message longer than the receive buffer");
+                    metrics.errors.add(1);
+                    self.close_client(fd);
+                    break;
+                }
+            } else {
+                let buf = unsafe { slice::from_raw_parts(stack_buf.as_ptr().cast(), n as usize) };
+                self.handler.on_recv(fd as u32, buf, &mut self.out);
+            }
+            if self.out.is_empty() {
+                continue;
+            }
+            let ret = reply(self.epoll_fd.as_fd(), fd, &self.out, &mut self.backlog);
+            self.out.clear();
+            match ret {
+                Ok(true) => {}
+                Ok(false) => break,
+                Err(err) => {
+                    eprintln!("failed to write: {err}");
+                    metrics.errors.add(1);
+                    self.close_client(fd);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Takes over a client from another event loop. Bytes it received meanwhile wait in its socket,
+    // which is level-triggered, so nothing is lost or reordered.
+    fn adopt(&mut self, migrated: Migrated) {
+        let fd = migrated.fd.as_raw_fd();
+        // Only this client is lost, with the state that came with it.
+        if let Err(err) = self.add_client(migrated.fd) {
+            eprintln!("failed to adopt a client: {err}");
+            self.metrics.errors.add(1);
+            self.metrics.closes.add(1);
+            return;
+        }
+        self.handler.on_attach(fd as u32, &migrated.state);
+        // Every event loop has rings of the same capacity.
+        if let Some(ring) = self.rings.get_mut(fd as usize).and_then(Option::as_mut) {
+            ring.extend_from_slice(&migrated.unread);
+        }
+        if let Some(backlog) = migrated.backlog {
+            self.backlog.pending.insert(fd, backlog);
+            set_interest(self.epoll_fd.as_fd(), fd, libc::EPOLLOUT);
+        }
+    }
+
+    // Hands a client over to event loop `target`. Everything read from it so far has been handled
+    // or is still held by its receive buffer, and goes with it along with its pending replies and
+    // the state of the handler.
+    fn give_away(&mut self, fd: RawFd, target: usize) {
+        epoll_ctl_del(&self.epoll_fd, &fd).unwrap();
+        let unread = match self.rings.get(fd as usize).and_then(Option::as_ref) {
+            Some(ring) => ring.data().to_vec(),
+            None => Vec::new(),
+        };
+        self.recycle_ring(fd);
+        let mut state = Vec::new();
+        self.handler.on_detach(fd as u32, &mut state);
+        let migrated = Migrated {
+            fd: unsafe { OwnedFd::from_raw_fd(fd) },
+            backlog: self.backlog.pending.remove(&fd),
+            state,
+            unread,
+        };
+        self.balance
+            .as_ref()
+            .unwrap()
+            .mailboxes
+            .send(target, migrated);
+        self.metrics.migrations.add(1);
+    }
+
+    fn rebalance(&mut self) {
+        let Some(balance) = &mut self.balance else {
+            return;
+        };
+        let mut arrived = mem::take(&mut balance.arrived);
+        balance
+            .mailboxes
+            .receive(balance.balancer.thread(), &mut arrived);
+        let moved = balance.balancer.poll();
+        for migrated in arrived.drain(..) {
+            self.adopt(migrated);
+        }
+        self.balance.as_mut().unwrap().arrived = arrived;
+        if let Some((conn, target)) = moved {
+            self.give_away(conn as RawFd, target);
+        }
+    }
+
+    pub fn handle_event(&mut self, event: &libc::epoll_event) {
+        if event.u64 == LISTENER {
+            self.accept_clients();
+        } else {
+            self.handle_client(event.u64 as RawFd);
+        }
+    }
+
+    pub fn run(mut self) {
+        self.metrics.init_thread();
+
+        let mut events = Vec::with_capacity(1024);
+        loop {
+            let n = epoll_wait(
+                &self.epoll_fd,
+                events.as_mut_ptr(),
+                events.capacity() as i32,
+                0,
+            )
+            .unwrap();
+            unsafe {
+                events.set_len(n as usize);
+            }
+            self.metrics.waits.add(1);
+            self.metrics.events.add(n as u64);
+
+            if n > 0 {
+                let start = Instant::now();
+                for event in &events {
+                    self.handle_event(event);
+                }
+                self.metrics.busy.add(start.elapsed().as_nanos() as u64);
+            }
+            // Segments that did not fit into a ring are retried even without new events.
+            if let Some(pipeline) = &mut self.pipeline {
+                pipeline.flush();
+            }
+            self.rebalance();
+        }
+    }
+}
+
+// One event loop thread serving a `SO_REUSEPORT` listener.
+pub struct Server {
+    pub listener: TcpListener,
+    pub accept: AcceptOptions,
+    // Workers of the pipeline mode, which run the handler on their own threads, or none to run it
+    // inline.
+    pub workers: Vec<Worker>,
+    // Receive blocks shared with the workers.
+    pub blocks: u32,
+    pub balance: Option<Balance>,
+    // Capacity of the receive buffer of every client, or 0 to share one among them.
+    pub ring_capacity: usize,
+}
+
+impl Engine for Server {
+    fn run<H: Handler + Clone + Send + 'static>(self, handler: H, metrics: &Metrics) {
+        let event_loop = EventLoop::new(self.listener, self.accept, handler, metrics)
+            .expect("failed to set up the event loop");
+        let event_loop = match self.balance {
+            Some(balance) => event_loop.with_balance(balance),
+            None => event_loop,
+        }
+        .with_rings(self.ring_capacity);
+        if self.workers.is_empty() {
+            event_loop.run()
+        } else {
+            let pipeline = Pipeline::start(self.workers, self.blocks, &event_loop.handler);
+            event_loop.with_pipeline(pipeline).run()
+        }
+    }
+}
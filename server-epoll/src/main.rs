@@ -1,151 +1,106 @@
-use std::{
-    io,
-    mem::MaybeUninit,
-    net::TcpListener,
-    os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, IntoRawFd, OwnedFd, RawFd},
-    ptr,
-};
-
 use clap::Parser;
+use common::{
+    balance::{BalanceArgs, Balancer},
+    engine::{check_options, serve_with_handler, HandlerArgs, ServerOptions},
+    metrics::{start_reporter, ReportArgs},
+    net::{bind_reuseport, raise_fd_limit, steer_by_cpu, ListenArgs},
+    numa::{interface_for_bind, pin_threads, place, NumaArgs},
+    pipeline::{assign_workers, PipelineArgs},
+};
+use server_epoll::{AcceptOptions, Balance, Server};
 
 #[derive(clap::Parser)]
 struct Args {
     #[clap(short, long)]
     bind: String,
-}
 
-fn epoll_create1(flags: i32) -> io::Result<OwnedFd> {
-    let ret = unsafe { libc::epoll_create1(flags) };
-    if ret == -1 {
-        return Err(io::Error::last_os_error());
-    }
-    Ok(unsafe { OwnedFd::from_raw_fd(ret) })
-}
+    /// Number of event loop threads, each with its own `SO_REUSEPORT` listener.
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
 
-fn epoll_ctl_add(
-    epoll_fd: &impl AsRawFd,
-    fd: &impl AsRawFd,
-    event: &libc::epoll_event,
-) -> io::Result<()> {
-    let ret = unsafe {
-        libc::epoll_ctl(
-            epoll_fd.as_raw_fd(),
-            libc::EPOLL_CTL_ADD,
-            fd.as_raw_fd(),
-            event as *const _ as *mut _,
-        )
-    };
-    if ret == -1 {
-        return Err(io::Error::last_os_error());
-    }
-    Ok(())
-}
+    #[clap(flatten)]
+    handler: HandlerArgs,
 
-fn epoll_ctl_del(epoll_fd: &impl AsRawFd, fd: &impl AsRawFd) -> io::Result<()> {
-    let ret = unsafe {
-        libc::epoll_ctl(
-            epoll_fd.as_raw_fd(),
-            libc::EPOLL_CTL_DEL,
-            fd.as_raw_fd(),
-            ptr::null_mut(),
-        )
-    };
-    if ret == -1 {
-        return Err(io::Error::last_os_error());
-    }
-    Ok(())
-}
+    /// Maximum number of connections accepted per listener wakeup, so that a connection storm
+    /// cannot starve established clients.
+    #[clap(long, default_value_t = 64)]
+    accept_batch: usize,
 
-fn epoll_wait(
-    epoll_fd: &impl AsRawFd,
-    events: *mut libc::epoll_event,
-    capacity: i32,
-    timeout: i32,
-) -> io::Result<i32> {
-    let ret = unsafe { libc::epoll_wait(epoll_fd.as_raw_fd(), events, capacity, timeout) };
-    if ret == -1 {
-        return Err(io::Error::last_os_error());
-    }
-    Ok(ret)
-}
+    /// Give every connection a receive buffer of this many KiB, mapped twice back to back so that
+    /// messages split across reads are parsed in place instead of copied, or 0 to read every
+    /// connection into a shared 4 KiB buffer.
+    #[clap(long, default_value_t = 0)]
+    recv_ring: usize,
 
-fn read(fd: &impl AsRawFd, buf: &mut [MaybeUninit<u8>]) -> io::Result<isize> {
-    let ret = unsafe { libc::read(fd.as_raw_fd(), buf.as_mut_ptr().cast(), buf.len()) };
-    if ret == -1 {
-        return Err(io::Error::last_os_error());
-    }
-    Ok(ret)
-}
+    #[clap(flatten)]
+    listen: ListenArgs,
 
-fn handle_event(event: &libc::epoll_event, epoll_fd: BorrowedFd, socket: &TcpListener) {
-    // The user data is `u64::MAX` for the server socket and the client file descriptor for client
-    // sockets.
-    if event.u64 == u64::MAX {
-        loop {
-            let (client, _addr) = match socket.accept() {
-                Ok(ret) => ret,
-                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
-                Err(err) => panic!("failed to accept: {err}"),
-            };
+    #[clap(flatten)]
+    pipeline: PipelineArgs,
 
-            epoll_ctl_add(
-                &epoll_fd,
-                &client,
-                &libc::epoll_event {
-                    events: libc::EPOLLIN as u32,
-                    u64: client.as_raw_fd() as u64,
-                },
-            )
-            .unwrap();
+    #[clap(flatten)]
+    balance: BalanceArgs,
 
-            let _fd = client.into_raw_fd();
-        }
-    } else {
-        let fd: RawFd = event.u64 as i32;
+    #[clap(flatten)]
+    numa: NumaArgs,
 
-        loop {
-            let mut buf = [MaybeUninit::uninit(); 4096];
-            let n = match read(&fd, &mut buf) {
-                Ok(ret) => ret,
-                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
-                Err(err) => panic!("failed to read: {err}"),
-            };
-            if n == 0 {
-                epoll_ctl_del(&epoll_fd, &fd).unwrap();
-                drop(unsafe { OwnedFd::from_raw_fd(fd) });
-            }
-        }
-    }
+    #[clap(flatten)]
+    report: ReportArgs,
 }
 
 fn main() {
     let args = Args::parse();
-
-    let listener = TcpListener::bind(&args.bind).unwrap();
-    listener.set_nonblocking(true).unwrap();
-
-    let epoll_fd = epoll_create1(libc::EPOLL_CLOEXEC).unwrap();
-
-    epoll_ctl_add(
-        &epoll_fd,
-        &listener,
-        &libc::epoll_event {
-            events: libc::EPOLLIN as u32,
-            u64: u64::MAX,
+    check_options(
+        &args.handler,
+        &ServerOptions {
+            sockets: true,
+            workers: args.pipeline.workers,
+            balance: args.balance.balance_interval > 0,
+            recv_ring: args.recv_ring > 0,
+            ..Default::default()
         },
-    )
-    .unwrap();
-
-    let mut events = Vec::with_capacity(1024);
-
-    loop {
-        let n = epoll_wait(&epoll_fd, events.as_mut_ptr(), events.capacity() as i32, 0).unwrap();
-        unsafe {
-            events.set_len(n as usize);
-        }
-
-        for event in &events {
-            handle_event(&event, epoll_fd.as_fd(), &listener);
-        }
+    );
+
+    // Every connection holds a file descriptor, or a slot in a registered file table which is
+    // bounded by the same limit.
+    let fd_limit = raise_fd_limit().expect("failed to raise the file descriptor limit");
+    eprintln!("file descriptor limit: {fd_limit}");
+
+    // Bind every listener before starting the threads so that no connection is refused while the
+    // server is starting up.
+    let listeners: Vec<_> = (0..args.threads)
+        .map(|_| bind_reuseport(&args.bind, &args.listen).unwrap())
+        .collect();
+
+    let interface = interface_for_bind(&args.bind);
+    let threads = args.pipeline.threads(args.threads);
+    let mut placements = place(&args.numa, interface.as_deref(), threads);
+    if args.listen.steer_by_cpu {
+        let cpus = pin_threads(&mut placements[..args.threads]);
+        steer_by_cpu(&listeners[0], &cpus).expect("failed to attach the reuseport program");
     }
+    let metrics = start_reporter(threads, &args.report);
+    let workers = assign_workers(args.threads, args.pipeline.workers, &placements, &metrics);
+    let balances =
+        Balance::for_balancers(Balancer::for_threads(args.threads, &metrics, &args.balance));
+
+    let accept = AcceptOptions {
+        batch: args.accept_batch,
+        read_first: args.listen.defer_accept.is_some(),
+        check_cpu: args.listen.steer_by_cpu,
+    };
+    let servers = listeners
+        .into_iter()
+        .zip(workers)
+        .zip(balances)
+        .map(|((listener, workers), balance)| Server {
+            listener,
+            accept,
+            workers,
+            blocks: args.pipeline.blocks,
+            balance,
+            ring_capacity: args.recv_ring << 10,
+        })
+        .collect();
+    serve_with_handler(servers, &placements, &args.handler, metrics);
 }
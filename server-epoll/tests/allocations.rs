@@ -0,0 +1,50 @@
+// Checks that the epoll event loop does not allocate once warm, with the handlers that pool their
+// buffers. Needs the `count-allocations` feature.
+use std::{
+    net::{SocketAddr, TcpListener},
+    sync::Arc,
+};
+
+use common::{
+    alloc::check::{assert_no_allocations, http_exchanges, kv_exchanges},
+    http::Http,
+    kv::{Kv, Store},
+};
+use server_epoll::{AcceptOptions, Server};
+
+fn server(ring_capacity: usize) -> (Server, SocketAddr) {
+    let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+    let addr = listener.local_addr().unwrap();
+    let server = Server {
+        listener,
+        accept: AcceptOptions {
+            batch: 64,
+            read_first: false,
+            check_cpu: false,
+        },
+        workers: Vec::new(),
+        blocks: 0,
+        balance: None,
+        ring_capacity,
+    };
+    (server, addr)
+}
+
+#[test]
+fn http_does_not_allocate() {
+    let (server, addr) = server(0);
+    assert_no_allocations(server, addr, Http::default(), http_exchanges());
+}
+
+#[test]
+fn http_with_rings_does_not_allocate() {
+    let (server, addr) = server(16 * 1024);
+    assert_no_allocations(server, addr, Http::default(), http_exchanges());
+}
+
+#[test]
+fn kv_does_not_allocate() {
+    let (server, addr) = server(0);
+    let kv = Kv::new(Arc::new(Store::new(1, 16)));
+    assert_no_allocations(server, addr, kv, kv_exchanges());
+}
@@ -0,0 +1,67 @@
+use std::{
+    env,
+    ffi::CString,
+    time::{Duration, Instant},
+};
+
+use common::{engine::Discard, metrics::Metrics};
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use io_uring::{cqueue, squeue, IoUring};
+use server_io_uring_zcrx::{Completion, Dispatcher, AREA_SIZE, RQ_ENTRIES};
+
+// Not exported by the io-uring crate.
+const IORING_CQE_F_MORE: u32 = 1 << 1;
+
+const CLIENT: u64 = 1;
+const RECV_LEN: i32 = 1448;
+// The receive area is split into buffers of one page.
+const PAGE_SIZE: u64 = 4096;
+
+// Registering an interface queue needs a NIC with header split and flow steering, so this only
+// runs when `ZCRX_INTERFACE` and `ZCRX_QUEUE` name a queue that is set up for it.
+fn interface_queue() -> Option<(u32, u32)> {
+    let interface = CString::new(env::var("ZCRX_INTERFACE").ok()?).unwrap();
+    let queue = env::var("ZCRX_QUEUE").ok()?.parse().unwrap();
+    let interface_index = unsafe { libc::if_nametoindex(interface.as_ptr()) };
+    assert_ne!(interface_index, 0, "unknown interface");
+    Some((interface_index, queue))
+}
+
+fn refill(c: &mut Criterion) {
+    let Some((interface_index, queue)) = interface_queue() else {
+        eprintln!("skipping the zcrx benchmarks: ZCRX_INTERFACE and ZCRX_QUEUE are not set");
+        return;
+    };
+    let metrics = Metrics::default();
+    let mut sq: Vec<squeue::Entry> = Vec::with_capacity(4);
+
+    // Every receive completion pushes its buffer to the refill queue, which only the kernel
+    // drains as it receives packets. Each sample therefore registers the queue again, times as
+    // many completions as the refill queue holds, and scales the result to the requested count.
+    c.bench_function("completion/recv+refill", |b| {
+        b.iter_custom(|iters| {
+            let io_uring: IoUring<squeue::Entry, cqueue::Entry32> =
+                IoUring::builder().build(32).unwrap();
+            let mut dispatcher =
+                Dispatcher::new(&io_uring, interface_index, queue, Discard, &metrics).unwrap();
+            let count = iters.min(u64::from(RQ_ENTRIES));
+            let start = Instant::now();
+            for i in 0..count {
+                let recv = Completion {
+                    user_data: CLIENT,
+                    result: RECV_LEN,
+                    flags: IORING_CQE_F_MORE,
+                    area_token: 0,
+                    buffer_offset: i * PAGE_SIZE % AREA_SIZE as u64,
+                };
+                dispatcher.handle_completion(black_box(recv), &mut sq);
+                sq.clear();
+            }
+            let elapsed = start.elapsed();
+            Duration::from_secs_f64(elapsed.as_secs_f64() * iters as f64 / count as f64)
+        })
+    });
+}
+
+criterion_group!(benches, refill);
+criterion_main!(benches);
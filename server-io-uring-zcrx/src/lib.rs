@@ -0,0 +1,322 @@
+use std::{collections::HashMap, io, mem, net::TcpListener, os::fd::AsRawFd};
+
+use common::{
+    engine::{Engine, Handler},
+    metrics::Metrics,
+};
+use io_uring::{
+    cqueue,
+    opcode::{AcceptMulti, FilesUpdate, RecvZcMulti, Send},
+    squeue,
+    types::Fixed,
+    IoUring, SubmissionQueue,
+};
+use io_uring_zcrx::{IoUringZcrxIfq, ZcrxCqe};
+
+// Size of the refill queue and of the receive area registered with every interface queue.
+pub const RQ_ENTRIES: u32 = 32;
+pub const AREA_SIZE: usize = 16384;
+
+// The fields of a CQE that the dispatcher reads. Taking them instead of the CQE lets benchmarks
+// drive the dispatcher with synthetic completions.
+#[derive(Clone, Copy)]
+pub struct Completion {
+    pub user_data: u64,
+    pub result: i32,
+    pub flags: u32,
+    pub area_token: u64,
+    pub buffer_offset: u64,
+}
+
+impl From<&cqueue::Entry32> for Completion {
+    fn from(cqe: &cqueue::Entry32) -> Self {
+        let rcqe = ZcrxCqe::from(cqe.clone());
+        Completion {
+            user_data: cqe.user_data(),
+            result: cqe.result(),
+            flags: cqe.flags(),
+            area_token: rcqe.area_token(),
+            buffer_offset: rcqe.buffer_offset(),
+        }
+    }
+}
+
+// Where the dispatcher pushes new SQEs: the submission queue of the ring, or a vector in
+// benchmarks.
+pub trait Submit {
+    fn push(&mut self, entry: &squeue::Entry);
+}
+
+impl Submit for SubmissionQueue<'_, squeue::Entry> {
+    fn push(&mut self, entry: &squeue::Entry) {
+        unsafe {
+            SubmissionQueue::push(self, entry).unwrap();
+        }
+    }
+}
+
+impl Submit for Vec<squeue::Entry> {
+    fn push(&mut self, entry: &squeue::Entry) {
+        Vec::push(self, entry.clone());
+    }
+}
+
+fn push_recv(sq: &mut impl Submit, file_index: u32) {
+    let recv = RecvZcMulti::new(Fixed(file_index))
+        .build()
+        .user_data(file_index.into());
+    sq.push(&recv);
+}
+
+// Flag in the user data of sends, whose lower 32 bits hold the file index of the client.
+pub const SEND: u64 = 1 << 32;
+
+// Reply state of a client. Only one send is in flight per client so that replies are never
+// reordered; replies made in the meantime are queued behind it. Replies are built in memory of
+// their own so that the receive buffer can be refilled immediately.
+#[derive(Default)]
+struct Reply {
+    sending: Vec<u8>,
+    sent: usize,
+    queued: Vec<u8>,
+    // The client is gone but its file index must stay registered until the send completes.
+    closed: bool,
+}
+
+// Reply state by file index, only for the clients with a send in flight, so that idle connections
+// cost no memory in user space.
+type Replies = HashMap<u32, Reply>;
+
+fn push_send(sq: &mut impl Submit, file_index: u32, reply: &Reply) {
+    let buf = &reply.sending[reply.sent..];
+    let send = Send::new(Fixed(file_index), buf.as_ptr(), buf.len() as u32)
+        .build()
+        .user_data(SEND | u64::from(file_index));
+    sq.push(&send);
+}
+
+fn push_unregister(sq: &mut impl Submit, file_index: u32) {
+    const DELETE: i32 = -1;
+    let unregister = FilesUpdate::new(&DELETE as *const _, 1)
+        .offset(file_index as i32)
+        .build()
+        .user_data(u64::MAX);
+    sq.push(&unregister);
+}
+
+// Sends `out` and leaves it empty. An idle client takes over the buffer of `out` instead of copying
+// it.
+fn reply(sq: &mut impl Submit, file_index: u32, replies: &mut Replies, out: &mut Vec<u8>) {
+    let reply = replies.entry(file_index).or_default();
+    if reply.sending.is_empty() {
+        mem::swap(&mut reply.sending, out);
+        push_send(sq, file_index, reply);
+    } else {
+        reply.queued.extend_from_slice(out);
+    }
+    out.clear();
+}
+
+fn handle_send(
+    cqe_result: i32,
+    sq: &mut impl Submit,
+    file_index: u32,
+    replies: &mut Replies,
+    metrics: &Metrics,
+) {
+    let reply = replies.get_mut(&file_index).unwrap();
+    if cqe_result < 0 {
+        // The receive side notices the broken connection as well and unregisters it.
+        eprintln!("send failed: {cqe_result}");
+        metrics.errors.add(1);
+        reply.queued.clear();
+    } else {
+        reply.sent += cqe_result as usize;
+        if reply.sent < reply.sending.len() {
+            push_send(sq, file_index, reply);
+            return;
+        }
+        if !reply.queued.is_empty() {
+            reply.sending = mem::take(&mut reply.queued);
+            reply.sent = 0;
+            push_send(sq, file_index, reply);
+            return;
+        }
+    }
+    if replies.remove(&file_index).unwrap().closed {
+        push_unregister(sq, file_index);
+    }
+}
+
+// Per-thread state that completions are dispatched to.
+pub struct Dispatcher<'a, H> {
+    zcrx_ifq: IoUringZcrxIfq,
+    handler: H,
+    // Reply of the handler to the last receive.
+    out: Vec<u8>,
+    replies: Replies,
+    metrics: &'a Metrics,
+}
+
+impl<'a, H: Handler> Dispatcher<'a, H> {
+    // Registers `queue` of the interface with the ring, so that it is exclusively used for
+    // zero-copy receive until the ring is dropped.
+    pub fn new(
+        io_uring: &IoUring<squeue::Entry, cqueue::Entry32>,
+        interface_index: u32,
+        queue: u32,
+        handler: H,
+        metrics: &'a Metrics,
+    ) -> io::Result<Self> {
+        Ok(Dispatcher {
+            zcrx_ifq: IoUringZcrxIfq::register(
+                io_uring,
+                interface_index,
+                queue,
+                RQ_ENTRIES,
+                AREA_SIZE,
+            )?,
+            handler,
+            out: Vec::new(),
+            replies: Replies::new(),
+            metrics,
+        })
+    }
+
+    pub fn handle_completion(&mut self, cqe: Completion, sq: &mut impl Submit) {
+        let metrics = self.metrics;
+
+        if cqe.user_data == u64::MAX {
+            // FILES_UPDATE operation to unregister a client.
+            return;
+        }
+        if cqe.user_data & SEND != 0 {
+            let file_index = cqe.user_data as u32;
+            handle_send(cqe.result, sq, file_index, &mut self.replies, metrics);
+            return;
+        }
+
+        // To make things simpler, the user data in SQEs will represent the file index of the
+        // server or client socket.
+        let file_index = cqe.user_data as u32;
+        if file_index == 0 {
+            if !cqueue::more(cqe.flags) {
+                // The multishot accept was terminated, for example because the file table is full.
+                let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
+                sq.push(&accept);
+            }
+            let ret = cqe.result;
+            if ret < 0 {
+                eprintln!("accept failed: {ret}");
+                metrics.errors.add(1);
+                return;
+            }
+            metrics.accepts.add(1);
+            push_recv(sq, ret as u32);
+        } else {
+            let ret = cqe.result;
+            metrics.recvs.add(1);
+            if ret == -libc::ENOBUFS {
+                // The buffers ran out, which terminates the multishot receive but not the
+                // connection.
+                metrics.errors.add(1);
+                push_recv(sq, file_index);
+                return;
+            }
+            // Clients may close with a RST to avoid `TIME_WAIT`, which is not worth reporting.
+            if ret < 0 && ret != -libc::ECONNRESET {
+                eprintln!("recv failed: {ret}");
+                metrics.errors.add(1);
+            }
+            if ret <= 0 {
+                // Unregister the client socket, once its last reply is sent.
+                match self.replies.get_mut(&file_index) {
+                    Some(reply) => reply.closed = true,
+                    None => push_unregister(sq, file_index),
+                }
+                self.handler.on_close(file_index);
+                metrics.closes.add(1);
+            } else {
+                metrics.bytes.add(ret as u64);
+                if !cqueue::more(cqe.flags) {
+                    push_recv(sq, file_index);
+                }
+                assert_eq!(cqe.area_token, 0);
+                let buf = unsafe {
+                    self.zcrx_ifq
+                        .get_buf(cqe.buffer_offset, ret as usize)
+                        .unwrap()
+                };
+                self.handler.on_recv(file_index, &buf, &mut self.out);
+                if !self.out.is_empty() {
+                    reply(sq, file_index, &mut self.replies, &mut self.out);
+                }
+                let rqe = buf.into_refill_entry();
+                unsafe { self.zcrx_ifq.refill().push(&rqe).unwrap() };
+            }
+        }
+    }
+}
+
+// One io_uring event loop thread serving a `SO_REUSEPORT` listener, whose connections are
+// steered to `queue` of the interface.
+pub struct Server {
+    pub listener: TcpListener,
+    pub interface_index: u32,
+    pub queue: u32,
+    // Size of the registered file table.
+    pub files: u32,
+}
+
+impl Engine for Server {
+    fn run<H: Handler>(self, handler: H, metrics: &Metrics) {
+        run(self, handler, metrics)
+    }
+}
+
+fn run<H: Handler>(server: Server, handler: H, metrics: &Metrics) {
+    let Server {
+        listener,
+        interface_index,
+        queue,
+        files,
+    } = server;
+    metrics.init_thread();
+
+    let mut io_uring = IoUring::builder()
+        .setup_coop_taskrun()
+        .setup_defer_taskrun()
+        .setup_single_issuer()
+        .build(32)
+        .expect("failed to create io_uring instance");
+
+    let submitter = io_uring.submitter();
+    // Register a big file table to store server and client sockets.
+    submitter.register_files_sparse(files).unwrap();
+    submitter
+        .register_files_update(0, &[listener.as_raw_fd()])
+        .unwrap();
+
+    let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
+    unsafe {
+        io_uring.submission().push(&accept).unwrap();
+    }
+
+    let mut dispatcher =
+        Dispatcher::new(&io_uring, interface_index, queue, handler, metrics).unwrap();
+
+    loop {
+        let (submitter, mut sq, cq) = io_uring.split();
+        // Every completion pushes at most two entries, so only reap as many as fit in the
+        // submission queue; the rest stay in the completion queue for the next iteration.
+        let budget = (sq.capacity() - sq.len()) / 2;
+        for cqe in cq.take(budget) {
+            metrics.events.add(1);
+            dispatcher.handle_completion(Completion::from(&cqe), &mut sq);
+        }
+        // Synchronize the submission queue with the kernel.
+        drop(sq);
+        submitter.submit_and_wait(1).unwrap();
+        metrics.waits.add(1);
+    }
+}
@@ -1,20 +1,41 @@
-use std::{ffi::CString, io, net::TcpListener, os::fd::AsRawFd};
+use std::{ffi::CString, io};
 
 use clap::Parser;
-use io_uring::{
-    cqueue,
-    opcode::{AcceptMulti, FilesUpdate, RecvZcMulti},
-    squeue,
-    types::Fixed,
-    IoUring, SubmissionQueue,
+use common::{
+    engine::{check_options, serve_with_handler, HandlerArgs, ServerOptions},
+    metrics::{start_reporter, ReportArgs},
+    net::{bind_reuseport, raise_fd_limit, steer_by_cpu, ListenArgs},
+    numa::{pin_threads, place, NumaArgs},
 };
-use io_uring_zcrx::{IoUringZcrxIfq, ZcrxCqe};
+use server_io_uring_zcrx::Server;
 
 #[derive(clap::Parser)]
 struct Args {
     #[clap(short, long)]
     bind: String,
 
+    /// Number of event loop threads, each with its own `SO_REUSEPORT` listener and io_uring
+    /// instance. Thread `i` receives from queue `queue + i`.
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    #[clap(flatten)]
+    handler: HandlerArgs,
+
+    /// Size of the registered file table, which bounds the number of concurrent connections per
+    /// thread. Accepted sockets are installed directly into it as direct descriptors.
+    #[clap(long, default_value_t = 128)]
+    files: u32,
+
+    #[clap(flatten)]
+    listen: ListenArgs,
+
+    #[clap(flatten)]
+    numa: NumaArgs,
+
+    #[clap(flatten)]
+    report: ReportArgs,
+
     #[clap(short, long)]
     interface: String,
 
@@ -22,102 +43,62 @@ struct Args {
     queue: u32,
 }
 
-fn handle_completion(
-    cqe: &cqueue::Entry32,
-    sq: &mut SubmissionQueue<squeue::Entry>,
-    zcrx_ifq: &mut IoUringZcrxIfq,
-) {
-    if cqe.user_data() == u64::MAX {
-        // FILES_UPDATE operation to unregister a client.
-        return;
-    }
-
-    // To make things simpler, the user data in SQEs will represent the file index of the
-    // server or client socket.
-    let file_index = cqe.user_data() as u32;
-    if file_index == 0 {
-        let ret = cqe.result();
-        if ret < 0 {
-            panic!("accept failed: {ret}");
-        }
-        let file_index = ret as u32;
-        let recv = RecvZcMulti::new(Fixed(file_index))
-            .build()
-            .user_data(file_index.into());
-        unsafe {
-            sq.push(&recv).unwrap();
-        }
-    } else {
-        let ret = cqe.result();
-        if ret < 0 {
-            eprintln!("recv failed: {ret}");
-        }
-        if ret <= 0 {
-            // Unregister the client socket.
-            const DELETE: i32 = -1;
-            let unregister = FilesUpdate::new(&DELETE as *const _, 1)
-                .offset(file_index as i32)
-                .build()
-                .user_data(u64::MAX);
-            unsafe {
-                sq.push(&unregister).unwrap();
-            }
-        } else {
-            let available_len = ret as usize;
-            let rcqe = ZcrxCqe::from(cqe.clone());
-            assert_eq!(rcqe.area_token(), 0);
-            let buf = unsafe {
-                zcrx_ifq
-                    .get_buf(rcqe.buffer_offset(), available_len)
-                    .unwrap()
-            };
-            let rqe = buf.into_refill_entry();
-            unsafe { zcrx_ifq.refill().push(&rqe).unwrap() };
-        }
-    }
-}
-
 fn main() {
     let args = Args::parse();
+    check_options(
+        &args.handler,
+        &ServerOptions {
+            sockets: true,
+            ..Default::default()
+        },
+    );
+    // Zero-copy receive does not deliver control messages.
+    assert!(
+        !args.report.rx_timestamps,
+        "--rx-timestamps is not supported with zero-copy receive"
+    );
 
-    let interface_cstring = CString::new(args.interface).unwrap();
+    let interface_cstring = CString::new(args.interface.as_str()).unwrap();
     let interface_index = unsafe { libc::if_nametoindex(interface_cstring.as_c_str().as_ptr()) };
     if interface_index == 0 {
         let err = io::Error::last_os_error();
         panic!("failed to convert interface name: {err}");
     }
 
-    let mut io_uring = IoUring::builder()
-        .setup_coop_taskrun()
-        .setup_defer_taskrun()
-        .setup_single_issuer()
-        .build(32)
-        .expect("failed to create io_uring instance");
-
-    let listener = TcpListener::bind(&args.bind).unwrap();
-
-    let submitter = io_uring.submitter();
-    // Register a big file table to store server and client sockets.
-    submitter.register_files_sparse(128).unwrap();
-    submitter
-        .register_files_update(0, &[listener.as_raw_fd()])
-        .unwrap();
-
-    let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
-    unsafe {
-        io_uring.submission().push(&accept).unwrap();
-    }
+    // Every connection holds a file descriptor, or a slot in a registered file table which is
+    // bounded by the same limit.
+    let fd_limit = raise_fd_limit().expect("failed to raise the file descriptor limit");
+    eprintln!("file descriptor limit: {fd_limit}");
+    // Each slot of a registered file table is a pointer in the kernel.
+    eprintln!(
+        "file table: {} slots per thread, {} KiB in the kernel",
+        args.files,
+        args.files as usize * 8 / 1024,
+    );
+
+    // Bind every listener before starting the threads so that no connection is refused while the
+    // server is starting up.
+    let listeners: Vec<_> = (0..args.threads)
+        .map(|_| bind_reuseport(&args.bind, &args.listen).unwrap())
+        .collect();
 
-    let mut zcrx_ifq =
-        IoUringZcrxIfq::register(&io_uring, interface_index, args.queue, 32, 16384).unwrap();
-
-    loop {
-        let (submitter, mut sq, cq) = io_uring.split();
-        for cqe in cq {
-            handle_completion(&cqe, &mut sq, &mut zcrx_ifq);
-        }
-        // Synchronize the submission queue with the kernel.
-        drop(sq);
-        submitter.submit_and_wait(1).unwrap();
+    let mut placements = place(&args.numa, Some(&args.interface), args.threads);
+    if args.listen.steer_by_cpu {
+        let cpus = pin_threads(&mut placements);
+        steer_by_cpu(&listeners[0], &cpus).expect("failed to attach the reuseport program");
     }
+    let metrics = start_reporter(args.threads, &args.report);
+
+    // `setup_single_issuer` requires each ring to be created on the thread that submits to it.
+    let servers = listeners
+        .into_iter()
+        .zip(args.queue..)
+        .map(|(listener, queue)| Server {
+            listener,
+            interface_index,
+            queue,
+            files: args.files,
+        })
+        .collect();
+    serve_with_handler(servers, &placements, &args.handler, metrics);
 }
@@ -0,0 +1,103 @@
+use common::{
+    engine::{Discard, Echo},
+    metrics::Metrics,
+};
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use io_uring::{squeue, IoUring};
+use server_io_uring::{
+    BufRing, Completion, Dispatcher, GroupOptions, BUF_RING_ENTRIES, BUF_SIZE, SEND,
+};
+
+// Not exported by the io-uring crate.
+const IORING_CQE_F_BUFFER: u32 = 1 << 0;
+const IORING_CQE_F_MORE: u32 = 1 << 1;
+const IORING_CQE_BUFFER_SHIFT: u32 = 16;
+
+const CLIENT: u64 = 1;
+const RECV_LEN: i32 = 1448;
+
+fn recv(id: &mut u32) -> Completion {
+    let completion = Completion {
+        user_data: CLIENT,
+        result: RECV_LEN,
+        flags: IORING_CQE_F_MORE | IORING_CQE_F_BUFFER | (*id << IORING_CQE_BUFFER_SHIFT),
+    };
+    *id = (*id + 1) % u32::from(BUF_RING_ENTRIES);
+    completion
+}
+
+// Feeds synthetic completions to the dispatcher. The buffer ring is registered with a real ring
+// that is never submitted to, and new SQEs go to a vector that is cleared after every completion.
+fn completions(c: &mut Criterion) {
+    let io_uring = IoUring::new(32).unwrap();
+    let metrics = Metrics::default();
+    let groups = GroupOptions::single(BUF_RING_ENTRIES);
+    let mut dispatcher = Dispatcher::new(&io_uring, Discard, &groups, &metrics).unwrap();
+    let mut sq: Vec<squeue::Entry> = Vec::with_capacity(4);
+
+    let mut group = c.benchmark_group("completion");
+    group.bench_function("accept", |b| {
+        let accept = Completion {
+            user_data: 0,
+            result: CLIENT as i32,
+            flags: IORING_CQE_F_MORE,
+        };
+        b.iter(|| {
+            dispatcher.handle_completion(black_box(accept), &mut sq);
+            sq.clear();
+        })
+    });
+    group.bench_function("recv", |b| {
+        let mut id = 0;
+        b.iter(|| {
+            dispatcher.handle_completion(black_box(recv(&mut id)), &mut sq);
+            sq.clear();
+        })
+    });
+    group.bench_function("close", |b| {
+        let close = Completion {
+            user_data: CLIENT,
+            result: 0,
+            flags: 0,
+        };
+        b.iter(|| {
+            dispatcher.handle_completion(black_box(close), &mut sq);
+            sq.clear();
+        })
+    });
+    group.finish();
+
+    // The receive completion copies the payload and pushes a send, whose completion is fed back
+    // right away.
+    let io_uring = IoUring::new(32).unwrap();
+    let mut dispatcher = Dispatcher::new(&io_uring, Echo, &groups, &metrics).unwrap();
+    let sent = Completion {
+        user_data: SEND | CLIENT,
+        result: RECV_LEN,
+        flags: 0,
+    };
+    c.bench_function("completion/recv+reply", |b| {
+        let mut id = 0;
+        b.iter(|| {
+            dispatcher.handle_completion(black_box(recv(&mut id)), &mut sq);
+            dispatcher.handle_completion(black_box(sent), &mut sq);
+            sq.clear();
+        })
+    });
+}
+
+fn buf_ring(c: &mut Criterion) {
+    let io_uring = IoUring::new(32).unwrap();
+    let mut buf_ring = BufRing::new(&io_uring, BUF_RING_ENTRIES, 0, BUF_SIZE).unwrap();
+    c.bench_function("buf_ring/get+recycle", |b| {
+        let mut id = 0;
+        b.iter(|| {
+            black_box(unsafe { buf_ring.get(id, RECV_LEN as usize) });
+            buf_ring.recycle(id);
+            id = (id + 1) % BUF_RING_ENTRIES;
+        })
+    });
+}
+
+criterion_group!(benches, completions, buf_ring);
+criterion_main!(benches);
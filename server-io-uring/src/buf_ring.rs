@@ -0,0 +1,106 @@
+use std::{
+    io, ptr, slice,
+    sync::atomic::{AtomicU16, Ordering},
+};
+
+use io_uring::{types::BufRingEntry, IoUring};
+
+fn mmap_anonymous(len: usize) -> io::Result<*mut u8> {
+    let ptr = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+            -1,
+            0,
+        )
+    };
+    if ptr == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ptr.cast())
+}
+
+// A ring of provided buffers registered with io_uring. A buffer picked by the kernel stays out of
+// the ring until it is explicitly recycled, so it can outlive the completion that filled it, for
+// example until a write of its contents completes.
+pub struct BufRing {
+    entries: *mut BufRingEntry,
+    count: u16,
+    // Local copy of the tail that is published to the kernel.
+    tail: u16,
+    memory: *mut u8,
+    buf_size: usize,
+}
+
+impl BufRing {
+    // Registers `count` buffers of `buf_size` bytes as group `group`. `count` must be a power of
+    // two.
+    pub fn new(io_uring: &IoUring, count: u16, group: u16, buf_size: usize) -> io::Result<Self> {
+        assert!(count.is_power_of_two());
+        let entries = mmap_anonymous(count as usize * size_of::<BufRingEntry>())?;
+        let memory = mmap_anonymous(count as usize * buf_size)?;
+        let mut buf_ring = BufRing {
+            entries: entries.cast(),
+            count,
+            tail: 0,
+            memory,
+            buf_size,
+        };
+        unsafe {
+            io_uring
+                .submitter()
+                .register_buf_ring(entries as u64, count, group)?;
+        }
+        for id in 0..count {
+            buf_ring.push(id);
+        }
+        buf_ring.publish();
+        Ok(buf_ring)
+    }
+
+    fn push(&mut self, id: u16) {
+        let entry = unsafe { &mut *self.entries.add((self.tail & (self.count - 1)) as usize) };
+        entry.set_addr(self.memory as u64 + id as u64 * self.buf_size as u64);
+        entry.set_len(self.buf_size as u32);
+        entry.set_bid(id);
+        self.tail = self.tail.wrapping_add(1);
+    }
+
+    fn publish(&self) {
+        let tail = unsafe { &*BufRingEntry::tail(self.entries).cast::<AtomicU16>() };
+        tail.store(self.tail, Ordering::Release);
+    }
+
+    pub fn buf_size(&self) -> usize {
+        self.buf_size
+    }
+
+    // Returns the first `len` bytes of buffer `id`.
+    //
+    // Safety: the kernel must have filled buffer `id` with at least `len` bytes, and the buffer
+    // must not have been recycled since.
+    pub unsafe fn get(&self, id: u16, len: usize) -> &[u8] {
+        assert!(id < self.count && len <= self.buf_size);
+        slice::from_raw_parts(self.memory.add(id as usize * self.buf_size), len)
+    }
+
+    // Gives buffer `id` back to the kernel.
+    pub fn recycle(&mut self, id: u16) {
+        self.push(id);
+        self.publish();
+    }
+}
+
+impl Drop for BufRing {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(
+                self.entries.cast(),
+                self.count as usize * size_of::<BufRingEntry>(),
+            );
+            libc::munmap(self.memory.cast(), self.count as usize * self.buf_size);
+        }
+    }
+}
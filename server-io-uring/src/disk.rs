@@ -0,0 +1,529 @@
+use std::{
+    collections::HashMap,
+    fs::{File, OpenOptions},
+    io,
+    os::{fd::AsRawFd, unix::fs::OpenOptionsExt},
+    path::PathBuf,
+    ptr,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+use common::metrics::Metrics;
+use io_uring::{
+    opcode::{Fsync, Write},
+    types::{Fd, FsyncFlags},
+};
+
+use crate::Submit;
+
+#[derive(clap::Args)]
+pub struct DiskArgs {
+    /// Append everything received to files in this directory, one per connection unless
+    /// `--shared-file` is given. Receive buffers go back to the ring once their write completes.
+    #[clap(long)]
+    pub write_dir: Option<PathBuf>,
+
+    /// Append the bytes of all connections and threads, in the order they arrive, to a single
+    /// file.
+    #[clap(long)]
+    pub shared_file: bool,
+
+    /// Open the files with `O_DIRECT`, copying received bytes into aligned buffers that are
+    /// written once full. Not supported with `--shared-file`.
+    #[clap(long)]
+    pub direct: bool,
+
+    /// Size of the aligned buffers of `--direct` in KiB, a multiple of 4.
+    #[clap(long, default_value_t = 1024)]
+    pub direct_buffer: usize,
+
+    /// Call `fdatasync` on a file once this many MiB were written to it since the last call, or
+    /// never with 0.
+    #[clap(long, default_value_t = 0)]
+    pub fsync_bytes: u64,
+
+    /// Call `fdatasync` on every file written to since the last call every this many
+    /// milliseconds, or never with 0.
+    #[clap(long, default_value_t = 0)]
+    pub fsync_interval: u64,
+}
+
+// Alignment of the offsets, lengths and buffers of `O_DIRECT` writes, the largest logical block
+// size of common devices.
+const ALIGN: usize = 4096;
+
+// Flags in the user data of writes, whose lower 32 bits hold the index of the write, and of
+// fsyncs, whose lower 32 bits hold the index of the file.
+pub const WRITE: u64 = 1 << 36;
+pub const FSYNC: u64 = 1 << 37;
+
+// The file that all threads append to with `--shared-file`. Each write reserves its range with an
+// atomic add, so writes of different threads never wait for each other.
+struct SharedFile {
+    file: Arc<File>,
+    end: AtomicU64,
+}
+
+// What every thread needs to set up its writer.
+#[derive(Clone)]
+pub struct DiskOptions {
+    dir: PathBuf,
+    shared: Option<Arc<SharedFile>>,
+    // Numbers the files of connections across threads.
+    next_file: Arc<AtomicU64>,
+    direct: bool,
+    direct_buffer: usize,
+    fsync_bytes: u64,
+    fsync_interval: Option<Duration>,
+}
+
+fn open(path: &PathBuf, direct: bool) -> io::Result<File> {
+    let mut options = OpenOptions::new();
+    options.write(true).create(true).truncate(true);
+    if direct {
+        options.custom_flags(libc::O_DIRECT);
+    }
+    options.open(path)
+}
+
+impl DiskOptions {
+    pub fn new(args: &DiskArgs) -> io::Result<Option<Self>> {
+        let Some(dir) = &args.write_dir else {
+            return Ok(None);
+        };
+        assert!(
+            args.direct_buffer > 0 && args.direct_buffer * 1024 % ALIGN == 0,
+            "--direct-buffer must be a multiple of 4"
+        );
+        // Each thread would hold the last partial block of the shared file in its own aligned
+        // buffer, which is only written when a file is closed, and the shared file never is.
+        // Padding it earlier would leave zeros in the middle of the stream.
+        assert!(
+            !(args.shared_file && args.direct),
+            "--direct is not supported with --shared-file"
+        );
+        std::fs::create_dir_all(dir)?;
+        let shared = if args.shared_file {
+            Some(Arc::new(SharedFile {
+                file: Arc::new(open(&dir.join("shared"), args.direct)?),
+                end: AtomicU64::new(0),
+            }))
+        } else {
+            None
+        };
+        Ok(Some(DiskOptions {
+            dir: dir.clone(),
+            shared,
+            next_file: Arc::new(AtomicU64::new(0)),
+            direct: args.direct,
+            direct_buffer: args.direct_buffer * 1024,
+            fsync_bytes: args.fsync_bytes << 20,
+            fsync_interval: (args.fsync_interval > 0)
+                .then(|| Duration::from_millis(args.fsync_interval)),
+        }))
+    }
+}
+
+// An aligned buffer of `O_DIRECT` writes.
+struct Aligned {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Aligned {
+    fn new(len: usize) -> Self {
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert!(ptr != libc::MAP_FAILED, "failed to allocate a write buffer");
+        Aligned {
+            ptr: ptr.cast(),
+            len,
+        }
+    }
+}
+
+impl Drop for Aligned {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr.cast(), self.len) };
+    }
+}
+
+struct OpenFile {
+    file: Arc<File>,
+    shared: bool,
+    // Offset of the next write, for a file of its own.
+    end: u64,
+    // Bytes received, which is shorter than `end` once the last `O_DIRECT` buffer was padded.
+    length: u64,
+    // The aligned buffer being filled and how many bytes it holds.
+    staging: Option<(u32, usize)>,
+    writes: u32,
+    unsynced: u64,
+    syncing: bool,
+    closed: bool,
+}
+
+// Where the bytes of a write are: in a buffer of the receive ring or in an aligned buffer.
+#[derive(Clone, Copy)]
+enum Source {
+    Ring(u16),
+    Aligned(u32),
+}
+
+struct PendingWrite {
+    file: u32,
+    source: Source,
+    ptr: *const u8,
+    len: usize,
+    written: usize,
+    offset: u64,
+}
+
+// The writer of one event loop. Writes carry explicit offsets, so that all the writes of a file
+// can be in flight at once.
+pub struct Disk {
+    options: DiskOptions,
+    files: Vec<Option<OpenFile>>,
+    free_files: Vec<u32>,
+    // File of every connection, or the shared file.
+    conns: HashMap<u32, u32>,
+    writes: Vec<Option<PendingWrite>>,
+    free_writes: Vec<u32>,
+    aligned: Vec<Aligned>,
+    free_aligned: Vec<u32>,
+    next_fsync: Option<Instant>,
+}
+
+impl Disk {
+    pub fn new(options: DiskOptions) -> Self {
+        let mut disk = Disk {
+            next_fsync: options
+                .fsync_interval
+                .map(|interval| Instant::now() + interval),
+            options,
+            files: Vec::new(),
+            free_files: Vec::new(),
+            conns: HashMap::new(),
+            writes: Vec::new(),
+            free_writes: Vec::new(),
+            aligned: Vec::new(),
+            free_aligned: Vec::new(),
+        };
+        if let Some(shared) = &disk.options.shared {
+            let file = shared.file.clone();
+            disk.insert_file(file, true);
+        }
+        disk
+    }
+
+    // Whether receive buffers stay out of the ring until their write completes, rather than being
+    // copied.
+    pub fn holds_buffers(&self) -> bool {
+        !self.options.direct
+    }
+
+    fn insert_file(&mut self, file: Arc<File>, shared: bool) -> u32 {
+        let file = Some(OpenFile {
+            file,
+            shared,
+            end: 0,
+            length: 0,
+            staging: None,
+            writes: 0,
+            unsynced: 0,
+            syncing: false,
+            closed: false,
+        });
+        match self.free_files.pop() {
+            Some(index) => {
+                self.files[index as usize] = file;
+                index
+            }
+            None => {
+                self.files.push(file);
+                self.files.len() as u32 - 1
+            }
+        }
+    }
+
+    // Returns the file of connection `conn`, creating it on its first bytes.
+    fn file_of(&mut self, conn: u32) -> io::Result<u32> {
+        if self.options.shared.is_some() {
+            return Ok(0);
+        }
+        if let Some(&file) = self.conns.get(&conn) {
+            return Ok(file);
+        }
+        let number = self.options.next_file.fetch_add(1, Ordering::Relaxed);
+        let path = self.options.dir.join(format!("conn-{number}"));
+        let file = Arc::new(open(&path, self.options.direct)?);
+        let file = self.insert_file(file, false);
+        self.conns.insert(conn, file);
+        Ok(file)
+    }
+
+    fn take_aligned(&mut self) -> u32 {
+        match self.free_aligned.pop() {
+            Some(index) => index,
+            None => {
+                // The pool grows to the number of buffers that are in flight at once.
+                self.aligned.push(Aligned::new(self.options.direct_buffer));
+                self.aligned.len() as u32 - 1
+            }
+        }
+    }
+
+    fn push_aligned(&mut self, sq: &mut impl Submit, file: u32, index: u32, len: usize) {
+        let ptr = self.aligned[index as usize].ptr;
+        self.push_write(sq, file, Source::Aligned(index), ptr, len);
+    }
+
+    // Reserves the next `len` bytes of `file` and writes `ptr` there.
+    fn push_write(
+        &mut self,
+        sq: &mut impl Submit,
+        file: u32,
+        source: Source,
+        ptr: *const u8,
+        len: usize,
+    ) {
+        let open_file = self.files[file as usize].as_mut().unwrap();
+        let offset = match (&self.options.shared, open_file.shared) {
+            (Some(shared), true) => shared.end.fetch_add(len as u64, Ordering::Relaxed),
+            _ => {
+                open_file.end += len as u64;
+                open_file.end - len as u64
+            }
+        };
+        open_file.writes += 1;
+        let write = PendingWrite {
+            file,
+            source,
+            ptr,
+            len,
+            written: 0,
+            offset,
+        };
+        let index = match self.free_writes.pop() {
+            Some(index) => {
+                self.writes[index as usize] = Some(write);
+                index
+            }
+            None => {
+                self.writes.push(Some(write));
+                self.writes.len() as u32 - 1
+            }
+        };
+        submit_write(
+            sq,
+            &self.files,
+            index,
+            self.writes[index as usize].as_ref().unwrap(),
+        );
+    }
+
+    // Writes `data`, received on `conn` into ring buffer `id`. Returns whether the ring buffer is
+    // held by the write, in which case it is returned by `complete`; with `O_DIRECT` the bytes are
+    // copied and the buffer can be recycled right away.
+    pub fn write(&mut self, sq: &mut impl Submit, conn: u32, data: &[u8], id: u16) -> bool {
+        let file = match self.file_of(conn) {
+            Ok(file) => file,
+            Err(err) => panic!("failed to create a file: {err}"),
+        };
+        self.files[file as usize].as_mut().unwrap().length += data.len() as u64;
+        if !self.options.direct {
+            self.push_write(sq, file, Source::Ring(id), data.as_ptr(), data.len());
+            return true;
+        }
+
+        let size = self.options.direct_buffer;
+        let mut data = data;
+        while !data.is_empty() {
+            let (index, fill) = match self.files[file as usize].as_ref().unwrap().staging {
+                Some(staging) => staging,
+                None => (self.take_aligned(), 0),
+            };
+            let n = data.len().min(size - fill);
+            let buffer = &self.aligned[index as usize];
+            unsafe { ptr::copy_nonoverlapping(data.as_ptr(), buffer.ptr.add(fill), n) };
+            data = &data[n..];
+            if fill + n == size {
+                self.files[file as usize].as_mut().unwrap().staging = None;
+                self.push_aligned(sq, file, index, size);
+            } else {
+                self.files[file as usize].as_mut().unwrap().staging = Some((index, fill + n));
+            }
+        }
+        false
+    }
+
+    // Writes what is left of the file of `conn` and closes it once all its writes completed.
+    pub fn close(&mut self, sq: &mut impl Submit, conn: u32) {
+        let Some(file) = self.conns.remove(&conn) else {
+            return;
+        };
+        let open_file = self.files[file as usize].as_mut().unwrap();
+        open_file.closed = true;
+        if let Some((index, fill)) = open_file.staging.take() {
+            // `O_DIRECT` writes whole blocks; the padding is truncated once written.
+            let padded = fill.next_multiple_of(ALIGN);
+            let buffer = &self.aligned[index as usize];
+            unsafe { ptr::write_bytes(buffer.ptr.add(fill), 0, padded - fill) };
+            self.push_aligned(sq, file, index, padded);
+        }
+        self.release_if_done(file);
+    }
+
+    fn release_if_done(&mut self, file: u32) {
+        let open_file = self.files[file as usize].as_ref().unwrap();
+        if !open_file.closed || open_file.writes > 0 || open_file.syncing {
+            return;
+        }
+        if open_file.end > open_file.length {
+            if let Err(err) = open_file.file.set_len(open_file.length) {
+                eprintln!("failed to truncate a file: {err}");
+            }
+        }
+        self.files[file as usize] = None;
+        self.free_files.push(file);
+    }
+
+    fn push_fsync(&mut self, sq: &mut impl Submit, file: u32) {
+        let open_file = self.files[file as usize].as_mut().unwrap();
+        open_file.syncing = true;
+        open_file.unsynced = 0;
+        let fsync = Fsync::new(Fd(open_file.file.as_raw_fd()))
+            .flags(FsyncFlags::DATASYNC)
+            .build()
+            .user_data(FSYNC | u64::from(file));
+        sq.push(&fsync);
+    }
+
+    // Handles the completion of a write or an fsync. Returns the ring buffer that a completed
+    // write held.
+    pub fn complete(
+        &mut self,
+        user_data: u64,
+        result: i32,
+        sq: &mut impl Submit,
+        metrics: &Metrics,
+    ) -> Option<u16> {
+        let index = user_data as u32;
+        if user_data & FSYNC != 0 {
+            if result < 0 {
+                eprintln!("fsync failed: {result}");
+                metrics.errors.add(1);
+            }
+            metrics.fsyncs.add(1);
+            self.files[index as usize].as_mut().unwrap().syncing = false;
+            self.release_if_done(index);
+            return None;
+        }
+
+        let write = self.writes[index as usize].as_mut().unwrap();
+        if result < 0 {
+            eprintln!("write failed: {result}");
+            metrics.errors.add(1);
+        } else {
+            metrics.disk_bytes.add(result as u64);
+            write.written += result as usize;
+            if write.written < write.len {
+                if result > 0 {
+                    // A short write, for example because the device is full; the rest is retried.
+                    submit_write(sq, &self.files, index, write);
+                    return None;
+                }
+                // Nothing more can be written, so the rest of the buffer is lost.
+                eprintln!(
+                    "write stopped after {} of {} bytes",
+                    write.written, write.len
+                );
+                metrics.errors.add(1);
+            }
+        }
+
+        let write = self.writes[index as usize].take().unwrap();
+        self.free_writes.push(index);
+        let open_file = self.files[write.file as usize].as_mut().unwrap();
+        open_file.writes -= 1;
+        open_file.unsynced += write.written as u64;
+        let fsync = self.options.fsync_bytes > 0
+            && open_file.unsynced >= self.options.fsync_bytes
+            && !open_file.syncing;
+        if fsync {
+            self.push_fsync(sq, write.file);
+        }
+        self.release_if_done(write.file);
+        match write.source {
+            Source::Ring(id) => Some(id),
+            Source::Aligned(aligned) => {
+                self.free_aligned.push(aligned);
+                None
+            }
+        }
+    }
+
+    // Calls `fdatasync` on every file written to since the last call, once per interval, with at
+    // most `budget` submissions. Files that do not fit are synced on the next call.
+    pub fn sync_due(&mut self, sq: &mut impl Submit, budget: usize) {
+        let (Some(next), Some(interval)) = (self.next_fsync, self.options.fsync_interval) else {
+            return;
+        };
+        let now = Instant::now();
+        if now < next {
+            return;
+        }
+        let due: Vec<u32> = (0..self.files.len() as u32)
+            .filter(|&file| {
+                let open_file = &self.files[file as usize];
+                open_file
+                    .as_ref()
+                    .is_some_and(|open_file| open_file.unsynced > 0 && !open_file.syncing)
+            })
+            .take(budget)
+            .collect();
+        if due.len() < budget {
+            self.next_fsync = Some(now + interval);
+        }
+        for file in due {
+            self.push_fsync(sq, file);
+        }
+    }
+
+    // Returns how long the event loop may wait for completions before the next interval sync.
+    pub fn timeout(&self) -> Option<Duration> {
+        self.next_fsync
+            .map(|next| next.saturating_duration_since(Instant::now()))
+    }
+}
+
+fn submit_write(
+    sq: &mut impl Submit,
+    files: &[Option<OpenFile>],
+    index: u32,
+    write: &PendingWrite,
+) {
+    let file = files[write.file as usize].as_ref().unwrap();
+    let ptr = unsafe { write.ptr.add(write.written) };
+    let entry = Write::new(
+        Fd(file.file.as_raw_fd()),
+        ptr,
+        (write.len - write.written) as u32,
+    )
+    .offset(write.offset + write.written as u64)
+    .build()
+    .user_data(WRITE | u64::from(index));
+    sq.push(&entry);
+}
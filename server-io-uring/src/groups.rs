@@ -0,0 +1,190 @@
+use std::{
+    io,
+    time::{Duration, Instant},
+};
+
+use io_uring::IoUring;
+
+use crate::{BufRing, BUF_RING_ENTRIES, BUF_SIZE};
+
+#[derive(clap::Args)]
+pub struct GroupArgs {
+    /// Provided buffer groups of every thread as comma-separated `<size>:<count>` pairs, from the
+    /// smallest buffers to the largest. Connections start receiving into the first group.
+    #[clap(long, value_delimiter = ',', value_parser = parse_group, default_value = "4096:16")]
+    pub buffer_groups: Vec<(usize, u16)>,
+
+    /// Receive rate in MB/s above which a connection moves to the next buffer group, or 0 to
+    /// never move connections.
+    #[clap(long, default_value_t = 10.0)]
+    pub promote_rate: f64,
+}
+
+fn parse_group(s: &str) -> Result<(usize, u16), String> {
+    let (size, count) = s.split_once(':').ok_or("expected <size>:<count>")?;
+    let size = size.parse().map_err(|err| format!("{err}"))?;
+    let count: u16 = count.parse().map_err(|err| format!("{err}"))?;
+    if size == 0 || !count.is_power_of_two() {
+        return Err("the size must be positive and the count a power of two".to_string());
+    }
+    Ok((size, count))
+}
+
+// A connection is promoted once the bytes that `--promote-rate` amounts to over this window arrive
+// within it.
+const PROMOTE_WINDOW: Duration = Duration::from_millis(100);
+
+#[derive(Clone)]
+pub struct GroupOptions {
+    groups: Vec<(usize, u16)>,
+    // Bytes received within `PROMOTE_WINDOW` that promote a connection, or 0 to never promote.
+    promote_bytes: u64,
+}
+
+impl GroupOptions {
+    pub fn new(args: &GroupArgs) -> Self {
+        assert!(
+            args.buffer_groups.is_sorted_by_key(|&(size, _)| size),
+            "--buffer-groups must be sorted by size"
+        );
+        GroupOptions {
+            groups: args.buffer_groups.clone(),
+            promote_bytes: (args.promote_rate * 1e6 * PROMOTE_WINDOW.as_secs_f64()) as u64,
+        }
+    }
+
+    // A single group of `count` buffers of `BUF_SIZE` bytes.
+    pub fn single(count: u16) -> Self {
+        GroupOptions {
+            groups: vec![(BUF_SIZE, count)],
+            promote_bytes: 0,
+        }
+    }
+
+    pub fn is_default(&self) -> bool {
+        self.groups == [(BUF_SIZE, BUF_RING_ENTRIES)]
+    }
+
+    pub fn groups(&self) -> &[(usize, u16)] {
+        &self.groups
+    }
+
+    // Bytes of the buffers of one thread.
+    pub fn memory(&self) -> usize {
+        self.groups
+            .iter()
+            .map(|&(size, count)| size * count as usize)
+            .sum()
+    }
+}
+
+#[derive(Clone, Copy)]
+struct Conn {
+    group: u16,
+    // The receive is being cancelled to arm it again with the next group.
+    promoting: bool,
+    window_start: Instant,
+    window_bytes: u64,
+}
+
+// The buffer groups of a thread, registered as groups `0..n`, and the group that the receive of
+// every client is armed with.
+pub(crate) struct Groups {
+    rings: Vec<BufRing>,
+    // By file index.
+    conns: Vec<Conn>,
+    promote_bytes: u64,
+}
+
+impl Groups {
+    pub fn new(io_uring: &IoUring, options: &GroupOptions) -> io::Result<Self> {
+        let rings = options
+            .groups
+            .iter()
+            .enumerate()
+            .map(|(group, &(size, count))| BufRing::new(io_uring, count, group as u16, size))
+            .collect::<io::Result<_>>()?;
+        Ok(Groups {
+            rings,
+            conns: Vec::new(),
+            promote_bytes: options.promote_bytes,
+        })
+    }
+
+    pub fn ring(&mut self, group: u16) -> &mut BufRing {
+        &mut self.rings[group as usize]
+    }
+
+    // Safety: as for `BufRing::get`.
+    pub unsafe fn get(&self, group: u16, id: u16, len: usize) -> &[u8] {
+        self.rings[group as usize].get(id, len)
+    }
+
+    // The group that the current receive of a client was armed with.
+    pub fn group(&self, file_index: u32) -> u16 {
+        self.conns
+            .get(file_index as usize)
+            .map_or(0, |conn| conn.group)
+    }
+
+    pub fn buf_size(&self, group: u16) -> usize {
+        self.rings[group as usize].buf_size()
+    }
+
+    // Starts a new client, or one moved from another ring, in the first group.
+    pub fn reset(&mut self, file_index: u32) -> u16 {
+        let conn = Conn {
+            group: 0,
+            promoting: false,
+            window_start: Instant::now(),
+            window_bytes: 0,
+        };
+        let index = file_index as usize;
+        if self.conns.len() <= index {
+            self.conns.resize(index + 1, conn);
+        }
+        self.conns[index] = conn;
+        0
+    }
+
+    // Accounts `bytes` received by a client and returns true if it receives fast enough to move to
+    // the next group. Its receive must then end before it is armed with the next group, because
+    // the completions until then still take buffers of the current one.
+    pub fn record(&mut self, file_index: u32, bytes: usize) -> bool {
+        let last = self.rings.len() as u16 - 1;
+        let Some(conn) = self.conns.get_mut(file_index as usize) else {
+            return false;
+        };
+        if self.promote_bytes == 0 || conn.group == last || conn.promoting {
+            return false;
+        }
+        conn.window_bytes += bytes as u64;
+        if conn.window_bytes < self.promote_bytes {
+            return false;
+        }
+        let now = Instant::now();
+        conn.promoting = now - conn.window_start <= PROMOTE_WINDOW;
+        conn.window_start = now;
+        conn.window_bytes = 0;
+        conn.promoting
+    }
+
+    pub fn promoting(&self, file_index: u32) -> bool {
+        self.conns
+            .get(file_index as usize)
+            .is_some_and(|conn| conn.promoting)
+    }
+
+    // Returns the group to arm the receive of a client with again, the next one if it was promoted.
+    pub fn rearm(&mut self, file_index: u32) -> u16 {
+        let Some(conn) = self.conns.get_mut(file_index as usize) else {
+            return 0;
+        };
+        if conn.promoting {
+            conn.promoting = false;
+            conn.group += 1;
+            conn.window_start = Instant::now();
+        }
+        conn.group
+    }
+}
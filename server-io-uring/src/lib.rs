@@ -0,0 +1,663 @@
+use std::{
+    collections::HashMap,
+    io, mem,
+    net::TcpListener,
+    os::fd::{AsRawFd, RawFd},
+    sync::{
+        atomic::{AtomicU32, Ordering},
+        Arc, Mutex, OnceLock,
+    },
+    time::Duration,
+};
+
+mod buf_ring;
+mod disk;
+mod groups;
+mod poll;
+
+use common::{
+    balance::Balancer,
+    engine::{Engine, Handler},
+    metrics::Metrics,
+    net::{enable_rx_timestamps, nanos_since, rx_timestamp, RX_TIMESTAMP_CONTROL_LEN},
+    pool::BufferPool,
+};
+use io_uring::{
+    cqueue,
+    opcode::{AcceptMulti, AsyncCancel, FilesUpdate, MsgRingSendFd, RecvMsgMulti, RecvMulti, Send},
+    squeue,
+    types::{DestinationSlot, Fd, Fixed, RecvMsgOut, SubmitArgs, Timespec},
+    IoUring, SubmissionQueue,
+};
+
+pub use buf_ring::BufRing;
+pub use disk::{Disk, DiskArgs, DiskOptions};
+pub use groups::{GroupArgs, GroupOptions};
+pub use poll::{push_accept, PollLoop, PollServer};
+
+use groups::Groups;
+
+// The fields of a CQE that the dispatcher reads. Taking them instead of the CQE lets benchmarks
+// drive the dispatcher with synthetic completions.
+#[derive(Clone, Copy)]
+pub struct Completion {
+    pub user_data: u64,
+    pub result: i32,
+    pub flags: u32,
+}
+
+impl From<&cqueue::Entry> for Completion {
+    fn from(cqe: &cqueue::Entry) -> Self {
+        Completion {
+            user_data: cqe.user_data(),
+            result: cqe.result(),
+            flags: cqe.flags(),
+        }
+    }
+}
+
+// Where the dispatcher pushes new SQEs: the submission queue of the ring, or a vector in
+// benchmarks.
+pub trait Submit {
+    fn push(&mut self, entry: &squeue::Entry);
+}
+
+impl Submit for SubmissionQueue<'_, squeue::Entry> {
+    fn push(&mut self, entry: &squeue::Entry) {
+        unsafe {
+            SubmissionQueue::push(self, entry).unwrap();
+        }
+    }
+}
+
+impl Submit for Vec<squeue::Entry> {
+    fn push(&mut self, entry: &squeue::Entry) {
+        Vec::push(self, entry.clone());
+    }
+}
+
+// With `msg`, the receive is a multishot `recvmsg` whose buffers also hold the control messages
+// that `msg` has room for. Buffers are taken from buffer group `group`.
+fn push_recv(sq: &mut impl Submit, file_index: u32, group: u16, msg: Option<&libc::msghdr>) {
+    let recv = match msg {
+        Some(msg) => RecvMsgMulti::new(Fixed(file_index), msg, group).build(),
+        None => RecvMulti::new(Fixed(file_index), group).build(),
+    };
+    let recv = recv.user_data(file_index.into());
+    sq.push(&recv);
+}
+
+// Provided buffers shared by all the connections of a thread, which is what keeps idle
+// connections cheap compared to a buffer per connection.
+pub const BUF_RING_ENTRIES: u16 = 16;
+pub const BUF_SIZE: usize = 4096;
+// When received bytes are written to disk, buffers stay out of the ring while their write is in
+// flight, which takes more of them to keep the connections receiving.
+pub const DISK_BUF_RING_ENTRIES: u16 = 256;
+
+// Flag in the user data of sends, whose lower 32 bits hold the file index of the client.
+pub const SEND: u64 = 1 << 32;
+
+// Flags in the user data of the operations that move a client to another ring, whose lower 32 bits
+// hold the file index of the client in the ring that completes them. The receive of the client is
+// cancelled, and once its last CQE is handled, its direct descriptor is passed with `MSG_RING`.
+const CANCEL: u64 = 1 << 33;
+const MIGRATE: u64 = 1 << 34;
+// Posted to the target ring, with the file index allocated there as the result and the token of
+// the handler state of the client in the lower 32 bits.
+const MIGRATED: u64 = 1 << 35;
+
+// The handler state of the clients in flight between rings, by a token that travels in the user
+// data of the message that passes the client. The state is put here before the message is sent,
+// so that it is there when the target handles the client.
+#[derive(Default)]
+pub struct Parcels {
+    next: AtomicU32,
+    states: Mutex<HashMap<u32, Vec<u8>>>,
+}
+
+impl Parcels {
+    fn send(&self, state: Vec<u8>) -> u32 {
+        let token = self.next.fetch_add(1, Ordering::Relaxed);
+        if !state.is_empty() {
+            self.states.lock().unwrap().insert(token, state);
+        }
+        token
+    }
+
+    fn take(&self, token: u32) -> Vec<u8> {
+        self.states
+            .lock()
+            .unwrap()
+            .remove(&token)
+            .unwrap_or_default()
+    }
+}
+
+// The balancer of a ring and the file descriptors of all the rings, which each thread publishes
+// once its ring is created.
+pub struct Balance {
+    pub balancer: Balancer,
+    pub rings: Arc<[OnceLock<RawFd>]>,
+    pub parcels: Arc<Parcels>,
+}
+
+impl Balance {
+    pub fn for_balancers(balancers: Vec<Option<Balancer>>) -> Vec<Option<Balance>> {
+        let rings: Arc<[OnceLock<RawFd>]> = balancers.iter().map(|_| OnceLock::new()).collect();
+        let parcels = Arc::new(Parcels::default());
+        balancers
+            .into_iter()
+            .map(|balancer| {
+                Some(Balance {
+                    balancer: balancer?,
+                    rings: rings.clone(),
+                    parcels: parcels.clone(),
+                })
+            })
+            .collect()
+    }
+}
+
+// Reply state of a client. Only one send is in flight per client so that replies are never
+// reordered; replies made in the meantime are queued behind it. Replies are built in memory of
+// their own so that the receive buffer can be recycled immediately.
+#[derive(Default)]
+struct Reply {
+    sending: Vec<u8>,
+    sent: usize,
+    queued: Vec<u8>,
+    // The client is gone but its file index must stay registered until the send completes.
+    closed: bool,
+}
+
+// Reply state by file index, only for the clients with a send in flight, so that idle connections
+// cost no memory in user space.
+type Replies = HashMap<u32, Reply>;
+
+fn push_send(sq: &mut impl Submit, file_index: u32, reply: &Reply) {
+    let buf = &reply.sending[reply.sent..];
+    let send = Send::new(Fixed(file_index), buf.as_ptr(), buf.len() as u32)
+        .build()
+        .user_data(SEND | u64::from(file_index));
+    sq.push(&send);
+}
+
+fn push_unregister(sq: &mut impl Submit, file_index: u32) {
+    const DELETE: i32 = -1;
+    let unregister = FilesUpdate::new(&DELETE as *const _, 1)
+        .offset(file_index as i32)
+        .build()
+        .user_data(u64::MAX);
+    sq.push(&unregister);
+}
+
+// Sends `out` and leaves it empty. An idle client takes over the buffer of `out` instead of copying
+// it, and `out` gets a buffer from the pool, where buffers go back once sent.
+fn reply(
+    sq: &mut impl Submit,
+    file_index: u32,
+    replies: &mut Replies,
+    out: &mut Vec<u8>,
+    pool: &mut BufferPool,
+) {
+    let reply = replies.entry(file_index).or_default();
+    if reply.sending.is_empty() {
+        mem::swap(&mut reply.sending, out);
+        push_send(sq, file_index, reply);
+        if out.capacity() == 0 {
+            *out = pool.take();
+        }
+    } else {
+        if reply.queued.capacity() == 0 {
+            reply.queued = pool.take();
+        }
+        reply.queued.extend_from_slice(out);
+    }
+    out.clear();
+}
+
+// Cancels the receive of a client, whose last CQE then reports `ECANCELED`.
+fn push_cancel(sq: &mut impl Submit, file_index: u32) {
+    let cancel = AsyncCancel::new(file_index.into())
+        .build()
+        .user_data(CANCEL | u64::from(file_index));
+    sq.push(&cancel);
+}
+
+fn push_send_fd(sq: &mut impl Submit, ring_fd: RawFd, file_index: u32, token: u32) {
+    let send_fd = MsgRingSendFd::new(
+        Fd(ring_fd),
+        Fixed(file_index),
+        DestinationSlot::auto_target(),
+        MIGRATED | u64::from(token),
+    )
+    .build()
+    .user_data(MIGRATE | u64::from(file_index));
+    sq.push(&send_fd);
+}
+
+fn handle_send(
+    cqe_result: i32,
+    sq: &mut impl Submit,
+    file_index: u32,
+    replies: &mut Replies,
+    pool: &mut BufferPool,
+    metrics: &Metrics,
+) {
+    let reply = replies.get_mut(&file_index).unwrap();
+    if cqe_result < 0 {
+        // The receive side notices the broken connection as well and unregisters it.
+        eprintln!("send failed: {cqe_result}");
+        metrics.errors.add(1);
+        reply.queued.clear();
+    } else {
+        reply.sent += cqe_result as usize;
+        if reply.sent < reply.sending.len() {
+            push_send(sq, file_index, reply);
+            return;
+        }
+        if !reply.queued.is_empty() {
+            let sent = mem::replace(&mut reply.sending, mem::take(&mut reply.queued));
+            pool.give(sent);
+            reply.sent = 0;
+            push_send(sq, file_index, reply);
+            return;
+        }
+    }
+    let reply = replies.remove(&file_index).unwrap();
+    if reply.closed {
+        push_unregister(sq, file_index);
+    }
+    pool.give(reply.sending);
+    pool.give(reply.queued);
+}
+
+// Per-thread state that completions are dispatched to.
+pub struct Dispatcher<'a, H> {
+    groups: Groups,
+    handler: H,
+    // Reply of the handler to the last receive.
+    out: Vec<u8>,
+    replies: Replies,
+    // Buffers of replies that were sent, for the next ones.
+    pool: BufferPool,
+    // Template of the multishot `recvmsg` when receive timestamps are enabled, which only receives
+    // control messages. It is boxed so that SQEs can point to it while the dispatcher moves.
+    msg: Option<Box<libc::msghdr>>,
+    balance: Option<Balance>,
+    // Clients whose receive is being cancelled to move them, by file index, with the target ring.
+    migrating: HashMap<u32, RawFd>,
+    // Clients being passed to another ring, by file index, with the token of their handler state.
+    sending: HashMap<u32, u32>,
+    disk: Option<Disk>,
+    // Clients whose receive ran out of buffers while all of them were held by writes. They are
+    // armed again as writes complete.
+    starved: Vec<u32>,
+    metrics: &'a Metrics,
+}
+
+impl<'a, H: Handler> Dispatcher<'a, H> {
+    pub fn new(
+        io_uring: &IoUring,
+        handler: H,
+        groups: &GroupOptions,
+        metrics: &'a Metrics,
+    ) -> io::Result<Self> {
+        let msg = metrics.rx_timestamps().then(|| {
+            let mut msg: Box<libc::msghdr> = Box::new(unsafe { mem::zeroed() });
+            msg.msg_controllen = RX_TIMESTAMP_CONTROL_LEN;
+            msg
+        });
+        Ok(Dispatcher {
+            groups: Groups::new(io_uring, groups)?,
+            handler,
+            out: Vec::new(),
+            replies: Replies::new(),
+            pool: BufferPool::default(),
+            msg,
+            balance: None,
+            migrating: HashMap::new(),
+            sending: HashMap::new(),
+            disk: None,
+            starved: Vec::new(),
+            metrics,
+        })
+    }
+
+    pub fn with_disk(mut self, disk: Disk) -> Self {
+        self.disk = Some(disk);
+        self
+    }
+
+    // Calls `fdatasync` on the files that are due, with at most `budget` submissions.
+    pub fn sync_due(&mut self, sq: &mut impl Submit, budget: usize) {
+        if let Some(disk) = &mut self.disk {
+            disk.sync_due(sq, budget);
+        }
+    }
+
+    // How long to wait for completions at most, when something is due at a given time.
+    pub fn timeout(&self) -> Option<Duration> {
+        self.disk.as_ref()?.timeout()
+    }
+
+    pub fn with_balance(mut self, balance: Balance) -> Self {
+        self.balance = Some(balance);
+        self
+    }
+
+    // Starts moving the busiest client to a less loaded ring, if the balancer picks one.
+    pub fn rebalance(&mut self, sq: &mut impl Submit) {
+        let Some(balance) = &mut self.balance else {
+            return;
+        };
+        let Some((file_index, target)) = balance.balancer.poll() else {
+            return;
+        };
+        let Some(&ring_fd) = balance.rings[target].get() else {
+            return;
+        };
+        if self.replies.contains_key(&file_index) {
+            return;
+        }
+        push_cancel(sq, file_index);
+        self.migrating.insert(file_index, ring_fd);
+    }
+
+    // Arms the receive of a client again after its multishot receive terminated, or passes the
+    // client to its target ring if it is being moved. A client with a send in flight stays, so
+    // that its replies are never sent from two rings at once.
+    fn rearm(&mut self, sq: &mut impl Submit, file_index: u32, group: u16) {
+        match self.migrating.remove(&file_index) {
+            Some(ring_fd) if !self.replies.contains_key(&file_index) => {
+                let mut state = Vec::new();
+                self.handler.on_detach(file_index, &mut state);
+                let token = self.balance.as_ref().unwrap().parcels.send(state);
+                self.sending.insert(file_index, token);
+                push_send_fd(sq, ring_fd, file_index, token);
+            }
+            _ => push_recv(sq, file_index, group, self.msg.as_deref()),
+        }
+    }
+
+    pub fn handle_completion(&mut self, cqe: Completion, sq: &mut impl Submit) {
+        let metrics = self.metrics;
+        let msg = self.msg.as_deref();
+
+        if cqe.user_data == u64::MAX {
+            // FILES_UPDATE operation to unregister a client.
+            return;
+        }
+        if cqe.user_data & SEND != 0 {
+            let file_index = cqe.user_data as u32;
+            let replies = &mut self.replies;
+            handle_send(cqe.result, sq, file_index, replies, &mut self.pool, metrics);
+            return;
+        }
+        if cqe.user_data & (disk::WRITE | disk::FSYNC) != 0 {
+            let disk = self.disk.as_mut().unwrap();
+            // Writing to disk uses a single group.
+            if let Some(id) = disk.complete(cqe.user_data, cqe.result, sq, metrics) {
+                self.groups.ring(0).recycle(id);
+                if let Some(file_index) = self.starved.pop() {
+                    push_recv(sq, file_index, 0, msg);
+                }
+            }
+            return;
+        }
+        if cqe.user_data & CANCEL != 0 {
+            // The receive reports the cancellation itself.
+            return;
+        }
+        if cqe.user_data & MIGRATE != 0 {
+            let file_index = cqe.user_data as u32;
+            let token = self.sending.remove(&file_index).unwrap();
+            if cqe.result < 0 {
+                // For example because the file table of the target is full. The client stays.
+                eprintln!("failed to move a client: {}", cqe.result);
+                metrics.errors.add(1);
+                let state = self.balance.as_ref().unwrap().parcels.take(token);
+                self.handler.on_attach(file_index, &state);
+                let group = self.groups.rearm(file_index);
+                push_recv(sq, file_index, group, msg);
+                return;
+            }
+            push_unregister(sq, file_index);
+            if let Some(balance) = &mut self.balance {
+                balance.balancer.forget(file_index);
+            }
+            metrics.migrations.add(1);
+            return;
+        }
+        if cqe.user_data & MIGRATED != 0 {
+            // A client moved from another ring. Bytes it received meanwhile wait in its socket.
+            let file_index = cqe.result as u32;
+            let state = self
+                .balance
+                .as_ref()
+                .unwrap()
+                .parcels
+                .take(cqe.user_data as u32);
+            self.handler.on_attach(file_index, &state);
+            let group = self.groups.reset(file_index);
+            push_recv(sq, file_index, group, msg);
+            return;
+        }
+
+        // To make things simpler, the user data in SQEs will represent the file index of the
+        // server or client socket.
+        let file_index = cqe.user_data as u32;
+        if file_index == 0 {
+            if !cqueue::more(cqe.flags) {
+                // The multishot accept was terminated, for example because the file table is full.
+                let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
+                sq.push(&accept);
+            }
+            let ret = cqe.result;
+            if ret < 0 {
+                eprintln!("accept failed: {ret}");
+                metrics.errors.add(1);
+                return;
+            }
+            metrics.accepts.add(1);
+            let group = self.groups.reset(ret as u32);
+            push_recv(sq, ret as u32, group, msg);
+        } else {
+            let ret = cqe.result;
+            metrics.recvs.add(1);
+            if ret == -libc::ENOBUFS {
+                // The buffers ran out, which terminates the multishot receive but not the
+                // connection.
+                metrics.errors.add(1);
+                let group = self.groups.rearm(file_index);
+                match &self.disk {
+                    Some(disk) if disk.holds_buffers() => self.starved.push(file_index),
+                    _ => self.rearm(sq, file_index, group),
+                }
+                return;
+            }
+            if ret == -libc::ECANCELED
+                && (self.migrating.contains_key(&file_index) || self.groups.promoting(file_index))
+            {
+                let group = self.groups.rearm(file_index);
+                self.rearm(sq, file_index, group);
+                return;
+            }
+            // Clients may close with a RST to avoid `TIME_WAIT`, which is not worth reporting.
+            if ret < 0 && ret != -libc::ECONNRESET {
+                eprintln!("recv failed: {ret}");
+                metrics.errors.add(1);
+            }
+
+            let group = self.groups.group(file_index);
+            let id = (ret > 0).then(|| cqueue::buffer_select(cqe.flags).unwrap());
+            if id.is_some() {
+                metrics.buffer_bytes.add(self.groups.buf_size(group) as u64);
+            }
+            let buf = id.map(|id| unsafe { self.groups.get(group, id, ret as usize) });
+            let out;
+            let payload = match (buf, msg) {
+                (Some(buf), Some(msg)) => {
+                    out = RecvMsgOut::parse(buf, msg).expect("recvmsg buffer is too small");
+                    if let Some(timestamp) = rx_timestamp(out.control_data()) {
+                        metrics.record_rx_delay(nanos_since(&timestamp));
+                    }
+                    out.payload_data()
+                }
+                (Some(buf), None) => buf,
+                (None, _) => &[],
+            };
+
+            // A multishot `recvmsg` reports the end of the stream with an empty payload.
+            if payload.is_empty() {
+                // Unregister the client socket, once its last reply is sent.
+                match self.replies.get_mut(&file_index) {
+                    Some(reply) => reply.closed = true,
+                    None => push_unregister(sq, file_index),
+                }
+                self.handler.on_close(file_index);
+                if let Some(disk) = &mut self.disk {
+                    disk.close(sq, file_index);
+                }
+                self.migrating.remove(&file_index);
+                if let Some(balance) = &mut self.balance {
+                    balance.balancer.forget(file_index);
+                }
+                metrics.closes.add(1);
+                // The end of a multishot `recvmsg` stream still takes a buffer.
+                if let Some(id) = id {
+                    self.groups.ring(group).recycle(id);
+                }
+            } else {
+                let received = payload.len();
+                metrics.bytes.add(received as u64);
+                if let Some(balance) = &mut self.balance {
+                    balance.balancer.record(file_index, received);
+                }
+                self.handler.on_recv(file_index, payload, &mut self.out);
+                if !self.out.is_empty() {
+                    let replies = &mut self.replies;
+                    reply(sq, file_index, replies, &mut self.out, &mut self.pool);
+                }
+                // The payload stays in the buffer until it is written, if the write needs it.
+                let held = match &mut self.disk {
+                    Some(disk) => disk.write(sq, file_index, payload, id.unwrap()),
+                    None => false,
+                };
+                if !held {
+                    self.groups.ring(group).recycle(id.unwrap());
+                }
+                let promote = self.groups.record(file_index, received);
+                if promote {
+                    metrics.promotions.add(1);
+                }
+                if !cqueue::more(cqe.flags) {
+                    let group = self.groups.rearm(file_index);
+                    self.rearm(sq, file_index, group);
+                } else if promote {
+                    push_cancel(sq, file_index);
+                }
+            }
+        }
+    }
+}
+
+// One io_uring event loop thread serving a `SO_REUSEPORT` listener.
+pub struct Server {
+    pub listener: TcpListener,
+    // Size of the registered file table.
+    pub files: u32,
+    pub balance: Option<Balance>,
+    // Where to write everything that is received, if anywhere.
+    pub disk: Option<DiskOptions>,
+    pub groups: GroupOptions,
+}
+
+impl Engine for Server {
+    fn run<H: Handler>(self, handler: H, metrics: &Metrics) {
+        run(self, handler, metrics)
+    }
+}
+
+fn run<H: Handler>(server: Server, handler: H, metrics: &Metrics) {
+    let Server {
+        listener,
+        files,
+        balance,
+        disk,
+        groups,
+    } = server;
+    metrics.init_thread();
+
+    let mut io_uring = IoUring::builder()
+        .setup_coop_taskrun()
+        .setup_defer_taskrun()
+        .setup_single_issuer()
+        .build(32)
+        .expect("failed to create io_uring instance");
+
+    if metrics.rx_timestamps() {
+        enable_rx_timestamps(&listener).expect("failed to enable SO_TIMESTAMPING");
+    }
+
+    let submitter = io_uring.submitter();
+    // Register a big file table to store server and client sockets.
+    submitter.register_files_sparse(files).unwrap();
+    submitter
+        .register_files_update(0, &[listener.as_raw_fd()])
+        .unwrap();
+
+    let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
+    unsafe {
+        io_uring.submission().push(&accept).unwrap();
+    }
+
+    // Every completion pushes at most two entries, or three when writing to disk.
+    let (groups, pushes) = match disk {
+        Some(_) => (GroupOptions::single(DISK_BUF_RING_ENTRIES), 3),
+        None => (groups, 2),
+    };
+    metrics.buffer_memory.add(groups.memory() as u64);
+    let mut dispatcher = Dispatcher::new(&io_uring, handler, &groups, metrics).unwrap();
+    if let Some(disk) = disk {
+        dispatcher = dispatcher.with_disk(Disk::new(disk));
+    }
+    if let Some(balance) = balance {
+        balance.rings[balance.balancer.thread()]
+            .set(io_uring.as_raw_fd())
+            .unwrap();
+        dispatcher = dispatcher.with_balance(balance);
+    }
+
+    loop {
+        let (submitter, mut sq, cq) = io_uring.split();
+        // Rebalancing pushes one entry, so only reap as many completions as fit in the submission
+        // queue; the rest stay in the completion queue for the next iteration.
+        let budget = (sq.capacity() - sq.len()).saturating_sub(1) / pushes;
+        for cqe in cq.take(budget) {
+            metrics.events.add(1);
+            dispatcher.handle_completion(Completion::from(&cqe), &mut sq);
+        }
+        dispatcher.rebalance(&mut sq);
+        let free = sq.capacity() - sq.len();
+        dispatcher.sync_due(&mut sq, free);
+        // Synchronize the submission queue with the kernel.
+        drop(sq);
+        match dispatcher.timeout() {
+            // Wake up for the next interval sync even if nothing completes.
+            Some(timeout) => {
+                let timespec = Timespec::from(timeout);
+                let args = SubmitArgs::new().timespec(&timespec);
+                match submitter.submit_with_args(1, &args) {
+                    Err(err) if err.raw_os_error() != Some(libc::ETIME) => panic!("{err}"),
+                    _ => {}
+                }
+            }
+            None => {
+                submitter.submit_and_wait(1).unwrap();
+            }
+        }
+        metrics.waits.add(1);
+    }
+}
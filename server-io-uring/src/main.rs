@@ -1,102 +1,162 @@
-use std::{net::TcpListener, os::fd::AsRawFd};
-
 use clap::Parser;
-use io_uring::{
-    cqueue,
-    opcode::{AcceptMulti, FilesUpdate, RecvMulti},
-    squeue,
-    types::Fixed,
-    IoUring, SubmissionQueue,
+use common::{
+    balance::{BalanceArgs, Balancer},
+    engine::{check_options, serve_with_handler, HandlerArgs, ServerOptions},
+    metrics::{start_reporter, ReportArgs},
+    net::{bind_reuseport, raise_fd_limit, steer_by_cpu, ListenArgs},
+    numa::{interface_for_bind, pin_threads, place, NumaArgs},
+};
+use server_io_uring::{
+    Balance, DiskArgs, DiskOptions, GroupArgs, GroupOptions, PollServer, Server,
+    DISK_BUF_RING_ENTRIES,
 };
-use io_uring_buf_ring::IoUringBufRing;
 
 #[derive(clap::Parser)]
 struct Args {
     #[clap(short, long)]
     bind: String,
-}
 
-fn handle_completion(
-    cqe: &cqueue::Entry,
-    sq: &mut SubmissionQueue<squeue::Entry>,
-    buf_ring: &mut IoUringBufRing<Vec<u8>>,
-) {
-    if cqe.user_data() == u64::MAX {
-        // FILES_UPDATE operation to unregister a client.
-        return;
-    }
+    /// Number of event loop threads, each with its own `SO_REUSEPORT` listener and io_uring
+    /// instance.
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
 
-    // To make things simpler, the user data in SQEs will represent the file index of the
-    // server or client socket.
-    let file_index = cqe.user_data() as u32;
-    if file_index == 0 {
-        let ret = cqe.result();
-        if ret < 0 {
-            panic!("accept failed: {ret}");
-        }
-        let file_index = ret as u32;
-        let recv = RecvMulti::new(Fixed(file_index), 0)
-            .build()
-            .user_data(file_index.into());
-        unsafe {
-            sq.push(&recv).unwrap();
-        }
-    } else {
-        let ret = cqe.result();
-        if ret < 0 {
-            eprintln!("recv failed: {ret}");
-        }
-        if ret <= 0 {
-            // Unregister the client socket.
-            const DELETE: i32 = -1;
-            let unregister = FilesUpdate::new(&DELETE as *const _, 1)
-                .offset(file_index as i32)
-                .build()
-                .user_data(u64::MAX);
-            unsafe {
-                sq.push(&unregister).unwrap();
-            }
-        } else {
-            let id = cqueue::buffer_select(cqe.flags()).unwrap();
-            let available_len = ret as usize;
-            let _buf = unsafe { buf_ring.get_buf(id, available_len) };
-        }
-    }
+    #[clap(flatten)]
+    handler: HandlerArgs,
+
+    /// Size of the registered file table, which bounds the number of concurrent connections per
+    /// thread. Accepted sockets are installed directly into it as direct descriptors.
+    #[clap(long, default_value_t = 128)]
+    files: u32,
+
+    #[clap(flatten)]
+    groups: GroupArgs,
+
+    /// Use io_uring only to learn which clients are readable, with a multishot `POLL_ADD` on each,
+    /// and read them with nonblocking `read` calls.
+    #[clap(long)]
+    poll: bool,
+
+    /// With `--poll`, read readable clients with `IORING_OP_RECV` operations submitted in batches
+    /// instead of `read` calls.
+    #[clap(long)]
+    batch_recvs: bool,
+
+    #[clap(flatten)]
+    listen: ListenArgs,
+
+    #[clap(flatten)]
+    balance: BalanceArgs,
+
+    #[clap(flatten)]
+    disk: DiskArgs,
+
+    #[clap(flatten)]
+    numa: NumaArgs,
+
+    #[clap(flatten)]
+    report: ReportArgs,
 }
 
 fn main() {
     let args = Args::parse();
+    check_options(
+        &args.handler,
+        &ServerOptions {
+            sockets: true,
+            balance: args.balance.balance_interval > 0,
+            write_dir: args.disk.write_dir.is_some(),
+            ..Default::default()
+        },
+    );
+    assert!(
+        args.poll || !args.batch_recvs,
+        "--batch-recvs requires --poll"
+    );
+    // The poll mode only reads and writes sockets.
+    assert!(
+        !(args.poll
+            && (args.disk.write_dir.is_some()
+                || args.balance.balance_interval > 0
+                || args.report.rx_timestamps)),
+        "--write-dir, --balance-interval and --rx-timestamps are not supported with --poll"
+    );
+    let disk = DiskOptions::new(&args.disk).expect("failed to prepare the write directory");
+    let groups = GroupOptions::new(&args.groups);
+    // Writes hold buffers of a single group, which is larger.
+    assert!(
+        disk.is_none() || groups.is_default(),
+        "--buffer-groups is not supported with --write-dir"
+    );
+    assert!(
+        !args.poll || groups.is_default(),
+        "--buffer-groups is not supported with --poll"
+    );
 
-    let mut io_uring = IoUring::builder()
-        .setup_coop_taskrun()
-        .setup_defer_taskrun()
-        .setup_single_issuer()
-        .build(32)
-        .expect("failed to create io_uring instance");
-
-    let listener = TcpListener::bind(&args.bind).unwrap();
-
-    let submitter = io_uring.submitter();
-    // Register a big file table to store server and client sockets.
-    submitter.register_files_sparse(128).unwrap();
-    submitter
-        .register_files_update(0, &[listener.as_raw_fd()])
-        .unwrap();
-
-    let accept = AcceptMulti::new(Fixed(0)).allocate_file_index(true).build();
-    unsafe {
-        io_uring.submission().push(&accept).unwrap();
+    // Every connection holds a file descriptor, or a slot in a registered file table which is
+    // bounded by the same limit.
+    let fd_limit = raise_fd_limit().expect("failed to raise the file descriptor limit");
+    eprintln!("file descriptor limit: {fd_limit}");
+    // Each slot of a registered file table is a pointer in the kernel. The buffers of the rings are
+    // shared by all the connections of a thread. The poll mode uses neither.
+    if !args.poll {
+        let buffers = match disk {
+            Some(_) => GroupOptions::single(DISK_BUF_RING_ENTRIES),
+            None => groups.clone(),
+        };
+        let rings: Vec<_> = buffers
+            .groups()
+            .iter()
+            .map(|(size, count)| format!("{count} of {size} B"))
+            .collect();
+        eprintln!(
+            "file table: {} slots per thread, {} KiB in the kernel; buffer rings: {} per \
+             thread, {} KiB",
+            args.files,
+            args.files as usize * 8 / 1024,
+            rings.join(", "),
+            buffers.memory() / 1024,
+        );
     }
 
-    let mut buf_ring = IoUringBufRing::new(&io_uring, 16, 0, 4096).unwrap();
+    // Bind every listener before starting the threads so that no connection is refused while the
+    // server is starting up.
+    let listeners: Vec<_> = (0..args.threads)
+        .map(|_| bind_reuseport(&args.bind, &args.listen).unwrap())
+        .collect();
 
-    loop {
-        let (submitter, mut sq, cq) = io_uring.split();
-        for cqe in cq {
-            handle_completion(&cqe, &mut sq, &mut buf_ring);
-        }
-        // Synchronize the submission queue with the kernel.
-        drop(sq);
-        submitter.submit_and_wait(1).unwrap();
+    let interface = interface_for_bind(&args.bind);
+    let mut placements = place(&args.numa, interface.as_deref(), args.threads);
+    if args.listen.steer_by_cpu {
+        let cpus = pin_threads(&mut placements[..args.threads]);
+        steer_by_cpu(&listeners[0], &cpus).expect("failed to attach the reuseport program");
+    }
+    let metrics = start_reporter(args.threads, &args.report);
+    if args.poll {
+        let servers = listeners
+            .into_iter()
+            .map(|listener| PollServer {
+                listener,
+                batch_recvs: args.batch_recvs,
+            })
+            .collect();
+        serve_with_handler(servers, &placements, &args.handler, metrics);
+        return;
     }
+    let balances =
+        Balance::for_balancers(Balancer::for_threads(args.threads, &metrics, &args.balance));
+
+    // `setup_single_issuer` requires each ring to be created on the thread that submits to it.
+    let servers = listeners
+        .into_iter()
+        .zip(balances)
+        .map(|(listener, balance)| Server {
+            listener,
+            files: args.files,
+            balance,
+            disk: disk.clone(),
+            groups: groups.clone(),
+        })
+        .collect();
+    serve_with_handler(servers, &placements, &args.handler, metrics);
 }
@@ -0,0 +1,477 @@
+use std::{
+    io,
+    mem::{self, MaybeUninit},
+    net::TcpListener,
+    os::fd::{AsRawFd, RawFd},
+    ptr, slice,
+};
+
+use common::{
+    engine::{Engine, Handler},
+    metrics::Metrics,
+};
+use io_uring::{
+    cqueue,
+    opcode::{AcceptMulti, PollAdd, PollRemove, Recv},
+    squeue,
+    types::Fd,
+    IoUring,
+};
+
+use crate::{BufRing, Completion, Submit, BUF_RING_ENTRIES, BUF_SIZE};
+
+// Maximum number of reads per readiness completion, so that a client that sends faster than it is
+// read cannot starve the others.
+const READ_BUDGET: usize = 64;
+
+// The user data of client operations holds the file descriptor in its lower 32 bits and one of
+// these flags.
+const READABLE: u64 = 1 << 32;
+const WRITABLE: u64 = 1 << 33;
+const RECV: u64 = 1 << 34;
+// Completions of `POLL_REMOVE` itself, which the removed poll reports as well.
+const REMOVE: u64 = 1 << 35;
+const ACCEPT: u64 = u64::MAX;
+
+fn read(fd: RawFd, buf: &mut [MaybeUninit<u8>]) -> io::Result<usize> {
+    let ret = unsafe { libc::read(fd, buf.as_mut_ptr().cast(), buf.len()) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret as usize)
+}
+
+fn write(fd: RawFd, buf: &[u8]) -> io::Result<usize> {
+    let ret = unsafe { libc::write(fd, buf.as_ptr().cast(), buf.len()) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret as usize)
+}
+
+// Writes as much of `buf` as possible without blocking and returns the number of bytes written.
+fn write_nonblocking(fd: RawFd, buf: &[u8]) -> io::Result<usize> {
+    let mut written = 0;
+    while written < buf.len() {
+        match write(fd, &buf[written..]) {
+            Ok(n) => written += n,
+            Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(written)
+}
+
+fn push_poll(sq: &mut impl Submit, fd: RawFd, events: i16, multi: bool, flag: u64) {
+    let poll = PollAdd::new(Fd(fd), events as u32)
+        .multi(multi)
+        .build()
+        .user_data(flag | fd as u64);
+    sq.push(&poll);
+}
+
+fn push_remove(sq: &mut impl Submit, fd: RawFd, flag: u64) {
+    let remove = PollRemove::new(flag | fd as u64).build().user_data(REMOVE);
+    sq.push(&remove);
+}
+
+#[derive(Default)]
+struct Client {
+    // Operations in flight on the descriptor, which is only closed once they all completed so that
+    // its number cannot be reused while completions still refer to it.
+    ops: u32,
+    closing: bool,
+    // With batched receives: a receive is in flight, and the socket was reported readable again
+    // meanwhile.
+    receiving: bool,
+    again: bool,
+    // Replies that could not be written without blocking. While a client has a backlog, it waits
+    // for `POLLOUT` and is not read from.
+    backlog: Vec<u8>,
+    writing: bool,
+}
+
+// The state of one thread of the poll mode, which uses io_uring only to learn which sockets are
+// readable: every client has a multishot `POLL_ADD`, and its bytes are read with `read` calls, or
+// with `IORING_OP_RECV` operations submitted in the next batch when receives are batched. Replies
+// are written with `write` calls either way.
+pub struct PollLoop<'a, H> {
+    listener: RawFd,
+    handler: H,
+    // By file descriptor.
+    clients: Vec<Client>,
+    // Clients that still had bytes after their budget, read again before the next wait since
+    // readiness is only reported when new bytes arrive.
+    pending: Vec<RawFd>,
+    // Provided buffers of the batched receives.
+    buf_ring: Option<BufRing>,
+    out: Vec<u8>,
+    metrics: &'a Metrics,
+}
+
+impl<'a, H: Handler> PollLoop<'a, H> {
+    // The multishot accept of `listener` must be pushed with `push_accept`.
+    pub fn new(
+        io_uring: &IoUring,
+        listener: RawFd,
+        handler: H,
+        batch_recvs: bool,
+        metrics: &'a Metrics,
+    ) -> io::Result<Self> {
+        let buf_ring = if batch_recvs {
+            Some(BufRing::new(io_uring, BUF_RING_ENTRIES, 0, BUF_SIZE)?)
+        } else {
+            None
+        };
+        Ok(PollLoop {
+            listener,
+            handler,
+            clients: Vec::new(),
+            pending: Vec::new(),
+            buf_ring,
+            out: Vec::new(),
+            metrics,
+        })
+    }
+
+    pub fn has_pending(&self) -> bool {
+        !self.pending.is_empty()
+    }
+
+    fn add_client(&mut self, sq: &mut impl Submit, fd: RawFd) {
+        let index = fd as usize;
+        if self.clients.len() <= index {
+            self.clients.resize_with(index + 1, Client::default);
+        }
+        self.clients[index] = Client {
+            ops: 1,
+            ..Default::default()
+        };
+        push_poll(sq, fd, libc::POLLIN, true, READABLE);
+    }
+
+    // Stops reading from a client and cancels its polls. The descriptor is closed once nothing
+    // refers to it any more.
+    fn close_client(&mut self, sq: &mut impl Submit, fd: RawFd) {
+        let client = &mut self.clients[fd as usize];
+        client.closing = true;
+        client.backlog.clear();
+        push_remove(sq, fd, READABLE);
+        if client.writing {
+            push_remove(sq, fd, WRITABLE);
+        }
+        self.handler.on_close(fd as u32);
+        self.metrics.closes.add(1);
+    }
+
+    fn complete_op(&mut self, fd: RawFd) {
+        let client = &mut self.clients[fd as usize];
+        client.ops -= 1;
+        if client.closing && client.ops == 0 {
+            client.closing = false;
+            unsafe { libc::close(fd) };
+        }
+    }
+
+    // Writes the reply of the handler, or queues what does not fit in the socket buffer and waits
+    // for the socket to be writable. Returns false if the client must not be read from meanwhile.
+    fn reply(&mut self, sq: &mut impl Submit, fd: RawFd) -> bool {
+        let written = match write_nonblocking(fd, &self.out) {
+            Ok(written) => written,
+            Err(err) => {
+                eprintln!("failed to write: {err}");
+                self.metrics.errors.add(1);
+                self.out.clear();
+                self.close_client(sq, fd);
+                return false;
+            }
+        };
+        let client = &mut self.clients[fd as usize];
+        if written < self.out.len() {
+            client.backlog.extend_from_slice(&self.out[written..]);
+            client.writing = true;
+            client.ops += 1;
+            push_poll(sq, fd, libc::POLLOUT, false, WRITABLE);
+        }
+        self.out.clear();
+        client.backlog.is_empty()
+    }
+
+    fn read_client(&mut self, sq: &mut impl Submit, fd: RawFd) {
+        let metrics = self.metrics;
+        for _ in 0..READ_BUDGET {
+            let mut buf = [MaybeUninit::uninit(); BUF_SIZE];
+            let ret = read(fd, &mut buf);
+            metrics.recvs.add(1);
+            let n = match ret {
+                Ok(0) => return self.close_client(sq, fd),
+                Ok(n) => n,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return,
+                // Clients may close with a RST to avoid `TIME_WAIT`, which is not worth reporting.
+                Err(err) if err.kind() == io::ErrorKind::ConnectionReset => {
+                    return self.close_client(sq, fd)
+                }
+                Err(err) => {
+                    eprintln!("failed to read: {err}");
+                    metrics.errors.add(1);
+                    return self.close_client(sq, fd);
+                }
+            };
+            metrics.bytes.add(n as u64);
+            let buf = unsafe { slice::from_raw_parts(buf.as_ptr().cast(), n) };
+            self.handler.on_recv(fd as u32, buf, &mut self.out);
+            if !self.out.is_empty() && !self.reply(sq, fd) {
+                return;
+            }
+            // A short read emptied the socket, which saves the read that would fail with `EAGAIN`.
+            // Bytes that arrive later are reported by the next readiness completion.
+            if n < BUF_SIZE {
+                return;
+            }
+        }
+        self.pending.push(fd);
+    }
+
+    fn push_recv(&mut self, sq: &mut impl Submit, fd: RawFd) {
+        let client = &mut self.clients[fd as usize];
+        if client.receiving {
+            client.again = true;
+            return;
+        }
+        client.receiving = true;
+        client.ops += 1;
+        let recv = Recv::new(Fd(fd), ptr::null_mut(), BUF_SIZE as u32)
+            .buf_group(0)
+            .build()
+            .flags(squeue::Flags::BUFFER_SELECT)
+            .user_data(RECV | fd as u64);
+        sq.push(&recv);
+    }
+
+    // Reads the bytes of a readable client, with a system call or an operation of the next batch.
+    fn receive(&mut self, sq: &mut impl Submit, fd: RawFd) {
+        if self.buf_ring.is_some() {
+            self.push_recv(sq, fd);
+        } else {
+            self.read_client(sq, fd);
+        }
+    }
+
+    // Reads the clients that were left with bytes after their budget, as long as the submission
+    // queue has room for what that pushes.
+    pub fn read_pending(&mut self, sq: &mut impl Submit, mut free: usize) {
+        let mut pending = mem::take(&mut self.pending);
+        let mut done = 0;
+        for &fd in &pending {
+            if free < 2 {
+                break;
+            }
+            let client = &self.clients[fd as usize];
+            if !client.closing && client.backlog.is_empty() {
+                self.receive(sq, fd);
+            }
+            free -= 2;
+            done += 1;
+        }
+        pending.drain(..done);
+        pending.append(&mut self.pending);
+        self.pending = pending;
+    }
+
+    fn handle_readable(&mut self, cqe: Completion, sq: &mut impl Submit, fd: RawFd) {
+        let more = cqueue::more(cqe.flags);
+        // Checked before the operation completes, which closes the descriptor of a closing client
+        // that has nothing else in flight.
+        if self.clients[fd as usize].closing {
+            if !more {
+                self.complete_op(fd);
+            }
+            return;
+        }
+        // A poll that failed would likely fail again if armed again, so the client is closed, as
+        // when waiting for it to be writable fails.
+        if cqe.result < 0 {
+            eprintln!("poll failed: {}", cqe.result);
+            self.metrics.errors.add(1);
+            self.close_client(sq, fd);
+            if !more {
+                self.complete_op(fd);
+            }
+            return;
+        }
+        // The multishot poll ended without an error, for example because the completion queue
+        // overflowed, and is armed again in place of the one that completed.
+        if !more {
+            push_poll(sq, fd, libc::POLLIN, true, READABLE);
+        }
+        // The backlog is flushed first, and the client read from once it is.
+        if self.clients[fd as usize].backlog.is_empty() {
+            self.receive(sq, fd);
+        }
+    }
+
+    fn handle_writable(&mut self, cqe: Completion, sq: &mut impl Submit, fd: RawFd) {
+        let client = &mut self.clients[fd as usize];
+        client.writing = false;
+        if client.closing {
+            return self.complete_op(fd);
+        }
+        self.complete_op(fd);
+        if cqe.result < 0 {
+            eprintln!("poll failed: {}", cqe.result);
+            self.metrics.errors.add(1);
+            return self.close_client(sq, fd);
+        }
+        let written = match write_nonblocking(fd, &self.clients[fd as usize].backlog) {
+            Ok(written) => written,
+            Err(err) => {
+                eprintln!("failed to write: {err}");
+                self.metrics.errors.add(1);
+                return self.close_client(sq, fd);
+            }
+        };
+        let client = &mut self.clients[fd as usize];
+        client.backlog.drain(..written);
+        if !client.backlog.is_empty() {
+            client.writing = true;
+            client.ops += 1;
+            push_poll(sq, fd, libc::POLLOUT, false, WRITABLE);
+            return;
+        }
+        // Readiness that was reported while the backlog was flushed was not acted on.
+        self.receive(sq, fd);
+    }
+
+    fn handle_recv(&mut self, cqe: Completion, sq: &mut impl Submit, fd: RawFd) {
+        let metrics = self.metrics;
+        metrics.recvs.add(1);
+        let client = &mut self.clients[fd as usize];
+        client.receiving = false;
+        let again = mem::take(&mut client.again);
+        let closing = client.closing;
+        let id = (cqe.result > 0).then(|| cqueue::buffer_select(cqe.flags).unwrap());
+        self.complete_op(fd);
+        if closing {
+            if let Some(id) = id {
+                self.buf_ring.as_mut().unwrap().recycle(id);
+            }
+            return;
+        }
+
+        let ret = cqe.result;
+        if ret == -libc::EAGAIN {
+            if again {
+                self.push_recv(sq, fd);
+            }
+            return;
+        }
+        if ret == -libc::ENOBUFS {
+            // Tried again before the next wait, once replies recycled buffers.
+            metrics.errors.add(1);
+            self.pending.push(fd);
+            return;
+        }
+        if ret <= 0 {
+            if ret < 0 && ret != -libc::ECONNRESET {
+                eprintln!("recv failed: {ret}");
+                metrics.errors.add(1);
+            }
+            return self.close_client(sq, fd);
+        }
+
+        let n = ret as usize;
+        let id = id.unwrap();
+        metrics.bytes.add(n as u64);
+        let buf_ring = self.buf_ring.as_mut().unwrap();
+        let buf = unsafe { buf_ring.get(id, n) };
+        self.handler.on_recv(fd as u32, buf, &mut self.out);
+        buf_ring.recycle(id);
+        if !self.out.is_empty() && !self.reply(sq, fd) {
+            return;
+        }
+        // A full buffer may have left bytes in the socket, which is only reported readable again
+        // when new ones arrive.
+        if n == BUF_SIZE || again {
+            self.push_recv(sq, fd);
+        }
+    }
+
+    pub fn handle_completion(&mut self, cqe: Completion, sq: &mut impl Submit) {
+        if cqe.user_data == ACCEPT {
+            if !cqueue::more(cqe.flags) {
+                // The multishot accept was terminated, for example because of the file limit.
+                push_accept(sq, self.listener);
+            }
+            if cqe.result < 0 {
+                eprintln!("accept failed: {}", cqe.result);
+                self.metrics.errors.add(1);
+                return;
+            }
+            self.metrics.accepts.add(1);
+            return self.add_client(sq, cqe.result);
+        }
+        let fd = cqe.user_data as u32 as RawFd;
+        match cqe.user_data & !u64::from(u32::MAX) {
+            READABLE => self.handle_readable(cqe, sq, fd),
+            WRITABLE => self.handle_writable(cqe, sq, fd),
+            RECV => self.handle_recv(cqe, sq, fd),
+            _ => {}
+        }
+    }
+}
+
+pub fn push_accept(sq: &mut impl Submit, listener: RawFd) {
+    let accept = AcceptMulti::new(Fd(listener))
+        .flags(libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC)
+        .build()
+        .user_data(ACCEPT);
+    sq.push(&accept);
+}
+
+// One thread of the poll mode serving a `SO_REUSEPORT` listener.
+pub struct PollServer {
+    pub listener: TcpListener,
+    // Receive with io_uring operations instead of `read` calls.
+    pub batch_recvs: bool,
+}
+
+impl Engine for PollServer {
+    fn run<H: Handler>(self, handler: H, metrics: &Metrics) {
+        run(self, handler, metrics)
+    }
+}
+
+fn run<H: Handler>(server: PollServer, handler: H, metrics: &Metrics) {
+    metrics.init_thread();
+
+    let mut io_uring = IoUring::builder()
+        .setup_coop_taskrun()
+        .setup_defer_taskrun()
+        .setup_single_issuer()
+        .build(256)
+        .expect("failed to create io_uring instance");
+    let listener = server.listener.as_raw_fd();
+    let mut poll_loop =
+        PollLoop::new(&io_uring, listener, handler, server.batch_recvs, metrics).unwrap();
+    push_accept(&mut io_uring.submission(), listener);
+
+    loop {
+        let (submitter, mut sq, cq) = io_uring.split();
+        // Every completion pushes at most two entries, and so does every pending client.
+        let budget = (sq.capacity() - sq.len()) / 2;
+        for cqe in cq.take(budget) {
+            metrics.events.add(1);
+            poll_loop.handle_completion(Completion::from(&cqe), &mut sq);
+        }
+        let free = sq.capacity() - sq.len();
+        poll_loop.read_pending(&mut sq, free);
+        drop(sq);
+        // Pending clients are read again right away.
+        if poll_loop.has_pending() {
+            submitter.submit().unwrap();
+        } else {
+            submitter.submit_and_wait(1).unwrap();
+        }
+        metrics.waits.add(1);
+    }
+}
@@ -0,0 +1,68 @@
+// Checks that the io_uring event loops, of the completion and the poll modes, do not allocate once
+// warm, with the handlers that pool their buffers. Needs the `count-allocations` feature.
+use std::{
+    net::{SocketAddr, TcpListener},
+    sync::Arc,
+};
+
+use common::{
+    alloc::check::{assert_no_allocations, http_exchanges, kv_exchanges},
+    http::Http,
+    kv::{Kv, Store},
+};
+use server_io_uring::{GroupOptions, PollServer, Server, BUF_RING_ENTRIES};
+
+fn bind() -> (TcpListener, SocketAddr) {
+    let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+    let addr = listener.local_addr().unwrap();
+    (listener, addr)
+}
+
+fn server() -> (Server, SocketAddr) {
+    let (listener, addr) = bind();
+    let server = Server {
+        listener,
+        files: 128,
+        balance: None,
+        disk: None,
+        groups: GroupOptions::single(BUF_RING_ENTRIES),
+    };
+    (server, addr)
+}
+
+fn poll_server(batch_recvs: bool) -> (PollServer, SocketAddr) {
+    let (listener, addr) = bind();
+    let server = PollServer {
+        listener,
+        batch_recvs,
+    };
+    (server, addr)
+}
+
+fn kv() -> Kv {
+    Kv::new(Arc::new(Store::new(1, 16)))
+}
+
+#[test]
+fn http_does_not_allocate() {
+    let (server, addr) = server();
+    assert_no_allocations(server, addr, Http::default(), http_exchanges());
+}
+
+#[test]
+fn kv_does_not_allocate() {
+    let (server, addr) = server();
+    assert_no_allocations(server, addr, kv(), kv_exchanges());
+}
+
+#[test]
+fn poll_http_does_not_allocate() {
+    let (server, addr) = poll_server(false);
+    assert_no_allocations(server, addr, Http::default(), http_exchanges());
+}
+
+#[test]
+fn poll_kv_with_batched_recvs_does_not_allocate() {
+    let (server, addr) = poll_server(true);
+    assert_no_allocations(server, addr, kv(), kv_exchanges());
+}
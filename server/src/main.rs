@@ -0,0 +1,360 @@
+use std::{ffi::CString, io, net::TcpListener, sync::Arc};
+
+use clap::Parser;
+use common::{
+    balance::{BalanceArgs, Balancer},
+    engine::{check_options, serve_with_handler, HandlerArgs, ServerOptions},
+    metrics::{start_reporter, ReportArgs},
+    net::{bind_reuseport, raise_fd_limit, steer_by_cpu, ListenArgs},
+    numa::{interface_for_bind, pin_threads, place, NumaArgs, Placement},
+    pipeline::{assign_workers, PipelineArgs},
+};
+
+#[derive(Clone, Copy, PartialEq, clap::ValueEnum)]
+enum Backend {
+    Epoll,
+    Uring,
+    UringPoll,
+    Zcrx,
+    Afxdp,
+    Replay,
+}
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(long, value_enum, default_value = "epoll")]
+    backend: Backend,
+
+    /// Address to listen on. Required by every backend but `afxdp` and `replay`.
+    #[clap(short, long)]
+    bind: Option<String>,
+
+    /// Number of receive threads.
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    #[clap(flatten)]
+    handler: HandlerArgs,
+
+    /// Maximum number of connections accepted per listener wakeup (`epoll`).
+    #[clap(long, default_value_t = 64)]
+    accept_batch: usize,
+
+    /// Receive buffer of every connection in KiB, mapped twice back to back so that messages split
+    /// across reads are parsed in place, or 0 for a shared buffer (`epoll`).
+    #[clap(long, default_value_t = 0)]
+    recv_ring: usize,
+
+    /// Read readable clients with `IORING_OP_RECV` operations submitted in batches instead of
+    /// `read` calls (`uring-poll`).
+    #[clap(long)]
+    batch_recvs: bool,
+
+    /// Size of the registered file table per thread (`uring` and `zcrx`).
+    #[clap(long, default_value_t = 128)]
+    files: u32,
+
+    /// Interface to receive from (`zcrx` and `afxdp`), or to transmit replayed frames on
+    /// (`replay` with `--inject`).
+    #[clap(short, long)]
+    interface: Option<String>,
+
+    /// First queue of the interface. Thread `i` receives from queue `queue + i`.
+    #[clap(short, long, default_value_t = 0)]
+    queue: u32,
+
+    /// Number of UMEM frames per socket, a power of two (`afxdp` and `replay`).
+    #[clap(long, default_value_t = 4096)]
+    frames: u32,
+
+    /// Require zero-copy mode (`afxdp`).
+    #[clap(long)]
+    zero_copy: bool,
+
+    #[clap(flatten)]
+    listen: ListenArgs,
+
+    /// Worker threads and blocks of the pipeline mode (`epoll`).
+    #[clap(flatten)]
+    pipeline: PipelineArgs,
+
+    /// Moving connections between event loops (`epoll` and `uring`).
+    #[clap(flatten)]
+    balance: BalanceArgs,
+
+    /// Writing received bytes to files (`uring`).
+    #[clap(flatten)]
+    disk: server_io_uring::DiskArgs,
+
+    /// Provided buffer groups and promotion between them (`uring`).
+    #[clap(flatten)]
+    groups: server_io_uring::GroupArgs,
+
+    /// Capturing received frames to pcapng files (`afxdp`).
+    #[clap(flatten)]
+    capture: server_af_xdp::CaptureArgs,
+
+    /// Replaying a capture file instead of receiving (`replay`).
+    #[clap(flatten)]
+    replay: server_af_xdp::ReplayArgs,
+
+    #[clap(flatten)]
+    numa: NumaArgs,
+
+    #[clap(flatten)]
+    report: ReportArgs,
+}
+
+fn interface_index(args: &Args) -> u32 {
+    let interface = args
+        .interface
+        .as_deref()
+        .expect("--interface is required by this backend");
+    let interface_cstring = CString::new(interface).unwrap();
+    let interface_index = unsafe { libc::if_nametoindex(interface_cstring.as_c_str().as_ptr()) };
+    if interface_index == 0 {
+        let err = io::Error::last_os_error();
+        panic!("failed to convert interface name: {err}");
+    }
+    interface_index
+}
+
+// Binds every listener before starting the threads so that no connection is refused while the
+// server is starting up. With `--steer-by-cpu`, the event loops are pinned to the CPUs that their
+// listeners receive from.
+fn listeners(args: &Args, placements: &mut [Placement]) -> Vec<TcpListener> {
+    let bind = args
+        .bind
+        .as_deref()
+        .expect("--bind is required by this backend");
+    let listeners: Vec<_> = (0..args.threads)
+        .map(|_| bind_reuseport(bind, &args.listen).unwrap())
+        .collect();
+    if args.listen.steer_by_cpu {
+        let cpus = pin_threads(&mut placements[..args.threads]);
+        steer_by_cpu(&listeners[0], &cpus).expect("failed to attach the reuseport program");
+    }
+    listeners
+}
+
+// The TCP backends receive from the interface that has the bind address, if there is only one.
+fn placements(args: &Args) -> Vec<Placement> {
+    let interface = match args.backend {
+        Backend::Epoll | Backend::Uring | Backend::UringPoll => {
+            args.bind.as_deref().and_then(interface_for_bind)
+        }
+        Backend::Zcrx | Backend::Afxdp | Backend::Replay => args.interface.clone(),
+    };
+    place(
+        &args.numa,
+        interface.as_deref(),
+        args.pipeline.threads(args.threads),
+    )
+}
+
+fn main() {
+    let args = Args::parse();
+    match args.backend {
+        // Zero-copy receive and the reads of the poll mode do not deliver control messages, AF_XDP
+        // receives frames before the kernel timestamps them, and replayed frames never were in the
+        // kernel.
+        Backend::UringPoll | Backend::Zcrx | Backend::Afxdp | Backend::Replay => assert!(
+            !args.report.rx_timestamps,
+            "--rx-timestamps is not supported by this backend"
+        ),
+        Backend::Epoll | Backend::Uring => {}
+    }
+    check_options(
+        &args.handler,
+        &ServerOptions {
+            sockets: !matches!(args.backend, Backend::Afxdp | Backend::Replay),
+            workers: args.pipeline.workers,
+            balance: args.balance.balance_interval > 0,
+            recv_ring: args.recv_ring > 0,
+            write_dir: args.disk.write_dir.is_some(),
+        },
+    );
+    assert!(
+        args.replay.replay.is_some() == (args.backend == Backend::Replay),
+        "--replay is required by and only supported by the replay backend"
+    );
+    assert!(
+        args.pipeline.workers == 0 || args.backend == Backend::Epoll,
+        "--workers is only supported by the epoll backend"
+    );
+    assert!(
+        args.balance.balance_interval == 0
+            || matches!(args.backend, Backend::Epoll | Backend::Uring),
+        "--balance-interval is only supported by the epoll and uring backends"
+    );
+    assert!(
+        args.recv_ring == 0 || args.backend == Backend::Epoll,
+        "--recv-ring is only supported by the epoll backend"
+    );
+    assert!(
+        args.backend == Backend::Uring
+            || server_io_uring::GroupOptions::new(&args.groups).is_default(),
+        "--buffer-groups is only supported by the uring backend"
+    );
+    assert!(
+        !args.batch_recvs || args.backend == Backend::UringPoll,
+        "--batch-recvs is only supported by the uring-poll backend"
+    );
+    assert!(
+        args.disk.write_dir.is_none() || args.backend == Backend::Uring,
+        "--write-dir is only supported by the uring backend"
+    );
+    assert!(
+        args.capture.capture.is_none() || args.backend == Backend::Afxdp,
+        "--capture is only supported by the afxdp backend"
+    );
+
+    if !matches!(args.backend, Backend::Afxdp | Backend::Replay) {
+        // Every connection holds a file descriptor, or a slot in a registered file table which is
+        // bounded by the same limit.
+        let fd_limit = raise_fd_limit().expect("failed to raise the file descriptor limit");
+        eprintln!("file descriptor limit: {fd_limit}");
+    }
+
+    match args.backend {
+        Backend::Epoll => {
+            let accept = server_epoll::AcceptOptions {
+                batch: args.accept_batch,
+                read_first: args.listen.defer_accept.is_some(),
+                check_cpu: args.listen.steer_by_cpu,
+            };
+            let threads = args.pipeline.threads(args.threads);
+            let mut placements = placements(&args);
+            let listeners = listeners(&args, &mut placements);
+            let metrics = start_reporter(threads, &args.report);
+            let workers =
+                assign_workers(args.threads, args.pipeline.workers, &placements, &metrics);
+            let balancers = Balancer::for_threads(args.threads, &metrics, &args.balance);
+            let servers = listeners
+                .into_iter()
+                .zip(workers)
+                .zip(server_epoll::Balance::for_balancers(balancers))
+                .map(|((listener, workers), balance)| server_epoll::Server {
+                    listener,
+                    accept,
+                    workers,
+                    blocks: args.pipeline.blocks,
+                    balance,
+                    ring_capacity: args.recv_ring << 10,
+                })
+                .collect();
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+        Backend::Uring => {
+            let mut placements = placements(&args);
+            let listeners = listeners(&args, &mut placements);
+            let metrics = start_reporter(args.threads, &args.report);
+            let balancers = Balancer::for_threads(args.threads, &metrics, &args.balance);
+            let disk = server_io_uring::DiskOptions::new(&args.disk)
+                .expect("failed to prepare the write directory");
+            let groups = server_io_uring::GroupOptions::new(&args.groups);
+            // Writes hold buffers of a single group, which is larger.
+            assert!(
+                disk.is_none() || groups.is_default(),
+                "--buffer-groups is not supported with --write-dir"
+            );
+            let servers = listeners
+                .into_iter()
+                .zip(server_io_uring::Balance::for_balancers(balancers))
+                .map(|(listener, balance)| server_io_uring::Server {
+                    listener,
+                    files: args.files,
+                    balance,
+                    disk: disk.clone(),
+                    groups: groups.clone(),
+                })
+                .collect();
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+        Backend::UringPoll => {
+            let mut placements = placements(&args);
+            let listeners = listeners(&args, &mut placements);
+            let metrics = start_reporter(args.threads, &args.report);
+            let servers = listeners
+                .into_iter()
+                .map(|listener| server_io_uring::PollServer {
+                    listener,
+                    batch_recvs: args.batch_recvs,
+                })
+                .collect();
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+        Backend::Zcrx => {
+            let interface_index = interface_index(&args);
+            let mut placements = placements(&args);
+            let servers = listeners(&args, &mut placements)
+                .into_iter()
+                .zip(args.queue..)
+                .map(|(listener, queue)| server_io_uring_zcrx::Server {
+                    listener,
+                    interface_index,
+                    queue,
+                    files: args.files,
+                })
+                .collect();
+            let metrics = start_reporter(args.threads, &args.report);
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+        Backend::Afxdp => {
+            assert!(
+                args.frames.is_power_of_two(),
+                "--frames must be a power of two"
+            );
+            let interface_index = interface_index(&args);
+            let queues = args.queue + args.threads as u32;
+            let program = Arc::new(
+                server_af_xdp::Program::attach(interface_index, queues)
+                    .expect("failed to attach the XDP program"),
+            );
+            let capture = server_af_xdp::CaptureOptions::new(&args.capture);
+            let servers = (args.queue..queues)
+                .map(|queue| server_af_xdp::Server {
+                    program: program.clone(),
+                    interface_index,
+                    queue,
+                    frames: args.frames,
+                    zero_copy: args.zero_copy,
+                    capture: capture.clone(),
+                })
+                .collect();
+            let placements = placements(&args);
+            let metrics = start_reporter(args.threads, &args.report);
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+        Backend::Replay => {
+            assert!(args.replay.burst > 0, "--burst must be positive");
+            let path = args.replay.replay.as_deref().unwrap();
+            let trace =
+                Arc::new(server_af_xdp::Trace::load(path).expect("failed to load the capture"));
+            let inject = args.replay.inject.then(|| {
+                assert!(
+                    args.frames.is_power_of_two(),
+                    "--frames must be a power of two"
+                );
+                interface_index(&args)
+            });
+            let servers = (0..args.threads as u32)
+                .map(|thread| server_af_xdp::Replay {
+                    trace: trace.clone(),
+                    thread,
+                    burst: args.replay.burst,
+                    recorded_speed: args.replay.recorded_speed,
+                    loops: args.replay.loops,
+                    inject: inject.map(|interface_index| server_af_xdp::Inject {
+                        interface_index,
+                        queue: args.queue + thread,
+                        frames: args.frames,
+                    }),
+                })
+                .collect();
+            let placements = placements(&args);
+            let metrics = start_reporter(args.threads, &args.report);
+            serve_with_handler(servers, &placements, &args.handler, metrics);
+        }
+    }
+}
@@ -0,0 +1,391 @@
+use std::{
+    io,
+    mem::{self, MaybeUninit},
+    net::TcpStream,
+    os::fd::{AsRawFd, RawFd},
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+    thread,
+    time::{Duration, Instant},
+};
+
+use clap::Parser;
+use io_uring::{cqueue, opcode::SendZc, types::Fd, IoUring};
+
+// Not exported by the libc crate.
+const SO_EE_ORIGIN_ZEROCOPY: u8 = 5;
+
+#[derive(Clone, Copy, PartialEq, Eq, clap::ValueEnum)]
+enum Mode {
+    /// Plain `send` on nonblocking sockets.
+    Send,
+    /// `send` with `MSG_ZEROCOPY`, reaping notifications from the error queue.
+    Zerocopy,
+    /// io_uring `SEND_ZC`.
+    SendZc,
+}
+
+#[derive(clap::Parser)]
+struct Args {
+    #[clap(short, long)]
+    connect: String,
+
+    /// Total number of connections, spread round-robin across threads.
+    #[clap(short = 'n', long, default_value_t = 1)]
+    connections: usize,
+
+    #[clap(short, long, default_value_t = 1)]
+    threads: usize,
+
+    #[clap(short, long, default_value_t = 65536)]
+    write_size: usize,
+
+    #[clap(short, long, value_enum, default_value_t = Mode::Send)]
+    mode: Mode,
+
+    /// Stop after this many seconds.
+    #[clap(short, long)]
+    duration: Option<f64>,
+
+    /// Stop after sending this many bytes in total (accepts K/M/G suffixes).
+    #[clap(long, value_parser = parse_size)]
+    bytes: Option<u64>,
+
+    /// Target send rate in bits per second for all threads combined (accepts K/M/G suffixes).
+    #[clap(short, long, value_parser = parse_size)]
+    rate: Option<u64>,
+}
+
+fn parse_size(s: &str) -> Result<u64, String> {
+    let (digits, multiplier) = match s.as_bytes().last() {
+        Some(b'k' | b'K') => (&s[..s.len() - 1], 1_000),
+        Some(b'm' | b'M') => (&s[..s.len() - 1], 1_000_000),
+        Some(b'g' | b'G') => (&s[..s.len() - 1], 1_000_000_000),
+        _ => (s, 1),
+    };
+    let value: f64 = digits.parse().map_err(|err| format!("{err}"))?;
+    Ok((value * multiplier as f64) as u64)
+}
+
+// Each thread publishes its byte count on its own cache line so that the reporting thread does
+// not cause false sharing between senders.
+#[derive(Default)]
+#[repr(align(64))]
+struct Counter(AtomicU64);
+
+struct Pacer {
+    start: Instant,
+    bytes_per_sec: f64,
+}
+
+impl Pacer {
+    fn wait(&self, sent: u64) {
+        let due = Duration::from_secs_f64(sent as f64 / self.bytes_per_sec);
+        let elapsed = self.start.elapsed();
+        if due > elapsed {
+            thread::sleep(due - elapsed);
+        }
+    }
+}
+
+struct Worker<'a> {
+    streams: Vec<TcpStream>,
+    buf: Vec<u8>,
+    mode: Mode,
+    limit: u64,
+    pacer: Option<Pacer>,
+    sent: &'a Counter,
+    stop: &'a AtomicBool,
+}
+
+fn setsockopt_int(fd: RawFd, level: i32, name: i32, value: i32) -> io::Result<()> {
+    let ret = unsafe {
+        libc::setsockopt(
+            fd,
+            level,
+            name,
+            &value as *const _ as *const _,
+            mem::size_of_val(&value) as libc::socklen_t,
+        )
+    };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+fn send(fd: RawFd, buf: &[u8], flags: i32) -> io::Result<usize> {
+    let ret = unsafe { libc::send(fd, buf.as_ptr().cast(), buf.len(), flags) };
+    if ret == -1 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(ret as usize)
+}
+
+// Drains `MSG_ZEROCOPY` completion notifications and returns the number of sends they cover.
+fn reap_zerocopy(fd: RawFd) -> io::Result<u64> {
+    let mut completed = 0;
+    loop {
+        let mut control = [MaybeUninit::<u64>::uninit(); 16];
+        let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+        msg.msg_control = control.as_mut_ptr().cast();
+        msg.msg_controllen = mem::size_of_val(&control);
+
+        let ret = unsafe { libc::recvmsg(fd, &mut msg, libc::MSG_ERRQUEUE | libc::MSG_DONTWAIT) };
+        if ret == -1 {
+            let err = io::Error::last_os_error();
+            if err.kind() == io::ErrorKind::WouldBlock {
+                return Ok(completed);
+            }
+            return Err(err);
+        }
+
+        let mut cmsg = unsafe { libc::CMSG_FIRSTHDR(&msg) };
+        while !cmsg.is_null() {
+            let hdr = unsafe { &*cmsg };
+            if (hdr.cmsg_level == libc::SOL_IP && hdr.cmsg_type == libc::IP_RECVERR)
+                || (hdr.cmsg_level == libc::SOL_IPV6 && hdr.cmsg_type == libc::IPV6_RECVERR)
+            {
+                let err = unsafe {
+                    libc::CMSG_DATA(cmsg)
+                        .cast::<libc::sock_extended_err>()
+                        .read_unaligned()
+                };
+                if err.ee_origin == SO_EE_ORIGIN_ZEROCOPY {
+                    completed += u64::from(err.ee_data.wrapping_sub(err.ee_info)) + 1;
+                }
+            }
+            cmsg = unsafe { libc::CMSG_NXTHDR(&msg, cmsg) };
+        }
+    }
+}
+
+impl Worker<'_> {
+    fn run(self) {
+        match self.mode {
+            Mode::Send | Mode::Zerocopy => self.run_send(),
+            Mode::SendZc => self.run_send_zc(),
+        }
+    }
+
+    fn run_send(self) {
+        let zerocopy = self.mode == Mode::Zerocopy;
+        let flags = libc::MSG_NOSIGNAL | if zerocopy { libc::MSG_ZEROCOPY } else { 0 };
+
+        let mut pollfds: Vec<_> = self
+            .streams
+            .iter()
+            .map(|stream| {
+                stream.set_nonblocking(true).unwrap();
+                if zerocopy {
+                    setsockopt_int(stream.as_raw_fd(), libc::SOL_SOCKET, libc::SO_ZEROCOPY, 1)
+                        .expect("failed to enable SO_ZEROCOPY");
+                }
+                libc::pollfd {
+                    fd: stream.as_raw_fd(),
+                    events: libc::POLLOUT,
+                    revents: 0,
+                }
+            })
+            .collect();
+        // Zerocopy sends that have not been acknowledged through the error queue yet.
+        let mut outstanding = vec![0u64; self.streams.len()];
+
+        let mut total = 0;
+        while total < self.limit && !self.stop.load(Ordering::Relaxed) {
+            if let Some(pacer) = &self.pacer {
+                pacer.wait(total);
+            }
+
+            let mut progressed = false;
+            for (i, stream) in self.streams.iter().enumerate() {
+                let len = self.buf.len().min((self.limit - total) as usize);
+                if len == 0 {
+                    break;
+                }
+                match send(stream.as_raw_fd(), &self.buf[..len], flags) {
+                    Ok(n) => {
+                        total += n as u64;
+                        progressed = true;
+                        if zerocopy {
+                            outstanding[i] += 1;
+                        }
+                    }
+                    Err(err) if err.kind() == io::ErrorKind::WouldBlock => {}
+                    // The socket ran out of option memory for pinned pages; reap below.
+                    Err(err) if zerocopy && err.raw_os_error() == Some(libc::ENOBUFS) => {}
+                    Err(err) => panic!("failed to send: {err}"),
+                }
+            }
+            self.sent.0.store(total, Ordering::Relaxed);
+
+            if zerocopy {
+                for (i, stream) in self.streams.iter().enumerate() {
+                    if !progressed || outstanding[i] >= 64 {
+                        let completed = reap_zerocopy(stream.as_raw_fd()).unwrap();
+                        outstanding[i] = outstanding[i].saturating_sub(completed);
+                    }
+                }
+            }
+
+            if !progressed {
+                let ret =
+                    unsafe { libc::poll(pollfds.as_mut_ptr(), pollfds.len() as libc::nfds_t, 100) };
+                if ret == -1 {
+                    let err = io::Error::last_os_error();
+                    panic!("failed to poll: {err}");
+                }
+            }
+        }
+    }
+
+    fn next_len(&self, committed: u64) -> u32 {
+        if self.stop.load(Ordering::Relaxed) {
+            return 0;
+        }
+        (self.buf.len() as u64).min(self.limit - committed) as u32
+    }
+
+    fn run_send_zc(self) {
+        let mut io_uring = IoUring::new(2 * self.streams.len().next_power_of_two() as u32)
+            .expect("failed to create io_uring instance");
+
+        let mut total = 0;
+        // Length of the send in flight on each connection, or 0 if there is none.
+        let mut in_flight = vec![0u32; self.streams.len()];
+        let mut queued = 0;
+        // Sends that completed but still pin the buffer until their notification arrives.
+        let mut notifs = 0;
+
+        // The user data is the connection index. The buffer is never written to, so it is fine to
+        // resubmit a send from it before the notification for the previous one has arrived.
+        let push = |sq: &mut io_uring::SubmissionQueue, i: usize, len: u32| {
+            let send = SendZc::new(Fd(self.streams[i].as_raw_fd()), self.buf.as_ptr(), len)
+                .build()
+                .user_data(i as u64);
+            unsafe {
+                sq.push(&send).unwrap();
+            }
+        };
+
+        for i in 0..self.streams.len() {
+            let len = self.next_len(queued);
+            if len > 0 {
+                push(&mut io_uring.submission(), i, len);
+                in_flight[i] = len;
+                queued += u64::from(len);
+            }
+        }
+
+        while queued > 0 || notifs > 0 {
+            io_uring.submit_and_wait(1).unwrap();
+
+            let (_, mut sq, cq) = io_uring.split();
+            for cqe in cq {
+                if cqueue::notif(cqe.flags()) {
+                    notifs -= 1;
+                    continue;
+                }
+                if cqueue::more(cqe.flags()) {
+                    notifs += 1;
+                }
+
+                let ret = cqe.result();
+                if ret < 0 {
+                    let err = io::Error::from_raw_os_error(-ret);
+                    panic!("failed to send: {err}");
+                }
+                let i = cqe.user_data() as usize;
+                queued -= u64::from(mem::take(&mut in_flight[i]));
+                total += ret as u64;
+                self.sent.0.store(total, Ordering::Relaxed);
+
+                if let Some(pacer) = &self.pacer {
+                    pacer.wait(total + queued);
+                }
+                let len = self.next_len(total + queued);
+                if len > 0 {
+                    push(&mut sq, i, len);
+                    in_flight[i] = len;
+                    queued += u64::from(len);
+                }
+            }
+        }
+    }
+}
+
+fn main() {
+    let args = Args::parse();
+    assert!(args.threads > 0 && args.connections >= args.threads);
+
+    let mut streams: Vec<Vec<TcpStream>> = (0..args.threads).map(|_| Vec::new()).collect();
+    for i in 0..args.connections {
+        let stream = TcpStream::connect(&args.connect).expect("failed to connect");
+        streams[i % args.threads].push(stream);
+    }
+
+    let counters: Vec<Counter> = (0..args.threads).map(|_| Counter::default()).collect();
+    let stop = AtomicBool::new(false);
+    let start = Instant::now();
+
+    thread::scope(|s| {
+        let workers: Vec<_> = streams
+            .into_iter()
+            .zip(&counters)
+            .enumerate()
+            .map(|(t, (streams, sent))| {
+                let share = |total: u64| {
+                    let n = args.threads as u64;
+                    total / n + u64::from((t as u64) < total % n)
+                };
+                let worker = Worker {
+                    streams,
+                    buf: vec![0xa5; args.write_size],
+                    mode: args.mode,
+                    limit: args.bytes.map_or(u64::MAX, share),
+                    pacer: args.rate.map(|rate| Pacer {
+                        start,
+                        bytes_per_sec: share(rate) as f64 / 8.0,
+                    }),
+                    sent,
+                    stop: &stop,
+                };
+                s.spawn(move || worker.run())
+            })
+            .collect();
+
+        let total = || {
+            counters
+                .iter()
+                .map(|c| c.0.load(Ordering::Relaxed))
+                .sum::<u64>()
+        };
+        let deadline = args.duration.map(|d| start + Duration::from_secs_f64(d));
+        let mut last = 0;
+        let mut tick = 1;
+        while !workers.iter().all(|w| w.is_finished()) {
+            let now = Instant::now();
+            if deadline.is_some_and(|deadline| now >= deadline) {
+                stop.store(true, Ordering::Relaxed);
+            }
+            let next = start + Duration::from_secs(tick);
+            if now < next {
+                thread::sleep((next - now).min(Duration::from_millis(10)));
+                continue;
+            }
+            let sent = total();
+            println!(
+                "{tick:>4}s {:>9.3} Gbit/s",
+                (sent - last) as f64 * 8.0 / 1e9
+            );
+            last = sent;
+            tick += 1;
+        }
+    });
+
+    let elapsed = start.elapsed().as_secs_f64();
+    let sent: u64 = counters.iter().map(|c| c.0.load(Ordering::Relaxed)).sum();
+    println!(
+        "sent {sent} bytes in {elapsed:.3}s, {:.3} Gbit/s",
+        sent as f64 * 8.0 / 1e9 / elapsed
+    );
+}